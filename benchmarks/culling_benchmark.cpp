@@ -0,0 +1,110 @@
+// Measures CPU frustum culling throughput on a single core for each backend
+// the CPU supports. Run as CullingBenchmark [bound count] [iterations]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "bounds.h"
+#include "frustum_culler.h"
+
+constexpr size_t DEFAULT_BOUND_COUNT = 1000000;
+constexpr size_t DEFAULT_ITERATIONS = 50;
+
+int main(int argc, char** argv)
+{
+    size_t bound_count = DEFAULT_BOUND_COUNT;
+    size_t iterations = DEFAULT_ITERATIONS;
+    if (argc > 1) {
+        bound_count = std::strtoull(argv[1], nullptr, 10);
+    }
+    if (argc > 2) {
+        iterations = std::max<size_t>(1, std::strtoull(argv[2], nullptr, 10));
+    }
+
+    // Scatter boxes all around the camera so that around a tenth are visible,
+    // which exercises both the early outs and the output path
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> size(0.1f, 2.0f);
+    std::vector<Aabb> bounds(bound_count);
+    for (auto& bound : bounds) {
+        glm::vec3 center(position(rng), position(rng), position(rng));
+        glm::vec3 extents(size(rng), size(rng), size(rng));
+        bound.min = center - extents;
+        bound.max = center + extents;
+    }
+
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+                                 glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 proj =
+        glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 100.0f);
+    auto frustum = Frustum::FromMatrix(proj * view);
+
+    std::cout << "Culling " << bound_count << " bounds, " << iterations
+              << " iterations, best of each\n";
+
+    std::vector<uint32_t> reference;
+    std::vector<uint32_t> visible;
+    visible.reserve(bound_count);
+    for (auto backend : {CullingBackend::Scalar, CullingBackend::Sse,
+                         CullingBackend::Avx}) {
+        if (!FrustumCuller::IsBackendSupported(backend)) {
+            std::cout << CullingBackendName(backend) << ": unsupported\n";
+            continue;
+        }
+
+        FrustumCuller culler(backend);
+        culler.Resize(bound_count);
+        for (size_t i = 0; i < bound_count; ++i) {
+            culler.SetBounds(i, bounds[i]);
+        }
+
+        // Warm up the caches and the output vector
+        culler.Cull(frustum, visible);
+
+        double best_seconds = std::numeric_limits<double>::max();
+        for (size_t i = 0; i < iterations; ++i) {
+            auto start = std::chrono::high_resolution_clock::now();
+            culler.Cull(frustum, visible);
+            auto end = std::chrono::high_resolution_clock::now();
+            best_seconds = std::min(
+                best_seconds, std::chrono::duration<double>(end - start).count());
+        }
+
+        // Contracting the scalar path into fused multiply-adds, like with
+        // -march=native, can still move bounds that touch a plane across it,
+        // so differences are reported rather than failing the run
+        size_t mismatch_count = 0;
+        if (backend == CullingBackend::Scalar) {
+            reference = visible;
+        } else {
+            std::vector<uint32_t> mismatches;
+            std::set_symmetric_difference(
+                visible.begin(), visible.end(), reference.begin(),
+                reference.end(), std::back_inserter(mismatches));
+            mismatch_count = mismatches.size();
+        }
+
+        double nanoseconds_per_bound = best_seconds * 1e9 / bound_count;
+        double bounds_per_second = bound_count / best_seconds;
+        std::cout << CullingBackendName(backend) << ": "
+                  << best_seconds * 1e3 << " ms, " << nanoseconds_per_bound
+                  << " ns/bound, " << bounds_per_second / 1e6
+                  << " M bounds/s/core, " << visible.size() << " visible";
+        if (mismatch_count > 0) {
+            std::cout << ", " << mismatch_count
+                      << " classified differently from scalar";
+        }
+        std::cout << "\n";
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -4,18 +4,48 @@
 #include <fstream>
 #include <optional>
 
+#include "bvh.h"
 #include "camera.h"
 #include "common.h"
 #include "common_vulkan.h"
+#include "depth_prepass.h"
+#include "draw_item.h"
+#include "frame_pacer.h"
+#include "frame_readback.h"
+#include "frustum_culler.h"
+#include "gpu_culling.h"
+#include "gpu_timer.h"
+#include "hiz_pyramid.h"
 #include "imgui.h"
 #include "model.h"
+#include "occlusion_query_culler.h"
+#include "parallel_command_recorder.h"
 #include "render_object.h"
+#include "renderer_settings.h"
 #include "scene_graph.h"
+#include "software_occlusion_culler.h"
 #include "texture.h"
+#include "thread_pool.h"
 #include "vertex.h"
 #include "input.h"
 
-constexpr size_t MAX_FRAMES_IN_FLIGHT = 2;
+enum class CpuCullingMode
+{
+    Off,
+    Flat,
+    Bvh
+};
+
+enum class OcclusionCullingMode
+{
+    Off,
+    Software,
+    // Two phase Hi-Z culling in the GPU culling pass
+    GpuHiZ,
+    // Only apply when GPU culling is off
+    HardwareQueries,
+    ConditionalRendering
+};
 
 struct FrameData
 {
@@ -23,18 +53,27 @@ struct FrameData
     vk::DescriptorSet camera_uniform_descriptor;
     vk::Semaphore image_available_semaphore;
     vk::Semaphore render_finished_semaphore;
-    vk::Fence in_flight_fence;
+    // Graphics timeline value signaled when the frame's commands are done,
+    // 0 before the first submission
+    uint64_t submitted_value = 0;
 };
 
 class Application
 {
 public:
+    explicit Application(RendererSettings settings = RendererSettings());
+
     void Run();
 
 private:
     // Main functions
     void Init();
     void MainLoop();
+    // Renders settings_.headless_frame_count frames with a fixed time step
+    // and prints how long they took
+    void RenderHeadless();
+    // Without a window, input or GUI
+    bool IsHeadless() const;
     void Update(double delta_time);
     void Render();
 
@@ -57,38 +96,64 @@ private:
     std::vector<const char*> GetRequiredExtensions();
     void CreateCommandBuffers();
     void CreateFrameData();
+    void DestroyFrameData();
     void RecreateSwapChain();
     void CreateCameraDescriptorSets();
+    // Recreates the swapchain for settings_, retiring the old one through
+    // the deletion queue. Only a change in the number of frames in flight
+    // waits for the device to be idle, to rebuild everything kept per frame.
+    // Returns whether it did, rendering then starts over at the first frame
+    bool ApplyRendererSettings();
 
     // Scene Setup Function
     void LoadScene();
+    void CreateGpuCuller();
+    void ResizeHiZPyramid();
+    void CreateOcclusionQueryCuller();
 
     // Update functions
     void UpdateRotatingCamera(double delta_time);
     void UpdateControlledCamera(double delta_time);
 
     // Rendering functions
-    void WaitForNextFrameFence();
+    void WaitForNextFrame();
     std::optional<uint32_t> GetNextImage();
-    void WaitForImageFenceAndSetNewFence(uint32_t image_index);
+    void WaitForImage(uint32_t image_index);
     void UpdateCameraUniformBuffer();
-    void DrawScene(FrameData& frame_data, vk::Framebuffer& framebuffer,
+    void UpdateVisibleObjects();
+    void UpdateOcclusion(const glm::mat4& viewproj);
+    void UpdateQueryOcclusion();
+    void UpdatePicking();
+    // Begins command_buffer and adds the scene passes for swapchain image
+    // image_index to the frame graph
+    void DrawScene(FrameData& frame_data, uint32_t image_index,
                    vk::CommandBuffer& command_buffer);
-    void DrawGui(vk::Framebuffer& framebuffer,
-                 vk::CommandBuffer& command_buffer,
-                 vk::SampleCountFlagBits& msaa_samples);
+    // Records draw_items_[first, last), called from several threads at once
+    // when recording in parallel
+    void RecordDrawItems(vk::CommandBuffer& command_buffer,
+                         FrameData& frame_data, size_t first, size_t last,
+                         bool conditional, bool query_occlusion,
+                         bool depth_prepass);
+    // Builds the GUI, if shown, and adds the overlay pass that draws it
+    void DrawGui(uint32_t image_index, vk::SampleCountFlagBits& msaa_samples);
     void SubmitGraphicsCommands(std::vector<vk::CommandBuffer> command_buffers);
     void Present(uint32_t image_index);
 
     // Imgui Functions
     void SetupImgui();
+    // Creates the GUI pipeline for the overlay subpass of the render pass,
+    // or for the swapchain format with dynamic rendering
+    void InitImGuiRenderer();
+    // For a new render pass or image count, waits for the last submission
+    void RecreateImGuiRenderer();
     void FindFontFile(std::string name);
-    void CreateImGuiFramebuffers();
-    void CreateImGuiCommandBuffers();
     void ResizeImGui();
+    void DrawOcclusionDepthBuffer();
 
-    // GLFW Window
-    GLFWwindow* window_;
+    // GLFW Window, null when headless
+    GLFWwindow* window_ = nullptr;
+    // Headless only, if the frames are written out
+    std::optional<FrameReadback> frame_readback_;
 
     // Main Vulkan Context
     std::optional<RendererState> renderer_;
@@ -98,6 +163,41 @@ private:
     std::vector<Model> models_;
     std::vector<RenderObject> render_objects_;
 
+    // Compute shader frustum culling, only created if the device supports
+    // drawIndexedIndirectCount
+    std::optional<GpuCuller> gpu_culler_;
+    bool use_gpu_culling_ = false;
+    // Only created if the depth buffer can also be sampled
+    std::optional<HiZPyramid> hiz_pyramid_;
+
+    // CPU frustum culling, visible_objects_ holds indices into
+    // render_objects_ and is refreshed every frame
+    FrustumCuller frustum_culler_;
+    std::vector<uint32_t> visible_objects_;
+    CpuCullingMode cpu_culling_mode_ = CpuCullingMode::Bvh;
+    double frustum_culling_time_ = 0.0;
+
+    // Spatial index over render object bounds, bvh_proxies_[i] is the leaf
+    // for render_objects_[i]
+    Bvh scene_bvh_;
+    std::vector<Bvh::ProxyId> bvh_proxies_;
+
+    // Occlusion culling, applied to the frustum culling results
+    OcclusionCullingMode occlusion_culling_mode_ = OcclusionCullingMode::Off;
+    ThreadPool thread_pool_;
+    SoftwareOcclusionCuller software_occlusion_culler_;
+    size_t occluded_object_count_ = 0;
+    double occlusion_culling_time_ = 0.0;
+    bool show_occlusion_depth_ = false;
+    std::optional<OcclusionQueryCuller> occlusion_query_culler_;
+    // Frustum visible objects that failed their last query, they only get
+    // a bounding box query instead of being drawn
+    std::vector<uint32_t> query_hidden_objects_;
+
+    // Mouse picking (only while the cursor is free) and radius queries
+    std::optional<uint32_t> picked_object_;
+    float nearby_radius_ = 2.0f;
+
     // Camera details
     std::array<Camera,2> cameras_;
     NonOwningPointer<Camera> rotating_camera_; //< cameras_[0], rotates around scene
@@ -107,11 +207,57 @@ private:
     // Command buffers (one per swapchain image)
     std::vector<vk::CommandBuffer> command_buffers_;
 
-    // Per frame uniform and sync data
-    std::array<FrameData, MAX_FRAMES_IN_FLIGHT> frame_data_;
+    // Splits the CPU draw list over thread_pool_ into secondary command
+    // buffers, one chunk per thread
+    std::optional<ParallelCommandRecorder> command_recorder_;
+    bool use_parallel_recording_ = true;
+    double command_recording_time_ = 0.0;
+    // One item per visible mesh range, opaque ones first. Sorted by
+    // material unless queries need them grouped by object
+    std::vector<DrawItem> draw_items_;
+    size_t first_transparent_item_ = 0;
+
+    // Secondaries recorded for a draw list are replayed until the list, the
+    // pipelines or the render pass change. Empty whenever draw_items_ was
+    // built for something else
+    bool use_cached_recording_ = true;
+    std::optional<std::vector<uint32_t>> cached_draw_list_;
+    uint64_t draw_list_generation_ = 0;
+
+    // Lays down the depth of the opaque CPU draw items from their position
+    // stream alone, so the main draws only shade the visible surface
+    std::optional<DepthPrepass> depth_prepass_;
+    bool use_depth_prepass_ = false;
+
+    // Timestamps before and after the CPU path's scene subpass. Its GPU
+    // time is kept separately with and without the depth pre-pass
+    std::optional<GpuTimer> gpu_timer_;
+    std::vector<bool> frame_used_depth_prepass_;
+    std::array<std::optional<double>, 2> scene_gpu_time_;
+
+    // Sample count picked in the GUI, switched to once the material
+    // pipelines for it have been built in the background
+    std::optional<vk::SampleCountFlagBits> pending_sample_count_;
+    // Last submission drawn with a GUI pipeline made for an old render pass.
+    // The GUI is hidden until it completes and the pipeline is recreated
+    std::optional<uint64_t> stale_imgui_renderer_value_;
+
+    // Frames in flight, swapchain image count and present mode. A change
+    // picked in the GUI is applied after the frame has been presented
+    RendererSettings settings_;
+    std::optional<RendererSettings> pending_settings_;
+    // Starts frames at settings_.frame_rate_limit
+    FramePacer frame_pacer_;
+
+    // Per frame uniform and sync data, one per frame in flight
+    std::vector<FrameData> frame_data_;
+    // Only holds the camera descriptor sets, so they can be reallocated when
+    // the number of frames in flight changes
+    vk::DescriptorPool camera_descriptor_pool_;
 
-    // Per swapchain fences (to avoid concurrent writes to same swapchain image)
-    std::vector<vk::Fence> images_in_flight_;
+    // Graphics timeline value of the last frame that rendered to each
+    // swapchain image (to avoid concurrent writes to the same image)
+    std::vector<uint64_t> images_in_flight_;
 
     // input handling
     std::optional<Input> input_;
@@ -120,10 +266,6 @@ private:
     bool imgui_display_ = false;
     bool imgui_toggle_pressed_last_frame_ = false;
     vk::DescriptorPool imgui_descriptor_pool_;
-    vk::RenderPass imgui_render_pass_;
-    vk::CommandPool imgui_command_pool_;
-    std::vector<vk::CommandBuffer> imgui_command_buffers_;
-    std::vector<vk::Framebuffer> imgui_frame_buffers_;
     std::string font_file_;
     ImGuiStyle imgui_style_;
 
@@ -131,6 +273,7 @@ private:
     size_t current_frame_ = 0;
     float current_frames_per_second_ = 0.0f;
     double fps_timer_ = 0.0;
+    uint32_t fps_frame_count_ = 0;
     std::vector<float> frames_per_second_data_;
 
     // Whether the framebuffer has been resized and a swapchain recreation is
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <vector>
+
+#include "common.h"
+#include "common_glm.h"
+
+struct Aabb
+{
+    glm::vec3 min = glm::vec3(0.0f);
+    glm::vec3 max = glm::vec3(0.0f);
+
+    static Aabb FromPoints(const std::vector<glm::vec3>& points);
+
+    glm::vec3 GetCenter() const;
+    glm::vec3 GetExtents() const;
+
+    float GetSurfaceArea() const;
+
+    void Merge(const Aabb& other);
+    bool Contains(const Aabb& other) const;
+    bool IntersectsSphere(const glm::vec3& center, float radius) const;
+
+    // Returns the box enclosing this box after it has been transformed
+    Aabb Transform(const glm::mat4& transform) const;
+};
+
+struct BoundingSphere
+{
+    glm::vec3 center = glm::vec3(0.0f);
+    float radius = 0.0f;
+
+    static BoundingSphere FromPoints(const std::vector<glm::vec3>& points);
+
+    BoundingSphere Transform(const glm::mat4& transform) const;
+};
+
+struct Ray
+{
+    glm::vec3 origin = glm::vec3(0.0f);
+    // Not required to be normalized, distances are in multiples of it
+    glm::vec3 direction = glm::vec3(0.0f, 0.0f, -1.0f);
+
+    glm::vec3 GetPoint(float distance) const;
+
+    // Returns the entry distance if the ray hits the box within max_distance,
+    // a ray starting inside the box hits it at 0
+    std::optional<float> Intersect(const Aabb& aabb, float max_distance) const;
+};
+
+// Frustum planes are stored as (normal, distance), with normals pointing
+// inwards, so a point p is inside a plane when dot(normal, p) + distance >= 0
+struct Frustum
+{
+    enum Plane
+    {
+        Left = 0,
+        Right,
+        Bottom,
+        Top,
+        Near,
+        Far,
+        Count
+    };
+
+    enum class Containment
+    {
+        Outside,
+        Intersecting,
+        Inside
+    };
+
+    std::array<glm::vec4, Plane::Count> planes;
+
+    // Extracts the planes from a view projection matrix using 0 to 1 depth
+    static Frustum FromMatrix(const glm::mat4& viewproj);
+
+    bool IntersectsSphere(const BoundingSphere& sphere) const;
+    bool IntersectsAabb(const Aabb& aabb) const;
+    // Like IntersectsAabb, but also reports boxes entirely inside the frustum
+    // so hierarchical tests can skip testing their children
+    Containment ClassifyAabb(const Aabb& aabb) const;
+};
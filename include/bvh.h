@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "bounds.h"
+#include "common.h"
+#include "common_glm.h"
+
+struct BvhRayHit
+{
+    uint32_t user_data;
+    float distance;
+};
+
+// Dynamic AABB tree. Every leaf holds one user supplied box and an id (for
+// the scene, an index into the render object list). Leaves can be inserted,
+// removed and refit one at a time, which slowly degrades the tree, so
+// Rebuild() rebuilds the internal nodes from scratch with a binned SAH split.
+// Proxy ids returned by Insert stay valid across rebuilds until removed
+class Bvh
+{
+public:
+    using ProxyId = uint32_t;
+    static constexpr ProxyId NULL_NODE = std::numeric_limits<uint32_t>::max();
+
+    ProxyId Insert(const Aabb& bounds, uint32_t user_data);
+    void Remove(ProxyId proxy);
+
+    // Replaces the leaf bounds and refits every ancestor, the tree topology
+    // is left alone
+    void Update(ProxyId proxy, const Aabb& bounds);
+
+    void Rebuild();
+    void Clear();
+
+    uint32_t GetUserData(ProxyId proxy) const;
+    const Aabb& GetBounds(ProxyId proxy) const;
+
+    size_t GetLeafCount() const;
+    size_t GetNodeCount() const;
+    // Number of nodes on the longest root to leaf path, 0 for an empty tree
+    uint32_t GetHeight() const;
+    // Sum of the internal node surface areas relative to the root, lower is
+    // better. Useful for deciding when a rebuild is worthwhile
+    float GetSahCost() const;
+
+    // Each query appends the user data of every matching leaf to results
+    void QueryFrustum(const Frustum& frustum,
+                      std::vector<uint32_t>& results) const;
+    void QueryRadius(const glm::vec3& center, float radius,
+                     std::vector<uint32_t>& results) const;
+
+    // Returns the closest leaf box the ray hits
+    std::optional<BvhRayHit> RayCast(
+        const Ray& ray,
+        float max_distance = std::numeric_limits<float>::max()) const;
+
+    // Checks parent links and that every node encloses its children
+    bool Validate() const;
+
+private:
+    struct Node
+    {
+        Aabb bounds;
+        ProxyId parent = NULL_NODE;
+        ProxyId left = NULL_NODE;
+        ProxyId right = NULL_NODE;
+        uint32_t user_data = 0;
+        // Also links the free list
+        ProxyId next_free = NULL_NODE;
+        // On the free list, a freed node otherwise looks like a leaf
+        bool is_free = false;
+
+        bool IsLeaf() const { return left == NULL_NODE; }
+    };
+
+    // A leaf that has not been removed
+    bool IsValidProxy(ProxyId proxy) const;
+
+    ProxyId AllocateNode();
+    void FreeNode(ProxyId node);
+
+    void InsertLeaf(ProxyId leaf);
+    void RemoveLeaf(ProxyId leaf);
+    void RefitAncestors(ProxyId node);
+
+    ProxyId BuildRange(std::vector<ProxyId>& leaves, size_t begin, size_t end);
+
+    void AddSubtree(ProxyId node, std::vector<uint32_t>& results) const;
+    uint32_t GetHeight(ProxyId node) const;
+
+    std::vector<Node> nodes_;
+    ProxyId root_ = NULL_NODE;
+    ProxyId free_list_ = NULL_NODE;
+    size_t leaf_count_ = 0;
+    size_t node_count_ = 0;
+};
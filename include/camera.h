@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bounds.h"
 #include "common.h"
 #include "common_glm.h"
 #include "common_vulkan.h"
@@ -31,6 +32,9 @@ public:
     void SetFarZ(float far_z);
     float GetFarZ() const;
 
+    // Distance from the camera to the corners of the near plane
+    float GetNearPlaneRadius() const;
+
     void SetNode(NonOwningPointer<SceneNode> node);
     NonOwningPointer<SceneNode> GetNode() const;
 
@@ -54,6 +58,10 @@ public:
 
     GpuCameraData GetCameraData() const;
 
+    // Returns the world space ray through a point in normalized device
+    // coordinates (-1 to 1, +y up), starting on the near plane
+    Ray GetRay(glm::vec2 ndc) const;
+
 private:
     float fov_;
     float aspect_ratio_;
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Destroys resources only once the GPU is done with them. Each entry is
+// tagged with the timeline value of the last submission that may use it and
+// is destroyed by the first Collect that sees that value completed, so
+// replacing a resource never has to wait for the device to go idle
+class DeletionQueue
+{
+public:
+    using Deleter = std::function<void()>;
+
+    DeletionQueue() = default;
+
+    DeletionQueue(const DeletionQueue&) = delete;
+    DeletionQueue(DeletionQueue&&) = delete;
+
+    DeletionQueue& operator=(const DeletionQueue&) = delete;
+    DeletionQueue& operator=(DeletionQueue&&) = delete;
+
+    // Anything still queued is destroyed, the device must be idle
+    ~DeletionQueue();
+
+    // deleter runs once last_use_value has completed
+    void Push(uint64_t last_use_value, Deleter deleter);
+
+    // Runs the deleters of every entry up to completed_value, in the order
+    // they were pushed. Returns how many ran
+    size_t Collect(uint64_t completed_value);
+
+    // Runs every deleter, the device must be idle
+    void Flush();
+
+    size_t GetPendingCount() const;
+
+private:
+    std::vector<std::pair<uint64_t, Deleter>> entries_;
+};
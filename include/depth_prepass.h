@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+
+#include "common.h"
+#include "common_vulkan.h"
+#include "draw_item.h"
+
+class RendererState;
+class RenderObject;
+
+// Depth only pass over the opaque draw items, run before the main draws in
+// the same subpass. It reads only the position stream of each mesh and has
+// no fragment shader, the main draws then use the materials' depth_equal
+// pipelines so every pixel is shaded once
+class DepthPrepass
+{
+public:
+    DepthPrepass(RendererState& renderer);
+
+    DepthPrepass(const DepthPrepass&) = delete;
+    DepthPrepass(DepthPrepass&&) = delete;
+
+    DepthPrepass& operator=(const DepthPrepass&) = delete;
+    DepthPrepass& operator=(DepthPrepass&&) = delete;
+
+    ~DepthPrepass();
+
+    // The pipeline depends on the sample count. The old one is destroyed
+    // once the frames in flight are done with it
+    void RecreatePipeline(RendererState& renderer);
+
+    // Must be recorded inside the scene render pass, before the main draws.
+    // Only the opaque items in [first, last) may be passed
+    void RecordDraws(vk::CommandBuffer& command_buffer,
+                     vk::DescriptorSet camera_descriptor,
+                     const std::vector<DrawItem>& draw_items, size_t first,
+                     size_t last, std::vector<RenderObject>& render_objects);
+
+private:
+    vk::Device& device_;
+
+    vk::PipelineLayout pipeline_layout_;
+    vk::Pipeline pipeline_;
+};
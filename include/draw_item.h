@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+#include "common_glm.h"
+#include "material_cache.h"
+
+class Mesh;
+class RenderObject;
+
+// One material range of one mesh of one object, the unit the CPU draw loop
+// records
+struct DrawItem
+{
+    MaterialHandle material;
+    NonOwningPointer<const Mesh> mesh;
+    uint32_t object_index;
+    uint32_t first_index;
+    uint32_t index_count;
+    bool transparent = false;
+    // Squared distance from the camera to the object's bounding sphere
+    float distance = 0.0f;
+};
+
+// Replaces draw_items with one item per mesh range of the objects, in object
+// order. Ranges without a material are left out
+void BuildDrawItems(const std::vector<uint32_t>& object_indices,
+                    std::vector<RenderObject>& render_objects,
+                    MaterialCache& material_cache,
+                    const glm::vec3& camera_position,
+                    std::vector<DrawItem>& draw_items);
+
+// Puts the opaque items first, ordered by material and then front to back
+// so that consecutive items share their pipeline as often as possible and
+// later ones fail the depth test. The transparent items follow back to
+// front. Returns the index of the first transparent item
+size_t SortDrawItems(std::vector<DrawItem>& draw_items);
+
+// Moves the transparent items behind the opaque ones without reordering
+// either, for draws that must stay grouped by object. Returns the index of
+// the first transparent item
+size_t PartitionDrawItems(std::vector<DrawItem>& draw_items);
+
+// Refreshes the distances of the transparent items from first_transparent
+// on and sorts them back to front again, for when only the camera moved
+void SortTransparentDrawItems(std::vector<DrawItem>& draw_items,
+                              size_t first_transparent,
+                              std::vector<RenderObject>& render_objects,
+                              const glm::vec3& camera_position);
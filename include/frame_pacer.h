@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Caps the frame rate by starting every frame at a fixed deadline. Deadlines
+// advance by exactly one frame period, so a frame that starts late is made
+// up for by the next one instead of shifting every later frame. The wait
+// sleeps until shortly before the deadline and spins for the rest, since
+// sleeps routinely overshoot by a millisecond or more
+class FramePacer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // 0 leaves the frame rate uncapped, as do negative and non-finite rates
+    // and rates whose period the clock cannot represent
+    void SetTargetFrameRate(double frames_per_second);
+    double GetTargetFrameRate() const;
+
+    // Blocks until the current frame's deadline and schedules the next one.
+    // Returns right away when uncapped
+    void WaitForNextFrame();
+
+    // How late frames started relative to their deadline over the last
+    // ERROR_HISTORY_SIZE frames, in milliseconds. 0 when uncapped
+    double GetErrorPercentile(double percentile) const;
+
+    static constexpr size_t ERROR_HISTORY_SIZE = 256;
+
+private:
+    void RecordError(double error_ms);
+
+    double target_frame_rate_ = 0.0;
+    Clock::duration frame_period_ = Clock::duration::zero();
+    Clock::time_point deadline_;
+    bool has_deadline_ = false;
+
+    // Ring buffer of the latest pacing errors
+    std::vector<double> errors_;
+    size_t next_error_ = 0;
+};
+
+// Nearest rank percentile, percentile in [0, 100]. 0 for no values
+double GetPercentile(std::vector<double> values, double percentile);
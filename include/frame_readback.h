@@ -0,0 +1,74 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "common_vulkan.h"
+#include "gpu_buffer.h"
+
+class RendererState;
+
+// A headless frame read back to the CPU. pixels holds extent.height tightly
+// packed rows of extent.width texels of format, it is only valid while the
+// sink runs
+struct ReadbackFrame
+{
+    uint64_t frame_number = 0;
+    vk::Extent2D extent;
+    vk::Format format = vk::Format::eUndefined;
+    const uint8_t* pixels = nullptr;
+};
+
+// Takes the place of presentation for a headless renderer
+using FrameSink = std::function<void(const ReadbackFrame& frame)>;
+
+// Binary PPM of 8 bit RGBA or BGRA texels, alpha is dropped. Throws for any
+// other format
+void WritePpm(std::ostream& out, const ReadbackFrame& frame);
+// Writes every frame to directory as frame_<number>.ppm, for diffing against
+// reference images
+FrameSink MakePpmFrameSink(const std::string& directory);
+
+// Copies the offscreen images of a headless renderer into host visible
+// buffers at the end of each frame, and hands them to the sink in frame
+// order once the GPU is done with them. Made for the images the swapchain
+// has at the time
+class FrameReadback
+{
+public:
+    FrameReadback(RendererState& renderer, FrameSink sink);
+
+    FrameReadback(const FrameReadback&) = delete;
+    FrameReadback(FrameReadback&&) = delete;
+
+    FrameReadback& operator=(const FrameReadback&) = delete;
+    FrameReadback& operator=(FrameReadback&&) = delete;
+
+    // Recorded at the very end of a frame, which leaves the image in
+    // eTransferSrcOptimal and makes transfers wait for its last write
+    void RecordCopy(vk::CommandBuffer& command_buffer, uint32_t image_index);
+
+    // The frame that last rendered image_index must have finished. It goes
+    // to the sink, unless it already has. Exceptions from the sink are
+    // passed on and the frame stays pending
+    void Deliver(uint32_t image_index);
+    // Delivers every frame left, the device must be idle
+    void Flush();
+
+private:
+    vk::Device& device_;
+    FrameSink sink_;
+
+    std::vector<vk::Image> images_;
+    vk::Extent2D extent_;
+    vk::Format format_;
+
+    std::vector<GpuBuffer> buffers_;
+    // Frame copied into each buffer that has not been delivered yet
+    std::vector<std::optional<uint64_t>> pending_frames_;
+    uint64_t next_frame_number_ = 0;
+};
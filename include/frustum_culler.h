@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bounds.h"
+#include "common.h"
+#include "common_glm.h"
+
+enum class CullingBackend
+{
+    Scalar,
+    Sse,
+    Avx
+};
+
+const char* CullingBackendName(CullingBackend backend);
+
+// Tests a flat list of world space AABBs against a frustum. Bounds are stored
+// as separate center and extent arrays per axis so that the SIMD paths can
+// test 4 (SSE) or 8 (AVX) boxes against a plane with a handful of
+// instructions. The AVX path is selected at runtime, and every build has the
+// scalar path as a fallback
+class FrustumCuller
+{
+public:
+    // Uses the widest backend the CPU supports
+    FrustumCuller();
+    explicit FrustumCuller(CullingBackend backend);
+
+    static bool IsBackendSupported(CullingBackend backend);
+    static CullingBackend GetBestBackend();
+
+    CullingBackend GetBackend() const;
+    // Falls back to the scalar path if the backend isn't supported
+    void SetBackend(CullingBackend backend);
+
+    // New bounds are empty boxes at the origin
+    void Resize(size_t count);
+    size_t GetSize() const;
+
+    void SetBounds(size_t index, const Aabb& bounds);
+
+    // Clears visible and fills it with the indices of every box that
+    // intersects the frustum, in increasing order
+    void Cull(const Frustum& frustum, std::vector<uint32_t>& visible) const;
+
+private:
+    void CullScalar(const Frustum& frustum,
+                    std::vector<uint32_t>& visible) const;
+    void CullSse(const Frustum& frustum, std::vector<uint32_t>& visible) const;
+    void CullAvx(const Frustum& frustum, std::vector<uint32_t>& visible) const;
+
+    CullingBackend backend_;
+
+    size_t count_ = 0;
+
+    // Padded to a multiple of the widest SIMD width, padding is never
+    // reported as visible
+    std::vector<float> center_x_;
+    std::vector<float> center_y_;
+    std::vector<float> center_z_;
+    std::vector<float> extent_x_;
+    std::vector<float> extent_y_;
+    std::vector<float> extent_z_;
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include "bounds.h"
+#include "common.h"
+#include "common_glm.h"
+#include "common_vulkan.h"
+#include "gpu_buffer.h"
+
+class HiZPyramid;
+class Material;
+class Mesh;
+class RendererState;
+class RenderObject;
+
+struct GpuCullBatch
+{
+    alignas(16) glm::vec4 bounding_sphere;
+    uint32_t index_count;
+    uint32_t first_index;
+    int32_t vertex_offset;
+    uint32_t command_offset;
+};
+
+struct GpuCullInstance
+{
+    uint32_t object_index;
+    uint32_t batch_index;
+};
+
+// Matches the std140 CullParameters block in cull.comp
+struct GpuCullParameters
+{
+    glm::mat4 viewproj;
+    glm::vec4 frustum_planes[Frustum::Plane::Count];
+    uint32_t instance_count;
+    uint32_t hiz_width;
+    uint32_t hiz_height;
+    uint32_t hiz_mip_count;
+};
+
+// All culls against the frustum only. Early and Late split the frame in two
+// for Hi-Z occlusion culling: Early draws the instances that were visible
+// last frame, the Hi-Z pyramid is then built from that depth, and Late draws
+// the instances that became visible, updating the visibility for next frame
+enum class GpuCullPhase : uint32_t
+{
+    All = 0,
+    Early = 1,
+    Late = 2
+};
+
+// Frustum (and optionally Hi-Z occlusion) culls every (object, mesh) instance
+// in a compute pass and writes compacted indexed indirect commands plus a
+// draw count per mesh, which are then consumed by drawIndexedIndirectCount
+class GpuCuller
+{
+public:
+    // hiz_occlusion enables the Late phase, SetHiZPyramid must be called
+    // before any frame is recorded
+    GpuCuller(RendererState& renderer, size_t frame_count, bool hiz_occlusion);
+
+    GpuCuller(const GpuCuller&) = delete;
+    GpuCuller(GpuCuller&&) = delete;
+
+    GpuCuller& operator=(const GpuCuller&) = delete;
+    GpuCuller& operator=(GpuCuller&&) = delete;
+
+    ~GpuCuller();
+
+    // Rebuilds the batch and instance tables, none of the frames may be in
+    // flight when this is called
+    void Build(RendererState& renderer,
+               std::vector<RenderObject>& render_objects);
+
+    // Copies the current object transforms into this frame's object buffer
+    void UpdateObjects(size_t frame_index,
+                       const std::vector<RenderObject>& render_objects);
+
+    // Points the Late phase at the pyramid, must be called again whenever
+    // the pyramid is resized. Frames in flight keep the old one, each frame's
+    // descriptor set is only rewritten by its next BeginFrame
+    void SetHiZPyramid(const HiZPyramid& hiz_pyramid);
+
+    // Writes this frame's culling parameters and resets the draw counts,
+    // must be recorded before any RecordCull of the frame. The last
+    // submission of frame_index must have completed
+    void BeginFrame(vk::CommandBuffer& command_buffer, size_t frame_index,
+                    const glm::mat4& viewproj);
+
+    // Must be recorded outside of a render pass
+    void RecordCull(vk::CommandBuffer& command_buffer, size_t frame_index,
+                    GpuCullPhase phase);
+
+    // Must be recorded inside the scene render pass
+    void RecordDraws(vk::CommandBuffer& command_buffer, size_t frame_index,
+                     GpuCullPhase phase, vk::DescriptorSet camera_descriptor);
+
+private:
+    struct Batch
+    {
+        NonOwningPointer<const Mesh> mesh;
+        NonOwningPointer<Material> material;
+        uint32_t first_index;
+        uint32_t index_count;
+        uint32_t command_offset;
+        uint32_t max_draw_count;
+    };
+
+    struct FrameResources
+    {
+        std::optional<GpuBuffer> object_buffer;
+        std::optional<GpuBuffer> command_buffer;
+        std::optional<GpuBuffer> count_buffer;
+        std::optional<GpuBuffer> parameter_buffer;
+        vk::DescriptorSet cull_descriptor_set;
+        vk::DescriptorSet object_descriptor_set;
+        // Still names the pyramid from before the last SetHiZPyramid
+        bool stale_hiz_descriptor = false;
+    };
+
+    void CreateDescriptorSets(RendererState& renderer);
+    void WriteDescriptorSets(FrameResources& frame);
+    void WriteHiZDescriptor(FrameResources& frame);
+
+    vk::Device& device_;
+
+    vk::DescriptorPool descriptor_pool_;
+    vk::DescriptorSetLayout cull_descriptor_set_layout_;
+    vk::PipelineLayout cull_pipeline_layout_;
+    vk::Pipeline cull_pipeline_;
+
+    std::vector<Batch> batches_;
+    uint32_t instance_count_ = 0;
+    uint32_t object_count_ = 0;
+    // Size of one phase's region of the command buffers
+    uint32_t command_count_ = 0;
+
+    std::optional<GpuBuffer> batch_buffer_;
+    std::optional<GpuBuffer> instance_buffer_;
+
+    // Shared by every frame, frames are culled in submission order so each
+    // one sees the visibility written by the frame before it
+    std::optional<GpuBuffer> visibility_buffer_;
+    bool reset_visibility_ = false;
+
+    bool hiz_occlusion_;
+    NonOwningPointer<const HiZPyramid> hiz_pyramid_ = nullptr;
+
+    std::vector<FrameResources> frames_;
+};
@@ -17,7 +17,8 @@ public:
     GpuImage(RendererState& renderer, uint32_t width, uint32_t height,
               uint32_t mip_levels, vk::SampleCountFlagBits num_samples,
               vk::Format format, vk::ImageTiling tiling,
-              vk::ImageUsageFlags usage, vk::MemoryPropertyFlags properties);
+              vk::ImageUsageFlags usage, vk::MemoryPropertyFlags properties,
+              vk::MemoryPropertyFlags preferred = {});
 
     GpuImage(const GpuImage&) = delete;
     GpuImage(GpuImage&& other);
@@ -34,6 +35,9 @@ public:
                  vk::MemoryPropertyFlags properties);
 
     vk::Image GetImage();
+    vk::DeviceMemory GetMemory();
+    // Of the memory type the image is bound to
+    vk::MemoryPropertyFlags GetMemoryProperties();
 
 private:
     void Cleanup();
@@ -42,4 +46,5 @@ private:
 
     vk::Image image_;
     vk::DeviceMemory memory_;
+    vk::MemoryPropertyFlags memory_properties_;
 };
\ No newline at end of file
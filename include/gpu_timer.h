@@ -0,0 +1,63 @@
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include "common.h"
+#include "common_vulkan.h"
+
+class RendererState;
+
+// GPU timestamps, a few per frame in flight. Results are read back the next
+// time the same frame index comes around, after it has been waited on
+class GpuTimer
+{
+public:
+    GpuTimer(RendererState& renderer, size_t frame_count,
+             uint32_t timestamp_count);
+
+    GpuTimer(const GpuTimer&) = delete;
+    GpuTimer(GpuTimer&&) = delete;
+
+    GpuTimer& operator=(const GpuTimer&) = delete;
+    GpuTimer& operator=(GpuTimer&&) = delete;
+
+    ~GpuTimer();
+
+    // Whether the graphics queue supports timestamps at all, nothing is
+    // recorded otherwise
+    bool IsSupported() const;
+
+    // Reads the timestamps written the last time frame_index was recorded.
+    // The frame must have been waited on
+    void ReadResults(size_t frame_index);
+
+    // Must be recorded outside of a render pass, before any Write of the
+    // frame
+    void Reset(vk::CommandBuffer& command_buffer, size_t frame_index);
+
+    // Writes timestamp index once all previous commands reached stage
+    void Write(vk::CommandBuffer& command_buffer, size_t frame_index,
+               uint32_t index, vk::PipelineStageFlagBits stage);
+
+    // Milliseconds between two timestamps of the last results read, if both
+    // were written
+    std::optional<double> GetMilliseconds(uint32_t first,
+                                          uint32_t second) const;
+
+private:
+    struct FrameResources
+    {
+        vk::QueryPool query_pool;
+        // Which timestamps were written since the last reset
+        std::vector<bool> written;
+    };
+
+    vk::Device& device_;
+
+    bool supported_ = false;
+    double nanoseconds_per_tick_ = 1.0;
+    uint32_t timestamp_count_ = 0;
+    std::vector<FrameResources> frames_;
+    std::vector<std::optional<uint64_t>> results_;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include "common.h"
+#include "common_vulkan.h"
+#include "gpu_image.h"
+
+class RendererState;
+
+// Hierarchical depth buffer built from the scene depth by compute. Every texel
+// of a mip holds the farthest depth (0 near, 1 far) of the texels it covers
+// in the level below, so a box whose nearest depth is behind the value it
+// overlaps is hidden. Odd sized levels fold their last row and column into
+// the neighbouring texel, so texel i of level n always covers at least pixels
+// [i * 2^n, (i + 1) * 2^n) of the depth buffer
+class HiZPyramid
+{
+public:
+    HiZPyramid(RendererState& renderer);
+
+    HiZPyramid(const HiZPyramid&) = delete;
+    HiZPyramid(HiZPyramid&&) = delete;
+
+    HiZPyramid& operator=(const HiZPyramid&) = delete;
+    HiZPyramid& operator=(HiZPyramid&&) = delete;
+
+    ~HiZPyramid();
+
+    // Matches the pyramid to the current depth buffer, must be called after
+    // the swapchain or sample count changes. The old image and descriptor
+    // sets are retired through the renderer, frames in flight keep them
+    void Resize(RendererState& renderer);
+
+    // Must be recorded outside of a render pass, after the scene depth has
+    // been written. The depth buffer is expected in (and returned to)
+    // DepthStencilAttachmentOptimal, the pyramid is left readable by compute
+    // shaders in General layout
+    void RecordBuild(vk::CommandBuffer& command_buffer);
+
+    // Every mip level, meant for texelFetch
+    vk::ImageView GetImageView() const;
+    vk::Sampler GetSampler() const;
+
+    uint32_t GetWidth() const;
+    uint32_t GetHeight() const;
+    uint32_t GetMipCount() const;
+
+private:
+    void CreateImage(RendererState& renderer);
+    void RetireImage(RendererState& renderer);
+    void DestroyImage();
+    void CreateDescriptorSets(RendererState& renderer);
+
+    vk::Device& device_;
+
+    // One per size, so the sets of the old size stay valid while in use
+    vk::DescriptorPool descriptor_pool_;
+    vk::DescriptorSetLayout copy_descriptor_set_layout_;
+    vk::DescriptorSetLayout downsample_descriptor_set_layout_;
+    vk::PipelineLayout copy_pipeline_layout_;
+    vk::Pipeline copy_pipeline_;
+    vk::PipelineLayout copy_multisampled_pipeline_layout_;
+    vk::Pipeline copy_multisampled_pipeline_;
+    vk::PipelineLayout downsample_pipeline_layout_;
+    vk::Pipeline downsample_pipeline_;
+    vk::Sampler sampler_;
+
+    std::optional<GpuImage> image_;
+    vk::ImageView image_view_;
+    std::vector<vk::ImageView> mip_views_;
+
+    // copy_descriptor_set_ writes mip 0, downsample_descriptor_sets_[i]
+    // writes mip i + 1
+    vk::DescriptorSet copy_descriptor_set_;
+    std::vector<vk::DescriptorSet> downsample_descriptor_sets_;
+
+    vk::Image depth_image_;
+    vk::Format depth_format_ = vk::Format::eUndefined;
+    uint32_t sample_count_ = 1;
+
+    uint32_t width_ = 0;
+    uint32_t height_ = 0;
+    uint32_t mip_count_ = 0;
+};
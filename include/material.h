@@ -1,16 +1,38 @@
 #pragma once
 
+#include <map>
+
 #include "common.h"
 #include "common_vulkan.h"
 
+#include "pipeline_target.h"
+#include "texture_cache.h"
 #include "tiny_obj_loader.h"
 
 class RendererState;
-class Texture;
+
+struct PipelineVariant
+{
+    // Draws come from an indirect buffer and read their transforms from the
+    // object storage buffer instead of a per object uniform buffer
+    bool indirect = false;
+    // Opaque materials only. Depth is tested for equality and not written,
+    // the depth pre-pass has already laid it down
+    bool depth_equal = false;
+
+    bool operator<(const PipelineVariant& other) const;
+};
 
 class Material
 {
 public:
+    // Every variant of a material for one sample count
+    using PipelineSet =
+        std::map<PipelineVariant, std::pair<vk::PipelineLayout, vk::Pipeline>>;
+
+    static void DestroyPipelines(vk::Device device,
+                                 const PipelineSet& pipelines);
+
     Material(RendererState& renderer, tinyobj::material_t material_defintion);
 
     Material(const Material&) = delete;
@@ -21,12 +43,27 @@ public:
 
     ~Material();
 
-    void RecreatePipeline(RendererState& renderer);
-
-    vk::PipelineLayout& GetGraphicsPipelineLayout();
-    vk::Pipeline& GetGraphicsPipeline();
-
-    NonOwningPointer<Texture> GetTexture();
+    // Builds every variant for target without changing the material, so it
+    // may run on another thread while the material is being drawn with
+    PipelineSet CreatePipelines(RendererState& renderer,
+                                const PipelineTarget& target) const;
+    bool HasPipelines(vk::SampleCountFlagBits sample_count) const;
+    // Keeps pipelines for sample_count, unless it already has some
+    void AddPipelines(vk::SampleCountFlagBits sample_count,
+                      PipelineSet pipelines);
+    // Draws with the pipelines of the renderer's current sample count from
+    // now on, they are built first if needed
+    void SelectPipelines(RendererState& renderer);
+
+    vk::PipelineLayout& GetGraphicsPipelineLayout(
+        PipelineVariant variant = {});
+    vk::Pipeline& GetGraphicsPipeline(PipelineVariant variant = {});
+
+    // INVALID_TEXTURE_HANDLE if the material is untextured
+    TextureHandle GetTexture() const;
+    // Classified at load from the MTL dissolve and the texture's alpha.
+    // Opaque materials get pipelines without blending
+    bool IsTransparent() const;
     vk::DescriptorSet& GetDescriptorSet();
 
 private:
@@ -35,19 +72,24 @@ private:
     void MoveFrom(Material&& other);
 
     std::pair<vk::PipelineLayout, vk::Pipeline> CreateGraphicsPipeline(
-        RendererState& renderer);
-    vk::ShaderModule CreateShaderModule(const std::vector<uint32_t>& code);
+        RendererState& renderer, const PipelineTarget& target,
+        PipelineVariant variant) const;
+    vk::ShaderModule CreateShaderModule(
+        const std::vector<uint32_t>& code) const;
 
     void CreateSampler(RendererState& renderer);
     void CreateDescriptorSet(RendererState& renderer);
 
     vk::Device& device_;
 
-    vk::PipelineLayout pipeline_layout_;
-    vk::Pipeline pipeline_;
+    // Kept for every sample count used so far
+    std::map<vk::SampleCountFlagBits, PipelineSet> pipelines_;
+    vk::SampleCountFlagBits current_sample_count_ =
+        vk::SampleCountFlagBits::e1;
 
     tinyobj::material_t material_;
     vk::DescriptorSet material_descriptor_set_;
-    NonOwningPointer<Texture> texture_;
+    TextureHandle texture_ = INVALID_TEXTURE_HANDLE;
+    bool transparent_ = false;
     vk::Sampler sampler_;
 };
\ No newline at end of file
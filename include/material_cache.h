@@ -1,7 +1,13 @@
 #pragma once
 
-#include <map>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <optional>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "common.h"
 
@@ -10,18 +16,71 @@
 
 class RendererState;
 
+// Index of a material in the MaterialCache, stable until the cache is cleared
+using MaterialHandle = uint32_t;
+constexpr MaterialHandle INVALID_MATERIAL_HANDLE =
+    std::numeric_limits<MaterialHandle>::max();
+
+// Materials are looked up by name only while loading, draws address them by
+// handle so that no strings are touched per frame. Pointers returned by
+// GetMaterial are invalidated by the next LoadMaterial, handles are not.
+//
+// Pipelines for another sample count can be built on a background thread
+// while the current ones keep drawing, so switching MSAA does not hitch
 class MaterialCache
 {
 public:
-    void LoadMaterial(RendererState& renderer,
-                     std::string name, tinyobj::material_t material_definition);
-    
-    NonOwningPointer<Material> GetMaterialByName(std::string name);
+    MaterialCache() = default;
+
+    MaterialCache(const MaterialCache&) = delete;
+    MaterialCache(MaterialCache&&) = delete;
+
+    MaterialCache& operator=(const MaterialCache&) = delete;
+    MaterialCache& operator=(MaterialCache&&) = delete;
+
+    ~MaterialCache();
+
+    // Loads the material unless one with the same name already is, and
+    // returns its handle
+    MaterialHandle LoadMaterial(RendererState& renderer,
+                                const std::string& name,
+                                const tinyobj::material_t& material_definition);
 
-    void RecreateAllPipelines(RendererState& renderer);
+    // INVALID_MATERIAL_HANDLE if no material has that name
+    MaterialHandle FindMaterial(const std::string& name) const;
+
+    // nullptr for INVALID_MATERIAL_HANDLE
+    NonOwningPointer<Material> GetMaterial(MaterialHandle handle);
+
+    // Whether every material has pipelines for sample_count. A background
+    // build of the missing ones is started unless one is already running,
+    // and a finished build is taken over first
+    bool PreparePipelines(RendererState& renderer,
+                          vk::SampleCountFlagBits sample_count);
+    // Switches every material to the renderer's current sample count,
+    // building whatever pipelines are still missing right away
+    void SelectPipelines(RendererState& renderer);
 
     void Clear();
 
 private:
-    std::map<std::string, Material> material_map_;
-};
\ No newline at end of file
+    struct PipelineBuild
+    {
+        PipelineTarget target;
+        // Material index and its pipelines
+        std::future<std::vector<std::pair<size_t, Material::PipelineSet>>>
+            result;
+    };
+
+    // Waits for the background build and hands its pipelines to the
+    // materials
+    void FinishPipelineBuild();
+    void CancelPipelineBuild();
+
+    std::vector<Material> materials_;
+    std::unordered_map<std::string, MaterialHandle> handles_;
+
+    std::optional<PipelineBuild> pipeline_build_;
+    // Only used to destroy the pipelines of a cancelled build
+    std::optional<vk::Device> device_;
+};
@@ -2,35 +2,68 @@
 
 #include <vector>
 
+#include "bounds.h"
 #include "common.h"
 #include "common_vulkan.h"
 
 #include "gpu_buffer.h"
+#include "material_cache.h"
 #include "tiny_obj_loader.h"
 #include "vertex.h"
 
+// Contiguous part of a mesh's index buffer drawn with one material
+struct MeshRange
+{
+    uint32_t first_index;
+    uint32_t index_count;
+    MaterialHandle material;
+};
+
 class Mesh
 {
 public:
+    // materials maps the OBJ material ids of the faces to loaded materials,
+    // faces with an id outside of it use the first material. The faces are
+    // reordered so every material gets a single range
     Mesh(RendererState& renderer, const tinyobj::attrib_t attribs,
-         const tinyobj::shape_t& shape);
+         const tinyobj::shape_t& shape,
+         const std::vector<MaterialHandle>& materials);
     Mesh(const Mesh&) = delete;
     Mesh(Mesh&& mesh);
 
-    vk::Buffer GetVertexBuffer() const;
+    // Binding 0 and 1 of Vertex::GetBindingDescriptions
+    vk::Buffer GetPositionBuffer() const;
+    vk::Buffer GetAttributeBuffer() const;
     vk::Buffer GetIndexBuffer() const;
 
     uint32_t GetVertexCount() const;
     uint32_t GetTriangleCount() const;
 
+    // Sorted by material
+    const std::vector<MeshRange>& GetRanges() const;
+
+    const Aabb& GetBounds() const;
+    const BoundingSphere& GetBoundingSphere() const;
+
+    // CPU copies of the geometry, used for software occlusion culling
+    const std::vector<glm::vec3>& GetPositions() const;
+    const std::vector<uint32_t>& GetIndices() const;
+
 private:
     std::string name_;
 
-    std::vector<int32_t> material_indices_;
+    std::vector<MeshRange> ranges_;
 
-    GpuBuffer gpu_vertices_;
+    GpuBuffer gpu_positions_;
+    GpuBuffer gpu_attributes_;
     GpuBuffer gpu_indices_;
 
     uint32_t vertex_count_;
     uint32_t tri_count_;
+
+    Aabb bounds_;
+    BoundingSphere bounding_sphere_;
+
+    std::vector<glm::vec3> positions_;
+    std::vector<uint32_t> indices_;
 };
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "common_vulkan.h"
 
+#include "material_cache.h"
 #include "mesh.h"
 #include "tiny_obj_loader.h"
 
@@ -23,9 +24,12 @@ public:
 
     const std::vector<Mesh>& GetMeshes();
 
-    const std::string& GetMaterialName();
+    // Union of all of the mesh bounds, in model space
+    const Aabb& GetBounds() const;
+
 
 private:
     std::vector<Mesh> meshes_;
     std::vector<tinyobj::material_t> materials_;
+    Aabb bounds_;
 };
\ No newline at end of file
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "bounds.h"
+#include "common.h"
+#include "common_glm.h"
+#include "common_vulkan.h"
+#include "gpu_buffer.h"
+
+class RendererState;
+class RenderObject;
+
+// Hardware occlusion queries with temporal coherence. Each frame in flight
+// owns a query pool; queries are issued either around a real draw or around
+// an invisible bounding box, and are read back the next time the same frame
+// index comes around, so results are one or two frames old.
+//
+// Without conditional rendering the CPU reads the results back and skips the
+// objects that were hidden, re-testing them with their bounding box only.
+// With VK_EXT_conditional_rendering the results of the previous frame are
+// copied into a predicate buffer on the GPU and every draw is predicated on
+// its object's last bounding box query, so nothing is read back at all
+class OcclusionQueryCuller
+{
+public:
+    static constexpr uint32_t NO_QUERY = std::numeric_limits<uint32_t>::max();
+
+    OcclusionQueryCuller(RendererState& renderer, size_t frame_count);
+
+    OcclusionQueryCuller(const OcclusionQueryCuller&) = delete;
+    OcclusionQueryCuller(OcclusionQueryCuller&&) = delete;
+
+    OcclusionQueryCuller& operator=(const OcclusionQueryCuller&) = delete;
+    OcclusionQueryCuller& operator=(OcclusionQueryCuller&&) = delete;
+
+    ~OcclusionQueryCuller();
+
+    // The bounding box pipeline depends on the sample count. The old one is
+    // destroyed once the frames in flight are done with it
+    void RecreatePipeline(RendererState& renderer);
+
+    // Sizes the query pools for object_count objects and marks every object
+    // visible, none of the frames may be in flight when this is called
+    void Resize(RendererState& renderer, size_t object_count);
+
+    // Reads the queries issued the last time frame_index was recorded, the
+    // frame must have been waited on
+    void ReadResults(size_t frame_index);
+
+    // Whether the object passed its last query, objects that were never
+    // queried count as visible
+    bool IsVisible(uint32_t object_index) const;
+    size_t GetHiddenObjectCount() const;
+
+    // Must be recorded outside of a render pass. Resets this frame's queries
+    // and, for conditional rendering, fills the predicate buffer from the
+    // previous frame's queries
+    void BeginFrame(vk::CommandBuffer& command_buffer, size_t frame_index,
+                    bool conditional);
+
+    // Wraps a real draw of the object in a query
+    void BeginQuery(vk::CommandBuffer& command_buffer, size_t frame_index,
+                    uint32_t object_index);
+    void EndQuery(vk::CommandBuffer& command_buffer, size_t frame_index);
+
+    // Tests the world bounds of each object without writing color or depth.
+    // Must be recorded inside the scene render pass after the other draws.
+    // Boxes within near_radius of the camera could be clipped away by the
+    // near plane, they are assumed visible instead of being queried
+    void QueryBoundingBoxes(vk::CommandBuffer& command_buffer,
+                            size_t frame_index,
+                            const std::vector<uint32_t>& object_indices,
+                            const std::vector<RenderObject>& render_objects,
+                            vk::DescriptorSet camera_descriptor,
+                            const glm::vec3& camera_position,
+                            float near_radius);
+
+    // Predicates the following draws on the object's bounding box query from
+    // the previous frame. Objects without one are drawn unconditionally
+    void BeginConditionalDraw(vk::CommandBuffer& command_buffer,
+                              size_t frame_index, uint32_t object_index);
+    void EndConditionalDraw(vk::CommandBuffer& command_buffer);
+
+private:
+    struct FrameResources
+    {
+        vk::QueryPool query_pool;
+        // Object index of every query issued, in query order
+        std::vector<uint32_t> queried_objects;
+        // Query index of every object, or NO_QUERY
+        std::vector<uint32_t> object_queries;
+        // Conditional rendering only, one 32 bit result per query of the
+        // previous frame
+        std::optional<GpuBuffer> predicate_buffer;
+        NonOwningPointer<const FrameResources> predicate_source = nullptr;
+    };
+
+    void DestroyPools();
+    uint32_t AddQuery(FrameResources& frame, uint32_t object_index);
+
+    vk::Device& device_;
+
+    vk::PipelineLayout pipeline_layout_;
+    vk::Pipeline pipeline_;
+
+    size_t object_count_ = 0;
+    std::vector<FrameResources> frames_;
+    // 1 if the object passed its last query that has been read back
+    std::vector<uint8_t> visible_;
+    bool conditional_draw_active_ = false;
+};
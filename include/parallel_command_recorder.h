@@ -0,0 +1,123 @@
+#pragma once
+
+#include <functional>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "common_vulkan.h"
+#include "pipeline_target.h"
+
+class RendererState;
+class ThreadPool;
+
+// Number of chunks to split item_count items into, at most max_chunks and
+// never fewer than min_chunk_size items per chunk (except for a lone chunk)
+size_t GetChunkCount(size_t item_count, size_t max_chunks,
+                     size_t min_chunk_size);
+
+// Item range [first, second) of chunk when item_count items are spread as
+// evenly as possible over chunk_count chunks
+std::pair<size_t, size_t> GetChunkRange(size_t item_count, size_t chunk_count,
+                                        size_t chunk);
+
+// Records a draw list in parallel into secondary command buffers. Every
+// chunk of a frame owns a command pool, so no two threads ever share one and
+// the whole frame is recycled with a single pool reset instead of resetting
+// command buffers one at a time.
+//
+// Draw lists that rarely change can instead be recorded once and replayed by
+// RecordCached for as long as the caller's generation number stays the same.
+// Each frame has cache_count independent caches, one per draw list
+class ParallelCommandRecorder
+{
+public:
+    // Records the items [first, last) into command_buffer, which has already
+    // been begun as a secondary continuing the render pass
+    using RecordFunction = std::function<void(
+        vk::CommandBuffer& command_buffer, size_t first, size_t last)>;
+
+    ParallelCommandRecorder(RendererState& renderer, size_t frame_count,
+                            size_t chunk_count, size_t cache_count);
+
+    ParallelCommandRecorder(const ParallelCommandRecorder&) = delete;
+    ParallelCommandRecorder(ParallelCommandRecorder&&) = delete;
+
+    ParallelCommandRecorder& operator=(const ParallelCommandRecorder&) = delete;
+    ParallelCommandRecorder& operator=(ParallelCommandRecorder&&) = delete;
+
+    ~ParallelCommandRecorder();
+
+    // Recycles every secondary recorded for frame_index, the frame must have
+    // been waited on
+    void BeginFrame(size_t frame_index);
+
+    // Splits item_count items into chunks, records them on thread_pool and
+    // executes them from primary in order. The scene pass must have been
+    // begun for secondaries and target must describe it. framebuffer may be
+    // null. May be called several times per frame, each call gets its own
+    // secondaries
+    void Record(vk::CommandBuffer& primary, size_t frame_index,
+                const PipelineTarget& target, vk::Framebuffer framebuffer,
+                ThreadPool& thread_pool, size_t item_count,
+                const RecordFunction& record);
+
+    // Same as Record, but the secondaries are kept and executed again as
+    // long as generation matches the one they were recorded with. The caller
+    // must change generation whenever anything the draws reference changes:
+    // the items, their descriptor sets, pipelines or the target. They are
+    // recorded without a framebuffer so every swapchain image can share them
+    void RecordCached(vk::CommandBuffer& primary, size_t frame_index,
+                      const PipelineTarget& target, ThreadPool& thread_pool,
+                      size_t item_count, size_t cache_index,
+                      uint64_t generation, const RecordFunction& record);
+
+    // Makes every cache record again the next time it is used
+    void InvalidateCache();
+
+    // Secondaries executed since the last BeginFrame, and how many of those
+    // were replayed from the cache
+    size_t GetExecutedChunkCount() const;
+    size_t GetReusedChunkCount() const;
+
+private:
+    struct ChunkBuffers
+    {
+        std::vector<vk::CommandPool> command_pools;
+        std::vector<vk::CommandBuffer> command_buffers;
+    };
+
+    // Kept until the generation changes
+    struct Cache
+    {
+        ChunkBuffers buffers;
+        std::optional<uint64_t> generation;
+        size_t chunk_count = 0;
+    };
+
+    struct FrameResources
+    {
+        // Recycled every frame, one set per Record call. Grows to the most
+        // calls made in a frame
+        std::vector<ChunkBuffers> transient;
+        size_t used_transient_count = 0;
+        std::vector<Cache> caches;
+    };
+
+    ChunkBuffers CreateChunkBuffers(vk::CommandPoolCreateFlags flags);
+    void ResetPools(const ChunkBuffers& buffers);
+    // Records and returns the number of chunks
+    size_t RecordChunks(const ChunkBuffers& buffers,
+                        const vk::CommandBufferBeginInfo& begin_info,
+                        ThreadPool& thread_pool, size_t item_count,
+                        const RecordFunction& record);
+
+    vk::Device& device_;
+    uint32_t queue_family_index_;
+    size_t chunk_count_;
+
+    std::vector<FrameResources> frames_;
+    size_t executed_chunk_count_ = 0;
+    size_t reused_chunk_count_ = 0;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "common.h"
+#include "common_vulkan.h"
+
+class RendererState;
+
+// What pipelines drawing into the scene pass, and the secondaries recording
+// those draws, are made for. With dynamic rendering there is no render pass,
+// only the attachment formats
+struct PipelineTarget
+{
+    vk::SampleCountFlagBits sample_count = vk::SampleCountFlagBits::e1;
+    // Any render pass compatible with the scene pass for sample_count, null
+    // with dynamic rendering
+    vk::RenderPass render_pass;
+    vk::Format color_format = vk::Format::eUndefined;
+    vk::Format depth_format = vk::Format::eUndefined;
+
+    // sample_count on the renderer's current swapchain
+    static PipelineTarget ForSampleCount(RendererState& renderer,
+                                         vk::SampleCountFlagBits sample_count);
+
+    bool UsesDynamicRendering() const;
+
+    // To chain into a pipeline's create info with dynamic rendering. Points
+    // into the target, which has to outlive it
+    vk::PipelineRenderingCreateInfoKHR GetRenderingCreateInfo() const;
+    // Same for the inheritance info of secondaries
+    vk::CommandBufferInheritanceRenderingInfoKHR GetInheritanceRenderingInfo()
+        const;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "common.h"
+#include "common_vulkan.h"
+
+// Timeline semaphore counting the submissions to one queue. Every Submit
+// signals the next value, so whether the GPU has finished some work comes
+// down to comparing its value with GetCompletedValue
+class QueueTimeline
+{
+public:
+    QueueTimeline(vk::Device& device, vk::Queue queue);
+
+    QueueTimeline(const QueueTimeline&) = delete;
+    QueueTimeline(QueueTimeline&&) = delete;
+
+    QueueTimeline& operator=(const QueueTimeline&) = delete;
+    QueueTimeline& operator=(QueueTimeline&&) = delete;
+
+    ~QueueTimeline();
+
+    // Submits command_buffers once the binary wait_semaphores have been
+    // signaled, one wait stage each, and signals the binary
+    // signal_semaphores along with the next timeline value. Returns that
+    // value
+    uint64_t Submit(const std::vector<vk::CommandBuffer>& command_buffers,
+                    const std::vector<vk::Semaphore>& wait_semaphores = {},
+                    const std::vector<vk::PipelineStageFlags>& wait_stages = {},
+                    const std::vector<vk::Semaphore>& signal_semaphores = {});
+
+    // Blocks until the queue has finished the submission that signals value.
+    // Returns right away for 0, which no submission signals
+    void Wait(uint64_t value);
+
+    // Value of the latest submission the queue has finished
+    uint64_t GetCompletedValue();
+    // Value of the latest submission
+    uint64_t GetSubmittedValue() const;
+
+    vk::Semaphore GetSemaphore();
+
+private:
+    vk::Device& device_;
+    vk::Queue queue_;
+    vk::Semaphore semaphore_;
+
+    uint64_t submitted_value_ = 0;
+    // Cached so values known to be done need no query
+    uint64_t completed_value_ = 0;
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "common_vulkan.h"
+#include "utils.h"
+
+class RendererState;
+
+// How a pass uses an image. Each maps to the pipeline stages, access and
+// layout the graph builds its barriers from
+enum class ImageAccess
+{
+    // Drawn to, blended or loaded as a color attachment
+    ColorAttachment,
+    // Depth tested and written
+    DepthAttachment,
+    // Sampled depth, in DepthStencilReadOnlyOptimal
+    DepthRead,
+    // Sampled from a fragment or compute shader
+    ShaderRead,
+    // Written as a storage image from a compute shader
+    StorageWrite,
+    // Source of a copy, like reading a headless frame back
+    TransferRead,
+    Present
+};
+
+// A resource that may share memory with others, it is in use from
+// first_pass to last_pass inclusive
+struct AliasedResource
+{
+    vk::DeviceSize size = 0;
+    vk::DeviceSize alignment = 1;
+    size_t first_pass = 0;
+    size_t last_pass = 0;
+};
+
+// Offsets of resources placed in one allocation of total_size bytes. Two
+// resources only overlap in memory if they are never in use at the same
+// time. The largest are placed first, each at the lowest offset that fits
+std::vector<vk::DeviceSize> PlaceAliasedResources(
+    const std::vector<AliasedResource>& resources, vk::DeviceSize& total_size);
+
+// Frame graph. The passes of a frame are declared together with the images
+// they use, Compile then works out their order and the barriers between
+// them, and Execute records the whole frame.
+//
+// Images are either imported, like the swapchain image, or transient. The
+// graph creates transient images itself and they only live within the
+// frame, so those that are never in use at the same time share memory. They
+// are kept across frames for as long as the graph declares the same ones
+class RenderGraph
+{
+public:
+    using ImageHandle = uint32_t;
+    using RecordFunction =
+        std::function<void(vk::CommandBuffer& command_buffer)>;
+
+    struct ImageUse
+    {
+        ImageHandle image;
+        ImageAccess access;
+    };
+
+    struct TransientImageDesc
+    {
+        vk::Format format = vk::Format::eUndefined;
+        vk::Extent2D extent;
+        vk::SampleCountFlagBits sample_count = vk::SampleCountFlagBits::e1;
+        vk::ImageUsageFlags usage;
+        vk::ImageAspectFlags aspect = vk::ImageAspectFlagBits::eColor;
+
+        bool operator==(const TransientImageDesc& other) const;
+        bool operator!=(const TransientImageDesc& other) const;
+    };
+
+    // A layout transition or memory dependency of one image
+    struct Barrier
+    {
+        ImageHandle image;
+        vk::ImageLayout old_layout;
+        vk::ImageLayout new_layout;
+        vk::AccessFlags src_access;
+        vk::AccessFlags dst_access;
+    };
+
+    // Everything one pass waits for, recorded as a single pipeline barrier
+    struct BarrierBatch
+    {
+        vk::PipelineStageFlags src_stages;
+        vk::PipelineStageFlags dst_stages;
+        std::vector<Barrier> barriers;
+    };
+
+    RenderGraph() = default;
+
+    RenderGraph(const RenderGraph&) = delete;
+    RenderGraph(RenderGraph&&) = delete;
+
+    RenderGraph& operator=(const RenderGraph&) = delete;
+    RenderGraph& operator=(RenderGraph&&) = delete;
+
+    // Destroys the transient images right away, the device must be idle
+    ~RenderGraph();
+
+    // Forgets the passes and images of the last frame. Transient images
+    // stay allocated until a frame declares different ones
+    void Reset();
+
+    // image is in initial_access when the frame starts and is left in the
+    // layout of final_access. With discard_contents whatever it holds is not
+    // needed, initial_access then only tells what the frame has to wait for
+    ImageHandle ImportImage(const std::string& name, vk::Image image,
+                            vk::ImageView view, vk::ImageAspectFlags aspect,
+                            ImageAccess initial_access,
+                            ImageAccess final_access,
+                            bool discard_contents = false);
+    ImageHandle CreateTransientImage(const std::string& name,
+                                     const TransientImageDesc& desc);
+
+    void AddPass(const std::string& name, std::vector<ImageUse> uses,
+                 RecordFunction record);
+
+    // Drops passes that only write transient images nobody uses afterwards,
+    // passes without any image writes are kept for their side effects. The
+    // rest run in the order they were added, which every use of an earlier
+    // pass's results already satisfies
+    void Compile();
+
+    // Creates the transient images if needed, then records the barriers and
+    // passes in order, and the final transitions of imported images
+    void Execute(RendererState& renderer, vk::CommandBuffer& command_buffer);
+
+    // Passes that Compile kept, as indices in the order they were added
+    const std::vector<size_t>& GetExecutionOrder() const;
+    // Recorded right before the pass at position in the execution order
+    const BarrierBatch& GetBarriers(size_t position) const;
+    // Transitions imported images to their final layout
+    const BarrierBatch& GetFinalBarriers() const;
+
+    // Transient images are only available once the graph executes
+    vk::Image GetImage(ImageHandle image) const;
+    vk::ImageView GetImageView(ImageHandle image) const;
+
+    // Memory all transient images take together. Transient attachments are
+    // put in lazily allocated memory where the device has it
+    MemoryReport GetTransientMemoryReport() const;
+
+private:
+    struct ImageResource
+    {
+        std::string name;
+        vk::ImageAspectFlags aspect;
+        // Imported images only
+        vk::Image image;
+        vk::ImageView view;
+        ImageAccess initial_access = ImageAccess::ColorAttachment;
+        ImageAccess final_access = ImageAccess::ColorAttachment;
+        bool discard_contents = false;
+        // Index into the transient descs, or NOT_TRANSIENT
+        size_t transient_index;
+    };
+
+    struct Pass
+    {
+        std::string name;
+        std::vector<ImageUse> uses;
+        RecordFunction record;
+    };
+
+    // Created by the graph, every image is bound to one of memories
+    struct TransientImages
+    {
+        std::vector<TransientImageDesc> descs;
+        std::vector<std::pair<size_t, size_t>> lifetimes;
+        std::vector<vk::Image> images;
+        std::vector<vk::ImageView> views;
+        std::vector<vk::DeviceMemory> memories;
+        std::vector<vk::DeviceSize> memory_sizes;
+        std::vector<vk::MemoryPropertyFlags> memory_properties;
+    };
+
+    static constexpr size_t NOT_TRANSIENT = ~size_t(0);
+
+    void RealizeTransientImages(RendererState& renderer);
+    void RecordBarriers(vk::CommandBuffer& command_buffer,
+                        const BarrierBatch& batch) const;
+    static void DestroyTransientImages(vk::Device device,
+                                       const TransientImages& transients);
+
+    std::vector<ImageResource> images_;
+    std::vector<TransientImageDesc> transient_descs_;
+    std::vector<Pass> passes_;
+
+    // Compiled
+    std::vector<size_t> order_;
+    std::vector<BarrierBatch> barriers_;
+    BarrierBatch final_barriers_;
+    // First and last position in order_ of every transient image
+    std::vector<std::pair<size_t, size_t>> transient_lifetimes_;
+
+    vk::Device device_;
+    TransientImages realized_;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bounds.h"
 #include "common.h"
 #include "common_vulkan.h"
 #include "gpu_buffer.h"
@@ -26,16 +27,39 @@ public:
 
     vk::DescriptorSet& GetDescriptorSet();
 
+    const glm::mat4& GetTransform() const;
+
+    // World space bounds of the model, kept in sync with the node transform
+    const Aabb& GetWorldBounds() const;
+    const BoundingSphere& GetWorldBoundingSphere() const;
+
+    // Set whenever the world bounds change, so that spatial structures only
+    // need to refresh objects that actually moved
+    bool IsBoundsDirty() const;
+    void ClearBoundsDirty();
+
+    // Occluders are rasterized by the software occlusion culler
+    void SetOccluder(bool occluder);
+    bool IsOccluder() const;
+
     void UpdateTransform();
 
 private:
     void CreateDescriptorSet(RendererState& renderer);
+    void UpdateWorldBounds();
 
     vk::Device& device_;
 
     NonOwningPointer<SceneNode> owning_node_;
     NonOwningPointer<Model> model_;
 
+    glm::mat4 transform_;
+
+    Aabb world_bounds_;
+    BoundingSphere world_bounding_sphere_;
+    bool bounds_dirty_;
+    bool occluder_;
+
     vk::DescriptorSet object_set_;
     GpuBuffer object_properties_buffer_;
 };
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "common_vulkan.h"
+
+// Presets trading input latency against throughput
+enum class LatencyMode
+{
+    // One frame in flight, double buffered
+    Low,
+    Balanced,
+    // Three frames in flight, triple buffered
+    HighThroughput
+};
+
+// Preferred present mode, the closest supported one is used instead when
+// the surface lacks it. FIFO is always available
+enum class PresentModePolicy
+{
+    // Uncapped and may tear, for measuring throughput
+    Immediate,
+    // Uncapped without tearing, falls back to FIFO
+    Mailbox,
+    // Capped to the refresh rate, saves power
+    Fifo,
+    // Like FIFO, but late frames are shown right away and may tear
+    FifoRelaxed
+};
+
+// Frame pacing choices fixed at startup, the application can switch them at
+// runtime by recreating everything that is kept per frame in flight
+struct RendererSettings
+{
+    // Frames the CPU may record while the GPU still works on earlier ones
+    size_t frames_in_flight = 2;
+    // Swapchain images to ask for, clamped to what the surface supports.
+    // 0 asks for one more than the surface's minimum
+    uint32_t swapchain_image_count = 0;
+    PresentModePolicy present_mode = PresentModePolicy::Mailbox;
+    // Frames started per second at most, 0 for uncapped
+    double frame_rate_limit = 0.0;
+    static constexpr double MAX_FRAME_RATE_LIMIT = 1000.0;
+    // Draw with VK_KHR_dynamic_rendering instead of render pass objects
+    // where the device and the GUI support it. Only read at startup
+    bool dynamic_rendering = false;
+    // Frames to render offscreen without opening a window before exiting,
+    // 0 opens one. Only read at startup
+    uint32_t headless_frame_count = 0;
+    // Where headless frames are written as PPM images, they are not read
+    // back at all if empty
+    std::string headless_output_directory;
+
+    static RendererSettings FromLatencyMode(LatencyMode mode);
+
+    // Sets the frames in flight and image count of a preset, the present
+    // mode is left alone
+    void SetLatencyMode(LatencyMode mode);
+    // The preset the frames in flight and image count match, if any
+    std::optional<LatencyMode> GetLatencyMode() const;
+
+    bool operator==(const RendererSettings& other) const;
+    bool operator!=(const RendererSettings& other) const;
+};
+
+const char* LatencyModeName(LatencyMode mode);
+// Accepts the names returned by LatencyModeName
+std::optional<LatencyMode> ParseLatencyMode(const std::string& name);
+
+const char* PresentModePolicyName(PresentModePolicy policy);
+// Accepts the names returned by PresentModePolicyName
+std::optional<PresentModePolicy> ParsePresentModePolicy(
+    const std::string& name);
+
+// The first mode of the policy's preference order the surface supports
+vk::PresentModeKHR ChoosePresentMode(
+    PresentModePolicy policy,
+    const std::vector<vk::PresentModeKHR>& available_present_modes);
+
+// Image count to create a swapchain with, max_image_count is 0 when the
+// surface has no upper limit
+uint32_t ChooseSwapchainImageCount(uint32_t requested_count,
+                                   uint32_t min_image_count,
+                                   uint32_t max_image_count);
@@ -1,22 +1,48 @@
 #pragma once
 
+#include <array>
+#include <map>
 #include <optional>
+#include <utility>
 
 #include "common.h"
 #include "common_vulkan.h"
+#include "deletion_queue.h"
 #include "material_cache.h"
+#include "pipeline_target.h"
+#include "queue_timeline.h"
+#include "render_graph.h"
 #include "swapchain.h"
 #include "texture_cache.h"
 
 class Swapchain;
 
+// Subpass of the scene render passes the GUI is drawn in
+constexpr uint32_t OVERLAY_SUBPASS = 1;
+
+// The scene is drawn in a single pass, or in an early pass that a late pass
+// continues on top of. Only the early pass stores the multisampled color and
+// depth, everywhere else they can stay in tile memory
+enum class ScenePass
+{
+    Single,
+    Early,
+    Late
+};
+constexpr size_t SCENE_PASS_COUNT = 3;
+
 class RendererState
 {
 public:
+    // Headless without a window. There is no surface then, and the
+    // swapchain is a ring of offscreen images of headless_extent
     RendererState(const std::string name, GLFWwindow* window,
                   const std::vector<const char*>& required_instance_extensions,
                   const std::vector<const char*>& required_device_extensions,
-                  const std::vector<const char*>& layers);
+                  const std::vector<const char*>& layers,
+                  uint32_t swapchain_image_count,
+                  PresentModePolicy present_mode_policy,
+                  bool dynamic_rendering, vk::Extent2D headless_extent = {});
 
     RendererState(const RendererState&) = delete;
     RendererState(RendererState&&) = delete;
@@ -27,17 +53,33 @@ public:
     ~RendererState();
 
     vk::Instance& GetInstance();
+    // Null when headless
     vk::SurfaceKHR& GetSurface();
+    // Frames end up in eTransferSrcOptimal to be read back instead of
+    // being presented
+    bool IsHeadless();
 
     vk::PhysicalDevice& GetPhysicalDevice();
     vk::Device& GetDevice();
 
     vk::CommandPool& GetGraphicsCommandPool();
     vk::Queue& GetGraphicsQueue();
+    uint32_t GetGraphicsQueueFamilyIndex();
     vk::Queue& GetPresentQueue();
 
     vk::CommandPool& GetTransientCommandPool();
     vk::Queue& GetTransferQueue();
+    // Submissions to the graphics and transfer queues should go through
+    // these, so their progress can be tracked
+    QueueTimeline& GetGraphicsTimeline();
+    QueueTimeline& GetTransferTimeline();
+
+    // Runs deleter once everything submitted to the graphics queue so far
+    // has finished. Only for resources that no unsubmitted command buffer
+    // uses
+    void DeferDestruction(DeletionQueue::Deleter deleter);
+    // Destroys the deferred resources the GPU is done with, once per frame
+    void CollectRetiredResources();
 
     TextureCache& GetTextureCache();
     MaterialCache& GetMaterialCache();
@@ -47,10 +89,66 @@ public:
 
     void UpdateCurrentSampleCount(vk::SampleCountFlagBits new_sample_count);
 
+    // window is not used when headless
     void RecreateSwapchain(GLFWwindow* window);
+    // These take effect the next time the swapchain is recreated
+    void SetSwapchainImageCount(uint32_t swapchain_image_count);
+    void SetPresentModePolicy(PresentModePolicy present_mode_policy);
     Swapchain& GetSwapchain();
 
+    // Starts a new frame graph for swapchain image image_index, with the
+    // scene attachments declared in it. Render pass objects transition
+    // their attachments themselves, so without dynamic rendering none are
+    RenderGraph& BeginFrameGraph(uint32_t image_index);
+    RenderGraph& GetFrameGraph();
+    // What the passes of the frame graph that draw the scene or the overlay
+    // have to declare
+    const std::vector<RenderGraph::ImageUse>& GetSceneAttachmentUses();
+    const std::vector<RenderGraph::ImageUse>& GetOverlayAttachmentUses();
+
+    // These are recorded from frame graph passes, which take care of the
+    // barriers in between.
+    //
+    // Begins drawing the scene into swapchain image image_index. Color and
+    // depth are cleared, or for the late pass kept from the early one.
+    // secondaries tells whether the draws will be executed from secondary
+    // command buffers. Also sets the viewport and scissor
+    void BeginScenePass(vk::CommandBuffer& command_buffer,
+                        uint32_t image_index, ScenePass pass,
+                        bool secondaries);
+    // Scene pipelines take the viewport and scissor as dynamic state, which
+    // secondaries do not inherit, so each has to set them itself
+    void SetSceneViewport(vk::CommandBuffer& command_buffer);
+    // Finishes the scene, resolving it if multisampled. With overlay the
+    // overlay pass comes next, otherwise there is work to do outside of the
+    // scene before the late pass continues
+    void EndScenePass(vk::CommandBuffer& command_buffer, bool overlay);
+    // The single sampled GUI overlay on the swapchain image
+    void BeginOverlay(vk::CommandBuffer& command_buffer, uint32_t image_index);
+    void EndOverlay(vk::CommandBuffer& command_buffer);
+
+    // What scene pipelines and secondaries are currently made for
+    PipelineTarget GetSceneTarget();
+    // Null with dynamic rendering
+    vk::Framebuffer GetFramebuffer(uint32_t image_index);
+
+    // Whether the scene is drawn with VK_KHR_dynamic_rendering instead of
+    // render pass and framebuffer objects. It has to be requested and
+    // supported by the device
+    bool UsesDynamicRendering();
+
+    // The render pass of ScenePass::Single. The scene is drawn in subpass 0
+    // and the GUI overlay in OVERLAY_SUBPASS, single sampled on the
+    // swapchain image. The pass leaves the swapchain image ready to present.
+    // Null with dynamic rendering
     vk::RenderPass& GetRenderPass();
+    // The render passes of every ScenePass for sample_count. They only
+    // differ in load and store ops, so pipelines and framebuffers are
+    // compatible with all of them. Made on first use and kept, so pipelines
+    // built for any sample count stay valid. Not available with dynamic
+    // rendering
+    std::array<vk::RenderPass, SCENE_PASS_COUNT> GetRenderPasses(
+        vk::SampleCountFlagBits sample_count);
 
     std::vector<vk::Framebuffer>& GetFramebuffers();
 
@@ -59,9 +157,33 @@ public:
     vk::DescriptorSetLayout& GetCameraDescriptorSetLayout();
     vk::DescriptorSetLayout& GetObjectDescriptorSetLayout();
     vk::DescriptorSetLayout& GetMaterialDescriptorSetLayout();
+    vk::DescriptorSetLayout& GetObjectStorageDescriptorSetLayout();
 
     vk::ImageView& GetColorImageView();
     vk::ImageView& GetDepthImageView();
+    vk::Image GetDepthImage();
+    vk::Format GetDepthFormat();
+    // Memory of the multisampled color and depth attachments, wherever they
+    // live. Attachments that are never stored are lazily allocated where
+    // the device supports it
+    MemoryReport GetAttachmentMemoryReport();
+
+    // Whether the depth buffer can be read by shaders after the scene pass,
+    // which the Hi-Z occlusion culling pyramid is built from
+    bool SupportsDepthSampling();
+
+    // Whether VK_EXT_conditional_rendering was found and enabled
+    bool SupportsConditionalRendering();
+
+    // Whether the device can run the compute culling path, which needs
+    // drawIndexedIndirectCount, multi draw indirect and first instance
+    bool SupportsGpuCulling();
+
+    std::pair<vk::PipelineLayout, vk::Pipeline> CreateComputePipeline(
+        const std::string& shader_path,
+        const std::vector<vk::DescriptorSetLayout>& set_layouts,
+        const std::vector<vk::PushConstantRange>& push_constant_ranges,
+        const std::vector<std::pair<std::string, std::string>>& macros = {});
 
     vk::CommandBuffer BeginSingleTimeCommands();
     void EndSingleTimeCommands(vk::CommandBuffer command_buffer);
@@ -130,14 +252,19 @@ private:
 
     std::tuple<vk::Device, vk::Queue, vk::Queue, vk::Queue>
     CreateDeviceAndQueues(const std::vector<const char*> extensions,
-                          const std::vector<const char*> layers);
+                          const std::vector<const char*> layers,
+                          bool dynamic_rendering);
 
     void CreateColorResources();
     void CreateDepthResources();
+    // Hands the framebuffers and the color and depth attachments to the
+    // deletion queue
+    void RetireAttachments();
 
     vk::CommandPool CreateCommandPool(uint32_t queue_index);
 
-    vk::RenderPass CreateRenderPass();
+    vk::RenderPass CreateRenderPass(ScenePass pass,
+                                    vk::SampleCountFlagBits sample_count);
 
     void CreateFramebuffers();
 
@@ -146,6 +273,7 @@ private:
     vk::DescriptorSetLayout CreateCameraDescriptorSetLayout();
     vk::DescriptorSetLayout CreateObjectDescriptorSetLayout();
     vk::DescriptorSetLayout CreateMaterialDescriptorSetLayout();
+    vk::DescriptorSetLayout CreateObjectStorageDescriptorSetLayout();
 
     vk::Instance instance_;
 
@@ -158,7 +286,12 @@ private:
     vk::Device device_;
 
     std::optional<Swapchain> swapchain_;
+    // Requested count and present mode, see Swapchain
+    uint32_t swapchain_image_count_ = 0;
+    PresentModePolicy present_mode_policy_ = PresentModePolicy::Mailbox;
 
+    // Only with render pass objects, with dynamic rendering the frame graph
+    // owns the multisampled color image
     std::optional<GpuImage> color_image_;
     vk::ImageView color_image_view_;
 
@@ -172,10 +305,26 @@ private:
     vk::CommandPool transient_command_pool_;
     vk::Queue transfer_queue_;
 
+    std::optional<QueueTimeline> graphics_timeline_;
+    std::optional<QueueTimeline> transfer_timeline_;
+
+    DeletionQueue deletion_queue_;
+
+    std::optional<RenderGraph> frame_graph_;
+    // Multisampled color in the current frame graph
+    RenderGraph::ImageHandle scene_color_ = 0;
+    std::vector<RenderGraph::ImageUse> scene_attachment_uses_;
+    std::vector<RenderGraph::ImageUse> overlay_attachment_uses_;
+
     TextureCache texture_cache_;
     MaterialCache material_cache_;
 
-    vk::RenderPass render_pass_;
+    // The current sample count's entry of render_passes_, indexed by
+    // ScenePass
+    std::array<vk::RenderPass, SCENE_PASS_COUNT> scene_render_passes_;
+    std::map<vk::SampleCountFlagBits,
+             std::array<vk::RenderPass, SCENE_PASS_COUNT>>
+        render_passes_;
 
     std::vector<vk::Framebuffer> swapchain_frame_buffers_;
 
@@ -184,7 +333,13 @@ private:
     vk::DescriptorSetLayout camera_descriptor_set_layout_;
     vk::DescriptorSetLayout object_descriptor_set_layout_;
     vk::DescriptorSetLayout material_descriptor_set_layout_;
+    vk::DescriptorSetLayout object_storage_descriptor_set_layout_;
 
     vk::SampleCountFlagBits max_msaa_samples_ = vk::SampleCountFlagBits::e1;
     vk::SampleCountFlagBits current_msaa_samples_ = vk::SampleCountFlagBits::e1;
+
+    bool supports_gpu_culling_ = false;
+    bool supports_depth_sampling_ = false;
+    bool supports_conditional_rendering_ = false;
+    bool use_dynamic_rendering_ = false;
 };
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bounds.h"
+#include "common.h"
+#include "common_glm.h"
+
+class ThreadPool;
+
+// Conservative CPU occlusion culling. Occluder triangles are rasterized into a
+// small depth buffer (0 near, 1 far), then occludee boxes are tested against
+// it: a box is only reported as occluded if every pixel it covers already has
+// an occluder in front of its nearest point.
+//
+// Rasterization happens per tile, so tiles can be filled in parallel without
+// any synchronization. Occluder triangles that cross the near plane are
+// dropped rather than clipped, which can only make culling less aggressive
+class SoftwareOcclusionCuller
+{
+public:
+    static constexpr uint32_t TILE_WIDTH = 32;
+    static constexpr uint32_t TILE_HEIGHT = 32;
+
+    // The size is rounded up to a whole number of tiles
+    SoftwareOcclusionCuller(uint32_t width = 320, uint32_t height = 192);
+
+    uint32_t GetWidth() const;
+    uint32_t GetHeight() const;
+
+    // Clears the depth buffer and occluder list
+    void BeginFrame(const glm::mat4& viewproj);
+
+    void AddOccluder(const std::vector<glm::vec3>& positions,
+                     const std::vector<uint32_t>& indices,
+                     const glm::mat4& transform);
+
+    // Rasterizes every occluder added since BeginFrame
+    void Rasterize(ThreadPool& thread_pool);
+
+    // Returns false only when the box is hidden behind the occluders
+    bool IsVisible(const Aabb& bounds) const;
+
+    size_t GetOccluderTriangleCount() const;
+
+    // Row major, row 0 is the top of the screen
+    const std::vector<float>& GetDepthBuffer() const;
+
+private:
+    struct ScreenTriangle
+    {
+        // x and y in pixels, z in 0 to 1 depth. Wound so that the edge
+        // functions are positive inside
+        glm::vec3 vertices[3];
+    };
+
+    void RasterizeTile(uint32_t tile_index);
+
+    uint32_t width_;
+    uint32_t height_;
+    uint32_t tiles_x_;
+    uint32_t tiles_y_;
+
+    glm::mat4 viewproj_;
+
+    std::vector<float> depth_buffer_;
+    std::vector<ScreenTriangle> triangles_;
+    // Indices into triangles_ overlapping each tile
+    std::vector<std::vector<uint32_t>> tile_bins_;
+};
@@ -1,16 +1,27 @@
 #pragma once
 
+#include <functional>
 #include <vector>
 
 #include "common.h"
 #include "common_vulkan.h"
+#include "gpu_image.h"
+#include "renderer_settings.h"
 
 class RendererState;
 
 class Swapchain
 {
 public:
-    Swapchain(RendererState& renderer, GLFWwindow* window);
+    // requested_image_count is clamped to the surface limits, 0 asks for one
+    // more than the minimum
+    Swapchain(RendererState& renderer, GLFWwindow* window,
+              uint32_t requested_image_count,
+              PresentModePolicy present_mode_policy);
+    // Headless, a ring of offscreen images of extent that are never
+    // presented. They can be copied from once rendered
+    Swapchain(RendererState& renderer, vk::Extent2D extent,
+              uint32_t requested_image_count);
     
     Swapchain(const Swapchain&) = delete;
     Swapchain(Swapchain&&) = delete;
@@ -20,18 +31,35 @@ public:
 
     ~Swapchain();
 
-    void RecreateSwapchain(RendererState& renderer, GLFWwindow* window);
-
+    // The old swapchain and its image views are kept until
+    // ReleaseRetiredSwapchains. Offscreen images keep their extent, window
+    // is not used for them
+    void RecreateSwapchain(RendererState& renderer, GLFWwindow* window,
+                           uint32_t requested_image_count,
+                           PresentModePolicy present_mode_policy);
+    // Call after submitting work that waits for an image acquired from the
+    // current swapchain. Waiting for the graphics timeline alone says
+    // nothing about presents to the old swapchains, which may also run on
+    // another queue. An acquire from the new one is only satisfied after
+    // them, so they are destroyed once that submission completes
+    void ReleaseRetiredSwapchains(RendererState& renderer);
+
+    // Null when offscreen
     vk::SwapchainKHR GetSwapchain();
+    bool IsOffscreen();
 
     uint32_t GetMinimumImageCount();
     uint32_t GetActualImageCount();
+    // What the present mode policy ended up with on this surface
+    vk::PresentModeKHR GetPresentMode();
 
     std::vector<vk::Image>& GetImages();
     vk::SurfaceFormatKHR& GetImageFormat();
     vk::Extent2D& GetExtent();
     std::vector<vk::ImageView>& GetImageViews();
 
+    // Offscreen images are handed out in turn right away, semaphore is then
+    // left alone
     vk::ResultValue<uint32_t> GetNextImage(uint64_t timeout, vk::Semaphore semaphore, vk::Fence fence);
 
 private:
@@ -40,13 +68,16 @@ private:
     vk::SurfaceFormatKHR ChooseSwapSurfaceFormat(
         const std::vector<vk::SurfaceFormatKHR>& available_formats);
 
-    vk::PresentModeKHR ChooseSwapPresentMode(
-        const std::vector<vk::PresentModeKHR>& available_present_modes);
-
     vk::Extent2D ChooseSwapExtent(
         GLFWwindow* window, const vk::SurfaceCapabilitiesKHR& capabilities);
 
-    void CreateSwapchain(RendererState& renderer, GLFWwindow* window);
+    void CreateSwapchain(RendererState& renderer, GLFWwindow* window,
+                         uint32_t requested_image_count,
+                         PresentModePolicy present_mode_policy,
+                         vk::SwapchainKHR old_swapchain = {});
+
+    void CreateOffscreenImages(RendererState& renderer,
+                               uint32_t requested_image_count);
 
     void CreateSwapchainImageViews(RendererState& renderer);
 
@@ -54,9 +85,16 @@ private:
     vk::SwapchainKHR swapchain_;
     uint32_t min_image_count_;
     uint32_t image_count_;
+    vk::PresentModeKHR present_mode_;
     std::vector<vk::Image> swapchain_images_;
     vk::SurfaceFormatKHR swapchain_image_format_;
     vk::Extent2D swapchain_extent_;
     std::vector<vk::ImageView> swapchain_image_views_;
+    // Headless only, swapchain_images_ are theirs
+    bool offscreen_ = false;
+    std::vector<GpuImage> offscreen_images_;
+    uint32_t next_offscreen_image_ = 0;
+    // Destroy the old swapchains, until nothing can present to them anymore
+    std::vector<std::function<void()>> retired_swapchains_;
     //std::vector<vk::Framebuffer> swapchain_frame_buffers_;
 };
\ No newline at end of file
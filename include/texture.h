@@ -24,6 +24,8 @@ public:
     vk::Image GetImage();
     vk::ImageView GetImageView();
     uint32_t GetMipLevels();
+    // Whether any texel has an alpha below 1
+    bool HasTransparency() const;
 
 private:
     void MoveFrom(Texture&& other);
@@ -32,4 +34,5 @@ private:
     GpuImage image_;
     vk::ImageView image_view_;
     uint32_t mip_levels_;
+    bool has_transparency_ = false;
 };
\ No newline at end of file
@@ -1,7 +1,10 @@
 #pragma once
 
-#include <map>
+#include <cstdint>
+#include <limits>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "common.h"
 
@@ -9,16 +12,30 @@
 
 class RendererState;
 
+// Index of a texture in the TextureCache, stable until the cache is cleared
+using TextureHandle = uint32_t;
+constexpr TextureHandle INVALID_TEXTURE_HANDLE =
+    std::numeric_limits<TextureHandle>::max();
+
+// Textures are looked up by path only while loading, everything afterwards
+// addresses them by handle. Pointers returned by GetTexture are invalidated
+// by the next LoadTexture, handles are not
 class TextureCache
 {
 public:
-    void LoadTexture(RendererState& renderer,
-                     std::string path);
-    
-    Texture* GetTextureByPath(std::string path);
+    // Loads the texture unless it already is, and returns its handle
+    TextureHandle LoadTexture(RendererState& renderer,
+                              const std::string& path);
+
+    // INVALID_TEXTURE_HANDLE if the texture has not been loaded
+    TextureHandle FindTexture(const std::string& path) const;
+
+    // nullptr for INVALID_TEXTURE_HANDLE
+    NonOwningPointer<Texture> GetTexture(TextureHandle handle);
 
     void Clear();
-    
+
 private:
-    std::map<std::string, Texture> texture_map_;
-};
\ No newline at end of file
+    std::vector<Texture> textures_;
+    std::unordered_map<std::string, TextureHandle> handles_;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data parallel loops. The calling thread
+// takes part in every loop, so a pool with no workers just runs the loop
+// inline
+class ThreadPool
+{
+public:
+    // Defaults to one worker per hardware thread besides the caller
+    ThreadPool();
+    explicit ThreadPool(size_t worker_count);
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool& operator=(ThreadPool&&) = delete;
+
+    ~ThreadPool();
+
+    // Worker threads plus the calling thread
+    size_t GetThreadCount() const;
+
+    // Calls task(i) once for every i in [0, count) and returns once they have
+    // all finished. Not reentrant, tasks must not call ParallelFor
+    void ParallelFor(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    void WorkerLoop();
+    void RunTasks();
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable work_available_;
+    std::condition_variable work_finished_;
+
+    const std::function<void(size_t)>* task_ = nullptr;
+    size_t task_count_ = 0;
+    std::atomic<size_t> next_task_ = 0;
+    size_t busy_workers_ = 0;
+    uint64_t generation_ = 0;
+    bool stopping_ = false;
+};
@@ -2,6 +2,7 @@
 
 #include <shaderc/shaderc.hpp>
 #include <string>
+#include <tuple>
 
 #include "common.h"
 #include "common_glm.h"
@@ -13,26 +14,51 @@ std::string GetFileContents(const char* filename);
 
 const std::string CompilationStatusToString(shaderc_compilation_status status);
 
-std::vector<uint32_t> CompileShader(const std::string& path,
-                                    shaderc_shader_kind kind);
+// macros are (name, value) pairs defined before compilation. Results are
+// cached, so a shader is only compiled once per program run. Thread safe
+std::vector<uint32_t> CompileShader(
+    const std::string& path, shaderc_shader_kind kind,
+    const std::vector<std::pair<std::string, std::string>>& macros = {});
 
 const bool CheckExtensions(
     const std::vector<vk::ExtensionProperties> supported_extensions,
     std::vector<const char*> required_extensions);
 
+// A memory type that has properties, and preferred as well if there is one
 uint32_t FindMemoryType(vk::PhysicalDevice& physical_device,
                         uint32_t type_filter,
-                        vk::MemoryPropertyFlags properties);
+                        vk::MemoryPropertyFlags properties,
+                        vk::MemoryPropertyFlags preferred = {});
+
+// Device memory taken by a group of allocations. Lazily allocated memory is
+// only backed as far as the device needs it, which for attachments that
+// never leave tile memory can be not at all
+struct MemoryReport
+{
+    vk::DeviceSize allocated_size = 0;
+    // The part of allocated_size in lazily allocated memory
+    vk::DeviceSize lazy_size = 0;
+    // How much of lazy_size is backed right now
+    vk::DeviceSize committed_lazy_size = 0;
+};
+
+// memory is size bytes of a memory type with properties
+void AddToMemoryReport(MemoryReport& report, vk::Device device,
+                       vk::DeviceMemory memory, vk::DeviceSize size,
+                       vk::MemoryPropertyFlags properties);
 
 std::pair<vk::Buffer, vk::DeviceMemory> CreateBuffer(
     RendererState& renderer, vk::DeviceSize size, vk::BufferUsageFlags usage,
     vk::MemoryPropertyFlags properties);
 
-std::pair<vk::Image, vk::DeviceMemory> CreateImage(
+// Also returns the properties of the memory type the image ended up in,
+// which has the preferred ones too where possible
+std::tuple<vk::Image, vk::DeviceMemory, vk::MemoryPropertyFlags> CreateImage(
     RendererState& renderer, uint32_t width, uint32_t height,
     uint32_t mip_levels, vk::SampleCountFlagBits num_samples, vk::Format format,
     vk::ImageTiling tiling, vk::ImageUsageFlags usage,
-    vk::MemoryPropertyFlags properties);
+    vk::MemoryPropertyFlags properties,
+    vk::MemoryPropertyFlags preferred = {});
 
 vk::ImageView CreateImageView(RendererState& renderer, vk::Image image,
                               vk::Format format,
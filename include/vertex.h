@@ -6,15 +6,34 @@
 #include "common_glm.h"
 #include "common_vulkan.h"
 
+// Everything but the position, which lives in its own vertex stream so that
+// depth only passes read as little as possible
+struct VertexAttributes
+{
+    glm::vec3 color;
+    glm::vec2 tex_coord;
+};
+
+// Meshes are uploaded as two streams, positions in binding 0 and
+// VertexAttributes in binding 1
 struct Vertex
 {
     glm::vec3 pos;
     glm::vec3 color;
     glm::vec2 tex_coord;
 
-    static vk::VertexInputBindingDescription GetBindingDescription();
+    VertexAttributes GetAttributes() const;
+
+    static std::array<vk::VertexInputBindingDescription, 2>
+    GetBindingDescriptions();
     static std::array<vk::VertexInputAttributeDescription, 3>
     GetAttributeDescriptions();
+
+    // Only the position stream, for depth only pipelines
+    static vk::VertexInputBindingDescription GetPositionBindingDescription();
+    static vk::VertexInputAttributeDescription
+    GetPositionAttributeDescription();
+
     bool operator==(const Vertex& other) const;
 };
 
@@ -0,0 +1,31 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Draws an axis aligned box for occlusion queries, the corners come from
+// the vertex index so no vertex buffer is needed
+
+layout(set = 0, binding = 0) uniform CameraProperties {
+    mat4 view;
+    mat4 proj;
+    mat4 viewproj;
+} camera;
+
+layout(push_constant) uniform BoxProperties {
+    vec4 min;
+    vec4 max;
+} box;
+
+// Unit cube as a single 14 vertex triangle strip
+const vec3 CUBE_STRIP[14] = vec3[](
+    vec3(0.0, 1.0, 1.0), vec3(1.0, 1.0, 1.0), vec3(0.0, 0.0, 1.0),
+    vec3(1.0, 0.0, 1.0), vec3(1.0, 0.0, 0.0), vec3(1.0, 1.0, 1.0),
+    vec3(1.0, 1.0, 0.0), vec3(0.0, 1.0, 1.0), vec3(0.0, 1.0, 0.0),
+    vec3(0.0, 0.0, 1.0), vec3(0.0, 0.0, 0.0), vec3(1.0, 0.0, 0.0),
+    vec3(0.0, 1.0, 0.0), vec3(1.0, 1.0, 0.0));
+
+void main() {
+    vec3 position = mix(box.min.xyz, box.max.xyz, CUBE_STRIP[gl_VertexIndex]);
+    gl_Position = camera.viewproj * vec4(position, 1.0);
+    // correct for opposite handedness between OpenGL and Vulcan
+    gl_Position.y = -gl_Position.y;
+}
@@ -0,0 +1,24 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(set = 0, binding = 0) uniform CameraProperties {
+    mat4 view;
+    mat4 proj;
+    mat4 viewproj;
+} camera;
+
+layout(set = 2, binding = 0) uniform ObjectProperties {
+    mat4 transform;
+} object;
+
+// Only the position stream is bound
+layout(location = 0) in vec3 inPosition;
+
+// Must match shader.vert bit for bit for the equal depth test
+invariant gl_Position;
+
+void main() {
+    gl_Position = camera.viewproj * object.transform * vec4(inPosition, 1.0);
+    // correct for opposite handedness between OpenGL and Vulcan
+    gl_Position.y = -gl_Position.y;
+}
@@ -3,11 +3,15 @@
 
 layout(set = 1, binding = 0) uniform sampler2D texSampler;
 
+// MTL dissolve, only used by transparent materials
+layout(constant_id = 0) const float DISSOLVE = 1.0;
+
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec2 fragTexCoord;
 
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor * texture(texSampler, fragTexCoord).rgb, 1.0);
+    vec4 texel = texture(texSampler, fragTexCoord);
+    outColor = vec4(fragColor * texel.rgb, texel.a * DISSOLVE);
 }
\ No newline at end of file
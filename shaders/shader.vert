@@ -18,6 +18,9 @@ layout(location = 2) in vec2 texCoord;
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
 
+// Must match depth_prepass.vert bit for bit for the equal depth test
+invariant gl_Position;
+
 void main() {
     gl_Position = camera.viewproj * object.transform * vec4(inPosition, 1.0);
     // correct for opposite handedness between OpenGL and Vulcan
@@ -0,0 +1,34 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(set = 0, binding = 0) uniform CameraProperties {
+    mat4 view;
+    mat4 proj;
+    mat4 viewproj;
+} camera;
+
+struct ObjectData {
+    mat4 transform;
+};
+
+// Indirect draws set firstInstance to the object index, so every object's
+// properties live in one buffer instead of a set per object
+layout(std430, set = 2, binding = 0) readonly buffer ObjectBuffer {
+    ObjectData objects[];
+};
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in vec2 texCoord;
+
+layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
+
+void main() {
+    mat4 transform = objects[gl_InstanceIndex].transform;
+    gl_Position = camera.viewproj * transform * vec4(inPosition, 1.0);
+    // correct for opposite handedness between OpenGL and Vulcan
+    gl_Position.y = -gl_Position.y;
+    fragColor = inColor;
+    fragTexCoord = texCoord;
+}
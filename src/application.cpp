@@ -11,6 +11,7 @@
 #include <cstdint>
 #include <iostream>
 #include <limits>
+#include <numeric>
 #include <unordered_map>
 
 #include "backends/imgui_impl_glfw.h"
@@ -30,6 +31,11 @@ constexpr uint32_t HEIGHT = 600;
 constexpr uint64_t MAX_FPS_DATA_COUNT = 10;
 constexpr double FPS_GRAPH_UPDATE_TIME = 0.1;
 
+// Draw lists the command recorder keeps cached secondaries for
+constexpr size_t SCENE_CACHE = 0;
+constexpr size_t DEPTH_PREPASS_CACHE = 1;
+constexpr size_t DRAW_CACHE_COUNT = 2;
+
 const std::vector<std::string> MODEL_PATHS = {"models/viking_room.obj"};
 const std::string TEXTURE_PATH = "textures/viking_room.png";
 
@@ -164,6 +170,11 @@ static void SetCaptureCursor(GLFWwindow* window, bool capture)
     }
 }
 
+Application::Application(RendererSettings settings) : settings_(settings)
+{
+    frame_pacer_.SetTargetFrameRate(settings_.frame_rate_limit);
+}
+
 void Application::Run()
 {
     Init();
@@ -173,16 +184,30 @@ void Application::Run()
 
 void Application::Init()
 {
-    InitWindow();
+    if (!IsHeadless()) {
+        InitWindow();
+    }
     InitVulkan();
-    SetupImgui();
+    if (!IsHeadless()) {
+        SetupImgui();
+    }
     LoadScene();
+    CreateGpuCuller();
+    CreateOcclusionQueryCuller();
 }
 
 void Application::MainLoop()
 {
+    if (IsHeadless()) {
+        RenderHeadless();
+        return;
+    }
+
     double previous_time = glfwGetTime();
     while (!glfwWindowShouldClose(window_)) {
+        // Before polling, so the frame reacts to the latest input
+        frame_pacer_.WaitForNextFrame();
+
         // Calls glfwPollEvents for us
         input_->Poll();
         if (input_->GetActionInputState(InputAction::Quit)) {
@@ -208,12 +233,15 @@ void Application::MainLoop()
         double delta = current_time - previous_time;
         previous_time = current_time;
 
-        // Update FPS counter
-        current_frames_per_second_ = 1.0f / (float)delta;
-
+        // Update FPS counter. Averaged over the graph's update interval, a
+        // single delta jumps around the pacer's target from frame to frame
         fps_timer_ += delta;
+        ++fps_frame_count_;
         if (fps_timer_ > FPS_GRAPH_UPDATE_TIME) {
-            fps_timer_ -= FPS_GRAPH_UPDATE_TIME;
+            current_frames_per_second_ =
+                (float)((double)fps_frame_count_ / fps_timer_);
+            fps_timer_ = 0.0;
+            fps_frame_count_ = 0;
             frames_per_second_data_.push_back(current_frames_per_second_);
             if (frames_per_second_data_.size() > MAX_FPS_DATA_COUNT) {
                 // This is inefficient but good enough for now
@@ -231,6 +259,43 @@ void Application::MainLoop()
     renderer_->GetDevice().waitIdle();
 }
 
+void Application::RenderHeadless()
+{
+    // A fixed time step renders the same frames on every run
+    constexpr double time_step = 1.0 / 60.0;
+    std::vector<double> frame_times;
+    for (uint32_t i = 0; i < settings_.headless_frame_count; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        frame_pacer_.WaitForNextFrame();
+        Update(time_step);
+        Render();
+        auto end = std::chrono::steady_clock::now();
+        frame_times.push_back(
+            std::chrono::duration<double, std::milli>(end - start).count());
+    }
+
+    renderer_->GetDevice().waitIdle();
+    if (frame_readback_.has_value()) {
+        frame_readback_->Flush();
+    }
+
+    // Once the GPU falls behind, frames also wait for the one that last
+    // used their resources, so this is the GPU's pace as well
+    double total_time =
+        std::accumulate(frame_times.begin(), frame_times.end(), 0.0);
+    std::cout << "Rendered " << frame_times.size() << " frames in "
+              << total_time << " ms, "
+              << total_time / static_cast<double>(frame_times.size())
+              << " ms per frame, median " << GetPercentile(frame_times, 50.0)
+              << " ms, 99th percentile " << GetPercentile(frame_times, 99.0)
+              << " ms\n";
+}
+
+bool Application::IsHeadless() const
+{
+    return settings_.headless_frame_count > 0;
+}
+
 void Application::Update(double delta_time)
 {
     UpdateRotatingCamera(delta_time);
@@ -239,88 +304,142 @@ void Application::Update(double delta_time)
 
 void Application::Render()
 {
-    WaitForNextFrameFence();
+    WaitForNextFrame();
+    renderer_->CollectRetiredResources();
+    // Once no frame uses the old GUI pipeline it is replaced without waiting
+    if (stale_imgui_renderer_value_.has_value() &&
+        renderer_->GetGraphicsTimeline().GetCompletedValue() >=
+            *stale_imgui_renderer_value_) {
+        RecreateImGuiRenderer();
+    }
+    gpu_timer_->ReadResults(current_frame_);
+    auto scene_gpu_time = gpu_timer_->GetMilliseconds(0, 1);
+    if (scene_gpu_time.has_value()) {
+        scene_gpu_time_[frame_used_depth_prepass_[current_frame_]] =
+            scene_gpu_time;
+    }
+
     auto image_index_optional = GetNextImage();
     if (!image_index_optional.has_value()) {
         RecreateSwapChain();
         return;
     }
     uint32_t image_index = *image_index_optional;
-    WaitForImageFenceAndSetNewFence(image_index);
+    WaitForImage(image_index);
 
     UpdateCameraUniformBuffer();
+    UpdateVisibleObjects();
 
-    DrawScene(frame_data_[current_frame_],
-              renderer_->GetFramebuffers()[image_index],
-              command_buffers_[image_index]);
+    auto& command_buffer = command_buffers_[image_index];
+    auto& frame_graph = renderer_->BeginFrameGraph(image_index);
+    DrawScene(frame_data_[current_frame_], image_index, command_buffer);
 
     // For updating MSAA samples
-    auto msaa_samples = renderer_->GetCurrentSampleCount();
+    auto requested_samples =
+        pending_sample_count_.value_or(renderer_->GetCurrentSampleCount());
+    auto msaa_samples = requested_samples;
 
-    DrawGui(imgui_frame_buffers_[image_index],
-            imgui_command_buffers_[image_index], msaa_samples);
+    DrawGui(image_index, msaa_samples);
 
-    bool should_update_samples =
-        msaa_samples != renderer_->GetCurrentSampleCount();
+    // Both only added their passes, they are recorded now
+    frame_graph.Compile();
+    frame_graph.Execute(*renderer_, command_buffer);
+    if (frame_readback_.has_value()) {
+        frame_readback_->RecordCopy(command_buffer, image_index);
+    }
+    command_buffer.end();
 
-    std::vector<vk::CommandBuffer> command_buffers_to_submit = {
-        command_buffers_[image_index], imgui_command_buffers_[image_index]};
+    if (msaa_samples != requested_samples) {
+        if (msaa_samples == renderer_->GetCurrentSampleCount()) {
+            pending_sample_count_.reset();
+        } else {
+            pending_sample_count_ = msaa_samples;
+        }
+    }
 
-    SubmitGraphicsCommands(command_buffers_to_submit);
+    SubmitGraphicsCommands({command_buffers_[image_index]});
+    images_in_flight_[image_index] =
+        frame_data_[current_frame_].submitted_value;
+    // This submission waits for the acquire from the current swapchain
+    renderer_->GetSwapchain().ReleaseRetiredSwapchains(*renderer_);
 
     Present(image_index);
 
-    if (should_update_samples) {
-        renderer_->UpdateCurrentSampleCount(msaa_samples);
+    // Keeps rendering with the current sample count until the pipelines
+    // for the new one are ready, then switches within a frame
+    if (pending_sample_count_.has_value() &&
+        renderer_->GetMaterialCache().PreparePipelines(
+            *renderer_, *pending_sample_count_)) {
+        renderer_->UpdateCurrentSampleCount(*pending_sample_count_);
+        pending_sample_count_.reset();
+        command_recorder_->InvalidateCache();
+        ResizeHiZPyramid();
+        occlusion_query_culler_->RecreatePipeline(*renderer_);
+        depth_prepass_->RecreatePipeline(*renderer_);
+        // The GUI pipeline was made for the old render pass. With dynamic
+        // rendering it only depends on the swapchain format
+        if (!renderer_->UsesDynamicRendering()) {
+            stale_imgui_renderer_value_ =
+                renderer_->GetGraphicsTimeline().GetSubmittedValue();
+        }
     }
 
-    current_frame_ = (current_frame_ + 1) % MAX_FRAMES_IN_FLIGHT;
+    if (pending_settings_.has_value()) {
+        settings_ = *pending_settings_;
+        pending_settings_.reset();
+        if (ApplyRendererSettings()) {
+            return;
+        }
+    }
+
+    current_frame_ = (current_frame_ + 1) % frame_data_.size();
 }
 
 void Application::CleanupSwapChain()
 {
-    for (auto framebuffer : imgui_frame_buffers_) {
-        renderer_->GetDevice().destroyFramebuffer(framebuffer);
-    }
-    renderer_->GetDevice().freeCommandBuffers(imgui_command_pool_,
-                                              imgui_command_buffers_);
-
-    renderer_->GetDevice().freeCommandBuffers(
-        renderer_->GetGraphicsCommandPool(), command_buffers_);
+    // The command buffers may still be pending
+    renderer_->DeferDestruction(
+        [device = renderer_->GetDevice(),
+         command_pool = renderer_->GetGraphicsCommandPool(),
+         command_buffers = command_buffers_]() {
+            device.freeCommandBuffers(command_pool, command_buffers);
+        });
+    command_buffers_.clear();
 }
 
 void Application::Cleanup()
 {
+    gpu_culler_.reset();
+    hiz_pyramid_.reset();
+    occlusion_query_culler_.reset();
+    command_recorder_.reset();
+    depth_prepass_.reset();
+    gpu_timer_.reset();
     models_.clear();
-    ImGui_ImplVulkan_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
-    ImGui::DestroyContext();
+    frame_readback_.reset();
+    if (!IsHeadless()) {
+        ImGui_ImplVulkan_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+        ImGui::DestroyContext();
+    }
 
     CleanupSwapChain();
 
     render_objects_.clear();
 
-    renderer_->GetDevice().destroyCommandPool(imgui_command_pool_);
-    renderer_->GetDevice().destroyRenderPass(imgui_render_pass_);
     renderer_->GetDevice().destroyDescriptorPool(imgui_descriptor_pool_);
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        auto& frame_data = frame_data_[i];
-        frame_data.camera_uniform_buffer.reset();
-        renderer_->GetDevice().destroySemaphore(
-            frame_data.render_finished_semaphore);
-        renderer_->GetDevice().destroySemaphore(
-            frame_data.image_available_semaphore);
-        renderer_->GetDevice().destroyFence(frame_data.in_flight_fence);
-    }
+    DestroyFrameData();
     if constexpr (ENABLE_VALIDATION_LAYERS) {
         renderer_->GetInstance().destroyDebugUtilsMessengerEXT(
             debug_messenger_);
     }
     renderer_.reset();
 
-    glfwDestroyWindow(window_);
-    glfwTerminate();
+    if (window_) {
+        glfwDestroyWindow(window_);
+        glfwTerminate();
+    }
 }
 
 void Application::InitWindow()
@@ -366,6 +485,18 @@ void Application::InitVulkan()
     CreateFrameData();
     CreateCameraDescriptorSets();
     CreateCommandBuffers();
+    command_recorder_.emplace(*renderer_, frame_data_.size(),
+                              thread_pool_.GetThreadCount(),
+                              DRAW_CACHE_COUNT);
+    depth_prepass_.emplace(*renderer_);
+    gpu_timer_.emplace(*renderer_, frame_data_.size(), 2);
+    frame_used_depth_prepass_.assign(frame_data_.size(), false);
+    // Without an output the frames are only rendered, for benchmarks
+    if (IsHeadless() && !settings_.headless_output_directory.empty()) {
+        frame_readback_.emplace(
+            *renderer_,
+            MakePpmFrameSink(settings_.headless_output_directory));
+    }
 }
 
 void Application::CreateRenderer()
@@ -374,8 +505,25 @@ void Application::CreateRenderer()
     if constexpr (ENABLE_VALIDATION_LAYERS) {
         layers = VALIDATION_LAYERS;
     }
+    // The GUI backend has to be able to draw without a render pass too
+#ifdef IMGUI_IMPL_VULKAN_HAS_DYNAMIC_RENDERING
+    bool dynamic_rendering = settings_.dynamic_rendering;
+#else
+    bool dynamic_rendering = false;
+    if (settings_.dynamic_rendering) {
+        std::cerr << "The GUI backend does not support dynamic rendering, "
+                     "using render passes\n";
+    }
+#endif
+    // Nothing is presented headless, so there is no need for swapchains
+    std::vector<const char*> device_extensions;
+    if (!IsHeadless()) {
+        device_extensions = DEVICE_EXTENSIONS;
+    }
     renderer_.emplace("Vulkan Renderer", window_, GetRequiredExtensions(),
-                      DEVICE_EXTENSIONS, layers);
+                      device_extensions, layers,
+                      settings_.swapchain_image_count, settings_.present_mode,
+                      dynamic_rendering, vk::Extent2D(WIDTH, HEIGHT));
 }
 
 void Application::SetupDebugMessenger()
@@ -392,13 +540,16 @@ void Application::SetupDebugMessenger()
 
 std::vector<const char*> Application::GetRequiredExtensions()
 {
-    uint32_t glfw_required_extension_count;
-    const char** glfw_required_extensions =
-        glfwGetRequiredInstanceExtensions(&glfw_required_extension_count);
-
-    std::vector<const char*> extensions(
-        glfw_required_extensions,
-        glfw_required_extensions + glfw_required_extension_count);
+    // Headless there is no surface to create
+    std::vector<const char*> extensions;
+    if (!IsHeadless()) {
+        uint32_t glfw_required_extension_count;
+        const char** glfw_required_extensions =
+            glfwGetRequiredInstanceExtensions(&glfw_required_extension_count);
+        extensions.assign(
+            glfw_required_extensions,
+            glfw_required_extensions + glfw_required_extension_count);
+    }
 
     if constexpr (ENABLE_VALIDATION_LAYERS) {
         extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -419,18 +570,13 @@ void Application::CreateCommandBuffers()
 
 void Application::CreateFrameData()
 {
-    // Create these as empty (default) so that we can copy in_flight fences into
-    // them
+    // 0 is never signaled by a submission, so nothing waits on these yet
     images_in_flight_.resize(renderer_->GetSwapchain().GetActualImageCount());
 
     vk::SemaphoreCreateInfo semaphore_info;
-    vk::FenceCreateInfo fence_info(
-        vk::FenceCreateFlagBits::eSignaled);  // Create signaled so we don't get
-                                              // stuck waiting for it
-
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-        auto& frame_data = frame_data_[i];
 
+    frame_data_.resize(settings_.frames_in_flight);
+    for (auto& frame_data : frame_data_) {
         frame_data.camera_uniform_buffer.emplace(
             *renderer_, sizeof(GpuCameraData),
             vk::BufferUsageFlagBits::eUniformBuffer,
@@ -444,23 +590,44 @@ void Application::CreateFrameData()
             renderer_->GetDevice().createSemaphore(semaphore_info);
         frame_data.render_finished_semaphore =
             renderer_->GetDevice().createSemaphore(semaphore_info);
-        frame_data.in_flight_fence =
-            renderer_->GetDevice().createFence(fence_info);
+        frame_data.submitted_value = 0;
     }
 }
 
+void Application::DestroyFrameData()
+{
+    for (auto& frame_data : frame_data_) {
+        frame_data.camera_uniform_buffer.reset();
+        renderer_->GetDevice().destroySemaphore(
+            frame_data.render_finished_semaphore);
+        renderer_->GetDevice().destroySemaphore(
+            frame_data.image_available_semaphore);
+    }
+    frame_data_.clear();
+    // Frees the camera descriptor sets
+    renderer_->GetDevice().destroyDescriptorPool(camera_descriptor_pool_);
+    camera_descriptor_pool_ = nullptr;
+}
+
 void Application::RecreateSwapChain()
 {
     renderer_->RecreateSwapchain(window_);
+    // The image count may have changed, and no frame has rendered to the
+    // new images yet
+    images_in_flight_.assign(renderer_->GetSwapchain().GetActualImageCount(),
+                             0);
+    // The cached draws set the old viewport
+    command_recorder_->InvalidateCache();
+    ResizeHiZPyramid();
 
     CleanupSwapChain();
 
     CreateCommandBuffers();
 
-    ImGui_ImplVulkan_SetMinImageCount(
-        renderer_->GetSwapchain().GetMinimumImageCount());
-    CreateImGuiCommandBuffers();
-    CreateImGuiFramebuffers();
+    if (!IsHeadless()) {
+        ImGui_ImplVulkan_SetMinImageCount(
+            renderer_->GetSwapchain().GetMinimumImageCount());
+    }
 
     // Update camera aspect ratios
     auto extent = renderer_->GetSwapchain().GetExtent();
@@ -472,15 +639,22 @@ void Application::RecreateSwapChain()
 
 void Application::CreateCameraDescriptorSets()
 {
+    auto frame_count = static_cast<uint32_t>(frame_data_.size());
+    vk::DescriptorPoolSize pool_size(vk::DescriptorType::eUniformBuffer,
+                                     frame_count);
+    vk::DescriptorPoolCreateInfo pool_info(vk::DescriptorPoolCreateFlags(),
+                                           frame_count, pool_size);
+    camera_descriptor_pool_ =
+        renderer_->GetDevice().createDescriptorPool(pool_info);
+
     std::vector<vk::DescriptorSetLayout> layouts(
-        MAX_FRAMES_IN_FLIGHT, renderer_->GetCameraDescriptorSetLayout());
-    vk::DescriptorSetAllocateInfo alloc_info(renderer_->GetDescriptorPool(),
-                                             layouts);
+        frame_count, renderer_->GetCameraDescriptorSetLayout());
+    vk::DescriptorSetAllocateInfo alloc_info(camera_descriptor_pool_, layouts);
 
     auto camera_descriptor_sets =
         renderer_->GetDevice().allocateDescriptorSets(alloc_info);
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    for (size_t i = 0; i < frame_data_.size(); ++i) {
         auto& frame_data = frame_data_[i];
         frame_data.camera_uniform_descriptor = camera_descriptor_sets[i];
 
@@ -501,6 +675,42 @@ void Application::CreateCameraDescriptorSets()
     }
 }
 
+bool Application::ApplyRendererSettings()
+{
+    bool frames_in_flight_changed =
+        frame_data_.size() != settings_.frames_in_flight;
+    if (frames_in_flight_changed) {
+        renderer_->GetDevice().waitIdle();
+        current_frame_ = 0;
+
+        DestroyFrameData();
+        CreateFrameData();
+        CreateCameraDescriptorSets();
+
+        // Everything else that keeps resources per frame in flight
+        command_recorder_.emplace(*renderer_, frame_data_.size(),
+                                  thread_pool_.GetThreadCount(),
+                                  DRAW_CACHE_COUNT);
+        gpu_timer_.emplace(*renderer_, frame_data_.size(), 2);
+        frame_used_depth_prepass_.assign(frame_data_.size(), false);
+        if (gpu_culler_.has_value()) {
+            CreateGpuCuller();
+        }
+        CreateOcclusionQueryCuller();
+    }
+
+    auto image_count = renderer_->GetSwapchain().GetActualImageCount();
+    renderer_->SetSwapchainImageCount(settings_.swapchain_image_count);
+    renderer_->SetPresentModePolicy(settings_.present_mode);
+    RecreateSwapChain();
+    // ImGui keeps one set of buffers per image it was told about, a present
+    // mode change alone leaves them be
+    if (renderer_->GetSwapchain().GetActualImageCount() != image_count) {
+        RecreateImGuiRenderer();
+    }
+    return frames_in_flight_changed;
+}
+
 void Application::UpdateCameraUniformBuffer()
 {
     GpuCameraData camera = active_camera_->GetCameraData();
@@ -514,6 +724,148 @@ void Application::UpdateCameraUniformBuffer()
         frame_data.camera_uniform_buffer->GetMemory());
 }
 
+const std::map<CpuCullingMode, const char*> CPU_CULLING_MODE_NAMES = {
+    {CpuCullingMode::Off, "Off"},
+    {CpuCullingMode::Flat, "Flat (SIMD)"},
+    {CpuCullingMode::Bvh, "BVH"}};
+
+const std::map<OcclusionCullingMode, const char*>
+    OCCLUSION_CULLING_MODE_NAMES = {
+        {OcclusionCullingMode::Off, "Off"},
+        {OcclusionCullingMode::Software, "Software Rasterizer"},
+        {OcclusionCullingMode::GpuHiZ, "GPU Hi-Z (two phase)"},
+        {OcclusionCullingMode::HardwareQueries, "Occlusion Queries"},
+        {OcclusionCullingMode::ConditionalRendering,
+         "Conditional Rendering"}};
+
+void Application::UpdateVisibleObjects()
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Only objects that moved since last frame need new bounds
+    for (size_t i = 0; i < render_objects_.size(); ++i) {
+        auto& obj = render_objects_[i];
+        if (obj.IsBoundsDirty()) {
+            frustum_culler_.SetBounds(i, obj.GetWorldBounds());
+            scene_bvh_.Update(bvh_proxies_[i], obj.GetWorldBounds());
+            obj.ClearBoundsDirty();
+        }
+    }
+
+    auto viewproj = active_camera_->GetCameraData().viewproj;
+    auto frustum = Frustum::FromMatrix(viewproj);
+    visible_objects_.clear();
+    switch (cpu_culling_mode_) {
+        case CpuCullingMode::Off:
+            for (size_t i = 0; i < render_objects_.size(); ++i) {
+                visible_objects_.push_back(static_cast<uint32_t>(i));
+            }
+            break;
+        case CpuCullingMode::Flat:
+            frustum_culler_.Cull(frustum, visible_objects_);
+            break;
+        case CpuCullingMode::Bvh:
+            scene_bvh_.QueryFrustum(frustum, visible_objects_);
+            // Keep the draw order stable regardless of the tree layout
+            std::sort(visible_objects_.begin(), visible_objects_.end());
+            break;
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    frustum_culling_time_ =
+        std::chrono::duration<double, std::milli>(end - start).count();
+
+    UpdateOcclusion(viewproj);
+}
+
+void Application::UpdateOcclusion(const glm::mat4& viewproj)
+{
+    occluded_object_count_ = 0;
+    query_hidden_objects_.clear();
+    bool gpu_culling = use_gpu_culling_ && gpu_culler_.has_value();
+    if (occlusion_culling_mode_ == OcclusionCullingMode::HardwareQueries &&
+        !gpu_culling) {
+        UpdateQueryOcclusion();
+        return;
+    }
+    if (occlusion_culling_mode_ != OcclusionCullingMode::Software) {
+        occlusion_culling_time_ = 0.0;
+        return;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Only occluders that survived frustum culling can hide anything
+    software_occlusion_culler_.BeginFrame(viewproj);
+    for (auto object_index : visible_objects_) {
+        auto& obj = render_objects_[object_index];
+        if (!obj.IsOccluder() || !obj.GetModel()) {
+            continue;
+        }
+        for (const auto& mesh : obj.GetModel()->GetMeshes()) {
+            software_occlusion_culler_.AddOccluder(
+                mesh.GetPositions(), mesh.GetIndices(), obj.GetTransform());
+        }
+    }
+    software_occlusion_culler_.Rasterize(thread_pool_);
+
+    auto visible_end = std::remove_if(
+        visible_objects_.begin(), visible_objects_.end(),
+        [this](uint32_t object_index) {
+            return !software_occlusion_culler_.IsVisible(
+                render_objects_[object_index].GetWorldBounds());
+        });
+    occluded_object_count_ =
+        static_cast<size_t>(visible_objects_.end() - visible_end);
+    visible_objects_.erase(visible_end, visible_objects_.end());
+
+    auto end = std::chrono::high_resolution_clock::now();
+    occlusion_culling_time_ =
+        std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void Application::UpdateQueryOcclusion()
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // This frame has been waited on, so the queries recorded the
+    // last time this frame index was used are done
+    occlusion_query_culler_->ReadResults(current_frame_);
+
+    auto visible_end = std::stable_partition(
+        visible_objects_.begin(), visible_objects_.end(),
+        [this](uint32_t object_index) {
+            return occlusion_query_culler_->IsVisible(object_index);
+        });
+    query_hidden_objects_.assign(visible_end, visible_objects_.end());
+    visible_objects_.erase(visible_end, visible_objects_.end());
+    occluded_object_count_ = query_hidden_objects_.size();
+
+    auto end = std::chrono::high_resolution_clock::now();
+    occlusion_culling_time_ =
+        std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void Application::UpdatePicking()
+{
+    ImGuiIO& io = ImGui::GetIO();
+    if (!ImGui::IsMouseClicked(ImGuiMouseButton_Left) ||
+        io.WantCaptureMouse || io.DisplaySize.x <= 0.0f ||
+        io.DisplaySize.y <= 0.0f) {
+        return;
+    }
+
+    // The vertex shader flips y, so the top of the window is +1
+    glm::vec2 ndc(2.0f * io.MousePos.x / io.DisplaySize.x - 1.0f,
+                  1.0f - 2.0f * io.MousePos.y / io.DisplaySize.y);
+    auto hit = scene_bvh_.RayCast(active_camera_->GetRay(ndc));
+    if (hit.has_value()) {
+        picked_object_ = hit->user_data;
+    } else {
+        picked_object_.reset();
+    }
+}
+
 void Application::LoadScene()
 {
     for (const auto& path : MODEL_PATHS) {
@@ -526,25 +878,29 @@ void Application::LoadScene()
     // so it needs to be rotated
     glm::quat viking_house_rotation =
         glm::angleAxis(glm::half_pi<float>(), glm::vec3(-1.0, 0.0, 0.0));
-    {
+    const std::vector<glm::vec3> object_positions = {{-1.0, 0.0, 0.0},
+                                                     {1.0, 0.0, 0.0}};
+
+    // Scene nodes hold pointers into render_objects_, so it must not
+    // reallocate once they have been handed out
+    render_objects_.reserve(object_positions.size());
+    for (const auto& position : object_positions) {
         render_objects_.emplace_back(*renderer_);
-        auto& obj1 = render_objects_.back();
-        auto scene_node1 = root->CreateChildNode();
-        scene_node1->SetTranslation(glm::vec3(-1.0, 0.0, 0.0));
-        scene_node1->SetRotation(viking_house_rotation);
-        obj1.SetModel(&models_.front());
-        scene_node1->SetRenderObject(&obj1);
+        auto& obj = render_objects_.back();
+        auto scene_node = root->CreateChildNode();
+        scene_node->SetTranslation(position);
+        scene_node->SetRotation(viking_house_rotation);
+        obj.SetModel(&models_.front());
+        obj.SetOccluder(true);
+        scene_node->SetRenderObject(&obj);
     }
 
-    {
-        render_objects_.emplace_back(*renderer_);
-        auto& obj2 = render_objects_.back();
-        auto scene_node2 = root->CreateChildNode();
-        scene_node2->SetTranslation(glm::vec3(1.0, 0.0, 0.0));
-        scene_node2->SetRotation(viking_house_rotation);
-        obj2.SetModel(&models_.front());
-        scene_node2->SetRenderObject(&obj2);
+    frustum_culler_.Resize(render_objects_.size());
+    for (size_t i = 0; i < render_objects_.size(); ++i) {
+        bvh_proxies_.push_back(scene_bvh_.Insert(
+            render_objects_[i].GetWorldBounds(), static_cast<uint32_t>(i)));
     }
+    scene_bvh_.Rebuild();
 
     // Create camera nodes
     auto extent = renderer_->GetSwapchain().GetExtent();
@@ -565,11 +921,43 @@ void Application::LoadScene()
     }
     active_camera_ = controlled_camera_;
 
-    if (active_camera_ == controlled_camera_) {
+    if (active_camera_ == controlled_camera_ && window_) {
         SetCaptureCursor(window_, !imgui_display_);
     }
 }
 
+void Application::CreateGpuCuller()
+{
+    if (!renderer_->SupportsGpuCulling()) {
+        std::cout << "GPU culling is not supported on this device\n";
+        return;
+    }
+
+    bool hiz_occlusion = renderer_->SupportsDepthSampling();
+    gpu_culler_.emplace(*renderer_, frame_data_.size(), hiz_occlusion);
+    if (hiz_occlusion) {
+        hiz_pyramid_.emplace(*renderer_);
+        gpu_culler_->SetHiZPyramid(*hiz_pyramid_);
+    }
+    gpu_culler_->Build(*renderer_, render_objects_);
+}
+
+void Application::CreateOcclusionQueryCuller()
+{
+    occlusion_query_culler_.emplace(*renderer_, frame_data_.size());
+    occlusion_query_culler_->Resize(*renderer_, render_objects_.size());
+}
+
+void Application::ResizeHiZPyramid()
+{
+    if (!hiz_pyramid_.has_value()) {
+        return;
+    }
+    // Frames in flight keep the old pyramid until they are done with it
+    hiz_pyramid_->Resize(*renderer_);
+    gpu_culler_->SetHiZPyramid(*hiz_pyramid_);
+}
+
 void Application::UpdateRotatingCamera(double delta_time)
 {
     auto pos = glm::vec3(
@@ -587,7 +975,8 @@ void Application::UpdateRotatingCamera(double delta_time)
 
 void Application::UpdateControlledCamera(double delta_time)
 {
-    if (active_camera_ != controlled_camera_) {
+    // Headless it stays where it was put
+    if (active_camera_ != controlled_camera_ || !input_.has_value()) {
         return;
     }
 
@@ -648,15 +1037,11 @@ void Application::UpdateControlledCamera(double delta_time)
     controlled_camera_->Rotate(rotation);
 }
 
-void Application::WaitForNextFrameFence()
+void Application::WaitForNextFrame()
 {
-    // Wait until this fence has been finished
-    auto wait_for_fence_result = renderer_->GetDevice().waitForFences(
-        frame_data_[current_frame_].in_flight_fence, VK_TRUE,
-        std::numeric_limits<uint64_t>::max());
-    if (wait_for_fence_result != vk::Result::eSuccess) {
-        throw std::runtime_error("Could not wait for fence!");
-    }
+    // Wait until the last submission of this frame has finished
+    renderer_->GetGraphicsTimeline().Wait(
+        frame_data_[current_frame_].submitted_value);
 }
 
 std::optional<uint32_t> Application::GetNextImage()
@@ -682,97 +1067,345 @@ std::optional<uint32_t> Application::GetNextImage()
     }
 }
 
-void Application::WaitForImageFenceAndSetNewFence(uint32_t image_index)
+void Application::WaitForImage(uint32_t image_index)
 {
-    // Check if a previous frame is using this image
-    // operator bool() is true if not VK_NULL_HANDLE
-    if (images_in_flight_[image_index]) {
-        auto wait_result = renderer_->GetDevice().waitForFences(
-            images_in_flight_[image_index], VK_TRUE,
-            std::numeric_limits<uint64_t>::max());
-
-        if (wait_result != vk::Result::eSuccess) {
-            throw std::runtime_error("Could not wait for image fence!");
-        }
+    // Wait if a previous frame is still rendering to this image, the value
+    // is updated once this frame has been submitted
+    renderer_->GetGraphicsTimeline().Wait(images_in_flight_[image_index]);
+    // That frame is done, so what it left in the image can be passed on
+    if (frame_readback_.has_value()) {
+        frame_readback_->Deliver(image_index);
     }
-
-    images_in_flight_[image_index] =
-        frame_data_[current_frame_].in_flight_fence;
 }
 
-void Application::DrawScene(FrameData& frame_data, vk::Framebuffer& framebuffer,
+void Application::DrawScene(FrameData& frame_data, uint32_t image_index,
                             vk::CommandBuffer& command_buffer)
 {
     vk::CommandBufferBeginInfo begin_info(vk::CommandBufferUsageFlags(), {});
 
     command_buffer.begin(begin_info);
 
-    std::array<vk::ClearValue, 2> clear_values;
-    clear_values[0].color.setFloat32({{0.0f, 0.0f, 0.0f, 0.0f}});
-    clear_values[1].depthStencil.setDepth(1.0f);
-    clear_values[1].depthStencil.setStencil(0);
+    // The frame has been waited on, so its secondaries are free
+    command_recorder_->BeginFrame(current_frame_);
+    gpu_timer_->Reset(command_buffer, current_frame_);
+
+    bool gpu_culling = use_gpu_culling_ && gpu_culler_.has_value();
+    bool two_phase = gpu_culling && hiz_pyramid_.has_value() &&
+                     occlusion_culling_mode_ == OcclusionCullingMode::GpuHiZ;
+    auto first_phase = two_phase ? GpuCullPhase::Early : GpuCullPhase::All;
+    if (gpu_culling) {
+        // The culling dispatch has to happen outside of the render pass
+        gpu_culler_->UpdateObjects(current_frame_, render_objects_);
+        gpu_culler_->BeginFrame(command_buffer, current_frame_,
+                                active_camera_->GetCameraData().viewproj);
+        gpu_culler_->RecordCull(command_buffer, current_frame_, first_phase);
+    }
 
-    vk::RenderPassBeginInfo render_pass_info(
-        renderer_->GetRenderPass(), framebuffer,
-        {{0, 0}, renderer_->GetSwapchain().GetExtent()}, clear_values);
+    bool conditional =
+        occlusion_culling_mode_ == OcclusionCullingMode::ConditionalRendering &&
+        renderer_->SupportsConditionalRendering();
+    bool query_occlusion =
+        !gpu_culling &&
+        (occlusion_culling_mode_ == OcclusionCullingMode::HardwareQueries ||
+         conditional);
+    if (query_occlusion) {
+        occlusion_query_culler_->BeginFrame(command_buffer, current_frame_,
+                                            conditional);
+    }
+
+    auto scene_target = renderer_->GetSceneTarget();
+    auto framebuffer = renderer_->GetFramebuffer(image_index);
+    auto& frame_graph = renderer_->GetFrameGraph();
+    auto scene_attachments = renderer_->GetSceneAttachmentUses();
+
+    if (gpu_culling) {
+        frame_graph.AddPass(
+            two_phase ? "early scene" : "scene", scene_attachments,
+            [=, &frame_data](vk::CommandBuffer& command_buffer) {
+                renderer_->BeginScenePass(
+                    command_buffer, image_index,
+                    two_phase ? ScenePass::Early : ScenePass::Single, false);
+                gpu_culler_->RecordDraws(command_buffer, current_frame_,
+                                         first_phase,
+                                         frame_data.camera_uniform_descriptor);
+                renderer_->EndScenePass(command_buffer, !two_phase);
+            });
+        if (two_phase) {
+            // Cull the rest against the depth of what was just drawn, then
+            // draw the newly visible instances on top. Building the pyramid
+            // leaves depth in the layout it found it in
+            frame_graph.AddPass(
+                "late cull", {}, [this](vk::CommandBuffer& command_buffer) {
+                    hiz_pyramid_->RecordBuild(command_buffer);
+                    gpu_culler_->RecordCull(command_buffer, current_frame_,
+                                            GpuCullPhase::Late);
+                });
+            frame_graph.AddPass(
+                "late scene", scene_attachments,
+                [=, &frame_data](vk::CommandBuffer& command_buffer) {
+                    renderer_->BeginScenePass(command_buffer, image_index,
+                                              ScenePass::Late, false);
+                    gpu_culler_->RecordDraws(
+                        command_buffer, current_frame_, GpuCullPhase::Late,
+                        frame_data.camera_uniform_descriptor);
+                    renderer_->EndScenePass(command_buffer, true);
+                });
+        }
+        return;
+    }
+
+    auto view = active_camera_->GetCameraData().view;
+    glm::vec3 camera_position(glm::inverse(view)[3]);
+
+    bool depth_prepass = use_depth_prepass_;
+    frame_used_depth_prepass_[current_frame_] = depth_prepass;
+
+    // Queries are numbered in recording order, so they keep recording every
+    // draw into the primary command buffer, in object order
+    bool cached = use_cached_recording_ && !query_occlusion;
+    bool parallel = use_parallel_recording_ && !query_occlusion;
+    if (cached) {
+        // Only the camera moved if the same objects survived culling, the
+        // cached draws read the camera from its uniform buffer
+        if (cached_draw_list_ != visible_objects_) {
+            cached_draw_list_ = visible_objects_;
+            ++draw_list_generation_;
+            BuildDrawItems(visible_objects_, render_objects_,
+                           renderer_->GetMaterialCache(), camera_position,
+                           draw_items_);
+            first_transparent_item_ = SortDrawItems(draw_items_);
+        } else {
+            // Their back to front order changes whenever the camera moves
+            SortTransparentDrawItems(draw_items_, first_transparent_item_,
+                                     render_objects_, camera_position);
+        }
+    } else {
+        // draw_items_ no longer matches the cached draw list
+        cached_draw_list_.reset();
+        BuildDrawItems(visible_objects_, render_objects_,
+                       renderer_->GetMaterialCache(), camera_position,
+                       draw_items_);
+        first_transparent_item_ = query_occlusion
+                                      ? PartitionDrawItems(draw_items_)
+                                      : SortDrawItems(draw_items_);
+    }
 
-    command_buffer.beginRenderPass(render_pass_info,
-                                   vk::SubpassContents::eInline);
+    // The settings may change before the graph runs, everything the pass
+    // depends on is decided here
+    auto generation = draw_list_generation_;
+    frame_graph.AddPass(
+        "scene", scene_attachments,
+        [=, &frame_data](vk::CommandBuffer& command_buffer) {
+            gpu_timer_->Write(command_buffer, current_frame_, 0,
+                              vk::PipelineStageFlagBits::eTopOfPipe);
+
+            auto record_start = std::chrono::high_resolution_clock::now();
+            auto record_secondary = [&](vk::CommandBuffer& secondary,
+                                        size_t first, size_t last) {
+                renderer_->SetSceneViewport(secondary);
+                RecordDrawItems(secondary, frame_data, first, last, false,
+                                false, depth_prepass);
+            };
+            auto record_prepass = [&](vk::CommandBuffer& buffer, size_t first,
+                                      size_t last) {
+                renderer_->SetSceneViewport(buffer);
+                depth_prepass_->RecordDraws(
+                    buffer, frame_data.camera_uniform_descriptor, draw_items_,
+                    first, last, render_objects_);
+            };
+            renderer_->BeginScenePass(command_buffer, image_index,
+                                      ScenePass::Single, cached || parallel);
+            if (cached) {
+                // Only the opaque items are cached, the transparent ones are
+                // recorded again every frame behind them
+                if (depth_prepass) {
+                    command_recorder_->RecordCached(
+                        command_buffer, current_frame_, scene_target,
+                        thread_pool_, first_transparent_item_,
+                        DEPTH_PREPASS_CACHE, generation,
+                        record_prepass);
+                }
+                command_recorder_->RecordCached(
+                    command_buffer, current_frame_, scene_target,
+                    thread_pool_, first_transparent_item_, SCENE_CACHE,
+                    generation, record_secondary);
+                command_recorder_->Record(
+                    command_buffer, current_frame_, scene_target,
+                    framebuffer, thread_pool_,
+                    draw_items_.size() - first_transparent_item_,
+                    [&](vk::CommandBuffer& secondary, size_t first,
+                        size_t last) {
+                        record_secondary(secondary,
+                                         first_transparent_item_ + first,
+                                         first_transparent_item_ + last);
+                    });
+            } else if (parallel) {
+                if (depth_prepass) {
+                    command_recorder_->Record(
+                        command_buffer, current_frame_, scene_target,
+                        framebuffer, thread_pool_, first_transparent_item_,
+                        record_prepass);
+                }
+                command_recorder_->Record(
+                    command_buffer, current_frame_, scene_target,
+                    framebuffer, thread_pool_, draw_items_.size(),
+                    record_secondary);
+            } else {
+                // With partitioned items the opaque ones still come first
+                if (depth_prepass) {
+                    record_prepass(command_buffer, 0,
+                                   first_transparent_item_);
+                }
+                RecordDrawItems(command_buffer, frame_data, 0,
+                                draw_items_.size(), conditional,
+                                query_occlusion, depth_prepass);
+            }
+            auto record_end = std::chrono::high_resolution_clock::now();
+            command_recording_time_ =
+                std::chrono::duration<double, std::milli>(record_end -
+                                                          record_start)
+                    .count();
+
+            // The bounding boxes go last so they are tested against everything
+            // drawn this frame
+            if (query_occlusion) {
+                occlusion_query_culler_->QueryBoundingBoxes(
+                    command_buffer, current_frame_,
+                    conditional ? visible_objects_ : query_hidden_objects_,
+                    render_objects_, frame_data.camera_uniform_descriptor,
+                    camera_position, active_camera_->GetNearPlaneRadius());
+            }
+
+            renderer_->EndScenePass(command_buffer, true);
+            gpu_timer_->Write(command_buffer, current_frame_, 1,
+                              vk::PipelineStageFlagBits::eBottomOfPipe);
+        });
+}
+
+void Application::RecordDrawItems(vk::CommandBuffer& command_buffer,
+                                  FrameData& frame_data, size_t first,
+                                  size_t last, bool conditional,
+                                  bool query_occlusion, bool depth_prepass)
+{
+    // Items of one object are consecutive whenever queries are in use, apart
+    // from its transparent ones which come after every opaque item
+    bool wrapping = false;
+    auto end_object = [&] {
+        if (conditional) {
+            occlusion_query_culler_->EndConditionalDraw(command_buffer);
+        } else if (query_occlusion) {
+            occlusion_query_culler_->EndQuery(command_buffer, current_frame_);
+        }
+    };
 
     NonOwningPointer<Material> last_material = nullptr;
-    for (auto& obj : render_objects_) {
-        auto model = obj.GetModel();
-        auto material_name = model->GetMaterialName();
+    NonOwningPointer<const Mesh> last_mesh = nullptr;
+    std::optional<uint32_t> last_object;
+    for (size_t i = first; i < last; ++i) {
+        auto& item = draw_items_[i];
         auto material =
-            renderer_->GetMaterialCache().GetMaterialByName(material_name);
-        if (material == nullptr) {
-            std::cerr << "Warning: material \"" << material_name
-                      << "\" does not exist!\n";
-            continue;
+            renderer_->GetMaterialCache().GetMaterial(item.material);
+        // Opaque depth is already final after the pre-pass
+        PipelineVariant variant;
+        variant.depth_equal = depth_prepass && !item.transparent;
+        bool new_object = last_object != item.object_index;
+        // Transparent items never occlude anything, so only the opaque ones
+        // are queried
+        bool wrap = conditional || (query_occlusion && !item.transparent);
+        if (wrapping && (new_object || !wrap)) {
+            end_object();
+            wrapping = false;
         }
+
         if (last_material != material) {
-            command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics,
-                                        material->GetGraphicsPipeline());
+            command_buffer.bindPipeline(
+                vk::PipelineBindPoint::eGraphics,
+                material->GetGraphicsPipeline(variant));
             // Bind camera
             command_buffer.bindDescriptorSets(
                 vk::PipelineBindPoint::eGraphics,
-                material->GetGraphicsPipelineLayout(), 0,
+                material->GetGraphicsPipelineLayout(variant), 0,
                 frame_data.camera_uniform_descriptor, {});
 
             // Bind texture
             command_buffer.bindDescriptorSets(
                 vk::PipelineBindPoint::eGraphics,
-                material->GetGraphicsPipelineLayout(), 1,
+                material->GetGraphicsPipelineLayout(variant), 1,
                 material->GetDescriptorSet(), {});
         }
 
         // bind object properties
-        command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
-                                          material->GetGraphicsPipelineLayout(),
-                                          2, obj.GetDescriptorSet(), {});
-
-        for (auto& mesh : model->GetMeshes()) {
-            command_buffer.bindVertexBuffers(0, mesh.GetVertexBuffer(), {0});
-            command_buffer.bindIndexBuffer(mesh.GetIndexBuffer(), 0,
+        if (new_object || last_material != material) {
+            auto& obj = render_objects_[item.object_index];
+            command_buffer.bindDescriptorSets(
+                vk::PipelineBindPoint::eGraphics,
+                material->GetGraphicsPipelineLayout(variant), 2,
+                obj.GetDescriptorSet(), {});
+        }
+        last_material = material;
+
+        // Objects that passed their last query test themselves while
+        // drawing, with conditional rendering the GPU decides instead
+        if (wrap && !wrapping) {
+            if (conditional) {
+                occlusion_query_culler_->BeginConditionalDraw(
+                    command_buffer, current_frame_, item.object_index);
+            } else {
+                occlusion_query_culler_->BeginQuery(
+                    command_buffer, current_frame_, item.object_index);
+            }
+            wrapping = true;
+        }
+        last_object = item.object_index;
+
+        if (last_mesh != item.mesh) {
+            command_buffer.bindVertexBuffers(
+                0,
+                {item.mesh->GetPositionBuffer(),
+                 item.mesh->GetAttributeBuffer()},
+                {0, 0});
+            command_buffer.bindIndexBuffer(item.mesh->GetIndexBuffer(), 0,
                                            vk::IndexType::eUint32);
-            command_buffer.drawIndexed(mesh.GetTriangleCount() * 3u, 1, 0, 0,
-                                       0);
+            last_mesh = item.mesh;
         }
+        command_buffer.drawIndexed(item.index_count, 1, item.first_index, 0,
+                                   0);
     }
 
-    command_buffer.endRenderPass();
-    command_buffer.end();
+    if (wrapping) {
+        end_object();
+    }
 }
 
-void Application::DrawGui(vk::Framebuffer& framebuffer,
-                          vk::CommandBuffer& command_buffer,
+void Application::DrawGui(uint32_t image_index,
                           vk::SampleCountFlagBits& msaa_samples)
 {
+    auto add_overlay_pass = [&](bool draw_gui) {
+        renderer_->GetFrameGraph().AddPass(
+            "overlay", renderer_->GetOverlayAttachmentUses(),
+            [this, image_index, draw_gui](vk::CommandBuffer& command_buffer) {
+                renderer_->BeginOverlay(command_buffer, image_index);
+                if (draw_gui) {
+                    ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(),
+                                                    command_buffer);
+                }
+                renderer_->EndOverlay(command_buffer);
+            });
+    };
+
+    // The overlay stays empty and ImGui does no work at all, also while its
+    // pipeline does not match the render pass
+    if (!imgui_display_ || stale_imgui_renderer_value_.has_value()) {
+        add_overlay_pass(false);
+        return;
+    }
+
     auto msaa_samples_str = REVERSE_SAMPLE_COUNT_MAP.at(msaa_samples);
     ImGui_ImplVulkan_NewFrame();
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
     if (imgui_display_) {
+        UpdatePicking();
         if (ImGui::Begin("Stats", &imgui_display_)) {
             uint32_t vertex_count = 0;
             uint32_t tri_count = 0;
@@ -788,6 +1421,52 @@ void Application::DrawGui(vk::Framebuffer& framebuffer,
             ImGui::Text("%u vertices", vertex_count);
             ImGui::Text("%u triangles", tri_count);
 
+            if (ImGui::TreeNode("Culling")) {
+                if (ImGui::BeginCombo(
+                        "CPU Frustum Culling",
+                        CPU_CULLING_MODE_NAMES.at(cpu_culling_mode_))) {
+                    for (auto& [mode, name] : CPU_CULLING_MODE_NAMES) {
+                        bool is_selected = mode == cpu_culling_mode_;
+                        if (ImGui::Selectable(name, is_selected)) {
+                            cpu_culling_mode_ = mode;
+                        }
+                        if (is_selected) {
+                            ImGui::SetItemDefaultFocus();
+                        }
+                    }
+                    ImGui::EndCombo();
+                }
+                ImGui::Text(
+                    "SIMD Backend: %s",
+                    CullingBackendName(frustum_culler_.GetBackend()));
+                ImGui::Text("%zu / %zu objects visible",
+                            visible_objects_.size(), render_objects_.size());
+                ImGui::Text("Cull time: %.03f ms", frustum_culling_time_);
+
+                ImGui::Text("BVH: %zu nodes, height %u, SAH cost %.02f",
+                            scene_bvh_.GetNodeCount(), scene_bvh_.GetHeight(),
+                            scene_bvh_.GetSahCost());
+                if (ImGui::Button("Rebuild BVH")) {
+                    scene_bvh_.Rebuild();
+                }
+
+                if (picked_object_.has_value()) {
+                    ImGui::Text("Picked object: %u", *picked_object_);
+                } else {
+                    ImGui::Text("Picked object: none (click the scene)");
+                }
+
+                ImGui::DragFloat("Nearby Radius", &nearby_radius_, 0.1f, 0.0f,
+                                 100.0f);
+                std::vector<uint32_t> nearby_objects;
+                scene_bvh_.QueryRadius(
+                    active_camera_->GetNode()->GetTranslation(),
+                    nearby_radius_, nearby_objects);
+                ImGui::Text("%zu objects within radius of the camera",
+                            nearby_objects.size());
+                ImGui::TreePop();
+            }
+
             if (ImGui::TreeNode("Camera")) {
                 ImGui::Text("Camera Type");
                 if (ImGui::RadioButton("Rotating",
@@ -850,6 +1529,11 @@ void Application::DrawGui(vk::Framebuffer& framebuffer,
                 (uint32_t)max_msaa_sample_count;
             ImGui::Text("Max MSAA Sample Count: %u", max_msaa_sample_count_int);
 
+            if (pending_sample_count_.has_value()) {
+                ImGui::Text("Preparing pipelines for %s...",
+                            REVERSE_SAMPLE_COUNT_MAP.at(
+                                *pending_sample_count_));
+            }
             if (ImGui::BeginCombo("Current MSAA Sample Count",
                                   msaa_samples_str)) {
                 for (auto& map_entry : SAMPLE_COUNT_MAP) {
@@ -867,6 +1551,181 @@ void Application::DrawGui(vk::Framebuffer& framebuffer,
                 }
                 ImGui::EndCombo();
             }
+
+            // Lazily allocated memory only counts as far as it is committed
+            auto attachment_memory = renderer_->GetAttachmentMemoryReport();
+            auto to_mib = [](vk::DeviceSize size) {
+                return static_cast<double>(size) / (1024.0 * 1024.0);
+            };
+            ImGui::Text("Attachment Memory: %.1f MiB",
+                        to_mib(attachment_memory.allocated_size));
+            ImGui::Text("Lazily Allocated: %.1f MiB, %.1f MiB committed",
+                        to_mib(attachment_memory.lazy_size),
+                        to_mib(attachment_memory.committed_lazy_size));
+
+            auto latency_mode = settings_.GetLatencyMode();
+            if (ImGui::BeginCombo("Latency Mode",
+                                  latency_mode.has_value()
+                                      ? LatencyModeName(*latency_mode)
+                                      : "custom")) {
+                for (auto mode : {LatencyMode::Low, LatencyMode::Balanced,
+                                  LatencyMode::HighThroughput}) {
+                    bool is_selected = mode == latency_mode;
+                    if (ImGui::Selectable(LatencyModeName(mode),
+                                          is_selected) &&
+                        !is_selected) {
+                        pending_settings_ = settings_;
+                        pending_settings_->SetLatencyMode(mode);
+                    }
+                    if (is_selected) {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            if (ImGui::BeginCombo(
+                    "Present Mode",
+                    PresentModePolicyName(settings_.present_mode))) {
+                for (auto policy :
+                     {PresentModePolicy::Immediate, PresentModePolicy::Mailbox,
+                      PresentModePolicy::Fifo,
+                      PresentModePolicy::FifoRelaxed}) {
+                    bool is_selected = policy == settings_.present_mode;
+                    if (ImGui::Selectable(PresentModePolicyName(policy),
+                                          is_selected) &&
+                        !is_selected) {
+                        pending_settings_ = settings_;
+                        pending_settings_->present_mode = policy;
+                    }
+                    if (is_selected) {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            auto frame_rate_limit = (float)settings_.frame_rate_limit;
+            if (ImGui::DragFloat(
+                    "Frame Rate Limit", &frame_rate_limit, 1.0f, 0.0f,
+                    (float)RendererSettings::MAX_FRAME_RATE_LIMIT, "%.0f")) {
+                settings_.frame_rate_limit = frame_rate_limit;
+                frame_pacer_.SetTargetFrameRate(frame_rate_limit);
+            }
+            if (frame_pacer_.GetTargetFrameRate() > 0.0) {
+                ImGui::Text("Pacing error: p50 %.03f, p95 %.03f, p99 %.03f ms",
+                            frame_pacer_.GetErrorPercentile(50.0),
+                            frame_pacer_.GetErrorPercentile(95.0),
+                            frame_pacer_.GetErrorPercentile(99.0));
+            } else {
+                ImGui::Text("Frame rate uncapped");
+            }
+
+            // The surface may not support what was asked for
+            auto& swapchain = renderer_->GetSwapchain();
+            ImGui::Text("%zu frames in flight, %u swapchain images (%s)",
+                        frame_data_.size(), swapchain.GetActualImageCount(),
+                        vk::to_string(swapchain.GetPresentMode()).c_str());
+
+            if (ImGui::BeginCombo(
+                    "Occlusion Culling",
+                    OCCLUSION_CULLING_MODE_NAMES.at(occlusion_culling_mode_))) {
+                for (auto& [mode, name] : OCCLUSION_CULLING_MODE_NAMES) {
+                    bool is_selected = mode == occlusion_culling_mode_;
+                    if (ImGui::Selectable(name, is_selected)) {
+                        occlusion_culling_mode_ = mode;
+                    }
+                    if (is_selected) {
+                        ImGui::SetItemDefaultFocus();
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            if (occlusion_culling_mode_ == OcclusionCullingMode::Software) {
+                ImGui::Text("%zu objects occluded, %zu occluder triangles",
+                            occluded_object_count_,
+                            software_occlusion_culler_
+                                .GetOccluderTriangleCount());
+                ImGui::Text("Occlusion time: %.03f ms (%zu threads)",
+                            occlusion_culling_time_,
+                            thread_pool_.GetThreadCount());
+                ImGui::Checkbox("Show Occlusion Depth", &show_occlusion_depth_);
+                if (show_occlusion_depth_) {
+                    DrawOcclusionDepthBuffer();
+                }
+            }
+
+            if (occlusion_culling_mode_ ==
+                    OcclusionCullingMode::HardwareQueries ||
+                occlusion_culling_mode_ ==
+                    OcclusionCullingMode::ConditionalRendering) {
+                if (use_gpu_culling_ && gpu_culler_.has_value()) {
+                    ImGui::Text("Queries need GPU Culling disabled");
+                } else if (occlusion_culling_mode_ ==
+                           OcclusionCullingMode::HardwareQueries) {
+                    ImGui::Text("%zu objects hidden by queries (%.03f ms)",
+                                occluded_object_count_,
+                                occlusion_culling_time_);
+                } else if (!renderer_->SupportsConditionalRendering()) {
+                    ImGui::Text("Conditional rendering: unsupported");
+                } else {
+                    ImGui::Text("Draws are predicated on the GPU");
+                }
+            }
+            if (occlusion_culling_mode_ == OcclusionCullingMode::GpuHiZ) {
+                if (!hiz_pyramid_.has_value()) {
+                    ImGui::Text("Hi-Z culling: unsupported");
+                } else if (!use_gpu_culling_) {
+                    ImGui::Text("Hi-Z culling needs GPU Culling enabled");
+                }
+            }
+
+            if (gpu_culler_.has_value()) {
+                ImGui::Checkbox("GPU Culling", &use_gpu_culling_);
+            } else {
+                ImGui::Text("GPU Culling: unsupported");
+            }
+
+            ImGui::Checkbox("Parallel Command Recording",
+                            &use_parallel_recording_);
+            ImGui::Checkbox("Cache Unchanged Draws", &use_cached_recording_);
+            if (use_gpu_culling_ && gpu_culler_.has_value()) {
+                ImGui::Text("Draws are recorded by the GPU culling pass");
+            } else {
+                ImGui::Text("%zu draw items", draw_items_.size());
+                ImGui::Text("%zu opaque, %zu transparent",
+                            first_transparent_item_,
+                            draw_items_.size() - first_transparent_item_);
+                ImGui::Text("Recording time: %.03f ms (%zu secondaries, "
+                            "%zu reused)",
+                            command_recording_time_,
+                            command_recorder_->GetExecutedChunkCount(),
+                            command_recorder_->GetReusedChunkCount());
+            }
+
+            if (ImGui::Checkbox("Depth Pre-pass", &use_depth_prepass_)) {
+                // The cached opaque draws use the other pipelines now. This
+                // frame still records them with the old ones, so the next
+                // one must not reuse what it caches
+                ++draw_list_generation_;
+            }
+            if (use_gpu_culling_ && gpu_culler_.has_value()) {
+                ImGui::Text("The depth pre-pass needs GPU Culling disabled");
+            } else if (!gpu_timer_->IsSupported()) {
+                ImGui::Text("Scene GPU time: timestamps unsupported");
+            } else {
+                // Both stay at their last value while the other is in use
+                for (bool prepass : {false, true}) {
+                    auto& time = scene_gpu_time_[prepass];
+                    const char* label =
+                        prepass ? "with pre-pass" : "without pre-pass";
+                    if (time.has_value()) {
+                        ImGui::Text("Scene GPU time %s: %.03f ms", label,
+                                    *time);
+                    } else {
+                        ImGui::Text("Scene GPU time %s: -", label);
+                    }
+                }
+            }
+
             ImGui::Text("%.02f FPS", current_frames_per_second_);
             ImGui::PlotLines("FPS Graph", frames_per_second_data_.data(),
                              (int)frames_per_second_data_.size(), 0, nullptr,
@@ -878,40 +1737,34 @@ void Application::DrawGui(vk::Framebuffer& framebuffer,
         }
     }
     ImGui::Render();
-    vk::CommandBufferBeginInfo begin_info(
-        vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
-    command_buffer.begin(begin_info);
-    vk::ClearValue clear_value;
-    clear_value.color.setFloat32({{0.0f, 0.0f, 0.0f, 1.0f}});
-    vk::RenderPassBeginInfo imgui_pass(
-        imgui_render_pass_, framebuffer,
-        {{0, 0}, renderer_->GetSwapchain().GetExtent()}, clear_value);
-    command_buffer.beginRenderPass(imgui_pass, vk::SubpassContents::eInline);
-    ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), command_buffer);
-    command_buffer.endRenderPass();
-    command_buffer.end();
+    add_overlay_pass(true);
 }
 
 void Application::SubmitGraphicsCommands(
     std::vector<vk::CommandBuffer> command_buffers)
 {
-    vk::PipelineStageFlags wait_dest_stage_mask =
-        vk::PipelineStageFlagBits::eColorAttachmentOutput;
-
-    vk::SubmitInfo submit_info(
-        frame_data_[current_frame_].image_available_semaphore,
-        wait_dest_stage_mask, command_buffers,
-        frame_data_[current_frame_].render_finished_semaphore);
-
-    renderer_->GetDevice().resetFences(
-        frame_data_[current_frame_].in_flight_fence);
-
-    renderer_->GetGraphicsQueue().submit(
-        submit_info, frame_data_[current_frame_].in_flight_fence);
+    auto& frame_data = frame_data_[current_frame_];
+    // Offscreen images are neither acquired nor presented
+    if (IsHeadless()) {
+        frame_data.submitted_value =
+            renderer_->GetGraphicsTimeline().Submit(command_buffers);
+        return;
+    }
+    // Present still needs binary semaphores, the timeline value is what the
+    // CPU waits on
+    frame_data.submitted_value = renderer_->GetGraphicsTimeline().Submit(
+        command_buffers, {frame_data.image_available_semaphore},
+        {vk::PipelineStageFlagBits::eColorAttachmentOutput},
+        {frame_data.render_finished_semaphore});
 }
 
 void Application::Present(uint32_t image_index)
 {
+    // Read back by frame_readback_ instead, if at all
+    if (IsHeadless()) {
+        return;
+    }
+
     auto swapchain = renderer_->GetSwapchain().GetSwapchain();
     vk::PresentInfoKHR present_info(
         frame_data_[current_frame_].render_finished_semaphore, swapchain,
@@ -961,52 +1814,13 @@ void Application::SetupImgui()
             renderer_->GetDevice().createDescriptorPool(pool_info);
     }
 
-    // Create imgui render pass
-    {
-        vk::AttachmentDescription attachment(
-            vk::AttachmentDescriptionFlags(),
-            renderer_->GetSwapchain().GetImageFormat().format,
-            vk::SampleCountFlagBits::e1, vk::AttachmentLoadOp::eLoad,
-            vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare,
-            vk::AttachmentStoreOp::eDontCare,
-            vk::ImageLayout::eColorAttachmentOptimal,
-            vk::ImageLayout::ePresentSrcKHR);
-
-        vk::AttachmentReference color_attachment(
-            0, vk::ImageLayout::eColorAttachmentOptimal);
-
-        vk::SubpassDescription subpass(vk::SubpassDescriptionFlags(),
-                                       vk::PipelineBindPoint::eGraphics, {},
-                                       color_attachment);
-
-        vk::SubpassDependency dependency(
-            VK_SUBPASS_EXTERNAL, 0,
-            vk::PipelineStageFlagBits::eColorAttachmentOutput,
-            vk::PipelineStageFlagBits::eColorAttachmentOutput,
-            vk::AccessFlagBits{0}, vk::AccessFlagBits::eColorAttachmentWrite);
-
-        vk::RenderPassCreateInfo render_pass_info(
-            vk::RenderPassCreateFlags(), attachment, subpass, dependency);
-
-        imgui_render_pass_ =
-            renderer_->GetDevice().createRenderPass(render_pass_info);
-    }
-
-    // create command pool and buffers
-    {
-        vk::CommandPoolCreateInfo command_pool_info(
-            vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
-            renderer_->GetQueueFamilies().graphics_family.value().index);
-        imgui_command_pool_ =
-            renderer_->GetDevice().createCommandPool(command_pool_info);
-
-        CreateImGuiCommandBuffers();
-    }
-
-    // Create framebuffers
-    CreateImGuiFramebuffers();
-
     ImGui_ImplGlfw_InitForVulkan(window_, true);
+    InitImGuiRenderer();
+    ResizeImGui();
+}
+
+void Application::InitImGuiRenderer()
+{
     ImGui_ImplVulkan_InitInfo init_info = {};
     init_info.Instance = renderer_->GetInstance();
     init_info.PhysicalDevice = renderer_->GetPhysicalDevice();
@@ -1018,10 +1832,37 @@ void Application::SetupImgui()
     init_info.DescriptorPool = imgui_descriptor_pool_;
     init_info.Allocator = nullptr;
     init_info.MinImageCount = renderer_->GetSwapchain().GetMinimumImageCount();
-    init_info.ImageCount = renderer_->GetSwapchain().GetActualImageCount();
+    // ImGui cycles through its vertex buffers once per image, it must not
+    // reuse one that a frame in flight still reads
+    init_info.ImageCount =
+        std::max<uint32_t>(renderer_->GetSwapchain().GetActualImageCount(),
+                           static_cast<uint32_t>(frame_data_.size()));
     init_info.CheckVkResultFn = check_vk_result;
-    ImGui_ImplVulkan_Init(&init_info, imgui_render_pass_);
-    ResizeImGui();
+    // Drawn at the end of the scene render pass, on the resolved image
+    init_info.Subpass = OVERLAY_SUBPASS;
+    init_info.MSAASamples = VK_SAMPLE_COUNT_1_BIT;
+#ifdef IMGUI_IMPL_VULKAN_HAS_DYNAMIC_RENDERING
+    if (renderer_->UsesDynamicRendering()) {
+        init_info.UseDynamicRendering = true;
+        init_info.ColorAttachmentFormat = static_cast<VkFormat>(
+            renderer_->GetSwapchain().GetImageFormat().format);
+        init_info.Subpass = 0;
+    }
+#endif
+    ImGui_ImplVulkan_Init(&init_info, renderer_->GetRenderPass());
+}
+
+void Application::RecreateImGuiRenderer()
+{
+    // The backend destroys its pipeline right away
+    renderer_->GetGraphicsTimeline().Wait(
+        renderer_->GetGraphicsTimeline().GetSubmittedValue());
+    ImGui_ImplVulkan_Shutdown();
+    stale_imgui_renderer_value_.reset();
+    InitImGuiRenderer();
+    auto command_buffer = renderer_->BeginSingleTimeCommands();
+    ImGui_ImplVulkan_CreateFontsTexture(command_buffer);
+    renderer_->EndSingleTimeCommands(command_buffer);
 }
 
 void Application::FindFontFile(std::string name)
@@ -1056,31 +1897,43 @@ void Application::FindFontFile(std::string name)
 #endif
 }
 
-void Application::CreateImGuiFramebuffers()
+void Application::DrawOcclusionDepthBuffer()
 {
-    auto image_count = renderer_->GetSwapchain().GetActualImageCount();
-    imgui_frame_buffers_.resize(image_count);
-    auto& image_views = renderer_->GetSwapchain().GetImageViews();
-    auto extent = renderer_->GetSwapchain().GetExtent();
-
-    for (uint32_t i = 0; i < image_count; ++i) {
-        vk::FramebufferCreateInfo info(vk::FramebufferCreateFlags(),
-                                       imgui_render_pass_, image_views[i],
-                                       extent.width, extent.height, 1);
-        imgui_frame_buffers_[i] =
-            renderer_->GetDevice().createFramebuffer(info);
+    const auto& depth_buffer = software_occlusion_culler_.GetDepthBuffer();
+    uint32_t width = software_occlusion_culler_.GetWidth();
+    uint32_t height = software_occlusion_culler_.GetHeight();
+
+    // One rect per block of pixels, ImGui's 16 bit indices can't take one
+    // rect per pixel
+    constexpr uint32_t block_size = 4;
+    float cell_size = 2.0f * block_size * window_scaling_;
+
+    ImVec2 origin = ImGui::GetCursorScreenPos();
+    ImGui::Dummy(ImVec2(width / block_size * cell_size,
+                        height / block_size * cell_size));
+    auto draw_list = ImGui::GetWindowDrawList();
+
+    // Linearize the depth so that distant occluders are still distinguishable
+    float near_z = active_camera_->GetNearZ();
+    float far_z = active_camera_->GetFarZ();
+    for (uint32_t y = 0; y + block_size <= height; y += block_size) {
+        for (uint32_t x = 0; x + block_size <= width; x += block_size) {
+            float depth = depth_buffer[y * width + x];
+            float linear_depth =
+                near_z * far_z / (far_z - depth * (far_z - near_z));
+            float brightness =
+                1.0f - glm::clamp(linear_depth / far_z, 0.0f, 1.0f);
+            auto shade = static_cast<int>(brightness * 255.0f);
+
+            ImVec2 min(origin.x + x / block_size * cell_size,
+                       origin.y + y / block_size * cell_size);
+            ImVec2 max(min.x + cell_size, min.y + cell_size);
+            draw_list->AddRectFilled(min, max,
+                                     IM_COL32(shade, shade, shade, 255));
+        }
     }
 }
 
-void Application::CreateImGuiCommandBuffers()
-{
-    vk::CommandBufferAllocateInfo command_buffer_info(
-        imgui_command_pool_, vk::CommandBufferLevel::ePrimary,
-        renderer_->GetSwapchain().GetActualImageCount());
-    imgui_command_buffers_ =
-        renderer_->GetDevice().allocateCommandBuffers(command_buffer_info);
-}
-
 void Application::ResizeImGui()
 {
     ImGuiIO& io = ImGui::GetIO();
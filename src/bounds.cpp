@@ -0,0 +1,212 @@
+#include "bounds.h"
+
+#include <algorithm>
+
+Aabb Aabb::FromPoints(const std::vector<glm::vec3>& points)
+{
+    Aabb aabb;
+    if (points.empty()) {
+        return aabb;
+    }
+
+    aabb.min = points[0];
+    aabb.max = points[0];
+    for (const auto& point : points) {
+        aabb.min = glm::min(aabb.min, point);
+        aabb.max = glm::max(aabb.max, point);
+    }
+
+    return aabb;
+}
+
+glm::vec3 Aabb::GetCenter() const { return (min + max) * 0.5f; }
+
+glm::vec3 Aabb::GetExtents() const { return (max - min) * 0.5f; }
+
+float Aabb::GetSurfaceArea() const
+{
+    glm::vec3 size = max - min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+void Aabb::Merge(const Aabb& other)
+{
+    min = glm::min(min, other.min);
+    max = glm::max(max, other.max);
+}
+
+bool Aabb::Contains(const Aabb& other) const
+{
+    return min.x <= other.min.x && min.y <= other.min.y &&
+           min.z <= other.min.z && max.x >= other.max.x &&
+           max.y >= other.max.y && max.z >= other.max.z;
+}
+
+bool Aabb::IntersectsSphere(const glm::vec3& center, float radius) const
+{
+    glm::vec3 closest = glm::clamp(center, min, max);
+    return glm::length2(closest - center) <= radius * radius;
+}
+
+Aabb Aabb::Transform(const glm::mat4& transform) const
+{
+    // Arvo's method, the new extents are the old extents projected onto the
+    // absolute value of each transformed axis
+    glm::vec3 center = glm::vec3(transform * glm::vec4(GetCenter(), 1.0f));
+    glm::vec3 extents = GetExtents();
+    glm::vec3 new_extents = glm::abs(glm::vec3(transform[0])) * extents.x +
+                            glm::abs(glm::vec3(transform[1])) * extents.y +
+                            glm::abs(glm::vec3(transform[2])) * extents.z;
+
+    Aabb aabb;
+    aabb.min = center - new_extents;
+    aabb.max = center + new_extents;
+    return aabb;
+}
+
+BoundingSphere BoundingSphere::FromPoints(const std::vector<glm::vec3>& points)
+{
+    BoundingSphere sphere;
+    if (points.empty()) {
+        return sphere;
+    }
+
+    // Center on the middle of the extents, then grow the radius to fit the
+    // furthest point. Not minimal, but cheap and good enough for culling
+    glm::vec3 min = points[0];
+    glm::vec3 max = points[0];
+    for (const auto& point : points) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+    sphere.center = (min + max) * 0.5f;
+
+    float radius_squared = 0.0f;
+    for (const auto& point : points) {
+        radius_squared =
+            std::max(radius_squared, glm::length2(point - sphere.center));
+    }
+    sphere.radius = glm::sqrt(radius_squared);
+
+    return sphere;
+}
+
+BoundingSphere BoundingSphere::Transform(const glm::mat4& transform) const
+{
+    BoundingSphere sphere;
+    sphere.center = glm::vec3(transform * glm::vec4(center, 1.0f));
+
+    // Non uniform scales stretch the sphere, so use the largest axis
+    float max_scale_squared = std::max(
+        {glm::length2(glm::vec3(transform[0])),
+         glm::length2(glm::vec3(transform[1])),
+         glm::length2(glm::vec3(transform[2]))});
+    sphere.radius = radius * glm::sqrt(max_scale_squared);
+
+    return sphere;
+}
+
+glm::vec3 Ray::GetPoint(float distance) const
+{
+    return origin + direction * distance;
+}
+
+std::optional<float> Ray::Intersect(const Aabb& aabb, float max_distance) const
+{
+    // Slab test
+    float t_min = 0.0f;
+    float t_max = max_distance;
+    for (int axis = 0; axis < 3; ++axis) {
+        // Parallel to the slab. Dividing by zero would give 0 * inf = NaN
+        // for an origin on a face, which no comparison accepts
+        if (direction[axis] == 0.0f) {
+            if (origin[axis] < aabb.min[axis] ||
+                origin[axis] > aabb.max[axis]) {
+                return std::nullopt;
+            }
+            continue;
+        }
+        float inverse_direction = 1.0f / direction[axis];
+        float t0 = (aabb.min[axis] - origin[axis]) * inverse_direction;
+        float t1 = (aabb.max[axis] - origin[axis]) * inverse_direction;
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        t_min = std::max(t_min, t0);
+        t_max = std::min(t_max, t1);
+        if (t_min > t_max) {
+            return std::nullopt;
+        }
+    }
+    return t_min;
+}
+
+Frustum Frustum::FromMatrix(const glm::mat4& viewproj)
+{
+    // Gribb/Hartmann plane extraction, glm matrices are column major so
+    // row i is (m[0][i], m[1][i], m[2][i], m[3][i])
+    auto row = [&viewproj](int i) {
+        return glm::vec4(viewproj[0][i], viewproj[1][i], viewproj[2][i],
+                         viewproj[3][i]);
+    };
+
+    Frustum frustum;
+    frustum.planes[Left] = row(3) + row(0);
+    frustum.planes[Right] = row(3) - row(0);
+    frustum.planes[Bottom] = row(3) + row(1);
+    frustum.planes[Top] = row(3) - row(1);
+    // Depth is 0 to 1 (GLM_FORCE_DEPTH_ZERO_TO_ONE), so near is just z >= 0
+    frustum.planes[Near] = row(2);
+    frustum.planes[Far] = row(3) - row(2);
+
+    for (auto& plane : frustum.planes) {
+        plane /= glm::length(glm::vec3(plane));
+    }
+
+    return frustum;
+}
+
+bool Frustum::IntersectsSphere(const BoundingSphere& sphere) const
+{
+    for (const auto& plane : planes) {
+        if (glm::dot(glm::vec3(plane), sphere.center) + plane.w <
+            -sphere.radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Frustum::IntersectsAabb(const Aabb& aabb) const
+{
+    glm::vec3 center = aabb.GetCenter();
+    glm::vec3 extents = aabb.GetExtents();
+    for (const auto& plane : planes) {
+        glm::vec3 normal = glm::vec3(plane);
+        float distance = glm::dot(normal, center) + plane.w;
+        float radius = glm::dot(glm::abs(normal), extents);
+        if (distance < -radius) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Frustum::Containment Frustum::ClassifyAabb(const Aabb& aabb) const
+{
+    glm::vec3 center = aabb.GetCenter();
+    glm::vec3 extents = aabb.GetExtents();
+    Containment result = Containment::Inside;
+    for (const auto& plane : planes) {
+        glm::vec3 normal = glm::vec3(plane);
+        float distance = glm::dot(normal, center) + plane.w;
+        float radius = glm::dot(glm::abs(normal), extents);
+        if (distance < -radius) {
+            return Containment::Outside;
+        }
+        if (distance < radius) {
+            result = Containment::Intersecting;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,500 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+constexpr size_t SAH_BIN_COUNT = 16;
+
+Bvh::ProxyId Bvh::Insert(const Aabb& bounds, uint32_t user_data)
+{
+    ProxyId leaf = AllocateNode();
+    nodes_[leaf].bounds = bounds;
+    nodes_[leaf].user_data = user_data;
+    InsertLeaf(leaf);
+    ++leaf_count_;
+    return leaf;
+}
+
+void Bvh::Remove(ProxyId proxy)
+{
+    if (!IsValidProxy(proxy)) {
+        throw std::runtime_error("Invalid BVH proxy!");
+    }
+    RemoveLeaf(proxy);
+    FreeNode(proxy);
+    --leaf_count_;
+}
+
+void Bvh::Update(ProxyId proxy, const Aabb& bounds)
+{
+    if (!IsValidProxy(proxy)) {
+        throw std::runtime_error("Invalid BVH proxy!");
+    }
+    nodes_[proxy].bounds = bounds;
+    RefitAncestors(nodes_[proxy].parent);
+}
+
+void Bvh::Rebuild()
+{
+    if (root_ == NULL_NODE) {
+        return;
+    }
+
+    // Collect the leaves and throw away every internal node, leaves keep
+    // their indices so that proxy ids survive the rebuild
+    std::vector<ProxyId> leaves;
+    leaves.reserve(leaf_count_);
+    std::vector<ProxyId> stack = {root_};
+    while (!stack.empty()) {
+        ProxyId node = stack.back();
+        stack.pop_back();
+        if (nodes_[node].IsLeaf()) {
+            leaves.push_back(node);
+        } else {
+            stack.push_back(nodes_[node].left);
+            stack.push_back(nodes_[node].right);
+            FreeNode(node);
+        }
+    }
+
+    root_ = BuildRange(leaves, 0, leaves.size());
+    nodes_[root_].parent = NULL_NODE;
+}
+
+void Bvh::Clear()
+{
+    nodes_.clear();
+    root_ = NULL_NODE;
+    free_list_ = NULL_NODE;
+    leaf_count_ = 0;
+    node_count_ = 0;
+}
+
+uint32_t Bvh::GetUserData(ProxyId proxy) const
+{
+    return nodes_[proxy].user_data;
+}
+
+const Aabb& Bvh::GetBounds(ProxyId proxy) const { return nodes_[proxy].bounds; }
+
+size_t Bvh::GetLeafCount() const { return leaf_count_; }
+
+size_t Bvh::GetNodeCount() const { return node_count_; }
+
+uint32_t Bvh::GetHeight() const { return GetHeight(root_); }
+
+float Bvh::GetSahCost() const
+{
+    if (root_ == NULL_NODE || nodes_[root_].IsLeaf()) {
+        return 0.0f;
+    }
+
+    float root_area = nodes_[root_].bounds.GetSurfaceArea();
+    if (root_area <= 0.0f) {
+        return 0.0f;
+    }
+
+    float area = 0.0f;
+    std::vector<ProxyId> stack = {root_};
+    while (!stack.empty()) {
+        const auto& node = nodes_[stack.back()];
+        stack.pop_back();
+        if (!node.IsLeaf()) {
+            area += node.bounds.GetSurfaceArea();
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+    return area / root_area;
+}
+
+void Bvh::QueryFrustum(const Frustum& frustum,
+                       std::vector<uint32_t>& results) const
+{
+    if (root_ == NULL_NODE) {
+        return;
+    }
+
+    std::vector<ProxyId> stack = {root_};
+    while (!stack.empty()) {
+        ProxyId index = stack.back();
+        stack.pop_back();
+        const auto& node = nodes_[index];
+
+        auto containment = frustum.ClassifyAabb(node.bounds);
+        if (containment == Frustum::Containment::Outside) {
+            continue;
+        }
+        if (containment == Frustum::Containment::Inside || node.IsLeaf()) {
+            // Nothing below a fully contained node needs testing
+            AddSubtree(index, results);
+        } else {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+}
+
+void Bvh::QueryRadius(const glm::vec3& center, float radius,
+                      std::vector<uint32_t>& results) const
+{
+    if (root_ == NULL_NODE) {
+        return;
+    }
+
+    std::vector<ProxyId> stack = {root_};
+    while (!stack.empty()) {
+        const auto& node = nodes_[stack.back()];
+        stack.pop_back();
+        if (!node.bounds.IntersectsSphere(center, radius)) {
+            continue;
+        }
+        if (node.IsLeaf()) {
+            results.push_back(node.user_data);
+        } else {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+}
+
+std::optional<BvhRayHit> Bvh::RayCast(const Ray& ray, float max_distance) const
+{
+    if (root_ == NULL_NODE) {
+        return std::nullopt;
+    }
+
+    std::optional<BvhRayHit> closest_hit;
+    float closest_distance = max_distance;
+    std::vector<ProxyId> stack = {root_};
+    while (!stack.empty()) {
+        const auto& node = nodes_[stack.back()];
+        stack.pop_back();
+
+        // Anything further than the closest hit so far can be skipped
+        auto distance = ray.Intersect(node.bounds, closest_distance);
+        if (!distance.has_value()) {
+            continue;
+        }
+        if (node.IsLeaf()) {
+            closest_distance = *distance;
+            closest_hit = BvhRayHit{node.user_data, *distance};
+        } else {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+    return closest_hit;
+}
+
+bool Bvh::Validate() const
+{
+    if (root_ == NULL_NODE) {
+        return leaf_count_ == 0 && node_count_ == 0;
+    }
+    if (nodes_[root_].parent != NULL_NODE) {
+        return false;
+    }
+
+    size_t leaves = 0;
+    size_t nodes = 0;
+    std::vector<ProxyId> stack = {root_};
+    while (!stack.empty()) {
+        ProxyId index = stack.back();
+        stack.pop_back();
+        const auto& node = nodes_[index];
+        ++nodes;
+        if (node.IsLeaf()) {
+            ++leaves;
+            continue;
+        }
+        for (ProxyId child : {node.left, node.right}) {
+            if (child == NULL_NODE || nodes_[child].parent != index ||
+                !node.bounds.Contains(nodes_[child].bounds)) {
+                return false;
+            }
+            stack.push_back(child);
+        }
+    }
+    return leaves == leaf_count_ && nodes == node_count_;
+}
+
+bool Bvh::IsValidProxy(ProxyId proxy) const
+{
+    return proxy < nodes_.size() && nodes_[proxy].IsLeaf() &&
+           !nodes_[proxy].is_free;
+}
+
+Bvh::ProxyId Bvh::AllocateNode()
+{
+    ++node_count_;
+    if (free_list_ != NULL_NODE) {
+        ProxyId node = free_list_;
+        free_list_ = nodes_[node].next_free;
+        nodes_[node] = Node();
+        return node;
+    }
+    nodes_.emplace_back();
+    return static_cast<ProxyId>(nodes_.size() - 1);
+}
+
+void Bvh::FreeNode(ProxyId node)
+{
+    --node_count_;
+    nodes_[node] = Node();
+    nodes_[node].next_free = free_list_;
+    nodes_[node].is_free = true;
+    free_list_ = node;
+}
+
+void Bvh::InsertLeaf(ProxyId leaf)
+{
+    if (root_ == NULL_NODE) {
+        root_ = leaf;
+        nodes_[leaf].parent = NULL_NODE;
+        return;
+    }
+
+    // Walk down picking the child whose bounds grow the least, stopping when
+    // creating a new parent here is cheaper than descending further
+    Aabb leaf_bounds = nodes_[leaf].bounds;
+    ProxyId index = root_;
+    while (!nodes_[index].IsLeaf()) {
+        const auto& node = nodes_[index];
+        float area = node.bounds.GetSurfaceArea();
+
+        Aabb combined = node.bounds;
+        combined.Merge(leaf_bounds);
+        float combined_area = combined.GetSurfaceArea();
+
+        float cost = 2.0f * combined_area;
+        float inheritance_cost = 2.0f * (combined_area - area);
+
+        auto child_cost = [&](ProxyId child) {
+            Aabb merged = nodes_[child].bounds;
+            merged.Merge(leaf_bounds);
+            float merged_area = merged.GetSurfaceArea();
+            if (nodes_[child].IsLeaf()) {
+                return merged_area + inheritance_cost;
+            }
+            return merged_area - nodes_[child].bounds.GetSurfaceArea() +
+                   inheritance_cost;
+        };
+        float left_cost = child_cost(node.left);
+        float right_cost = child_cost(node.right);
+
+        if (cost < left_cost && cost < right_cost) {
+            break;
+        }
+        index = left_cost < right_cost ? node.left : node.right;
+    }
+
+    ProxyId sibling = index;
+    ProxyId old_parent = nodes_[sibling].parent;
+    ProxyId new_parent = AllocateNode();
+
+    nodes_[new_parent].parent = old_parent;
+    nodes_[new_parent].bounds = nodes_[sibling].bounds;
+    nodes_[new_parent].bounds.Merge(leaf_bounds);
+    nodes_[new_parent].left = sibling;
+    nodes_[new_parent].right = leaf;
+    nodes_[sibling].parent = new_parent;
+    nodes_[leaf].parent = new_parent;
+
+    if (old_parent == NULL_NODE) {
+        root_ = new_parent;
+    } else {
+        if (nodes_[old_parent].left == sibling) {
+            nodes_[old_parent].left = new_parent;
+        } else {
+            nodes_[old_parent].right = new_parent;
+        }
+        RefitAncestors(old_parent);
+    }
+}
+
+void Bvh::RemoveLeaf(ProxyId leaf)
+{
+    if (leaf == root_) {
+        root_ = NULL_NODE;
+        return;
+    }
+
+    ProxyId parent = nodes_[leaf].parent;
+    ProxyId grandparent = nodes_[parent].parent;
+    ProxyId sibling = nodes_[parent].left == leaf ? nodes_[parent].right
+                                                  : nodes_[parent].left;
+
+    // The sibling takes the parent's place
+    nodes_[sibling].parent = grandparent;
+    if (grandparent == NULL_NODE) {
+        root_ = sibling;
+    } else {
+        if (nodes_[grandparent].left == parent) {
+            nodes_[grandparent].left = sibling;
+        } else {
+            nodes_[grandparent].right = sibling;
+        }
+        RefitAncestors(grandparent);
+    }
+    FreeNode(parent);
+}
+
+void Bvh::RefitAncestors(ProxyId node)
+{
+    while (node != NULL_NODE) {
+        auto& current = nodes_[node];
+        current.bounds = nodes_[current.left].bounds;
+        current.bounds.Merge(nodes_[current.right].bounds);
+        node = current.parent;
+    }
+}
+
+Bvh::ProxyId Bvh::BuildRange(std::vector<ProxyId>& leaves, size_t begin,
+                             size_t end)
+{
+    if (end - begin == 1) {
+        return leaves[begin];
+    }
+
+    Aabb centroid_bounds;
+    centroid_bounds.min = centroid_bounds.max =
+        nodes_[leaves[begin]].bounds.GetCenter();
+    for (size_t i = begin; i < end; ++i) {
+        glm::vec3 centroid = nodes_[leaves[i]].bounds.GetCenter();
+        centroid_bounds.min = glm::min(centroid_bounds.min, centroid);
+        centroid_bounds.max = glm::max(centroid_bounds.max, centroid);
+    }
+    glm::vec3 centroid_size = centroid_bounds.max - centroid_bounds.min;
+
+    // Bin the centroids along each axis and evaluate the SAH at every bin
+    // boundary
+    int best_axis = -1;
+    size_t best_split = 0;
+    float best_cost = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroid_size[axis] <= 0.0f) {
+            continue;
+        }
+
+        float bin_scale = SAH_BIN_COUNT / centroid_size[axis];
+        auto get_bin = [&](ProxyId leaf) {
+            float offset = nodes_[leaf].bounds.GetCenter()[axis] -
+                           centroid_bounds.min[axis];
+            return std::min(static_cast<size_t>(offset * bin_scale),
+                            SAH_BIN_COUNT - 1);
+        };
+
+        std::array<Aabb, SAH_BIN_COUNT> bin_bounds;
+        std::array<size_t, SAH_BIN_COUNT> bin_counts = {};
+        for (size_t i = begin; i < end; ++i) {
+            size_t bin = get_bin(leaves[i]);
+            if (bin_counts[bin] == 0) {
+                bin_bounds[bin] = nodes_[leaves[i]].bounds;
+            } else {
+                bin_bounds[bin].Merge(nodes_[leaves[i]].bounds);
+            }
+            ++bin_counts[bin];
+        }
+
+        // Sweep from the right to get the area and count right of each split
+        std::array<float, SAH_BIN_COUNT> right_areas = {};
+        std::array<size_t, SAH_BIN_COUNT> right_counts = {};
+        Aabb right_bounds;
+        size_t right_count = 0;
+        for (size_t bin = SAH_BIN_COUNT - 1; bin > 0; --bin) {
+            if (bin_counts[bin] > 0) {
+                if (right_count == 0) {
+                    right_bounds = bin_bounds[bin];
+                } else {
+                    right_bounds.Merge(bin_bounds[bin]);
+                }
+                right_count += bin_counts[bin];
+            }
+            right_areas[bin] = right_bounds.GetSurfaceArea();
+            right_counts[bin] = right_count;
+        }
+
+        Aabb left_bounds;
+        size_t left_count = 0;
+        for (size_t split = 1; split < SAH_BIN_COUNT; ++split) {
+            size_t bin = split - 1;
+            if (bin_counts[bin] > 0) {
+                if (left_count == 0) {
+                    left_bounds = bin_bounds[bin];
+                } else {
+                    left_bounds.Merge(bin_bounds[bin]);
+                }
+                left_count += bin_counts[bin];
+            }
+            if (left_count == 0 || right_counts[split] == 0) {
+                continue;
+            }
+            float cost = left_count * left_bounds.GetSurfaceArea() +
+                         right_counts[split] * right_areas[split];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = split;
+            }
+        }
+    }
+
+    size_t middle;
+    if (best_axis < 0) {
+        // Every centroid is in the same place, any split is as good as another
+        middle = begin + (end - begin) / 2;
+    } else {
+        float bin_scale = SAH_BIN_COUNT / centroid_size[best_axis];
+        auto split_it = std::partition(
+            leaves.begin() + begin, leaves.begin() + end, [&](ProxyId leaf) {
+                float offset = nodes_[leaf].bounds.GetCenter()[best_axis] -
+                               centroid_bounds.min[best_axis];
+                size_t bin = std::min(static_cast<size_t>(offset * bin_scale),
+                                      SAH_BIN_COUNT - 1);
+                return bin < best_split;
+            });
+        middle = static_cast<size_t>(split_it - leaves.begin());
+    }
+
+    ProxyId left = BuildRange(leaves, begin, middle);
+    ProxyId right = BuildRange(leaves, middle, end);
+
+    // Allocate after recursing, since allocation can move nodes_
+    ProxyId node = AllocateNode();
+    nodes_[node].left = left;
+    nodes_[node].right = right;
+    nodes_[node].bounds = nodes_[left].bounds;
+    nodes_[node].bounds.Merge(nodes_[right].bounds);
+    nodes_[left].parent = node;
+    nodes_[right].parent = node;
+    return node;
+}
+
+void Bvh::AddSubtree(ProxyId node, std::vector<uint32_t>& results) const
+{
+    std::vector<ProxyId> stack = {node};
+    while (!stack.empty()) {
+        const auto& current = nodes_[stack.back()];
+        stack.pop_back();
+        if (current.IsLeaf()) {
+            results.push_back(current.user_data);
+        } else {
+            stack.push_back(current.left);
+            stack.push_back(current.right);
+        }
+    }
+}
+
+uint32_t Bvh::GetHeight(ProxyId node) const
+{
+    if (node == NULL_NODE) {
+        return 0;
+    }
+    if (nodes_[node].IsLeaf()) {
+        return 1;
+    }
+    return 1 + std::max(GetHeight(nodes_[node].left),
+                        GetHeight(nodes_[node].right));
+}
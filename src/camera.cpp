@@ -1,5 +1,7 @@
 #include "camera.h"
 
+#include <cmath>
+
 #include "scene_node.h"
 #include "utils.h"
 
@@ -30,6 +32,14 @@ void Camera::SetFarZ(float far_z) { far_z_ = far_z; }
 
 float Camera::GetFarZ() const { return far_z_; }
 
+float Camera::GetNearPlaneRadius() const
+{
+    float half_height = near_z_ * std::tan(glm::radians(fov_) * 0.5f);
+    float half_width = half_height * aspect_ratio_;
+    return std::sqrt(near_z_ * near_z_ + half_height * half_height +
+                     half_width * half_width);
+}
+
 void Camera::SetNode(NonOwningPointer<SceneNode> node) { owning_node_ = node; }
 
 NonOwningPointer<SceneNode> Camera::GetNode() const { return owning_node_; }
@@ -134,6 +144,22 @@ GpuCameraData Camera::GetCameraData() const
     return camera_data;
 }
 
+Ray Camera::GetRay(glm::vec2 ndc) const
+{
+    auto inverse_viewproj = glm::inverse(GetCameraData().viewproj);
+
+    // Depth is 0 to 1, so unproject a point on each of the near and far planes
+    glm::vec4 near_point = inverse_viewproj * glm::vec4(ndc, 0.0f, 1.0f);
+    glm::vec4 far_point = inverse_viewproj * glm::vec4(ndc, 1.0f, 1.0f);
+    near_point /= near_point.w;
+    far_point /= far_point.w;
+
+    Ray ray;
+    ray.origin = glm::vec3(near_point);
+    ray.direction = glm::normalize(glm::vec3(far_point - near_point));
+    return ray;
+}
+
 void Camera::WrapAngles()
 {
     // pitch
@@ -0,0 +1,43 @@
+#include "deletion_queue.h"
+
+#include <algorithm>
+
+DeletionQueue::~DeletionQueue() { Flush(); }
+
+void DeletionQueue::Push(uint64_t last_use_value, Deleter deleter)
+{
+    entries_.emplace_back(last_use_value, std::move(deleter));
+}
+
+size_t DeletionQueue::Collect(uint64_t completed_value)
+{
+    // Deleters may push more entries, so the completed ones are taken out
+    // before any of them runs
+    auto pending_end = std::stable_partition(
+        entries_.begin(), entries_.end(), [&](const auto& entry) {
+            return entry.first > completed_value;
+        });
+    std::vector<std::pair<uint64_t, Deleter>> completed(
+        std::make_move_iterator(pending_end),
+        std::make_move_iterator(entries_.end()));
+    entries_.erase(pending_end, entries_.end());
+
+    for (auto& entry : completed) {
+        entry.second();
+    }
+    return completed.size();
+}
+
+void DeletionQueue::Flush()
+{
+    // Deleters may push more entries
+    while (!entries_.empty()) {
+        auto entries = std::move(entries_);
+        entries_.clear();
+        for (auto& entry : entries) {
+            entry.second();
+        }
+    }
+}
+
+size_t DeletionQueue::GetPendingCount() const { return entries_.size(); }
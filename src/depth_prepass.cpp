@@ -0,0 +1,144 @@
+#include "depth_prepass.h"
+
+#include <array>
+#include <optional>
+
+#include "mesh.h"
+#include "render_object.h"
+#include "renderer_state.h"
+#include "utils.h"
+#include "vertex.h"
+
+DepthPrepass::DepthPrepass(RendererState& renderer)
+    : device_(renderer.GetDevice())
+{
+    // Same set layouts as the material pipelines, so the camera and object
+    // sets line up and stay bound when switching to them
+    std::array<vk::DescriptorSetLayout, 3> layouts = {
+        renderer.GetCameraDescriptorSetLayout(),
+        renderer.GetMaterialDescriptorSetLayout(),
+        renderer.GetObjectDescriptorSetLayout()};
+    vk::PipelineLayoutCreateInfo pipeline_layout_info(
+        vk::PipelineLayoutCreateFlags(), layouts, {});
+    pipeline_layout_ = device_.createPipelineLayout(pipeline_layout_info);
+
+    RecreatePipeline(renderer);
+}
+
+DepthPrepass::~DepthPrepass()
+{
+    device_.destroyPipeline(pipeline_);
+    device_.destroyPipelineLayout(pipeline_layout_);
+}
+
+void DepthPrepass::RecreatePipeline(RendererState& renderer)
+{
+    if (pipeline_) {
+        renderer.DeferDestruction([device = device_, pipeline = pipeline_]() {
+            device.destroyPipeline(pipeline);
+        });
+    }
+
+    auto vert_shader_bin = CompileShader("shaders/depth_prepass.vert",
+                                         shaderc_glsl_vertex_shader);
+    auto vert_shader_module = device_.createShaderModule(
+        vk::ShaderModuleCreateInfo({}, vert_shader_bin));
+
+    // Only depth is written, so there is no fragment shader
+    vk::PipelineShaderStageCreateInfo vert_shader_stage_info(
+        vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eVertex,
+        vert_shader_module, "main");
+
+    auto binding_description = Vertex::GetPositionBindingDescription();
+    auto attribute_description = Vertex::GetPositionAttributeDescription();
+    vk::PipelineVertexInputStateCreateInfo vertex_input_info(
+        vk::PipelineVertexInputStateCreateFlags(), binding_description,
+        attribute_description);
+
+    vk::PipelineInputAssemblyStateCreateInfo input_assembly(
+        vk::PipelineInputAssemblyStateCreateFlags(),
+        vk::PrimitiveTopology::eTriangleList, VK_FALSE);
+
+    auto target = renderer.GetSceneTarget();
+    // Set with the scene pass, like for the material pipelines
+    vk::PipelineViewportStateCreateInfo viewport_state(
+        vk::PipelineViewportStateCreateFlags(), 1, nullptr, 1, nullptr);
+    std::array<vk::DynamicState, 2> dynamic_states = {
+        vk::DynamicState::eViewport, vk::DynamicState::eScissor};
+    vk::PipelineDynamicStateCreateInfo dynamic_state(
+        vk::PipelineDynamicStateCreateFlags(), dynamic_states);
+
+    // Rasterization has to match the material pipelines exactly
+    vk::PipelineRasterizationStateCreateInfo rasterizer(
+        vk::PipelineRasterizationStateCreateFlags(), VK_FALSE, VK_FALSE,
+        vk::PolygonMode::eFill, vk::CullModeFlagBits::eBack,
+        vk::FrontFace::eCounterClockwise, VK_FALSE, 0.0f, 0.0f, 0.0f, 1.0f);
+
+    vk::PipelineMultisampleStateCreateInfo multisampling(
+        vk::PipelineMultisampleStateCreateFlags(), target.sample_count);
+
+    vk::PipelineDepthStencilStateCreateInfo depth_stencil(
+        vk::PipelineDepthStencilStateCreateFlags(), VK_TRUE, VK_TRUE,
+        vk::CompareOp::eLess, VK_FALSE, VK_FALSE, {}, {});
+
+    vk::PipelineColorBlendAttachmentState color_blend_attachment;
+    color_blend_attachment.colorWriteMask = vk::ColorComponentFlags();
+    vk::PipelineColorBlendStateCreateInfo color_blending(
+        vk::PipelineColorBlendStateCreateFlags(), VK_FALSE, vk::LogicOp::eCopy,
+        color_blend_attachment, {0.0f, 0.0f, 0.0f, 0.0f});
+
+    vk::GraphicsPipelineCreateInfo pipeline_info(
+        vk::PipelineCreateFlags(), vert_shader_stage_info, &vertex_input_info,
+        &input_assembly, {}, &viewport_state, &rasterizer, &multisampling,
+        &depth_stencil, &color_blending, &dynamic_state, pipeline_layout_,
+        target.render_pass, 0, {}, -1);
+    auto rendering_info = target.GetRenderingCreateInfo();
+    if (target.UsesDynamicRendering()) {
+        pipeline_info.pNext = &rendering_info;
+    }
+
+    auto result = device_.createGraphicsPipeline({}, pipeline_info);
+    device_.destroyShaderModule(vert_shader_module);
+    if (result.result != vk::Result::eSuccess) {
+        throw std::runtime_error(
+            "Could not create the depth pre-pass pipeline!");
+    }
+    pipeline_ = result.value;
+}
+
+void DepthPrepass::RecordDraws(vk::CommandBuffer& command_buffer,
+                               vk::DescriptorSet camera_descriptor,
+                               const std::vector<DrawItem>& draw_items,
+                               size_t first, size_t last,
+                               std::vector<RenderObject>& render_objects)
+{
+    if (first == last) {
+        return;
+    }
+
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline_);
+    command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                      pipeline_layout_, 0, camera_descriptor,
+                                      {});
+
+    NonOwningPointer<const Mesh> last_mesh = nullptr;
+    std::optional<uint32_t> last_object;
+    for (size_t i = first; i < last; ++i) {
+        auto& item = draw_items[i];
+        if (last_object != item.object_index) {
+            command_buffer.bindDescriptorSets(
+                vk::PipelineBindPoint::eGraphics, pipeline_layout_, 2,
+                render_objects[item.object_index].GetDescriptorSet(), {});
+            last_object = item.object_index;
+        }
+        if (last_mesh != item.mesh) {
+            command_buffer.bindVertexBuffers(0, item.mesh->GetPositionBuffer(),
+                                             {0});
+            command_buffer.bindIndexBuffer(item.mesh->GetIndexBuffer(), 0,
+                                           vk::IndexType::eUint32);
+            last_mesh = item.mesh;
+        }
+        command_buffer.drawIndexed(item.index_count, 1, item.first_index, 0,
+                                   0);
+    }
+}
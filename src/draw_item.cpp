@@ -0,0 +1,94 @@
+#include "draw_item.h"
+
+#include <algorithm>
+#include <tuple>
+
+#include "material.h"
+#include "mesh.h"
+#include "model.h"
+#include "render_object.h"
+
+static float DistanceToCamera(const RenderObject& render_object,
+                              const glm::vec3& camera_position)
+{
+    auto offset =
+        render_object.GetWorldBoundingSphere().center - camera_position;
+    return glm::dot(offset, offset);
+}
+
+// Farthest first, ties broken so the order is stable from frame to frame
+static bool BackToFront(const DrawItem& a, const DrawItem& b)
+{
+    return std::tie(b.distance, a.object_index, a.first_index) <
+           std::tie(a.distance, b.object_index, b.first_index);
+}
+
+void BuildDrawItems(const std::vector<uint32_t>& object_indices,
+                    std::vector<RenderObject>& render_objects,
+                    MaterialCache& material_cache,
+                    const glm::vec3& camera_position,
+                    std::vector<DrawItem>& draw_items)
+{
+    draw_items.clear();
+    for (auto object_index : object_indices) {
+        auto& render_object = render_objects[object_index];
+        auto model = render_object.GetModel();
+        if (!model) {
+            continue;
+        }
+        float distance = DistanceToCamera(render_object, camera_position);
+        for (auto& mesh : model->GetMeshes()) {
+            for (auto& range : mesh.GetRanges()) {
+                auto material = material_cache.GetMaterial(range.material);
+                if (material == nullptr) {
+                    continue;
+                }
+                draw_items.push_back({range.material, &mesh, object_index,
+                                      range.first_index, range.index_count,
+                                      material->IsTransparent(), distance});
+            }
+        }
+    }
+}
+
+size_t SortDrawItems(std::vector<DrawItem>& draw_items)
+{
+    std::sort(draw_items.begin(), draw_items.end(),
+              [](const DrawItem& a, const DrawItem& b) {
+                  if (a.transparent != b.transparent) {
+                      return b.transparent;
+                  }
+                  if (a.transparent) {
+                      return BackToFront(a, b);
+                  }
+                  return std::tie(a.material, a.distance, a.mesh,
+                                  a.object_index, a.first_index) <
+                         std::tie(b.material, b.distance, b.mesh,
+                                  b.object_index, b.first_index);
+              });
+    auto first_transparent =
+        std::find_if(draw_items.begin(), draw_items.end(),
+                     [](const DrawItem& item) { return item.transparent; });
+    return first_transparent - draw_items.begin();
+}
+
+size_t PartitionDrawItems(std::vector<DrawItem>& draw_items)
+{
+    auto first_transparent = std::stable_partition(
+        draw_items.begin(), draw_items.end(),
+        [](const DrawItem& item) { return !item.transparent; });
+    return first_transparent - draw_items.begin();
+}
+
+void SortTransparentDrawItems(std::vector<DrawItem>& draw_items,
+                              size_t first_transparent,
+                              std::vector<RenderObject>& render_objects,
+                              const glm::vec3& camera_position)
+{
+    auto first = draw_items.begin() + first_transparent;
+    for (auto it = first; it != draw_items.end(); ++it) {
+        it->distance =
+            DistanceToCamera(render_objects[it->object_index], camera_position);
+    }
+    std::sort(first, draw_items.end(), BackToFront);
+}
@@ -0,0 +1,95 @@
+#include "frame_pacer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+// Sleeping closer to the deadline than this risks waking up too late
+constexpr auto SPIN_MARGIN = std::chrono::microseconds(1500);
+
+void FramePacer::SetTargetFrameRate(double frames_per_second)
+{
+    target_frame_rate_ = 0.0;
+    frame_period_ = Clock::duration::zero();
+    // Also rejects NaN, which compares false against everything
+    if (std::isfinite(frames_per_second) && frames_per_second > 0.0) {
+        // Periods too long for the clock, or too short to tell apart from
+        // zero, leave the frame rate uncapped
+        std::chrono::duration<double> period(1.0 / frames_per_second);
+        std::chrono::duration<double> longest_period(Clock::duration::max());
+        if (period < longest_period) {
+            auto clock_period =
+                std::chrono::duration_cast<Clock::duration>(period);
+            if (clock_period > Clock::duration::zero()) {
+                target_frame_rate_ = frames_per_second;
+                frame_period_ = clock_period;
+            }
+        }
+    }
+    // The old deadlines and errors no longer apply
+    has_deadline_ = false;
+    errors_.clear();
+    next_error_ = 0;
+}
+
+double FramePacer::GetTargetFrameRate() const { return target_frame_rate_; }
+
+void FramePacer::WaitForNextFrame()
+{
+    if (frame_period_ == Clock::duration::zero()) {
+        return;
+    }
+
+    auto now = Clock::now();
+    if (!has_deadline_) {
+        deadline_ = now;
+        has_deadline_ = true;
+    }
+
+    if (now < deadline_) {
+        if (deadline_ - now > SPIN_MARGIN) {
+            std::this_thread::sleep_until(deadline_ - SPIN_MARGIN);
+        }
+        while ((now = Clock::now()) < deadline_) {
+            std::this_thread::yield();
+        }
+    }
+
+    RecordError(
+        std::chrono::duration<double, std::milli>(now - deadline_).count());
+
+    deadline_ += frame_period_;
+    // After a stall, start over from now rather than rushing through the
+    // missed deadlines
+    if (deadline_ + frame_period_ < now) {
+        deadline_ = now + frame_period_;
+    }
+}
+
+double FramePacer::GetErrorPercentile(double percentile) const
+{
+    return GetPercentile(errors_, percentile);
+}
+
+void FramePacer::RecordError(double error_ms)
+{
+    if (errors_.size() < ERROR_HISTORY_SIZE) {
+        errors_.push_back(error_ms);
+    } else {
+        errors_[next_error_] = error_ms;
+    }
+    next_error_ = (next_error_ + 1) % ERROR_HISTORY_SIZE;
+}
+
+double GetPercentile(std::vector<double> values, double percentile)
+{
+    if (values.empty()) {
+        return 0.0;
+    }
+    percentile = std::clamp(percentile, 0.0, 100.0);
+    auto rank = static_cast<size_t>(
+        std::ceil(percentile / 100.0 * (double)values.size()));
+    auto index = rank == 0 ? 0 : rank - 1;
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
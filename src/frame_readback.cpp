@@ -0,0 +1,140 @@
+#include "frame_readback.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+
+#include "renderer_state.h"
+#include "swapchain.h"
+
+constexpr vk::DeviceSize TEXEL_SIZE = 4;
+
+void WritePpm(std::ostream& out, const ReadbackFrame& frame)
+{
+    bool bgra = false;
+    switch (frame.format) {
+        case vk::Format::eR8G8B8A8Srgb:
+        case vk::Format::eR8G8B8A8Unorm:
+            break;
+        case vk::Format::eB8G8R8A8Srgb:
+        case vk::Format::eB8G8R8A8Unorm:
+            bgra = true;
+            break;
+        default:
+            throw std::runtime_error("Unsupported format for a PPM image!");
+    }
+
+    out << "P6\n" << frame.extent.width << ' ' << frame.extent.height
+        << "\n255\n";
+    std::vector<char> row(frame.extent.width * 3);
+    for (uint32_t y = 0; y < frame.extent.height; ++y) {
+        for (uint32_t x = 0; x < frame.extent.width; ++x) {
+            auto texel = frame.pixels +
+                         (static_cast<size_t>(y) * frame.extent.width + x) *
+                             TEXEL_SIZE;
+            row[3 * x] = static_cast<char>(texel[bgra ? 2 : 0]);
+            row[3 * x + 1] = static_cast<char>(texel[1]);
+            row[3 * x + 2] = static_cast<char>(texel[bgra ? 0 : 2]);
+        }
+        out.write(row.data(), static_cast<std::streamsize>(row.size()));
+    }
+}
+
+FrameSink MakePpmFrameSink(const std::string& directory)
+{
+    return [directory](const ReadbackFrame& frame) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "frame_%05llu.ppm",
+                      static_cast<unsigned long long>(frame.frame_number));
+        auto path = directory + "/" + name;
+        std::ofstream file(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("failed to open " + path);
+        }
+        WritePpm(file, frame);
+    };
+}
+
+FrameReadback::FrameReadback(RendererState& renderer, FrameSink sink)
+    : device_(renderer.GetDevice()), sink_(std::move(sink))
+{
+    auto& swapchain = renderer.GetSwapchain();
+    images_ = swapchain.GetImages();
+    extent_ = swapchain.GetExtent();
+    format_ = swapchain.GetImageFormat().format;
+
+    auto size = extent_.width * extent_.height * TEXEL_SIZE;
+    buffers_.reserve(images_.size());
+    for (size_t i = 0; i < images_.size(); ++i) {
+        buffers_.emplace_back(renderer, size,
+                              vk::BufferUsageFlagBits::eTransferDst,
+                              vk::MemoryPropertyFlagBits::eHostVisible |
+                                  vk::MemoryPropertyFlagBits::eHostCoherent);
+    }
+    pending_frames_.resize(images_.size());
+}
+
+void FrameReadback::RecordCopy(vk::CommandBuffer& command_buffer,
+                               uint32_t image_index)
+{
+    // Tightly packed rows
+    vk::ImageSubresourceLayers layers(vk::ImageAspectFlagBits::eColor, 0, 0,
+                                      1);
+    vk::BufferImageCopy region(0, 0, 0, layers, {0, 0, 0},
+                               {extent_.width, extent_.height, 1});
+    auto buffer = buffers_[image_index].GetBuffer();
+    command_buffer.copyImageToBuffer(images_[image_index],
+                                     vk::ImageLayout::eTransferSrcOptimal,
+                                     buffer, region);
+
+    // Waiting for the frame on the CPU does not make the copy visible to it
+    vk::BufferMemoryBarrier host_barrier(
+        vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, buffer, 0,
+        VK_WHOLE_SIZE);
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                   vk::PipelineStageFlagBits::eHost,
+                                   vk::DependencyFlags(), {}, host_barrier,
+                                   {});
+
+    pending_frames_[image_index] = next_frame_number_++;
+}
+
+void FrameReadback::Deliver(uint32_t image_index)
+{
+    auto& frame_number = pending_frames_[image_index];
+    if (!frame_number.has_value()) {
+        return;
+    }
+
+    auto memory = buffers_[image_index].GetMemory();
+    auto data = device_.mapMemory(memory, 0, VK_WHOLE_SIZE);
+    ReadbackFrame frame;
+    frame.frame_number = *frame_number;
+    frame.extent = extent_;
+    frame.format = format_;
+    frame.pixels = static_cast<const uint8_t*>(data);
+    // A sink that throws leaves the frame pending, to be delivered again
+    try {
+        sink_(frame);
+    } catch (...) {
+        device_.unmapMemory(memory);
+        throw;
+    }
+    device_.unmapMemory(memory);
+    frame_number.reset();
+}
+
+void FrameReadback::Flush()
+{
+    std::vector<uint32_t> indices(pending_frames_.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    // Frames without a copy sort first and are skipped
+    std::sort(indices.begin(), indices.end(), [this](uint32_t a, uint32_t b) {
+        return pending_frames_[a] < pending_frames_[b];
+    });
+    for (auto index : indices) {
+        Deliver(index);
+    }
+}
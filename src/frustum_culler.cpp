@@ -0,0 +1,287 @@
+#include "frustum_culler.h"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FRUSTUM_CULLER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only allow AVX intrinsics in functions compiled for AVX, MSVC
+// allows them anywhere
+#if defined(FRUSTUM_CULLER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FRUSTUM_CULLER_TARGET_AVX __attribute__((target("avx")))
+#else
+#define FRUSTUM_CULLER_TARGET_AVX
+#endif
+
+constexpr size_t BOUNDS_PADDING = 8;
+
+static bool CpuSupportsAvx()
+{
+#if !defined(FRUSTUM_CULLER_X86)
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) != 0;
+    bool has_avx = (info[2] & (1 << 28)) != 0;
+    return os_saves_ymm && has_avx && (_xgetbv(0) & 0x6) == 0x6;
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+
+const char* CullingBackendName(CullingBackend backend)
+{
+    switch (backend) {
+        case CullingBackend::Scalar:
+            return "Scalar";
+        case CullingBackend::Sse:
+            return "SSE";
+        case CullingBackend::Avx:
+            return "AVX";
+    }
+    return "Unknown";
+}
+
+FrustumCuller::FrustumCuller() : backend_(GetBestBackend()) {}
+
+FrustumCuller::FrustumCuller(CullingBackend backend)
+    : backend_(CullingBackend::Scalar)
+{
+    SetBackend(backend);
+}
+
+bool FrustumCuller::IsBackendSupported(CullingBackend backend)
+{
+    switch (backend) {
+        case CullingBackend::Scalar:
+            return true;
+        case CullingBackend::Sse:
+#ifdef FRUSTUM_CULLER_X86
+            // Every x86-64 CPU has SSE2
+            return true;
+#else
+            return false;
+#endif
+        case CullingBackend::Avx:
+            return CpuSupportsAvx();
+    }
+    return false;
+}
+
+CullingBackend FrustumCuller::GetBestBackend()
+{
+    if (IsBackendSupported(CullingBackend::Avx)) {
+        return CullingBackend::Avx;
+    }
+    if (IsBackendSupported(CullingBackend::Sse)) {
+        return CullingBackend::Sse;
+    }
+    return CullingBackend::Scalar;
+}
+
+CullingBackend FrustumCuller::GetBackend() const { return backend_; }
+
+void FrustumCuller::SetBackend(CullingBackend backend)
+{
+    backend_ =
+        IsBackendSupported(backend) ? backend : CullingBackend::Scalar;
+}
+
+void FrustumCuller::Resize(size_t count)
+{
+    count_ = count;
+    size_t padded_count =
+        (count + BOUNDS_PADDING - 1) / BOUNDS_PADDING * BOUNDS_PADDING;
+    center_x_.resize(padded_count, 0.0f);
+    center_y_.resize(padded_count, 0.0f);
+    center_z_.resize(padded_count, 0.0f);
+    extent_x_.resize(padded_count, 0.0f);
+    extent_y_.resize(padded_count, 0.0f);
+    extent_z_.resize(padded_count, 0.0f);
+}
+
+size_t FrustumCuller::GetSize() const { return count_; }
+
+void FrustumCuller::SetBounds(size_t index, const Aabb& bounds)
+{
+    glm::vec3 center = bounds.GetCenter();
+    glm::vec3 extents = bounds.GetExtents();
+    center_x_[index] = center.x;
+    center_y_[index] = center.y;
+    center_z_[index] = center.z;
+    extent_x_[index] = extents.x;
+    extent_y_[index] = extents.y;
+    extent_z_[index] = extents.z;
+}
+
+void FrustumCuller::Cull(const Frustum& frustum,
+                         std::vector<uint32_t>& visible) const
+{
+    visible.clear();
+    switch (backend_) {
+        case CullingBackend::Scalar:
+            CullScalar(frustum, visible);
+            break;
+        case CullingBackend::Sse:
+            CullSse(frustum, visible);
+            break;
+        case CullingBackend::Avx:
+            CullAvx(frustum, visible);
+            break;
+    }
+}
+
+void FrustumCuller::CullScalar(const Frustum& frustum,
+                               std::vector<uint32_t>& visible) const
+{
+    for (size_t i = 0; i < count_; ++i) {
+        bool inside = true;
+        for (const auto& plane : frustum.planes) {
+            // Summed in the same order as the SIMD paths, so that bounds
+            // touching a plane are classified the same by every backend
+            float distance =
+                (plane.x * center_x_[i] + plane.y * center_y_[i]) +
+                (plane.z * center_z_[i] + plane.w);
+            float radius = (std::abs(plane.x) * extent_x_[i] +
+                            std::abs(plane.y) * extent_y_[i]) +
+                           std::abs(plane.z) * extent_z_[i];
+            if (distance + radius < 0.0f) {
+                inside = false;
+                break;
+            }
+        }
+        if (inside) {
+            visible.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+#ifdef FRUSTUM_CULLER_X86
+
+void FrustumCuller::CullSse(const Frustum& frustum,
+                            std::vector<uint32_t>& visible) const
+{
+    // Broadcast every plane component once up front
+    __m128 normal_x[Frustum::Plane::Count];
+    __m128 normal_y[Frustum::Plane::Count];
+    __m128 normal_z[Frustum::Plane::Count];
+    __m128 abs_normal_x[Frustum::Plane::Count];
+    __m128 abs_normal_y[Frustum::Plane::Count];
+    __m128 abs_normal_z[Frustum::Plane::Count];
+    __m128 distance[Frustum::Plane::Count];
+    for (size_t p = 0; p < Frustum::Plane::Count; ++p) {
+        const auto& plane = frustum.planes[p];
+        normal_x[p] = _mm_set1_ps(plane.x);
+        normal_y[p] = _mm_set1_ps(plane.y);
+        normal_z[p] = _mm_set1_ps(plane.z);
+        abs_normal_x[p] = _mm_set1_ps(std::abs(plane.x));
+        abs_normal_y[p] = _mm_set1_ps(std::abs(plane.y));
+        abs_normal_z[p] = _mm_set1_ps(std::abs(plane.z));
+        distance[p] = _mm_set1_ps(plane.w);
+    }
+
+    const __m128 zero = _mm_setzero_ps();
+    for (size_t i = 0; i < count_; i += 4) {
+        __m128 cx = _mm_loadu_ps(&center_x_[i]);
+        __m128 cy = _mm_loadu_ps(&center_y_[i]);
+        __m128 cz = _mm_loadu_ps(&center_z_[i]);
+        __m128 ex = _mm_loadu_ps(&extent_x_[i]);
+        __m128 ey = _mm_loadu_ps(&extent_y_[i]);
+        __m128 ez = _mm_loadu_ps(&extent_z_[i]);
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (size_t p = 0; p < Frustum::Plane::Count; ++p) {
+            __m128 d = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(normal_x[p], cx),
+                           _mm_mul_ps(normal_y[p], cy)),
+                _mm_add_ps(_mm_mul_ps(normal_z[p], cz), distance[p]));
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(abs_normal_x[p], ex),
+                                             _mm_mul_ps(abs_normal_y[p], ey)),
+                                  _mm_mul_ps(abs_normal_z[p], ez));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), zero));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (size_t lane = 0; lane < 4 && i + lane < count_; ++lane) {
+            if (mask & (1 << lane)) {
+                visible.push_back(static_cast<uint32_t>(i + lane));
+            }
+        }
+    }
+}
+
+FRUSTUM_CULLER_TARGET_AVX void FrustumCuller::CullAvx(
+    const Frustum& frustum, std::vector<uint32_t>& visible) const
+{
+    __m256 normal_x[Frustum::Plane::Count];
+    __m256 normal_y[Frustum::Plane::Count];
+    __m256 normal_z[Frustum::Plane::Count];
+    __m256 abs_normal_x[Frustum::Plane::Count];
+    __m256 abs_normal_y[Frustum::Plane::Count];
+    __m256 abs_normal_z[Frustum::Plane::Count];
+    __m256 distance[Frustum::Plane::Count];
+    for (size_t p = 0; p < Frustum::Plane::Count; ++p) {
+        const auto& plane = frustum.planes[p];
+        normal_x[p] = _mm256_set1_ps(plane.x);
+        normal_y[p] = _mm256_set1_ps(plane.y);
+        normal_z[p] = _mm256_set1_ps(plane.z);
+        abs_normal_x[p] = _mm256_set1_ps(std::abs(plane.x));
+        abs_normal_y[p] = _mm256_set1_ps(std::abs(plane.y));
+        abs_normal_z[p] = _mm256_set1_ps(std::abs(plane.z));
+        distance[p] = _mm256_set1_ps(plane.w);
+    }
+
+    const __m256 zero = _mm256_setzero_ps();
+    for (size_t i = 0; i < count_; i += 8) {
+        __m256 cx = _mm256_loadu_ps(&center_x_[i]);
+        __m256 cy = _mm256_loadu_ps(&center_y_[i]);
+        __m256 cz = _mm256_loadu_ps(&center_z_[i]);
+        __m256 ex = _mm256_loadu_ps(&extent_x_[i]);
+        __m256 ey = _mm256_loadu_ps(&extent_y_[i]);
+        __m256 ez = _mm256_loadu_ps(&extent_z_[i]);
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (size_t p = 0; p < Frustum::Plane::Count; ++p) {
+            __m256 d = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(normal_x[p], cx),
+                              _mm256_mul_ps(normal_y[p], cy)),
+                _mm256_add_ps(_mm256_mul_ps(normal_z[p], cz), distance[p]));
+            __m256 r =
+                _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(abs_normal_x[p], ex),
+                                            _mm256_mul_ps(abs_normal_y[p], ey)),
+                              _mm256_mul_ps(abs_normal_z[p], ez));
+            inside = _mm256_and_ps(
+                inside, _mm256_cmp_ps(_mm256_add_ps(d, r), zero, _CMP_GE_OQ));
+        }
+
+        int mask = _mm256_movemask_ps(inside);
+        for (size_t lane = 0; lane < 8 && i + lane < count_; ++lane) {
+            if (mask & (1 << lane)) {
+                visible.push_back(static_cast<uint32_t>(i + lane));
+            }
+        }
+    }
+}
+
+#else
+
+// Not reachable, SetBackend only accepts the scalar path on other CPUs
+void FrustumCuller::CullSse(const Frustum& frustum,
+                            std::vector<uint32_t>& visible) const
+{
+    CullScalar(frustum, visible);
+}
+
+void FrustumCuller::CullAvx(const Frustum& frustum,
+                            std::vector<uint32_t>& visible) const
+{
+    CullScalar(frustum, visible);
+}
+
+#endif
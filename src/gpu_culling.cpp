@@ -0,0 +1,485 @@
+#include "gpu_culling.h"
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <tuple>
+
+#include "hiz_pyramid.h"
+#include "material.h"
+#include "material_cache.h"
+#include "mesh.h"
+#include "model.h"
+#include "render_object.h"
+#include "renderer_state.h"
+
+constexpr uint32_t CULL_WORKGROUP_SIZE = 64;
+// Objects, batches, instances, commands and counts
+constexpr uint32_t CULL_STORAGE_BINDING_COUNT = 5;
+constexpr uint32_t CULL_PARAMETER_BINDING = 5;
+constexpr uint32_t CULL_VISIBILITY_BINDING = 6;
+constexpr uint32_t CULL_HIZ_BINDING = 7;
+// Marks mesh ranges whose material is missing, they are never drawn
+constexpr uint32_t NO_BATCH = std::numeric_limits<uint32_t>::max();
+
+struct GpuCullPhaseConstants
+{
+    uint32_t phase;
+    uint32_t command_base;
+    uint32_t count_base;
+};
+
+GpuCuller::GpuCuller(RendererState& renderer, size_t frame_count,
+                     bool hiz_occlusion)
+    : device_(renderer.GetDevice()),
+      hiz_occlusion_(hiz_occlusion),
+      frames_(frame_count)
+{
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    for (uint32_t i = 0; i < CULL_STORAGE_BINDING_COUNT; ++i) {
+        bindings.push_back(vk::DescriptorSetLayoutBinding(
+            i, vk::DescriptorType::eStorageBuffer, 1,
+            vk::ShaderStageFlagBits::eCompute));
+    }
+    bindings.push_back(vk::DescriptorSetLayoutBinding(
+        CULL_PARAMETER_BINDING, vk::DescriptorType::eUniformBuffer, 1,
+        vk::ShaderStageFlagBits::eCompute));
+    bindings.push_back(vk::DescriptorSetLayoutBinding(
+        CULL_VISIBILITY_BINDING, vk::DescriptorType::eStorageBuffer, 1,
+        vk::ShaderStageFlagBits::eCompute));
+    bindings.push_back(vk::DescriptorSetLayoutBinding(
+        CULL_HIZ_BINDING, vk::DescriptorType::eCombinedImageSampler, 1,
+        vk::ShaderStageFlagBits::eCompute));
+    vk::DescriptorSetLayoutCreateInfo layout_info(
+        vk::DescriptorSetLayoutCreateFlags(), bindings);
+    cull_descriptor_set_layout_ =
+        device_.createDescriptorSetLayout(layout_info);
+
+    vk::PushConstantRange push_constant_range(
+        vk::ShaderStageFlagBits::eCompute, 0, sizeof(GpuCullPhaseConstants));
+
+    std::tie(cull_pipeline_layout_, cull_pipeline_) =
+        renderer.CreateComputePipeline(
+            "shaders/cull.comp", {cull_descriptor_set_layout_},
+            {push_constant_range},
+            {{"HIZ_OCCLUSION", hiz_occlusion_ ? "1" : "0"}});
+
+    for (auto& frame : frames_) {
+        frame.parameter_buffer.emplace(
+            renderer, sizeof(GpuCullParameters),
+            vk::BufferUsageFlagBits::eUniformBuffer,
+            vk::MemoryPropertyFlagBits::eHostVisible |
+                vk::MemoryPropertyFlagBits::eHostCoherent);
+    }
+
+    CreateDescriptorSets(renderer);
+}
+
+GpuCuller::~GpuCuller()
+{
+    frames_.clear();
+    batch_buffer_.reset();
+    instance_buffer_.reset();
+    visibility_buffer_.reset();
+
+    device_.destroyPipeline(cull_pipeline_);
+    device_.destroyPipelineLayout(cull_pipeline_layout_);
+    device_.destroyDescriptorPool(descriptor_pool_);
+    device_.destroyDescriptorSetLayout(cull_descriptor_set_layout_);
+}
+
+void GpuCuller::Build(RendererState& renderer,
+                      std::vector<RenderObject>& render_objects)
+{
+    batches_.clear();
+
+    // One batch per mesh range, every object using that mesh becomes an
+    // instance of each of its ranges. The map is ordered by transparency and
+    // then material, so the batches come out grouped by material with the
+    // transparent ones drawn last. Their instances can't be sorted back to
+    // front, the GPU appends them in whatever order they pass culling
+    using BatchKey = std::tuple<bool, MaterialHandle,
+                                NonOwningPointer<const Mesh>, uint32_t>;
+    auto make_key = [&](const Mesh& mesh, uint32_t range) {
+        auto handle = mesh.GetRanges()[range].material;
+        auto material = renderer.GetMaterialCache().GetMaterial(handle);
+        bool transparent = material != nullptr && material->IsTransparent();
+        return BatchKey{transparent, handle, &mesh, range};
+    };
+    std::map<BatchKey, uint32_t> batch_map;
+    for (auto& object : render_objects) {
+        auto model = object.GetModel();
+        if (!model) {
+            continue;
+        }
+        for (auto& mesh : model->GetMeshes()) {
+            auto& ranges = mesh.GetRanges();
+            for (uint32_t range = 0; range < ranges.size(); ++range) {
+                batch_map.emplace(make_key(mesh, range), 0);
+            }
+        }
+    }
+    for (auto& [key, batch_index] : batch_map) {
+        auto [transparent, material_handle, mesh, range] = key;
+        auto material =
+            renderer.GetMaterialCache().GetMaterial(material_handle);
+        if (material == nullptr) {
+            batch_index = NO_BATCH;
+            continue;
+        }
+        batch_index = (uint32_t)batches_.size();
+        const auto& mesh_range = mesh->GetRanges()[range];
+        batches_.push_back({mesh, material, mesh_range.first_index,
+                            mesh_range.index_count, 0, 0});
+    }
+
+    std::vector<GpuCullInstance> instances;
+    for (uint32_t object_index = 0; object_index < render_objects.size();
+         ++object_index) {
+        auto model = render_objects[object_index].GetModel();
+        if (!model) {
+            continue;
+        }
+        for (auto& mesh : model->GetMeshes()) {
+            auto& ranges = mesh.GetRanges();
+            for (uint32_t range = 0; range < ranges.size(); ++range) {
+                auto batch_index = batch_map.at(make_key(mesh, range));
+                if (batch_index == NO_BATCH) {
+                    continue;
+                }
+                instances.push_back({object_index, batch_index});
+                ++batches_[batch_index].max_draw_count;
+            }
+        }
+    }
+
+    // Every batch gets a region big enough for all of its instances
+    std::vector<GpuCullBatch> gpu_batches;
+    gpu_batches.reserve(batches_.size());
+    uint32_t command_count = 0;
+    for (auto& batch : batches_) {
+        batch.command_offset = command_count;
+        command_count += batch.max_draw_count;
+
+        const auto& sphere = batch.mesh->GetBoundingSphere();
+        GpuCullBatch gpu_batch;
+        gpu_batch.bounding_sphere = glm::vec4(sphere.center, sphere.radius);
+        gpu_batch.index_count = batch.index_count;
+        gpu_batch.first_index = batch.first_index;
+        gpu_batch.vertex_offset = 0;
+        gpu_batch.command_offset = batch.command_offset;
+        gpu_batches.push_back(gpu_batch);
+    }
+
+    instance_count_ = (uint32_t)instances.size();
+    object_count_ = (uint32_t)render_objects.size();
+    command_count_ = command_count;
+    if (instance_count_ == 0) {
+        return;
+    }
+
+    batch_buffer_.emplace(renderer.GetDevice());
+    batch_buffer_->SetData(renderer, gpu_batches,
+                           vk::BufferUsageFlagBits::eTransferDst |
+                               vk::BufferUsageFlagBits::eStorageBuffer,
+                           vk::MemoryPropertyFlagBits::eDeviceLocal);
+    instance_buffer_.emplace(renderer.GetDevice());
+    instance_buffer_->SetData(renderer, instances,
+                              vk::BufferUsageFlagBits::eTransferDst |
+                                  vk::BufferUsageFlagBits::eStorageBuffer,
+                              vk::MemoryPropertyFlagBits::eDeviceLocal);
+    visibility_buffer_.emplace(
+        renderer, sizeof(uint32_t) * instance_count_,
+        vk::BufferUsageFlagBits::eStorageBuffer |
+            vk::BufferUsageFlagBits::eTransferDst,
+        vk::MemoryPropertyFlagBits::eDeviceLocal);
+    reset_visibility_ = true;
+
+    // Each phase appends into its own half of the command and count buffers
+    for (auto& frame : frames_) {
+        frame.object_buffer.emplace(
+            renderer, sizeof(GpuObjectData) * object_count_,
+            vk::BufferUsageFlagBits::eStorageBuffer,
+            vk::MemoryPropertyFlagBits::eHostVisible |
+                vk::MemoryPropertyFlagBits::eHostCoherent);
+        frame.command_buffer.emplace(
+            renderer,
+            2 * sizeof(vk::DrawIndexedIndirectCommand) * command_count,
+            vk::BufferUsageFlagBits::eStorageBuffer |
+                vk::BufferUsageFlagBits::eIndirectBuffer,
+            vk::MemoryPropertyFlagBits::eDeviceLocal);
+        frame.count_buffer.emplace(
+            renderer, 2 * sizeof(uint32_t) * batches_.size(),
+            vk::BufferUsageFlagBits::eStorageBuffer |
+                vk::BufferUsageFlagBits::eIndirectBuffer |
+                vk::BufferUsageFlagBits::eTransferDst,
+            vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+        WriteDescriptorSets(frame);
+    }
+}
+
+void GpuCuller::UpdateObjects(size_t frame_index,
+                              const std::vector<RenderObject>& render_objects)
+{
+    if (instance_count_ == 0) {
+        return;
+    }
+    assert(render_objects.size() == object_count_);
+
+    auto memory = frames_[frame_index].object_buffer->GetMemory();
+    auto* data = static_cast<GpuObjectData*>(device_.mapMemory(
+        memory, 0, sizeof(GpuObjectData) * object_count_));
+    for (size_t i = 0; i < object_count_; ++i) {
+        data[i].transform = render_objects[i].GetTransform();
+    }
+    device_.unmapMemory(memory);
+}
+
+void GpuCuller::SetHiZPyramid(const HiZPyramid& hiz_pyramid)
+{
+    hiz_pyramid_ = &hiz_pyramid;
+    for (auto& frame : frames_) {
+        frame.stale_hiz_descriptor = true;
+    }
+}
+
+void GpuCuller::BeginFrame(vk::CommandBuffer& command_buffer,
+                           size_t frame_index, const glm::mat4& viewproj)
+{
+    auto& frame = frames_[frame_index];
+    if (frame.stale_hiz_descriptor) {
+        WriteHiZDescriptor(frame);
+    }
+    if (instance_count_ == 0) {
+        return;
+    }
+
+    auto frustum = Frustum::FromMatrix(viewproj);
+    GpuCullParameters parameters;
+    parameters.viewproj = viewproj;
+    for (size_t i = 0; i < Frustum::Plane::Count; ++i) {
+        parameters.frustum_planes[i] = frustum.planes[i];
+    }
+    parameters.instance_count = instance_count_;
+    parameters.hiz_width = hiz_pyramid_ ? hiz_pyramid_->GetWidth() : 0;
+    parameters.hiz_height = hiz_pyramid_ ? hiz_pyramid_->GetHeight() : 0;
+    parameters.hiz_mip_count = hiz_pyramid_ ? hiz_pyramid_->GetMipCount() : 0;
+
+    auto memory = frame.parameter_buffer->GetMemory();
+    void* data = device_.mapMemory(memory, 0, sizeof(GpuCullParameters));
+    memcpy(data, &parameters, sizeof(GpuCullParameters));
+    device_.unmapMemory(memory);
+
+    // Reset the draw counts of both phases before the culling shader starts
+    // appending
+    command_buffer.fillBuffer(frame.count_buffer->GetBuffer(), 0,
+                              VK_WHOLE_SIZE, 0);
+    // Until a Late phase has run, treat everything as visible so that Early
+    // doesn't skip anything
+    if (reset_visibility_) {
+        command_buffer.fillBuffer(visibility_buffer_->GetBuffer(), 0,
+                                  VK_WHOLE_SIZE, 1);
+        reset_visibility_ = false;
+    }
+
+    // Also orders this frame's culling after the previous frame's visibility
+    // writes
+    vk::MemoryBarrier clear_barrier(
+        vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eShaderWrite,
+        vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer |
+            vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(),
+        clear_barrier, {}, {});
+}
+
+void GpuCuller::RecordCull(vk::CommandBuffer& command_buffer,
+                           size_t frame_index, GpuCullPhase phase)
+{
+    if (instance_count_ == 0) {
+        return;
+    }
+    assert(phase != GpuCullPhase::Late || (hiz_occlusion_ && hiz_pyramid_));
+    auto& frame = frames_[frame_index];
+
+    bool late = phase == GpuCullPhase::Late;
+    GpuCullPhaseConstants constants;
+    constants.phase = static_cast<uint32_t>(phase);
+    constants.command_base = late ? command_count_ : 0;
+    constants.count_base = late ? (uint32_t)batches_.size() : 0;
+
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                                cull_pipeline_);
+    command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                      cull_pipeline_layout_, 0,
+                                      frame.cull_descriptor_set, {});
+    command_buffer.pushConstants(cull_pipeline_layout_,
+                                 vk::ShaderStageFlagBits::eCompute, 0,
+                                 sizeof(GpuCullPhaseConstants), &constants);
+    command_buffer.dispatch(
+        (instance_count_ + CULL_WORKGROUP_SIZE - 1) / CULL_WORKGROUP_SIZE, 1,
+        1);
+
+    std::array<vk::BufferMemoryBarrier, 2> draw_barriers = {
+        vk::BufferMemoryBarrier(vk::AccessFlagBits::eShaderWrite,
+                                vk::AccessFlagBits::eIndirectCommandRead,
+                                VK_QUEUE_FAMILY_IGNORED,
+                                VK_QUEUE_FAMILY_IGNORED,
+                                frame.command_buffer->GetBuffer(), 0,
+                                VK_WHOLE_SIZE),
+        vk::BufferMemoryBarrier(vk::AccessFlagBits::eShaderWrite,
+                                vk::AccessFlagBits::eIndirectCommandRead,
+                                VK_QUEUE_FAMILY_IGNORED,
+                                VK_QUEUE_FAMILY_IGNORED,
+                                frame.count_buffer->GetBuffer(), 0,
+                                VK_WHOLE_SIZE)};
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                   vk::PipelineStageFlagBits::eDrawIndirect,
+                                   vk::DependencyFlags(), {}, draw_barriers,
+                                   {});
+}
+
+void GpuCuller::RecordDraws(vk::CommandBuffer& command_buffer,
+                            size_t frame_index, GpuCullPhase phase,
+                            vk::DescriptorSet camera_descriptor)
+{
+    if (instance_count_ == 0) {
+        return;
+    }
+    auto& frame = frames_[frame_index];
+
+    bool late = phase == GpuCullPhase::Late;
+    uint32_t command_base = late ? command_count_ : 0;
+    uint32_t count_base = late ? (uint32_t)batches_.size() : 0;
+
+    PipelineVariant variant;
+    variant.indirect = true;
+
+    NonOwningPointer<Material> last_material = nullptr;
+    for (uint32_t batch_index = 0; batch_index < batches_.size();
+         ++batch_index) {
+        auto& batch = batches_[batch_index];
+        auto material = batch.material;
+        auto& pipeline_layout = material->GetGraphicsPipelineLayout(variant);
+        if (last_material != material) {
+            command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics,
+                                        material->GetGraphicsPipeline(variant));
+            // Bind camera
+            command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                              pipeline_layout, 0,
+                                              camera_descriptor, {});
+
+            // Bind texture
+            command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                              pipeline_layout, 1,
+                                              material->GetDescriptorSet(), {});
+
+            // Bind every object's properties at once
+            command_buffer.bindDescriptorSets(
+                vk::PipelineBindPoint::eGraphics, pipeline_layout, 2,
+                frame.object_descriptor_set, {});
+            last_material = material;
+        }
+
+        command_buffer.bindVertexBuffers(
+            0,
+            {batch.mesh->GetPositionBuffer(), batch.mesh->GetAttributeBuffer()},
+            {0, 0});
+        command_buffer.bindIndexBuffer(batch.mesh->GetIndexBuffer(), 0,
+                                       vk::IndexType::eUint32);
+        command_buffer.drawIndexedIndirectCount(
+            frame.command_buffer->GetBuffer(),
+            (command_base + batch.command_offset) *
+                sizeof(vk::DrawIndexedIndirectCommand),
+            frame.count_buffer->GetBuffer(),
+            (count_base + batch_index) * sizeof(uint32_t),
+            batch.max_draw_count, sizeof(vk::DrawIndexedIndirectCommand));
+    }
+}
+
+void GpuCuller::CreateDescriptorSets(RendererState& renderer)
+{
+    uint32_t frame_count = (uint32_t)frames_.size();
+
+    // The cull set has the storage buffers plus visibility, the parameters
+    // and the Hi-Z pyramid, and the object set used by the vertex shader has
+    // one more storage buffer
+    std::array<vk::DescriptorPoolSize, 3> pool_sizes = {
+        {{vk::DescriptorType::eStorageBuffer,
+          (CULL_STORAGE_BINDING_COUNT + 2) * frame_count},
+         {vk::DescriptorType::eUniformBuffer, frame_count},
+         {vk::DescriptorType::eCombinedImageSampler, frame_count}}};
+    vk::DescriptorPoolCreateInfo pool_info(vk::DescriptorPoolCreateFlags(),
+                                           2 * frame_count, pool_sizes);
+    descriptor_pool_ = device_.createDescriptorPool(pool_info);
+
+    std::vector<vk::DescriptorSetLayout> cull_layouts(
+        frame_count, cull_descriptor_set_layout_);
+    auto cull_sets = device_.allocateDescriptorSets(
+        vk::DescriptorSetAllocateInfo(descriptor_pool_, cull_layouts));
+
+    std::vector<vk::DescriptorSetLayout> object_layouts(
+        frame_count, renderer.GetObjectStorageDescriptorSetLayout());
+    auto object_sets = device_.allocateDescriptorSets(
+        vk::DescriptorSetAllocateInfo(descriptor_pool_, object_layouts));
+
+    for (size_t i = 0; i < frames_.size(); ++i) {
+        frames_[i].cull_descriptor_set = cull_sets[i];
+        frames_[i].object_descriptor_set = object_sets[i];
+    }
+}
+
+void GpuCuller::WriteHiZDescriptor(FrameResources& frame)
+{
+    vk::DescriptorImageInfo image_info(hiz_pyramid_->GetSampler(),
+                                       hiz_pyramid_->GetImageView(),
+                                       vk::ImageLayout::eGeneral);
+    device_.updateDescriptorSets(
+        vk::WriteDescriptorSet(frame.cull_descriptor_set, CULL_HIZ_BINDING, 0,
+                               vk::DescriptorType::eCombinedImageSampler,
+                               image_info),
+        {});
+    frame.stale_hiz_descriptor = false;
+}
+
+void GpuCuller::WriteDescriptorSets(FrameResources& frame)
+{
+    std::array<vk::DescriptorBufferInfo, CULL_STORAGE_BINDING_COUNT>
+        buffer_infos = {
+            vk::DescriptorBufferInfo(frame.object_buffer->GetBuffer(), 0,
+                                     VK_WHOLE_SIZE),
+            vk::DescriptorBufferInfo(batch_buffer_->GetBuffer(), 0,
+                                     VK_WHOLE_SIZE),
+            vk::DescriptorBufferInfo(instance_buffer_->GetBuffer(), 0,
+                                     VK_WHOLE_SIZE),
+            vk::DescriptorBufferInfo(frame.command_buffer->GetBuffer(), 0,
+                                     VK_WHOLE_SIZE),
+            vk::DescriptorBufferInfo(frame.count_buffer->GetBuffer(), 0,
+                                     VK_WHOLE_SIZE)};
+
+    vk::DescriptorBufferInfo parameter_info(
+        frame.parameter_buffer->GetBuffer(), 0, sizeof(GpuCullParameters));
+    vk::DescriptorBufferInfo visibility_info(visibility_buffer_->GetBuffer(),
+                                             0, VK_WHOLE_SIZE);
+
+    std::vector<vk::WriteDescriptorSet> descriptor_writes;
+    for (uint32_t i = 0; i < CULL_STORAGE_BINDING_COUNT; ++i) {
+        descriptor_writes.push_back(vk::WriteDescriptorSet(
+            frame.cull_descriptor_set, i, 0, vk::DescriptorType::eStorageBuffer,
+            {}, buffer_infos[i]));
+    }
+    descriptor_writes.push_back(vk::WriteDescriptorSet(
+        frame.cull_descriptor_set, CULL_PARAMETER_BINDING, 0,
+        vk::DescriptorType::eUniformBuffer, {}, parameter_info));
+    descriptor_writes.push_back(vk::WriteDescriptorSet(
+        frame.cull_descriptor_set, CULL_VISIBILITY_BINDING, 0,
+        vk::DescriptorType::eStorageBuffer, {}, visibility_info));
+    descriptor_writes.push_back(vk::WriteDescriptorSet(
+        frame.object_descriptor_set, 0, 0, vk::DescriptorType::eStorageBuffer,
+        {}, buffer_infos[0]));
+
+    device_.updateDescriptorSets(descriptor_writes, {});
+}
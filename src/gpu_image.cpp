@@ -9,12 +9,13 @@ GpuImage::GpuImage(RendererState& renderer, uint32_t width, uint32_t height,
                    uint32_t mip_levels, vk::SampleCountFlagBits num_samples,
                    vk::Format format, vk::ImageTiling tiling,
                    vk::ImageUsageFlags usage,
-                   vk::MemoryPropertyFlags properties)
+                   vk::MemoryPropertyFlags properties,
+                   vk::MemoryPropertyFlags preferred)
     : device_(renderer.GetDevice())
 {
-    std::tie(image_, memory_) =
+    std::tie(image_, memory_, memory_properties_) =
         CreateImage(renderer, width, height, mip_levels, num_samples, format,
-                    tiling, usage, properties);
+                    tiling, usage, properties, preferred);
 }
 
 GpuImage::GpuImage(GpuImage&& other) : device_(other.device_)
@@ -38,7 +39,7 @@ void GpuImage::SetData(RendererState& renderer, uint32_t width, uint32_t height,
 {
     device_ = renderer.GetDevice();
     vk::DeviceSize size = width * height * 4;
-    std::tie(image_, memory_) =
+    std::tie(image_, memory_, memory_properties_) =
         CreateImage(renderer, width, height, mip_levels, num_samples, format,
                     tiling, usage, properties);
 
@@ -68,6 +69,13 @@ void GpuImage::MoveFrom(GpuImage&& other)
     other.image_ = (VkImage)VK_NULL_HANDLE;
     memory_ = other.memory_;
     other.memory_ = (VkDeviceMemory)VK_NULL_HANDLE;
+    memory_properties_ = other.memory_properties_;
 }
 
-vk::Image GpuImage::GetImage() { return image_; }
\ No newline at end of file
+vk::Image GpuImage::GetImage() { return image_; }
+vk::DeviceMemory GpuImage::GetMemory() { return memory_; }
+
+vk::MemoryPropertyFlags GpuImage::GetMemoryProperties()
+{
+    return memory_properties_;
+}
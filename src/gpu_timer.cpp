@@ -0,0 +1,109 @@
+#include "gpu_timer.h"
+
+#include <algorithm>
+
+#include "renderer_state.h"
+
+GpuTimer::GpuTimer(RendererState& renderer, size_t frame_count,
+                   uint32_t timestamp_count)
+    : device_(renderer.GetDevice()),
+      timestamp_count_(timestamp_count),
+      frames_(frame_count),
+      results_(timestamp_count)
+{
+    auto queue_families =
+        renderer.GetPhysicalDevice().getQueueFamilyProperties();
+    auto& graphics_family =
+        queue_families[renderer.GetGraphicsQueueFamilyIndex()];
+    supported_ = graphics_family.timestampValidBits > 0;
+    if (!supported_) {
+        return;
+    }
+    nanoseconds_per_tick_ =
+        renderer.GetPhysicalDevice().getProperties().limits.timestampPeriod;
+
+    vk::QueryPoolCreateInfo pool_info(vk::QueryPoolCreateFlags(),
+                                      vk::QueryType::eTimestamp,
+                                      timestamp_count_);
+    for (auto& frame : frames_) {
+        frame.query_pool = device_.createQueryPool(pool_info);
+        frame.written.assign(timestamp_count_, false);
+    }
+}
+
+GpuTimer::~GpuTimer()
+{
+    for (auto& frame : frames_) {
+        if (frame.query_pool) {
+            device_.destroyQueryPool(frame.query_pool);
+        }
+    }
+}
+
+bool GpuTimer::IsSupported() const { return supported_; }
+
+void GpuTimer::ReadResults(size_t frame_index)
+{
+    if (!supported_) {
+        return;
+    }
+
+    // Nothing was written for this frame, and its pool may never have been
+    // reset
+    auto& frame = frames_[frame_index];
+    if (std::find(frame.written.begin(), frame.written.end(), true) ==
+        frame.written.end()) {
+        std::fill(results_.begin(), results_.end(), std::nullopt);
+        return;
+    }
+
+    // Pairs of (timestamp, availability)
+    std::vector<uint64_t> data(2 * timestamp_count_);
+    auto result = device_.getQueryPoolResults(
+        frame.query_pool, 0, timestamp_count_, data.size() * sizeof(uint64_t),
+        data.data(), 2 * sizeof(uint64_t),
+        vk::QueryResultFlagBits::e64 |
+            vk::QueryResultFlagBits::eWithAvailability);
+    if (result != vk::Result::eSuccess && result != vk::Result::eNotReady) {
+        throw std::runtime_error("Could not read the GPU timestamps!");
+    }
+
+    for (uint32_t i = 0; i < timestamp_count_; ++i) {
+        if (frame.written[i] && data[2 * i + 1] != 0) {
+            results_[i] = data[2 * i];
+        } else {
+            results_[i].reset();
+        }
+    }
+}
+
+void GpuTimer::Reset(vk::CommandBuffer& command_buffer, size_t frame_index)
+{
+    if (!supported_) {
+        return;
+    }
+    auto& frame = frames_[frame_index];
+    command_buffer.resetQueryPool(frame.query_pool, 0, timestamp_count_);
+    frame.written.assign(timestamp_count_, false);
+}
+
+void GpuTimer::Write(vk::CommandBuffer& command_buffer, size_t frame_index,
+                     uint32_t index, vk::PipelineStageFlagBits stage)
+{
+    if (!supported_) {
+        return;
+    }
+    auto& frame = frames_[frame_index];
+    command_buffer.writeTimestamp(stage, frame.query_pool, index);
+    frame.written[index] = true;
+}
+
+std::optional<double> GpuTimer::GetMilliseconds(uint32_t first,
+                                                uint32_t second) const
+{
+    if (!results_[first].has_value() || !results_[second].has_value()) {
+        return std::nullopt;
+    }
+    auto ticks = (double)(*results_[second] - *results_[first]);
+    return ticks * nanoseconds_per_tick_ / 1e6;
+}
@@ -0,0 +1,340 @@
+#include "hiz_pyramid.h"
+
+#include <algorithm>
+#include <memory>
+
+#include "renderer_state.h"
+
+constexpr uint32_t HIZ_WORKGROUP_SIZE = 8;
+// Enough for a 32768 pixel wide depth buffer
+constexpr uint32_t HIZ_MAX_MIP_COUNT = 16;
+constexpr vk::Format HIZ_FORMAT = vk::Format::eR32Sfloat;
+
+struct HiZConstants
+{
+    uint32_t source_width;
+    uint32_t source_height;
+    uint32_t destination_width;
+    uint32_t destination_height;
+    uint32_t sample_count;
+};
+
+static uint32_t GetGroupCount(uint32_t size)
+{
+    return (size + HIZ_WORKGROUP_SIZE - 1) / HIZ_WORKGROUP_SIZE;
+}
+
+static uint32_t GetMipSize(uint32_t size, uint32_t level)
+{
+    return std::max(size >> level, 1u);
+}
+
+HiZPyramid::HiZPyramid(RendererState& renderer) : device_(renderer.GetDevice())
+{
+    // Copy reads the depth buffer, downsample reads the previous level as a
+    // storage image. Both write the next level as a storage image
+    std::array<vk::DescriptorSetLayoutBinding, 2> copy_bindings = {
+        vk::DescriptorSetLayoutBinding(
+            0, vk::DescriptorType::eCombinedImageSampler, 1,
+            vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eStorageImage, 1,
+                                       vk::ShaderStageFlagBits::eCompute)};
+    copy_descriptor_set_layout_ = device_.createDescriptorSetLayout(
+        vk::DescriptorSetLayoutCreateInfo({}, copy_bindings));
+
+    std::array<vk::DescriptorSetLayoutBinding, 2> downsample_bindings = {
+        vk::DescriptorSetLayoutBinding(0, vk::DescriptorType::eStorageImage, 1,
+                                       vk::ShaderStageFlagBits::eCompute),
+        vk::DescriptorSetLayoutBinding(1, vk::DescriptorType::eStorageImage, 1,
+                                       vk::ShaderStageFlagBits::eCompute)};
+    downsample_descriptor_set_layout_ = device_.createDescriptorSetLayout(
+        vk::DescriptorSetLayoutCreateInfo({}, downsample_bindings));
+
+    vk::PushConstantRange push_constant_range(
+        vk::ShaderStageFlagBits::eCompute, 0, sizeof(HiZConstants));
+
+    std::tie(copy_pipeline_layout_, copy_pipeline_) =
+        renderer.CreateComputePipeline("shaders/hiz_copy.comp",
+                                       {copy_descriptor_set_layout_},
+                                       {push_constant_range});
+    std::tie(copy_multisampled_pipeline_layout_, copy_multisampled_pipeline_) =
+        renderer.CreateComputePipeline(
+            "shaders/hiz_copy.comp", {copy_descriptor_set_layout_},
+            {push_constant_range}, {{"MULTISAMPLED", "1"}});
+    std::tie(downsample_pipeline_layout_, downsample_pipeline_) =
+        renderer.CreateComputePipeline("shaders/hiz_downsample.comp",
+                                       {downsample_descriptor_set_layout_},
+                                       {push_constant_range});
+
+    vk::SamplerCreateInfo sampler_info(
+        vk::SamplerCreateFlags(), vk::Filter::eNearest, vk::Filter::eNearest,
+        vk::SamplerMipmapMode::eNearest, vk::SamplerAddressMode::eClampToEdge,
+        vk::SamplerAddressMode::eClampToEdge,
+        vk::SamplerAddressMode::eClampToEdge, 0.0f, false, 1.0f, false,
+        vk::CompareOp::eAlways, 0.0f, static_cast<float>(HIZ_MAX_MIP_COUNT));
+    sampler_ = device_.createSampler(sampler_info);
+
+    Resize(renderer);
+}
+
+HiZPyramid::~HiZPyramid()
+{
+    DestroyImage();
+
+    device_.destroySampler(sampler_);
+    device_.destroyPipeline(copy_pipeline_);
+    device_.destroyPipelineLayout(copy_pipeline_layout_);
+    device_.destroyPipeline(copy_multisampled_pipeline_);
+    device_.destroyPipelineLayout(copy_multisampled_pipeline_layout_);
+    device_.destroyPipeline(downsample_pipeline_);
+    device_.destroyPipelineLayout(downsample_pipeline_layout_);
+    device_.destroyDescriptorPool(descriptor_pool_);
+    device_.destroyDescriptorSetLayout(copy_descriptor_set_layout_);
+    device_.destroyDescriptorSetLayout(downsample_descriptor_set_layout_);
+}
+
+void HiZPyramid::Resize(RendererState& renderer)
+{
+    RetireImage(renderer);
+
+    auto extent = renderer.GetSwapchain().GetExtent();
+    width_ = extent.width;
+    height_ = extent.height;
+    mip_count_ = 1;
+    while (mip_count_ < HIZ_MAX_MIP_COUNT &&
+           (GetMipSize(width_, mip_count_ - 1) > 1 ||
+            GetMipSize(height_, mip_count_ - 1) > 1)) {
+        ++mip_count_;
+    }
+
+    depth_image_ = renderer.GetDepthImage();
+    depth_format_ = renderer.GetDepthFormat();
+    sample_count_ = static_cast<uint32_t>(renderer.GetCurrentSampleCount());
+
+    CreateImage(renderer);
+    CreateDescriptorSets(renderer);
+}
+
+void HiZPyramid::RecordBuild(vk::CommandBuffer& command_buffer)
+{
+    vk::ImageAspectFlags depth_aspect = vk::ImageAspectFlagBits::eDepth;
+    if (HasStencilComponent(depth_format_)) {
+        depth_aspect |= vk::ImageAspectFlagBits::eStencil;
+    }
+    vk::ImageSubresourceRange depth_range(depth_aspect, 0, 1, 0, 1);
+    vk::ImageSubresourceRange pyramid_range(vk::ImageAspectFlagBits::eColor, 0,
+                                            mip_count_, 0, 1);
+
+    // Every level is rewritten, so the old contents can be discarded. The
+    // previous frame's culling reads of the pyramid must still finish first
+    std::array<vk::ImageMemoryBarrier, 2> begin_barriers = {
+        vk::ImageMemoryBarrier(
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+            vk::AccessFlagBits::eShaderRead,
+            vk::ImageLayout::eDepthStencilAttachmentOptimal,
+            vk::ImageLayout::eDepthStencilReadOnlyOptimal,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, depth_image_,
+            depth_range),
+        vk::ImageMemoryBarrier(
+            vk::AccessFlags(), vk::AccessFlagBits::eShaderWrite,
+            vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+            image_->GetImage(), pyramid_range)};
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eLateFragmentTests |
+            vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(), {},
+        {}, begin_barriers);
+
+    HiZConstants constants;
+    constants.source_width = width_;
+    constants.source_height = height_;
+    constants.destination_width = width_;
+    constants.destination_height = height_;
+    constants.sample_count = sample_count_;
+
+    bool multisampled = sample_count_ > 1;
+    auto& copy_layout = multisampled ? copy_multisampled_pipeline_layout_
+                                     : copy_pipeline_layout_;
+    command_buffer.bindPipeline(
+        vk::PipelineBindPoint::eCompute,
+        multisampled ? copy_multisampled_pipeline_ : copy_pipeline_);
+    command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                      copy_layout, 0, copy_descriptor_set_,
+                                      {});
+    command_buffer.pushConstants(copy_layout,
+                                 vk::ShaderStageFlagBits::eCompute, 0,
+                                 sizeof(HiZConstants), &constants);
+    command_buffer.dispatch(GetGroupCount(width_), GetGroupCount(height_), 1);
+
+    vk::MemoryBarrier level_barrier(vk::AccessFlagBits::eShaderWrite,
+                                    vk::AccessFlagBits::eShaderRead);
+
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute,
+                                downsample_pipeline_);
+    for (uint32_t level = 1; level < mip_count_; ++level) {
+        command_buffer.pipelineBarrier(
+            vk::PipelineStageFlagBits::eComputeShader,
+            vk::PipelineStageFlagBits::eComputeShader, vk::DependencyFlags(),
+            level_barrier, {}, {});
+
+        constants.source_width = GetMipSize(width_, level - 1);
+        constants.source_height = GetMipSize(height_, level - 1);
+        constants.destination_width = GetMipSize(width_, level);
+        constants.destination_height = GetMipSize(height_, level);
+
+        command_buffer.bindDescriptorSets(
+            vk::PipelineBindPoint::eCompute, downsample_pipeline_layout_, 0,
+            downsample_descriptor_sets_[level - 1], {});
+        command_buffer.pushConstants(downsample_pipeline_layout_,
+                                     vk::ShaderStageFlagBits::eCompute, 0,
+                                     sizeof(HiZConstants), &constants);
+        command_buffer.dispatch(GetGroupCount(constants.destination_width),
+                                GetGroupCount(constants.destination_height),
+                                1);
+    }
+
+    // Hand the depth buffer back to the render pass and make the last level
+    // visible to the culling shader
+    vk::ImageMemoryBarrier depth_barrier(
+        vk::AccessFlagBits::eShaderRead,
+        vk::AccessFlagBits::eDepthStencilAttachmentRead |
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+        vk::ImageLayout::eDepthStencilReadOnlyOptimal,
+        vk::ImageLayout::eDepthStencilAttachmentOptimal,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, depth_image_,
+        depth_range);
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eComputeShader |
+            vk::PipelineStageFlagBits::eEarlyFragmentTests |
+            vk::PipelineStageFlagBits::eLateFragmentTests,
+        vk::DependencyFlags(), level_barrier, {}, depth_barrier);
+}
+
+vk::ImageView HiZPyramid::GetImageView() const { return image_view_; }
+
+vk::Sampler HiZPyramid::GetSampler() const { return sampler_; }
+
+uint32_t HiZPyramid::GetWidth() const { return width_; }
+
+uint32_t HiZPyramid::GetHeight() const { return height_; }
+
+uint32_t HiZPyramid::GetMipCount() const { return mip_count_; }
+
+void HiZPyramid::CreateImage(RendererState& renderer)
+{
+    image_.emplace(renderer, width_, height_, mip_count_,
+                   vk::SampleCountFlagBits::e1, HIZ_FORMAT,
+                   vk::ImageTiling::eOptimal,
+                   vk::ImageUsageFlagBits::eStorage |
+                       vk::ImageUsageFlagBits::eSampled,
+                   vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+    image_view_ = CreateImageView(renderer, image_->GetImage(), HIZ_FORMAT,
+                                  vk::ImageAspectFlagBits::eColor, mip_count_);
+    // The culling shader binds the pyramid even on frames that don't build
+    // it, so it has to be in the layout its descriptor names from the start
+    TransitionImageLayout(renderer, image_->GetImage(), HIZ_FORMAT,
+                          vk::ImageLayout::eUndefined,
+                          vk::ImageLayout::eGeneral, mip_count_);
+
+    for (uint32_t level = 0; level < mip_count_; ++level) {
+        vk::ImageViewCreateInfo view_info(
+            vk::ImageViewCreateFlags(), image_->GetImage(),
+            vk::ImageViewType::e2D, HIZ_FORMAT, vk::ComponentMapping(),
+            vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, level,
+                                      1, 0, 1));
+        mip_views_.push_back(device_.createImageView(view_info));
+    }
+}
+
+void HiZPyramid::RetireImage(RendererState& renderer)
+{
+    if (!image_.has_value()) {
+        return;
+    }
+
+    // GpuImage can only be moved, the deleter has to be copyable
+    auto image = std::make_shared<GpuImage>(std::move(*image_));
+    image_.reset();
+    renderer.DeferDestruction([device = device_, image,
+                               image_view = image_view_, mip_views = mip_views_,
+                               descriptor_pool = descriptor_pool_]() mutable {
+        device.destroyDescriptorPool(descriptor_pool);
+        for (auto view : mip_views) {
+            device.destroyImageView(view);
+        }
+        device.destroyImageView(image_view);
+        image.reset();
+    });
+    mip_views_.clear();
+    image_view_ = vk::ImageView();
+    descriptor_pool_ = vk::DescriptorPool();
+}
+
+void HiZPyramid::DestroyImage()
+{
+    if (!image_.has_value()) {
+        return;
+    }
+
+    for (auto view : mip_views_) {
+        device_.destroyImageView(view);
+    }
+    mip_views_.clear();
+    device_.destroyImageView(image_view_);
+    image_.reset();
+}
+
+void HiZPyramid::CreateDescriptorSets(RendererState& renderer)
+{
+    std::array<vk::DescriptorPoolSize, 2> pool_sizes = {
+        {{vk::DescriptorType::eCombinedImageSampler, 1},
+         {vk::DescriptorType::eStorageImage, 2 * HIZ_MAX_MIP_COUNT}}};
+    vk::DescriptorPoolCreateInfo pool_info(vk::DescriptorPoolCreateFlags(),
+                                           HIZ_MAX_MIP_COUNT, pool_sizes);
+    descriptor_pool_ = device_.createDescriptorPool(pool_info);
+    downsample_descriptor_sets_.clear();
+
+    copy_descriptor_set_ =
+        device_
+            .allocateDescriptorSets(vk::DescriptorSetAllocateInfo(
+                descriptor_pool_, copy_descriptor_set_layout_))
+            .front();
+    if (mip_count_ > 1) {
+        std::vector<vk::DescriptorSetLayout> layouts(
+            mip_count_ - 1, downsample_descriptor_set_layout_);
+        downsample_descriptor_sets_ = device_.allocateDescriptorSets(
+            vk::DescriptorSetAllocateInfo(descriptor_pool_, layouts));
+    }
+
+    // The image infos have to outlive the updateDescriptorSets call
+    std::vector<vk::DescriptorImageInfo> mip_infos;
+    for (auto view : mip_views_) {
+        mip_infos.push_back(
+            vk::DescriptorImageInfo({}, view, vk::ImageLayout::eGeneral));
+    }
+    vk::DescriptorImageInfo depth_info(
+        sampler_, renderer.GetDepthImageView(),
+        vk::ImageLayout::eDepthStencilReadOnlyOptimal);
+
+    std::vector<vk::WriteDescriptorSet> descriptor_writes = {
+        vk::WriteDescriptorSet(copy_descriptor_set_, 0, 0,
+                               vk::DescriptorType::eCombinedImageSampler,
+                               depth_info),
+        vk::WriteDescriptorSet(copy_descriptor_set_, 1, 0,
+                               vk::DescriptorType::eStorageImage,
+                               mip_infos[0])};
+    for (uint32_t level = 1; level < mip_count_; ++level) {
+        auto set = downsample_descriptor_sets_[level - 1];
+        descriptor_writes.push_back(
+            vk::WriteDescriptorSet(set, 0, 0, vk::DescriptorType::eStorageImage,
+                                   mip_infos[level - 1]));
+        descriptor_writes.push_back(
+            vk::WriteDescriptorSet(set, 1, 0, vk::DescriptorType::eStorageImage,
+                                   mip_infos[level]));
+    }
+
+    device_.updateDescriptorSets(descriptor_writes, {});
+}
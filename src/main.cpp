@@ -1,12 +1,108 @@
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
 #include <vector>
 
 #include "application.h"
+#include "renderer_settings.h"
 #include "utils.h"
 
-int main()
+// Value of an argument like --output=frames
+static std::optional<std::string> ParseOption(const std::string& argument,
+                                              const std::string& name)
 {
-    Application app;
+    const std::string prefix = "--" + name + "=";
+    if (argument.compare(0, prefix.size(), prefix) != 0) {
+        return std::nullopt;
+    }
+    return argument.substr(prefix.size());
+}
+
+// Frame rate limit from an argument like --frame-rate=144, anything outside
+// the range the GUI allows is rejected
+static std::optional<double> ParseFrameRate(const std::string& argument)
+{
+    auto value = ParseOption(argument, "frame-rate");
+    // stod would accept leading whitespace, signs, inf and nan
+    if (!value.has_value() || value->empty() ||
+        !(std::isdigit(static_cast<unsigned char>(value->front())) ||
+          value->front() == '.')) {
+        return std::nullopt;
+    }
+    double frame_rate = 0.0;
+    size_t length = 0;
+    try {
+        frame_rate = std::stod(*value, &length);
+    } catch (std::exception&) {
+        return std::nullopt;
+    }
+    if (length != value->size() || !std::isfinite(frame_rate) ||
+        frame_rate < 0.0 ||
+        frame_rate > RendererSettings::MAX_FRAME_RATE_LIMIT) {
+        return std::nullopt;
+    }
+    return frame_rate;
+}
+
+// Frame count from an argument like --headless=600, anything but a positive
+// number is rejected rather than opening a window
+static std::optional<uint32_t> ParseFrameCount(const std::string& argument)
+{
+    auto value = ParseOption(argument, "headless");
+    // strtoul would accept leading whitespace and signs
+    if (!value.has_value() || value->empty() ||
+        !std::isdigit(static_cast<unsigned char>(value->front()))) {
+        return std::nullopt;
+    }
+    char* end = nullptr;
+    auto count = std::strtoul(value->c_str(), &end, 10);
+    if (*end != '\0' || count == 0 ||
+        count > std::numeric_limits<uint32_t>::max()) {
+        return std::nullopt;
+    }
+    return static_cast<uint32_t>(count);
+}
+
+int main(int argc, char** argv)
+{
+    // Any of a latency mode, a present mode, a frame rate limit and dynamic
+    // rendering, balanced, mailbox, uncapped and render passes by default.
+    // --headless renders a number of frames without a window, --output
+    // writes them out
+    RendererSettings settings;
+    for (int i = 1; i < argc; ++i) {
+        if (auto mode = ParseLatencyMode(argv[i])) {
+            settings.SetLatencyMode(*mode);
+        } else if (auto policy = ParsePresentModePolicy(argv[i])) {
+            settings.present_mode = *policy;
+        } else if (auto frame_rate = ParseFrameRate(argv[i])) {
+            settings.frame_rate_limit = *frame_rate;
+        } else if (std::string(argv[i]) == "--dynamic-rendering") {
+            settings.dynamic_rendering = true;
+        } else if (auto frame_count = ParseFrameCount(argv[i])) {
+            settings.headless_frame_count = *frame_count;
+        } else if (auto directory = ParseOption(argv[i], "output")) {
+            settings.headless_output_directory = *directory;
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [low-latency|balanced|high-throughput]"
+                         " [immediate|mailbox|fifo|fifo-relaxed]"
+                         " [--frame-rate=<fps>] [--dynamic-rendering]"
+                         " [--headless=<frames> [--output=<directory>]]\n";
+            return 1;
+        }
+    }
+    if (!settings.headless_output_directory.empty() &&
+        settings.headless_frame_count == 0) {
+        std::cerr << "--output needs --headless\n";
+        return 1;
+    }
+
+    Application app(settings);
 
     app.Run();
 
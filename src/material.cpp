@@ -1,23 +1,44 @@
 #include "material.h"
 
+#include <tuple>
+
 #include "renderer_state.h"
 #include "swapchain.h"
 #include "utils.h"
 #include "vertex.h"
 
+bool PipelineVariant::operator<(const PipelineVariant& other) const
+{
+    return std::tie(indirect, depth_equal) <
+           std::tie(other.indirect, other.depth_equal);
+}
+
+void Material::DestroyPipelines(vk::Device device,
+                                const PipelineSet& pipelines)
+{
+    for (auto& variant_pipeline_pair : pipelines) {
+        auto& [pipeline_layout, pipeline] = variant_pipeline_pair.second;
+        device.destroyPipelineLayout(pipeline_layout);
+        device.destroyPipeline(pipeline);
+    }
+}
+
 Material::Material(RendererState& renderer,
                    tinyobj::material_t material_defintion)
     : device_(renderer.GetDevice()), material_(material_defintion)
 {
-    std::tie(pipeline_layout_, pipeline_) = CreateGraphicsPipeline(renderer);
     if (material_.diffuse_texname.size() > 0) {
-        renderer.GetTextureCache().LoadTexture(renderer,
-                                               material_.diffuse_texname);
-        texture_ = renderer.GetTextureCache().GetTextureByPath(
-            material_.diffuse_texname);
+        texture_ = renderer.GetTextureCache().LoadTexture(
+            renderer, material_.diffuse_texname);
     }
 
-    if (texture_) {
+    // The pipelines depend on the classification, so it has to come first
+    auto texture = renderer.GetTextureCache().GetTexture(texture_);
+    transparent_ = material_.dissolve < 1.0f ||
+                   (texture != nullptr && texture->HasTransparency());
+    SelectPipelines(renderer);
+
+    if (texture_ != INVALID_TEXTURE_HANDLE) {
         CreateSampler(renderer);
         CreateDescriptorSet(renderer);
     }
@@ -37,20 +58,71 @@ Material& Material::operator=(Material&& other)
 
 Material::~Material() { Cleanup(); }
 
-void Material::RecreatePipeline(RendererState& renderer)
+Material::PipelineSet Material::CreatePipelines(
+    RendererState& renderer, const PipelineTarget& target) const
 {
-    CleanupPipeline();
-    std::tie(pipeline_layout_, pipeline_) = CreateGraphicsPipeline(renderer);
+    PipelineSet pipelines;
+
+    PipelineVariant standard;
+    pipelines[standard] = CreateGraphicsPipeline(renderer, target, standard);
+
+    if (renderer.SupportsGpuCulling()) {
+        PipelineVariant indirect;
+        indirect.indirect = true;
+        pipelines[indirect] =
+            CreateGraphicsPipeline(renderer, target, indirect);
+    }
+
+    if (!transparent_) {
+        PipelineVariant depth_equal;
+        depth_equal.depth_equal = true;
+        pipelines[depth_equal] =
+            CreateGraphicsPipeline(renderer, target, depth_equal);
+    }
+    return pipelines;
+}
+
+bool Material::HasPipelines(vk::SampleCountFlagBits sample_count) const
+{
+    return pipelines_.count(sample_count) > 0;
 }
 
-vk::PipelineLayout& Material::GetGraphicsPipelineLayout()
+void Material::AddPipelines(vk::SampleCountFlagBits sample_count,
+                            PipelineSet pipelines)
 {
-    return pipeline_layout_;
+    if (HasPipelines(sample_count)) {
+        // Never drawn with
+        DestroyPipelines(device_, pipelines);
+        return;
+    }
+    pipelines_.emplace(sample_count, std::move(pipelines));
 }
 
-vk::Pipeline& Material::GetGraphicsPipeline() { return pipeline_; }
+void Material::SelectPipelines(RendererState& renderer)
+{
+    current_sample_count_ = renderer.GetCurrentSampleCount();
+    if (!HasPipelines(current_sample_count_)) {
+        pipelines_.emplace(
+            current_sample_count_,
+            CreatePipelines(renderer, PipelineTarget::ForSampleCount(
+                                          renderer, current_sample_count_)));
+    }
+}
 
-NonOwningPointer<Texture> Material::GetTexture() { return texture_; }
+vk::PipelineLayout& Material::GetGraphicsPipelineLayout(
+    PipelineVariant variant)
+{
+    return pipelines_.at(current_sample_count_).at(variant).first;
+}
+
+vk::Pipeline& Material::GetGraphicsPipeline(PipelineVariant variant)
+{
+    return pipelines_.at(current_sample_count_).at(variant).second;
+}
+
+TextureHandle Material::GetTexture() const { return texture_; }
+
+bool Material::IsTransparent() const { return transparent_; }
 vk::DescriptorSet& Material::GetDescriptorSet()
 {
     return material_descriptor_set_;
@@ -58,12 +130,10 @@ vk::DescriptorSet& Material::GetDescriptorSet()
 
 void Material::CleanupPipeline()
 {
-    if (pipeline_layout_) {
-        device_.destroyPipelineLayout(pipeline_layout_);
-    }
-    if (pipeline_) {
-        device_.destroyPipeline(pipeline_);
+    for (auto& sample_count_pipelines_pair : pipelines_) {
+        DestroyPipelines(device_, sample_count_pipelines_pair.second);
     }
+    pipelines_.clear();
 }
 
 void Material::Cleanup()
@@ -77,23 +147,25 @@ void Material::Cleanup()
 void Material::MoveFrom(Material&& other)
 {
     device_ = other.device_;
-    pipeline_layout_ = std::move(other.pipeline_layout_);
-    other.pipeline_layout_ = (VkPipelineLayout)VK_NULL_HANDLE;
-    pipeline_ = std::move(other.pipeline_);
-    other.pipeline_ = (VkPipeline)VK_NULL_HANDLE;
+    pipelines_ = std::move(other.pipelines_);
+    other.pipelines_.clear();
+    current_sample_count_ = other.current_sample_count_;
     material_ = std::move(other.material_);
     material_descriptor_set_ = std::move(other.material_descriptor_set_);
     other.material_descriptor_set_ = (VkDescriptorSet)VK_NULL_HANDLE;
-    texture_ = std::move(other.texture_);
+    texture_ = other.texture_;
+    transparent_ = other.transparent_;
     sampler_ = std::move(other.sampler_);
     other.sampler_ = (VkSampler)VK_NULL_HANDLE;
 }
 
 std::pair<vk::PipelineLayout, vk::Pipeline> Material::CreateGraphicsPipeline(
-    RendererState& renderer)
+    RendererState& renderer, const PipelineTarget& target,
+    PipelineVariant variant) const
 {
-    auto vert_shader_bin =
-        CompileShader("shaders/shader.vert", shaderc_glsl_vertex_shader);
+    auto vert_shader_bin = CompileShader(
+        variant.indirect ? "shaders/shader_indirect.vert" : "shaders/shader.vert",
+        shaderc_glsl_vertex_shader);
     auto frag_shader_bin =
         CompileShader("shaders/shader.frag", shaderc_glsl_fragment_shader);
 
@@ -107,14 +179,22 @@ std::pair<vk::PipelineLayout, vk::Pipeline> Material::CreateGraphicsPipeline(
         vk::PipelineShaderStageCreateFlags(),
         vk::ShaderStageFlagBits::eFragment, frag_shader_module, "main");
 
+    // The dissolve only matters to transparent materials, opaque ones are
+    // written without blending
+    float dissolve = transparent_ ? material_.dissolve : 1.0f;
+    vk::SpecializationMapEntry dissolve_entry(0, 0, sizeof(float));
+    vk::SpecializationInfo specialization_info(1, &dissolve_entry,
+                                               sizeof(float), &dissolve);
+    frag_shader_stage_info.pSpecializationInfo = &specialization_info;
+
     std::vector<vk::PipelineShaderStageCreateInfo> shader_stages = {
         vert_shader_stage_info, frag_shader_stage_info};
 
-    auto bindingDescription = Vertex::GetBindingDescription();
+    auto bindingDescriptions = Vertex::GetBindingDescriptions();
     auto attributeDescriptions = Vertex::GetAttributeDescriptions();
     vk::PipelineVertexInputStateCreateInfo vertex_input_info(
         vk::PipelineVertexInputStateCreateFlags(),
-        bindingDescription,    // Vertex Binding Descriptions
+        bindingDescriptions,   // Vertex Binding Descriptions
         attributeDescriptions  // Vertex attribute descriptions
     );
 
@@ -122,13 +202,10 @@ std::pair<vk::PipelineLayout, vk::Pipeline> Material::CreateGraphicsPipeline(
         vk::PipelineInputAssemblyStateCreateFlags(),
         vk::PrimitiveTopology::eTriangleList, VK_FALSE);
 
-    auto extent = renderer.GetSwapchain().GetExtent();
-    vk::Viewport viewport(0.0f, 0.0f, (float)extent.width, (float)extent.height,
-                          0.0f, 1.0f);
-    vk::Rect2D scissor({0, 0}, extent);
-
+    // The viewport and scissor are dynamic, so the pipelines outlive any
+    // resize of the swapchain
     vk::PipelineViewportStateCreateInfo viewport_state(
-        vk::PipelineViewportStateCreateFlags(), viewport, scissor);
+        vk::PipelineViewportStateCreateFlags(), 1, nullptr, 1, nullptr);
 
     vk::PipelineRasterizationStateCreateInfo rasterizer(
         vk::PipelineRasterizationStateCreateFlags(), VK_FALSE, VK_FALSE,
@@ -136,13 +213,13 @@ std::pair<vk::PipelineLayout, vk::Pipeline> Material::CreateGraphicsPipeline(
         vk::FrontFace::eCounterClockwise, VK_FALSE, 0.0f, 0.0f, 0.0f, 1.0f);
 
     vk::PipelineMultisampleStateCreateInfo multisampling(
-        vk::PipelineMultisampleStateCreateFlags(), renderer.GetCurrentSampleCount(),
+        vk::PipelineMultisampleStateCreateFlags(), target.sample_count,
         VK_TRUE, 0.2f, nullptr, VK_FALSE, VK_FALSE);
 
     vk::PipelineColorBlendAttachmentState color_blend_attachment(
-        VK_TRUE, vk::BlendFactor::eSrcAlpha, vk::BlendFactor::eOneMinusSrcAlpha,
-        vk::BlendOp::eAdd, vk::BlendFactor::eOne, vk::BlendFactor::eZero,
-        vk::BlendOp::eAdd,
+        transparent_ ? VK_TRUE : VK_FALSE, vk::BlendFactor::eSrcAlpha,
+        vk::BlendFactor::eOneMinusSrcAlpha, vk::BlendOp::eAdd,
+        vk::BlendFactor::eOne, vk::BlendFactor::eZero, vk::BlendOp::eAdd,
         vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
             vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA);
 
@@ -151,9 +228,7 @@ std::pair<vk::PipelineLayout, vk::Pipeline> Material::CreateGraphicsPipeline(
         color_blend_attachment, {0.0f, 0.0f, 0.0f, 0.0f});
 
     std::vector<vk::DynamicState> dynamic_states = {
-        // vk::DynamicState::eViewport,
-        // vk::DynamicState::eLineWidth
-    };
+        vk::DynamicState::eViewport, vk::DynamicState::eScissor};
 
     vk::PipelineDynamicStateCreateInfo dynamic_state(
         vk::PipelineDynamicStateCreateFlags(), dynamic_states);
@@ -167,7 +242,11 @@ std::pair<vk::PipelineLayout, vk::Pipeline> Material::CreateGraphicsPipeline(
         layouts.push_back(renderer.GetMaterialDescriptorSetLayout());
     }
 
-    layouts.push_back(renderer.GetObjectDescriptorSetLayout());
+    if (variant.indirect) {
+        layouts.push_back(renderer.GetObjectStorageDescriptorSetLayout());
+    } else {
+        layouts.push_back(renderer.GetObjectDescriptorSetLayout());
+    }
 
     vk::PipelineLayoutCreateInfo pipeline_layout_info(
         vk::PipelineLayoutCreateFlags(),
@@ -178,15 +257,25 @@ std::pair<vk::PipelineLayout, vk::Pipeline> Material::CreateGraphicsPipeline(
     auto pipeline_layout =
         renderer.GetDevice().createPipelineLayout(pipeline_layout_info);
 
+    // Transparent surfaces are drawn back to front after every opaque one,
+    // they are depth tested but must not hide each other
+    bool depth_write = !transparent_ && !variant.depth_equal;
     vk::PipelineDepthStencilStateCreateInfo depth_stencil(
-        vk::PipelineDepthStencilStateCreateFlags(), VK_TRUE, VK_TRUE,
-        vk::CompareOp::eLess, VK_FALSE, VK_FALSE, {}, {});
+        vk::PipelineDepthStencilStateCreateFlags(), VK_TRUE,
+        depth_write ? VK_TRUE : VK_FALSE,
+        variant.depth_equal ? vk::CompareOp::eEqual : vk::CompareOp::eLess,
+        VK_FALSE, VK_FALSE, {}, {});
 
     vk::GraphicsPipelineCreateInfo pipeline_info(
         vk::PipelineCreateFlags(), shader_stages, &vertex_input_info,
         &input_assembly, {}, &viewport_state, &rasterizer, &multisampling,
         &depth_stencil, &color_blending, &dynamic_state, pipeline_layout,
-        renderer.GetRenderPass(), 0, {}, -1);
+        target.render_pass, 0, {}, -1);
+    // Without a render pass the attachment formats describe the target
+    auto rendering_info = target.GetRenderingCreateInfo();
+    if (target.UsesDynamicRendering()) {
+        pipeline_info.pNext = &rendering_info;
+    }
 
     vk::Pipeline pipeline;
     auto result =
@@ -205,7 +294,8 @@ std::pair<vk::PipelineLayout, vk::Pipeline> Material::CreateGraphicsPipeline(
     return {pipeline_layout, pipeline};
 }
 
-vk::ShaderModule Material::CreateShaderModule(const std::vector<uint32_t>& code)
+vk::ShaderModule Material::CreateShaderModule(
+    const std::vector<uint32_t>& code) const
 {
     vk::ShaderModuleCreateInfo create_info(vk::ShaderModuleCreateFlagBits(),
                                            code);
@@ -215,6 +305,7 @@ vk::ShaderModule Material::CreateShaderModule(const std::vector<uint32_t>& code)
 
 void Material::CreateSampler(RendererState& renderer)
 {
+    auto texture = renderer.GetTextureCache().GetTexture(texture_);
     auto properties = renderer.GetPhysicalDevice().getProperties();
     vk::SamplerCreateInfo sampler_info(
         vk::SamplerCreateFlags(), vk::Filter::eLinear, vk::Filter::eLinear,
@@ -222,7 +313,7 @@ void Material::CreateSampler(RendererState& renderer)
         vk::SamplerAddressMode::eRepeat, vk::SamplerAddressMode::eRepeat, 0.0f,
         VK_TRUE, properties.limits.maxSamplerAnisotropy, VK_FALSE,
         vk::CompareOp::eAlways, 0.0f,
-        static_cast<float>(texture_->GetMipLevels()),
+        static_cast<float>(texture->GetMipLevels()),
         vk::BorderColor::eIntOpaqueBlack, VK_FALSE);
 
     sampler_ = device_.createSampler(sampler_info);
@@ -236,7 +327,8 @@ void Material::CreateDescriptorSet(RendererState& renderer)
                                              layouts);
     material_descriptor_set_ = device_.allocateDescriptorSets(alloc_info)[0];
 
-    vk::DescriptorImageInfo image_info(sampler_, texture_->GetImageView(),
+    auto texture = renderer.GetTextureCache().GetTexture(texture_);
+    vk::DescriptorImageInfo image_info(sampler_, texture->GetImageView(),
                                        vk::ImageLayout::eShaderReadOnlyOptimal);
 
     vk::WriteDescriptorSet descriptor_write(
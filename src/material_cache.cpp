@@ -1,32 +1,121 @@
 #include "material_cache.h"
 
+#include <cassert>
+#include <chrono>
+
 #include "material.h"
+#include "renderer_state.h"
+
+MaterialCache::~MaterialCache() { CancelPipelineBuild(); }
 
-void MaterialCache::LoadMaterial(RendererState& renderer,
-                     std::string name, tinyobj::material_t material_definition)
+MaterialHandle MaterialCache::LoadMaterial(
+    RendererState& renderer, const std::string& name,
+    const tinyobj::material_t& material_definition)
 {
-    if (material_map_.find(name) == material_map_.end()) {
-        material_map_.emplace(std::move(name), Material(renderer, material_definition));
+    auto it = handles_.find(name);
+    if (it != handles_.end()) {
+        return it->second;
+    }
+
+    // The background build reads the materials
+    if (pipeline_build_.has_value()) {
+        FinishPipelineBuild();
     }
+
+    auto handle = static_cast<MaterialHandle>(materials_.size());
+    materials_.emplace_back(renderer, material_definition);
+    handles_.emplace(name, handle);
+    return handle;
+}
+
+MaterialHandle MaterialCache::FindMaterial(const std::string& name) const
+{
+    auto it = handles_.find(name);
+    return it != handles_.end() ? it->second : INVALID_MATERIAL_HANDLE;
 }
 
-NonOwningPointer<Material> MaterialCache::GetMaterialByName(std::string name) {
-    if (material_map_.find(name) != material_map_.end())
-    {
-        return &material_map_.at(name);
+NonOwningPointer<Material> MaterialCache::GetMaterial(MaterialHandle handle)
+{
+    if (handle == INVALID_MATERIAL_HANDLE) {
+        return nullptr;
     }
-    return nullptr;
+    assert(handle < materials_.size());
+    return &materials_[handle];
 }
 
-void MaterialCache::RecreateAllPipelines(RendererState& renderer)
+bool MaterialCache::PreparePipelines(RendererState& renderer,
+                                     vk::SampleCountFlagBits sample_count)
 {
-    for (auto& name_mat_pair : material_map_)
-    {
-        name_mat_pair.second.RecreatePipeline(renderer);
+    if (pipeline_build_.has_value()) {
+        if (pipeline_build_->result.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready) {
+            return false;
+        }
+        FinishPipelineBuild();
+    }
+
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < materials_.size(); ++i) {
+        if (!materials_[i].HasPipelines(sample_count)) {
+            missing.push_back(i);
+        }
+    }
+    if (missing.empty()) {
+        return true;
+    }
+
+    // The render pass is made here, the build itself only reads the
+    // materials and the renderer's immutable state
+    auto target = PipelineTarget::ForSampleCount(renderer, sample_count);
+    device_ = renderer.GetDevice();
+    auto result = std::async(std::launch::async, [this, &renderer, target,
+                                                  missing]() {
+        std::vector<std::pair<size_t, Material::PipelineSet>> pipelines;
+        for (auto i : missing) {
+            pipelines.emplace_back(
+                i, materials_[i].CreatePipelines(renderer, target));
+        }
+        return pipelines;
+    });
+    pipeline_build_ = PipelineBuild{target, std::move(result)};
+    return false;
+}
+
+void MaterialCache::SelectPipelines(RendererState& renderer)
+{
+    if (pipeline_build_.has_value()) {
+        FinishPipelineBuild();
+    }
+    for (auto& material : materials_) {
+        material.SelectPipelines(renderer);
     }
 }
 
 void MaterialCache::Clear()
 {
-    material_map_.clear();
-}
\ No newline at end of file
+    CancelPipelineBuild();
+    materials_.clear();
+    handles_.clear();
+}
+
+void MaterialCache::FinishPipelineBuild()
+{
+    auto sample_count = pipeline_build_->target.sample_count;
+    auto pipelines = pipeline_build_->result.get();
+    pipeline_build_.reset();
+
+    for (auto& [index, pipeline_set] : pipelines) {
+        materials_[index].AddPipelines(sample_count, std::move(pipeline_set));
+    }
+}
+
+void MaterialCache::CancelPipelineBuild()
+{
+    if (!pipeline_build_.has_value()) {
+        return;
+    }
+    for (auto& [index, pipeline_set] : pipeline_build_->result.get()) {
+        Material::DestroyPipelines(*device_, pipeline_set);
+    }
+    pipeline_build_.reset();
+}
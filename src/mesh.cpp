@@ -1,13 +1,16 @@
 #include "mesh.h"
 
+#include <algorithm>
+#include <numeric>
 #include <unordered_map>
 
 Mesh::Mesh(RendererState& renderer, const tinyobj::attrib_t attribs,
-           const tinyobj::shape_t& shape)
-    : gpu_vertices_(renderer.GetDevice()),
+           const tinyobj::shape_t& shape,
+           const std::vector<MaterialHandle>& materials)
+    : gpu_positions_(renderer.GetDevice()),
+      gpu_attributes_(renderer.GetDevice()),
       gpu_indices_(renderer.GetDevice()),
-      name_(shape.name),
-      material_indices_(shape.mesh.material_ids)
+      name_(shape.name)
 {
     std::vector<Vertex> vertices;
     std::vector<uint32_t> indices;
@@ -37,13 +40,65 @@ Mesh::Mesh(RendererState& renderer, const tinyobj::attrib_t attribs,
         indices.push_back(unique_vertices[vertex]);
     }
 
+    // The shape is triangulated, so face i is indices [3i, 3i + 3)
+    size_t face_count = indices.size() / 3;
+    std::vector<MaterialHandle> face_materials(face_count);
+    for (size_t face = 0; face < face_count; ++face) {
+        int material_id = face < shape.mesh.material_ids.size()
+                              ? shape.mesh.material_ids[face]
+                              : -1;
+        if (material_id >= 0 && (size_t)material_id < materials.size()) {
+            face_materials[face] = materials[material_id];
+        } else {
+            face_materials[face] = materials.empty() ? INVALID_MATERIAL_HANDLE
+                                                     : materials[0];
+        }
+    }
+
+    // Group the faces by material, keeping their order within a material
+    std::vector<uint32_t> face_order(face_count);
+    std::iota(face_order.begin(), face_order.end(), 0u);
+    std::stable_sort(face_order.begin(), face_order.end(),
+                     [&](uint32_t a, uint32_t b) {
+                         return face_materials[a] < face_materials[b];
+                     });
+
+    std::vector<uint32_t> sorted_indices;
+    sorted_indices.reserve(indices.size());
+    for (auto face : face_order) {
+        auto material = face_materials[face];
+        if (ranges_.empty() || ranges_.back().material != material) {
+            ranges_.push_back({(uint32_t)sorted_indices.size(), 0, material});
+        }
+        ranges_.back().index_count += 3;
+        sorted_indices.insert(sorted_indices.end(),
+                              indices.begin() + 3 * face,
+                              indices.begin() + 3 * face + 3);
+    }
+    indices = std::move(sorted_indices);
+
+    std::vector<VertexAttributes> attributes;
+    positions_.reserve(vertices.size());
+    attributes.reserve(vertices.size());
+    for (const auto& vertex : vertices) {
+        positions_.push_back(vertex.pos);
+        attributes.push_back(vertex.GetAttributes());
+    }
+    bounds_ = Aabb::FromPoints(positions_);
+    bounding_sphere_ = BoundingSphere::FromPoints(positions_);
+    indices_ = indices;
+
     vertex_count_ = (uint32_t)vertices.size();
     tri_count_ = (uint32_t)(indices.size() / 3);
 
-    gpu_vertices_.SetData(renderer, vertices,
-                          vk::BufferUsageFlagBits::eTransferDst |
-                              vk::BufferUsageFlagBits::eVertexBuffer,
-                          vk::MemoryPropertyFlagBits::eDeviceLocal);
+    gpu_positions_.SetData(renderer, positions_,
+                           vk::BufferUsageFlagBits::eTransferDst |
+                               vk::BufferUsageFlagBits::eVertexBuffer,
+                           vk::MemoryPropertyFlagBits::eDeviceLocal);
+    gpu_attributes_.SetData(renderer, attributes,
+                            vk::BufferUsageFlagBits::eTransferDst |
+                                vk::BufferUsageFlagBits::eVertexBuffer,
+                            vk::MemoryPropertyFlagBits::eDeviceLocal);
     gpu_indices_.SetData(renderer, indices,
                          vk::BufferUsageFlagBits::eTransferDst |
                              vk::BufferUsageFlagBits::eIndexBuffer,
@@ -52,16 +107,43 @@ Mesh::Mesh(RendererState& renderer, const tinyobj::attrib_t attribs,
 
 Mesh::Mesh(Mesh&& other)
     : name_(std::move(other.name_)),
-      gpu_vertices_(std::move(other.gpu_vertices_)),
+      gpu_positions_(std::move(other.gpu_positions_)),
+      gpu_attributes_(std::move(other.gpu_attributes_)),
       gpu_indices_(std::move(other.gpu_indices_)),
       vertex_count_(other.vertex_count_),
-      tri_count_(other.tri_count_)
+      tri_count_(other.tri_count_),
+      ranges_(std::move(other.ranges_)),
+      bounds_(other.bounds_),
+      bounding_sphere_(other.bounding_sphere_),
+      positions_(std::move(other.positions_)),
+      indices_(std::move(other.indices_))
 {}
 
-vk::Buffer Mesh::GetVertexBuffer() const { return gpu_vertices_.GetBuffer(); }
+vk::Buffer Mesh::GetPositionBuffer() const
+{
+    return gpu_positions_.GetBuffer();
+}
+
+vk::Buffer Mesh::GetAttributeBuffer() const
+{
+    return gpu_attributes_.GetBuffer();
+}
 
 vk::Buffer Mesh::GetIndexBuffer() const { return gpu_indices_.GetBuffer(); }
 
 uint32_t Mesh::GetVertexCount() const { return vertex_count_; }
 
-uint32_t Mesh::GetTriangleCount() const { return tri_count_; }
\ No newline at end of file
+uint32_t Mesh::GetTriangleCount() const { return tri_count_; }
+
+const std::vector<MeshRange>& Mesh::GetRanges() const { return ranges_; }
+
+const Aabb& Mesh::GetBounds() const { return bounds_; }
+
+const BoundingSphere& Mesh::GetBoundingSphere() const
+{
+    return bounding_sphere_;
+}
+
+const std::vector<glm::vec3>& Mesh::GetPositions() const { return positions_; }
+
+const std::vector<uint32_t>& Mesh::GetIndices() const { return indices_; }
\ No newline at end of file
@@ -26,12 +26,27 @@ Model::Model(RendererState& renderer, std::string path)
     auto& attrib = reader.GetAttrib();
     materials_ = reader.GetMaterials();
 
+    // Face material ids index into the model's own material list
+    std::vector<MaterialHandle> material_handles;
+    material_handles.reserve(materials_.size());
+    for (const auto& mat : materials_) {
+        material_handles.push_back(
+            renderer.GetMaterialCache().LoadMaterial(renderer, mat.name, mat));
+    }
+    if (material_handles.empty()) {
+        std::cerr << "Warning: model \"" << path
+                  << "\" has no material and will not be drawn\n";
+    }
+
     for (const auto& shape : shapes) {
-        meshes_.emplace_back(renderer, attrib, shape);
+        meshes_.emplace_back(renderer, attrib, shape, material_handles);
     }
 
-    for (auto mat : materials_) {
-        renderer.GetMaterialCache().LoadMaterial(renderer, mat.name, mat);
+    if (!meshes_.empty()) {
+        bounds_ = meshes_[0].GetBounds();
+        for (const auto& mesh : meshes_) {
+            bounds_.Merge(mesh.GetBounds());
+        }
     }
 }
 
@@ -60,7 +75,4 @@ const std::vector<Mesh>& Model::GetMeshes()
     return meshes_;
 }
 
-const std::string& Model::GetMaterialName()
-{
-    return materials_[0].name;
-}
\ No newline at end of file
+const Aabb& Model::GetBounds() const { return bounds_; }
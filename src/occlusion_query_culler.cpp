@@ -0,0 +1,330 @@
+#include "occlusion_query_culler.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+
+#include "render_object.h"
+#include "renderer_state.h"
+
+// Matches the push constants of bounding_box.vert
+struct BoundingBoxConstants
+{
+    glm::vec4 min;
+    glm::vec4 max;
+};
+
+// The cube is drawn as a 14 vertex triangle strip generated in the shader
+constexpr uint32_t BOUNDING_BOX_VERTEX_COUNT = 14;
+
+OcclusionQueryCuller::OcclusionQueryCuller(RendererState& renderer,
+                                           size_t frame_count)
+    : device_(renderer.GetDevice()), frames_(frame_count)
+{
+    vk::PushConstantRange push_constant_range(
+        vk::ShaderStageFlagBits::eVertex, 0, sizeof(BoundingBoxConstants));
+    vk::PipelineLayoutCreateInfo pipeline_layout_info(
+        vk::PipelineLayoutCreateFlags(),
+        renderer.GetCameraDescriptorSetLayout(), push_constant_range);
+    pipeline_layout_ = device_.createPipelineLayout(pipeline_layout_info);
+
+    RecreatePipeline(renderer);
+}
+
+OcclusionQueryCuller::~OcclusionQueryCuller()
+{
+    DestroyPools();
+    device_.destroyPipeline(pipeline_);
+    device_.destroyPipelineLayout(pipeline_layout_);
+}
+
+void OcclusionQueryCuller::RecreatePipeline(RendererState& renderer)
+{
+    if (pipeline_) {
+        renderer.DeferDestruction([device = device_, pipeline = pipeline_]() {
+            device.destroyPipeline(pipeline);
+        });
+    }
+
+    auto vert_shader_bin = CompileShader("shaders/bounding_box.vert",
+                                         shaderc_glsl_vertex_shader);
+    auto vert_shader_module = device_.createShaderModule(
+        vk::ShaderModuleCreateInfo({}, vert_shader_bin));
+
+    // Only depth testing matters, so there is no fragment shader
+    vk::PipelineShaderStageCreateInfo vert_shader_stage_info(
+        vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eVertex,
+        vert_shader_module, "main");
+
+    vk::PipelineVertexInputStateCreateInfo vertex_input_info;
+
+    vk::PipelineInputAssemblyStateCreateInfo input_assembly(
+        vk::PipelineInputAssemblyStateCreateFlags(),
+        vk::PrimitiveTopology::eTriangleStrip, VK_FALSE);
+
+    auto target = renderer.GetSceneTarget();
+    // Set when the scene pass begins
+    vk::PipelineViewportStateCreateInfo viewport_state(
+        vk::PipelineViewportStateCreateFlags(), 1, nullptr, 1, nullptr);
+    std::array<vk::DynamicState, 2> dynamic_states = {
+        vk::DynamicState::eViewport, vk::DynamicState::eScissor};
+    vk::PipelineDynamicStateCreateInfo dynamic_state(
+        vk::PipelineDynamicStateCreateFlags(), dynamic_states);
+
+    // Both sides are drawn so the box still counts when the camera is close
+    vk::PipelineRasterizationStateCreateInfo rasterizer(
+        vk::PipelineRasterizationStateCreateFlags(), VK_FALSE, VK_FALSE,
+        vk::PolygonMode::eFill, vk::CullModeFlagBits::eNone,
+        vk::FrontFace::eCounterClockwise, VK_FALSE, 0.0f, 0.0f, 0.0f, 1.0f);
+
+    vk::PipelineMultisampleStateCreateInfo multisampling(
+        vk::PipelineMultisampleStateCreateFlags(), target.sample_count);
+
+    vk::PipelineDepthStencilStateCreateInfo depth_stencil(
+        vk::PipelineDepthStencilStateCreateFlags(), VK_TRUE, VK_FALSE,
+        vk::CompareOp::eLessOrEqual, VK_FALSE, VK_FALSE, {}, {});
+
+    vk::PipelineColorBlendAttachmentState color_blend_attachment;
+    color_blend_attachment.colorWriteMask = vk::ColorComponentFlags();
+    vk::PipelineColorBlendStateCreateInfo color_blending(
+        vk::PipelineColorBlendStateCreateFlags(), VK_FALSE, vk::LogicOp::eCopy,
+        color_blend_attachment, {0.0f, 0.0f, 0.0f, 0.0f});
+
+    vk::GraphicsPipelineCreateInfo pipeline_info(
+        vk::PipelineCreateFlags(), vert_shader_stage_info, &vertex_input_info,
+        &input_assembly, {}, &viewport_state, &rasterizer, &multisampling,
+        &depth_stencil, &color_blending, &dynamic_state, pipeline_layout_,
+        target.render_pass, 0, {}, -1);
+    auto rendering_info = target.GetRenderingCreateInfo();
+    if (target.UsesDynamicRendering()) {
+        pipeline_info.pNext = &rendering_info;
+    }
+
+    auto result = device_.createGraphicsPipeline({}, pipeline_info);
+    device_.destroyShaderModule(vert_shader_module);
+    if (result.result != vk::Result::eSuccess) {
+        throw std::runtime_error(
+            "Could not create the bounding box query pipeline!");
+    }
+    pipeline_ = result.value;
+}
+
+void OcclusionQueryCuller::Resize(RendererState& renderer,
+                                  size_t object_count)
+{
+    DestroyPools();
+    object_count_ = object_count;
+    visible_.assign(object_count_, 1);
+    if (object_count_ == 0) {
+        return;
+    }
+
+    vk::QueryPoolCreateInfo pool_info(vk::QueryPoolCreateFlags(),
+                                      vk::QueryType::eOcclusion,
+                                      (uint32_t)object_count_);
+    for (auto& frame : frames_) {
+        frame.query_pool = device_.createQueryPool(pool_info);
+        frame.object_queries.assign(object_count_, NO_QUERY);
+        if (renderer.SupportsConditionalRendering()) {
+            frame.predicate_buffer.emplace(
+                renderer, sizeof(uint32_t) * object_count_,
+                vk::BufferUsageFlagBits::eConditionalRenderingEXT |
+                    vk::BufferUsageFlagBits::eTransferDst,
+                vk::MemoryPropertyFlagBits::eDeviceLocal);
+        }
+    }
+}
+
+void OcclusionQueryCuller::ReadResults(size_t frame_index)
+{
+    auto& frame = frames_[frame_index];
+    if (frame.queried_objects.empty()) {
+        return;
+    }
+
+    // Pairs of (samples passed, availability), a query that somehow isn't
+    // available yet keeps the previous result
+    uint32_t query_count = (uint32_t)frame.queried_objects.size();
+    std::vector<uint32_t> results(2 * query_count);
+    auto result = device_.getQueryPoolResults(
+        frame.query_pool, 0, query_count, results.size() * sizeof(uint32_t),
+        results.data(), 2 * sizeof(uint32_t),
+        vk::QueryResultFlagBits::eWithAvailability);
+    if (result != vk::Result::eSuccess && result != vk::Result::eNotReady) {
+        throw std::runtime_error("Could not read occlusion query results!");
+    }
+
+    for (uint32_t query = 0; query < query_count; ++query) {
+        if (results[2 * query + 1] != 0) {
+            visible_[frame.queried_objects[query]] = results[2 * query] > 0;
+        }
+    }
+}
+
+bool OcclusionQueryCuller::IsVisible(uint32_t object_index) const
+{
+    return visible_[object_index] != 0;
+}
+
+size_t OcclusionQueryCuller::GetHiddenObjectCount() const
+{
+    return std::count(visible_.begin(), visible_.end(), 0);
+}
+
+void OcclusionQueryCuller::BeginFrame(vk::CommandBuffer& command_buffer,
+                                      size_t frame_index, bool conditional)
+{
+    if (object_count_ == 0) {
+        return;
+    }
+    auto& frame = frames_[frame_index];
+
+    frame.predicate_source = nullptr;
+    if (conditional && frame.predicate_buffer.has_value()) {
+        // The previous frame was submitted before this one, so waiting on
+        // its queries can't stall forever
+        const auto& previous =
+            frames_[(frame_index + frames_.size() - 1) % frames_.size()];
+        if (!previous.queried_objects.empty()) {
+            command_buffer.copyQueryPoolResults(
+                previous.query_pool, 0,
+                (uint32_t)previous.queried_objects.size(),
+                frame.predicate_buffer->GetBuffer(), 0, sizeof(uint32_t),
+                vk::QueryResultFlagBits::eWait);
+            frame.predicate_source = &previous;
+        }
+    }
+
+    // Also orders the reset after any earlier copy out of this pool
+    vk::MemoryBarrier copy_barrier(
+        vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eTransferWrite |
+            vk::AccessFlagBits::eConditionalRenderingReadEXT);
+    vk::PipelineStageFlags destination_stage =
+        vk::PipelineStageFlagBits::eTransfer;
+    if (frame.predicate_buffer.has_value()) {
+        destination_stage |=
+            vk::PipelineStageFlagBits::eConditionalRenderingEXT;
+    } else {
+        copy_barrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+    }
+    command_buffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                   destination_stage, vk::DependencyFlags(),
+                                   copy_barrier, {}, {});
+
+    command_buffer.resetQueryPool(frame.query_pool, 0,
+                                  (uint32_t)object_count_);
+    frame.queried_objects.clear();
+    std::fill(frame.object_queries.begin(), frame.object_queries.end(),
+              NO_QUERY);
+}
+
+void OcclusionQueryCuller::BeginQuery(vk::CommandBuffer& command_buffer,
+                                      size_t frame_index,
+                                      uint32_t object_index)
+{
+    auto& frame = frames_[frame_index];
+    command_buffer.beginQuery(frame.query_pool,
+                              AddQuery(frame, object_index),
+                              vk::QueryControlFlags());
+}
+
+void OcclusionQueryCuller::EndQuery(vk::CommandBuffer& command_buffer,
+                                    size_t frame_index)
+{
+    auto& frame = frames_[frame_index];
+    command_buffer.endQuery(frame.query_pool,
+                            (uint32_t)frame.queried_objects.size() - 1);
+}
+
+void OcclusionQueryCuller::QueryBoundingBoxes(
+    vk::CommandBuffer& command_buffer, size_t frame_index,
+    const std::vector<uint32_t>& object_indices,
+    const std::vector<RenderObject>& render_objects,
+    vk::DescriptorSet camera_descriptor, const glm::vec3& camera_position,
+    float near_radius)
+{
+    if (object_indices.empty()) {
+        return;
+    }
+    auto& frame = frames_[frame_index];
+
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline_);
+    command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                      pipeline_layout_, 0, camera_descriptor,
+                                      {});
+
+    for (auto object_index : object_indices) {
+        const auto& bounds = render_objects[object_index].GetWorldBounds();
+        if (bounds.IntersectsSphere(camera_position, near_radius)) {
+            visible_[object_index] = 1;
+            continue;
+        }
+
+        BoundingBoxConstants constants;
+        constants.min = glm::vec4(bounds.min, 1.0f);
+        constants.max = glm::vec4(bounds.max, 1.0f);
+        command_buffer.pushConstants(pipeline_layout_,
+                                     vk::ShaderStageFlagBits::eVertex, 0,
+                                     sizeof(BoundingBoxConstants), &constants);
+
+        uint32_t query = AddQuery(frame, object_index);
+        command_buffer.beginQuery(frame.query_pool, query,
+                                  vk::QueryControlFlags());
+        command_buffer.draw(BOUNDING_BOX_VERTEX_COUNT, 1, 0, 0);
+        command_buffer.endQuery(frame.query_pool, query);
+    }
+}
+
+void OcclusionQueryCuller::BeginConditionalDraw(
+    vk::CommandBuffer& command_buffer, size_t frame_index,
+    uint32_t object_index)
+{
+    assert(!conditional_draw_active_);
+    const auto& frame = frames_[frame_index];
+    if (!frame.predicate_source) {
+        return;
+    }
+    uint32_t query = frame.predicate_source->object_queries[object_index];
+    if (query == NO_QUERY) {
+        return;
+    }
+
+    vk::ConditionalRenderingBeginInfoEXT begin_info(
+        frame.predicate_buffer->GetBuffer(), query * sizeof(uint32_t));
+    command_buffer.beginConditionalRenderingEXT(begin_info);
+    conditional_draw_active_ = true;
+}
+
+void OcclusionQueryCuller::EndConditionalDraw(
+    vk::CommandBuffer& command_buffer)
+{
+    if (conditional_draw_active_) {
+        command_buffer.endConditionalRenderingEXT();
+        conditional_draw_active_ = false;
+    }
+}
+
+void OcclusionQueryCuller::DestroyPools()
+{
+    for (auto& frame : frames_) {
+        device_.destroyQueryPool(frame.query_pool);
+        frame.query_pool = nullptr;
+        frame.queried_objects.clear();
+        frame.object_queries.clear();
+        frame.predicate_buffer.reset();
+        frame.predicate_source = nullptr;
+    }
+}
+
+uint32_t OcclusionQueryCuller::AddQuery(FrameResources& frame,
+                                        uint32_t object_index)
+{
+    // Each object is queried at most once per frame, so the pool never
+    // needs more queries than there are objects
+    assert(frame.object_queries[object_index] == NO_QUERY);
+    uint32_t query = (uint32_t)frame.queried_objects.size();
+    frame.queried_objects.push_back(object_index);
+    frame.object_queries[object_index] = query;
+    return query;
+}
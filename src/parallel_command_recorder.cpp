@@ -0,0 +1,226 @@
+#include "parallel_command_recorder.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "renderer_state.h"
+#include "thread_pool.h"
+
+// Below this many draws per chunk the cost of an extra secondary command
+// buffer outweighs what recording in parallel saves
+constexpr size_t MIN_ITEMS_PER_CHUNK = 256;
+
+size_t GetChunkCount(size_t item_count, size_t max_chunks,
+                     size_t min_chunk_size)
+{
+    if (item_count == 0 || max_chunks == 0) {
+        return 0;
+    }
+    size_t chunk_count = item_count / std::max<size_t>(min_chunk_size, 1);
+    return std::clamp<size_t>(chunk_count, 1, max_chunks);
+}
+
+std::pair<size_t, size_t> GetChunkRange(size_t item_count, size_t chunk_count,
+                                        size_t chunk)
+{
+    assert(chunk < chunk_count);
+    // The first item_count % chunk_count chunks take one extra item
+    size_t base_size = item_count / chunk_count;
+    size_t remainder = item_count % chunk_count;
+    size_t first = chunk * base_size + std::min(chunk, remainder);
+    size_t last = first + base_size + (chunk < remainder ? 1 : 0);
+    return {first, last};
+}
+
+ParallelCommandRecorder::ParallelCommandRecorder(RendererState& renderer,
+                                                 size_t frame_count,
+                                                 size_t chunk_count,
+                                                 size_t cache_count)
+    : device_(renderer.GetDevice()),
+      queue_family_index_(renderer.GetGraphicsQueueFamilyIndex()),
+      chunk_count_(chunk_count),
+      frames_(frame_count)
+{
+    for (auto& frame : frames_) {
+        // Command buffers are never reset individually, only their whole
+        // pool. Cached ones live for many frames so they are not transient
+        frame.transient.push_back(CreateChunkBuffers(
+            vk::CommandPoolCreateFlagBits::eTransient));
+        frame.caches.resize(cache_count);
+        for (auto& cache : frame.caches) {
+            cache.buffers = CreateChunkBuffers(vk::CommandPoolCreateFlags());
+        }
+    }
+}
+
+ParallelCommandRecorder::~ParallelCommandRecorder()
+{
+    for (auto& frame : frames_) {
+        // Destroying a pool frees its command buffers
+        for (auto& buffers : frame.transient) {
+            for (auto pool : buffers.command_pools) {
+                device_.destroyCommandPool(pool);
+            }
+        }
+        for (auto& cache : frame.caches) {
+            for (auto pool : cache.buffers.command_pools) {
+                device_.destroyCommandPool(pool);
+            }
+        }
+    }
+}
+
+void ParallelCommandRecorder::BeginFrame(size_t frame_index)
+{
+    auto& frame = frames_[frame_index];
+    for (size_t i = 0; i < frame.used_transient_count; ++i) {
+        ResetPools(frame.transient[i]);
+    }
+    frame.used_transient_count = 0;
+    executed_chunk_count_ = 0;
+    reused_chunk_count_ = 0;
+}
+
+void ParallelCommandRecorder::Record(vk::CommandBuffer& primary,
+                                     size_t frame_index,
+                                     const PipelineTarget& target,
+                                     vk::Framebuffer framebuffer,
+                                     ThreadPool& thread_pool,
+                                     size_t item_count,
+                                     const RecordFunction& record)
+{
+    vk::CommandBufferInheritanceInfo inheritance_info(target.render_pass, 0,
+                                                      framebuffer);
+    // With dynamic rendering the attachment formats take the place of the
+    // render pass
+    auto rendering_info = target.GetInheritanceRenderingInfo();
+    if (target.UsesDynamicRendering()) {
+        inheritance_info.pNext = &rendering_info;
+    }
+    vk::CommandBufferBeginInfo begin_info(
+        vk::CommandBufferUsageFlagBits::eOneTimeSubmit |
+            vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+        &inheritance_info);
+
+    auto& frame = frames_[frame_index];
+    if (frame.used_transient_count == frame.transient.size()) {
+        frame.transient.push_back(CreateChunkBuffers(
+            vk::CommandPoolCreateFlagBits::eTransient));
+    }
+    auto& buffers = frame.transient[frame.used_transient_count++];
+    size_t chunk_count =
+        RecordChunks(buffers, begin_info, thread_pool, item_count, record);
+    executed_chunk_count_ += chunk_count;
+    if (chunk_count > 0) {
+        primary.executeCommands(static_cast<uint32_t>(chunk_count),
+                                buffers.command_buffers.data());
+    }
+}
+
+void ParallelCommandRecorder::RecordCached(vk::CommandBuffer& primary,
+                                           size_t frame_index,
+                                           const PipelineTarget& target,
+                                           ThreadPool& thread_pool,
+                                           size_t item_count,
+                                           size_t cache_index,
+                                           uint64_t generation,
+                                           const RecordFunction& record)
+{
+    auto& cache = frames_[frame_index].caches[cache_index];
+    bool reuse = cache.generation == generation;
+    if (!reuse) {
+        // The last primary that executed these belonged to this frame index
+        // and it has been waited on, so they are no longer pending
+        ResetPools(cache.buffers);
+
+        // Without a framebuffer the secondaries stay valid for every
+        // swapchain image. Not one time submit, they are replayed
+        vk::CommandBufferInheritanceInfo inheritance_info(target.render_pass,
+                                                          0);
+        auto rendering_info = target.GetInheritanceRenderingInfo();
+        if (target.UsesDynamicRendering()) {
+            inheritance_info.pNext = &rendering_info;
+        }
+        vk::CommandBufferBeginInfo begin_info(
+            vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+            &inheritance_info);
+        cache.chunk_count = RecordChunks(cache.buffers, begin_info,
+                                         thread_pool, item_count, record);
+        cache.generation = generation;
+    }
+
+    size_t chunk_count = cache.chunk_count;
+    executed_chunk_count_ += chunk_count;
+    if (reuse) {
+        reused_chunk_count_ += chunk_count;
+    }
+    if (chunk_count > 0) {
+        primary.executeCommands(static_cast<uint32_t>(chunk_count),
+                                cache.buffers.command_buffers.data());
+    }
+}
+
+void ParallelCommandRecorder::InvalidateCache()
+{
+    for (auto& frame : frames_) {
+        for (auto& cache : frame.caches) {
+            cache.generation.reset();
+        }
+    }
+}
+
+size_t ParallelCommandRecorder::GetExecutedChunkCount() const
+{
+    return executed_chunk_count_;
+}
+
+size_t ParallelCommandRecorder::GetReusedChunkCount() const
+{
+    return reused_chunk_count_;
+}
+
+ParallelCommandRecorder::ChunkBuffers
+ParallelCommandRecorder::CreateChunkBuffers(vk::CommandPoolCreateFlags flags)
+{
+    vk::CommandPoolCreateInfo pool_info(flags, queue_family_index_);
+
+    ChunkBuffers buffers;
+    for (size_t i = 0; i < chunk_count_; ++i) {
+        auto pool = device_.createCommandPool(pool_info);
+        vk::CommandBufferAllocateInfo alloc_info(
+            pool, vk::CommandBufferLevel::eSecondary, 1);
+        buffers.command_pools.push_back(pool);
+        buffers.command_buffers.push_back(
+            device_.allocateCommandBuffers(alloc_info).front());
+    }
+    return buffers;
+}
+
+void ParallelCommandRecorder::ResetPools(const ChunkBuffers& buffers)
+{
+    for (auto pool : buffers.command_pools) {
+        device_.resetCommandPool(pool, vk::CommandPoolResetFlags());
+    }
+}
+
+size_t ParallelCommandRecorder::RecordChunks(
+    const ChunkBuffers& buffers, const vk::CommandBufferBeginInfo& begin_info,
+    ThreadPool& thread_pool, size_t item_count, const RecordFunction& record)
+{
+    size_t chunk_count = GetChunkCount(
+        item_count, std::min(buffers.command_buffers.size(),
+                             thread_pool.GetThreadCount()),
+        MIN_ITEMS_PER_CHUNK);
+
+    // Chunk i is always recorded into the buffer of pool i, whichever thread
+    // picks it up, so every pool is only ever touched by one thread at a time
+    thread_pool.ParallelFor(chunk_count, [&](size_t chunk) {
+        auto command_buffer = buffers.command_buffers[chunk];
+        auto [first, last] = GetChunkRange(item_count, chunk_count, chunk);
+        command_buffer.begin(begin_info);
+        record(command_buffer, first, last);
+        command_buffer.end();
+    });
+
+    return chunk_count;
+}
@@ -0,0 +1,36 @@
+#include "pipeline_target.h"
+
+#include "renderer_state.h"
+#include "swapchain.h"
+#include "utils.h"
+
+PipelineTarget PipelineTarget::ForSampleCount(
+    RendererState& renderer, vk::SampleCountFlagBits sample_count)
+{
+    PipelineTarget target;
+    target.sample_count = sample_count;
+    if (!renderer.UsesDynamicRendering()) {
+        // Any of the scene passes would do, they are all compatible
+        target.render_pass = renderer.GetRenderPasses(
+            sample_count)[static_cast<size_t>(ScenePass::Single)];
+    }
+    target.color_format = renderer.GetSwapchain().GetImageFormat().format;
+    target.depth_format = renderer.GetDepthFormat();
+    return target;
+}
+
+bool PipelineTarget::UsesDynamicRendering() const { return !render_pass; }
+
+vk::PipelineRenderingCreateInfoKHR PipelineTarget::GetRenderingCreateInfo()
+    const
+{
+    return vk::PipelineRenderingCreateInfoKHR(0, color_format, depth_format);
+}
+
+vk::CommandBufferInheritanceRenderingInfoKHR
+PipelineTarget::GetInheritanceRenderingInfo() const
+{
+    return vk::CommandBufferInheritanceRenderingInfoKHR(
+        vk::RenderingFlagsKHR(), 0, color_format, depth_format,
+        vk::Format::eUndefined, sample_count);
+}
@@ -0,0 +1,67 @@
+#include "queue_timeline.h"
+
+#include <limits>
+
+QueueTimeline::QueueTimeline(vk::Device& device, vk::Queue queue)
+    : device_(device), queue_(queue)
+{
+    vk::SemaphoreTypeCreateInfo type_info(vk::SemaphoreType::eTimeline, 0);
+    vk::SemaphoreCreateInfo semaphore_info;
+    semaphore_info.pNext = &type_info;
+    semaphore_ = device_.createSemaphore(semaphore_info);
+}
+
+QueueTimeline::~QueueTimeline() { device_.destroySemaphore(semaphore_); }
+
+uint64_t QueueTimeline::Submit(
+    const std::vector<vk::CommandBuffer>& command_buffers,
+    const std::vector<vk::Semaphore>& wait_semaphores,
+    const std::vector<vk::PipelineStageFlags>& wait_stages,
+    const std::vector<vk::Semaphore>& signal_semaphores)
+{
+    uint64_t value = submitted_value_ + 1;
+
+    // Binary semaphores take a value too, it is ignored
+    std::vector<uint64_t> wait_values(wait_semaphores.size(), 0);
+    auto signals = signal_semaphores;
+    signals.push_back(semaphore_);
+    std::vector<uint64_t> signal_values(signal_semaphores.size(), 0);
+    signal_values.push_back(value);
+
+    vk::TimelineSemaphoreSubmitInfo timeline_info(wait_values, signal_values);
+    vk::SubmitInfo submit_info(wait_semaphores, wait_stages, command_buffers,
+                               signals);
+    submit_info.pNext = &timeline_info;
+    queue_.submit(submit_info);
+
+    submitted_value_ = value;
+    return value;
+}
+
+void QueueTimeline::Wait(uint64_t value)
+{
+    if (value <= completed_value_) {
+        return;
+    }
+
+    vk::SemaphoreWaitInfo wait_info(vk::SemaphoreWaitFlags(), semaphore_,
+                                    value);
+    auto result =
+        device_.waitSemaphores(wait_info, std::numeric_limits<uint64_t>::max());
+    if (result != vk::Result::eSuccess) {
+        throw std::runtime_error("Could not wait for the queue timeline!");
+    }
+    completed_value_ = value;
+}
+
+uint64_t QueueTimeline::GetCompletedValue()
+{
+    if (completed_value_ < submitted_value_) {
+        completed_value_ = device_.getSemaphoreCounterValue(semaphore_);
+    }
+    return completed_value_;
+}
+
+uint64_t QueueTimeline::GetSubmittedValue() const { return submitted_value_; }
+
+vk::Semaphore QueueTimeline::GetSemaphore() { return semaphore_; }
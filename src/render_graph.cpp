@@ -0,0 +1,504 @@
+#include "render_graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <numeric>
+#include <tuple>
+
+#include "renderer_state.h"
+#include "utils.h"
+
+struct AccessInfo
+{
+    vk::PipelineStageFlags stages;
+    vk::AccessFlags access;
+    // The part of access that writes
+    vk::AccessFlags write_access;
+    vk::ImageLayout layout;
+};
+
+// What an image has been through since its last barrier
+struct ImageState
+{
+    vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+    vk::PipelineStageFlags write_stages;
+    vk::AccessFlags write_access;
+    // Reads since the last write, a later write has to wait for them
+    vk::PipelineStageFlags read_stages;
+    // Stages the last write has been made visible to
+    vk::PipelineStageFlags visible_stages;
+};
+
+static AccessInfo GetAccessInfo(ImageAccess access)
+{
+    switch (access) {
+        case ImageAccess::ColorAttachment:
+            return {vk::PipelineStageFlagBits::eColorAttachmentOutput,
+                    vk::AccessFlagBits::eColorAttachmentRead |
+                        vk::AccessFlagBits::eColorAttachmentWrite,
+                    vk::AccessFlagBits::eColorAttachmentWrite,
+                    vk::ImageLayout::eColorAttachmentOptimal};
+        case ImageAccess::DepthAttachment:
+            return {vk::PipelineStageFlagBits::eEarlyFragmentTests |
+                        vk::PipelineStageFlagBits::eLateFragmentTests,
+                    vk::AccessFlagBits::eDepthStencilAttachmentRead |
+                        vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+                    vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+                    vk::ImageLayout::eDepthStencilAttachmentOptimal};
+        case ImageAccess::DepthRead:
+            return {vk::PipelineStageFlagBits::eFragmentShader |
+                        vk::PipelineStageFlagBits::eComputeShader,
+                    vk::AccessFlagBits::eShaderRead, vk::AccessFlags(),
+                    vk::ImageLayout::eDepthStencilReadOnlyOptimal};
+        case ImageAccess::ShaderRead:
+            return {vk::PipelineStageFlagBits::eFragmentShader |
+                        vk::PipelineStageFlagBits::eComputeShader,
+                    vk::AccessFlagBits::eShaderRead, vk::AccessFlags(),
+                    vk::ImageLayout::eShaderReadOnlyOptimal};
+        case ImageAccess::StorageWrite:
+            return {vk::PipelineStageFlagBits::eComputeShader,
+                    vk::AccessFlagBits::eShaderRead |
+                        vk::AccessFlagBits::eShaderWrite,
+                    vk::AccessFlagBits::eShaderWrite,
+                    vk::ImageLayout::eGeneral};
+        case ImageAccess::TransferRead:
+            return {vk::PipelineStageFlagBits::eTransfer,
+                    vk::AccessFlagBits::eTransferRead, vk::AccessFlags(),
+                    vk::ImageLayout::eTransferSrcOptimal};
+        case ImageAccess::Present:
+            return {vk::PipelineStageFlagBits::eBottomOfPipe,
+                    vk::AccessFlags(), vk::AccessFlags(),
+                    vk::ImageLayout::ePresentSrcKHR};
+    }
+    throw std::runtime_error("Unknown image access!");
+}
+
+static ImageState GetInitialState(const AccessInfo& info, bool discard)
+{
+    ImageState state;
+    state.layout = discard ? vk::ImageLayout::eUndefined : info.layout;
+    if (info.write_access) {
+        state.write_stages = info.stages;
+        state.write_access = info.write_access;
+    } else {
+        state.read_stages = info.stages;
+    }
+    return state;
+}
+
+// Adds the barrier needed before use to batch, if any, and moves state past
+// the use. A final transition only changes the layout
+static void AddBarrier(RenderGraph::ImageHandle image, ImageState& state,
+                       const AccessInfo& use, bool final_transition,
+                       RenderGraph::BarrierBatch& batch)
+{
+    bool layout_change = state.layout != use.layout;
+    bool write = static_cast<bool>(use.write_access);
+    // A read only has to wait if the last write is not visible to it yet
+    bool unseen_write = state.write_stages &&
+                        (use.stages & ~state.visible_stages);
+    bool needed = final_transition ? layout_change
+                                   : layout_change || write || unseen_write;
+    if (needed) {
+        auto src_stages = state.write_stages;
+        // Only a write or a layout change has to wait for earlier reads
+        if (layout_change || write) {
+            src_stages |= state.read_stages;
+        }
+        if (!src_stages) {
+            src_stages = vk::PipelineStageFlagBits::eTopOfPipe;
+        }
+        batch.src_stages |= src_stages;
+        batch.dst_stages |= use.stages;
+        batch.barriers.push_back({image, state.layout, use.layout,
+                                  state.write_access, use.access});
+    }
+
+    state.layout = use.layout;
+    if (write) {
+        state.write_stages = use.stages;
+        state.write_access = use.write_access;
+        state.read_stages = vk::PipelineStageFlags();
+        state.visible_stages = vk::PipelineStageFlags();
+    } else {
+        state.read_stages |= use.stages;
+        if (needed) {
+            state.visible_stages |= use.stages;
+        }
+    }
+}
+
+std::vector<vk::DeviceSize> PlaceAliasedResources(
+    const std::vector<AliasedResource>& resources, vk::DeviceSize& total_size)
+{
+    std::vector<size_t> by_size(resources.size());
+    std::iota(by_size.begin(), by_size.end(), 0);
+    std::stable_sort(by_size.begin(), by_size.end(), [&](size_t a, size_t b) {
+        return resources[a].size > resources[b].size;
+    });
+
+    auto align = [](vk::DeviceSize offset, vk::DeviceSize alignment) {
+        alignment = std::max<vk::DeviceSize>(alignment, 1);
+        return (offset + alignment - 1) / alignment * alignment;
+    };
+
+    std::vector<vk::DeviceSize> offsets(resources.size(), 0);
+    std::vector<size_t> placed;
+    total_size = 0;
+    for (auto index : by_size) {
+        const auto& resource = resources[index];
+        // Only resources in use at the same time are in the way
+        std::vector<size_t> live;
+        for (auto other : placed) {
+            if (resources[other].first_pass <= resource.last_pass &&
+                resource.first_pass <= resources[other].last_pass) {
+                live.push_back(other);
+            }
+        }
+
+        // The lowest offset that fits is either 0 or right after one of
+        // them
+        std::vector<vk::DeviceSize> candidates = {0};
+        for (auto other : live) {
+            candidates.push_back(
+                align(offsets[other] + resources[other].size,
+                      resource.alignment));
+        }
+        std::sort(candidates.begin(), candidates.end());
+        for (auto offset : candidates) {
+            bool fits = std::none_of(live.begin(), live.end(), [&](size_t o) {
+                return offset < offsets[o] + resources[o].size &&
+                       offsets[o] < offset + resource.size;
+            });
+            if (fits) {
+                offsets[index] = offset;
+                break;
+            }
+        }
+        total_size = std::max(total_size, offsets[index] + resource.size);
+        placed.push_back(index);
+    }
+    return offsets;
+}
+
+bool RenderGraph::TransientImageDesc::operator==(
+    const TransientImageDesc& other) const
+{
+    return std::tie(format, extent, sample_count, usage, aspect) ==
+           std::tie(other.format, other.extent, other.sample_count,
+                    other.usage, other.aspect);
+}
+
+bool RenderGraph::TransientImageDesc::operator!=(
+    const TransientImageDesc& other) const
+{
+    return !(*this == other);
+}
+
+RenderGraph::~RenderGraph() { DestroyTransientImages(device_, realized_); }
+
+void RenderGraph::Reset()
+{
+    images_.clear();
+    transient_descs_.clear();
+    passes_.clear();
+    order_.clear();
+    barriers_.clear();
+    final_barriers_ = {};
+    transient_lifetimes_.clear();
+}
+
+RenderGraph::ImageHandle RenderGraph::ImportImage(
+    const std::string& name, vk::Image image, vk::ImageView view,
+    vk::ImageAspectFlags aspect, ImageAccess initial_access,
+    ImageAccess final_access, bool discard_contents)
+{
+    images_.push_back({name, aspect, image, view, initial_access,
+                       final_access, discard_contents, NOT_TRANSIENT});
+    return static_cast<ImageHandle>(images_.size() - 1);
+}
+
+RenderGraph::ImageHandle RenderGraph::CreateTransientImage(
+    const std::string& name, const TransientImageDesc& desc)
+{
+    ImageResource resource;
+    resource.name = name;
+    resource.aspect = desc.aspect;
+    resource.transient_index = transient_descs_.size();
+    images_.push_back(resource);
+    transient_descs_.push_back(desc);
+    return static_cast<ImageHandle>(images_.size() - 1);
+}
+
+void RenderGraph::AddPass(const std::string& name, std::vector<ImageUse> uses,
+                          RecordFunction record)
+{
+    passes_.push_back({name, std::move(uses), std::move(record)});
+}
+
+void RenderGraph::Compile()
+{
+    // Walking backwards, a pass is needed if anything after it uses what it
+    // writes
+    std::vector<bool> used_later(images_.size(), false);
+    std::vector<bool> kept(passes_.size(), false);
+    for (size_t i = passes_.size(); i-- > 0;) {
+        bool writes = false;
+        bool needed = false;
+        for (const auto& use : passes_[i].uses) {
+            if (GetAccessInfo(use.access).write_access) {
+                writes = true;
+                needed = needed || used_later[use.image] ||
+                         images_[use.image].transient_index == NOT_TRANSIENT;
+            }
+        }
+        kept[i] = !writes || needed;
+        if (kept[i]) {
+            for (const auto& use : passes_[i].uses) {
+                used_later[use.image] = true;
+            }
+        }
+    }
+    order_.clear();
+    for (size_t i = 0; i < passes_.size(); ++i) {
+        if (kept[i]) {
+            order_.push_back(i);
+        }
+    }
+
+    transient_lifetimes_.assign(transient_descs_.size(), {~size_t(0), 0});
+    std::vector<ImageAccess> last_access(images_.size());
+    for (size_t position = 0; position < order_.size(); ++position) {
+        for (const auto& use : passes_[order_[position]].uses) {
+            auto transient = images_[use.image].transient_index;
+            if (transient != NOT_TRANSIENT) {
+                auto& lifetime = transient_lifetimes_[transient];
+                lifetime.first = std::min(lifetime.first, position);
+                lifetime.second = position;
+            }
+            last_access[use.image] = use.access;
+        }
+    }
+
+    // Transient images may share memory with any other, so the first use of
+    // one waits for whatever last touched every transient image, in this
+    // frame or the one before
+    AccessInfo transient_wait;
+    for (size_t i = 0; i < images_.size(); ++i) {
+        auto transient = images_[i].transient_index;
+        if (transient != NOT_TRANSIENT &&
+            transient_lifetimes_[transient].first != ~size_t(0)) {
+            auto info = GetAccessInfo(last_access[i]);
+            transient_wait.stages |= info.stages;
+            transient_wait.write_access |= info.write_access;
+        }
+    }
+
+    std::vector<ImageState> states;
+    for (const auto& image : images_) {
+        if (image.transient_index == NOT_TRANSIENT) {
+            states.push_back(GetInitialState(
+                GetAccessInfo(image.initial_access), image.discard_contents));
+        } else {
+            ImageState state;
+            state.write_stages = transient_wait.stages;
+            state.write_access = transient_wait.write_access;
+            states.push_back(state);
+        }
+    }
+
+    barriers_.assign(order_.size(), {});
+    for (size_t position = 0; position < order_.size(); ++position) {
+        for (const auto& use : passes_[order_[position]].uses) {
+            AddBarrier(use.image, states[use.image],
+                       GetAccessInfo(use.access), false, barriers_[position]);
+        }
+    }
+
+    final_barriers_ = {};
+    for (size_t i = 0; i < images_.size(); ++i) {
+        if (images_[i].transient_index == NOT_TRANSIENT) {
+            AddBarrier(static_cast<ImageHandle>(i), states[i],
+                       GetAccessInfo(images_[i].final_access), true,
+                       final_barriers_);
+        }
+    }
+}
+
+void RenderGraph::Execute(RendererState& renderer,
+                          vk::CommandBuffer& command_buffer)
+{
+    RealizeTransientImages(renderer);
+    for (size_t position = 0; position < order_.size(); ++position) {
+        RecordBarriers(command_buffer, barriers_[position]);
+        auto& pass = passes_[order_[position]];
+        if (pass.record) {
+            pass.record(command_buffer);
+        }
+    }
+    RecordBarriers(command_buffer, final_barriers_);
+}
+
+const std::vector<size_t>& RenderGraph::GetExecutionOrder() const
+{
+    return order_;
+}
+
+const RenderGraph::BarrierBatch& RenderGraph::GetBarriers(
+    size_t position) const
+{
+    return barriers_[position];
+}
+
+const RenderGraph::BarrierBatch& RenderGraph::GetFinalBarriers() const
+{
+    return final_barriers_;
+}
+
+vk::Image RenderGraph::GetImage(ImageHandle image) const
+{
+    auto transient = images_[image].transient_index;
+    if (transient == NOT_TRANSIENT) {
+        return images_[image].image;
+    }
+    assert(transient < realized_.images.size());
+    return realized_.images[transient];
+}
+
+vk::ImageView RenderGraph::GetImageView(ImageHandle image) const
+{
+    auto transient = images_[image].transient_index;
+    if (transient == NOT_TRANSIENT) {
+        return images_[image].view;
+    }
+    assert(transient < realized_.views.size());
+    return realized_.views[transient];
+}
+
+MemoryReport RenderGraph::GetTransientMemoryReport() const
+{
+    MemoryReport report;
+    for (size_t i = 0; i < realized_.memories.size(); ++i) {
+        AddToMemoryReport(report, device_, realized_.memories[i],
+                          realized_.memory_sizes[i],
+                          realized_.memory_properties[i]);
+    }
+    return report;
+}
+
+void RenderGraph::RealizeTransientImages(RendererState& renderer)
+{
+    if (realized_.descs == transient_descs_ &&
+        realized_.lifetimes == transient_lifetimes_) {
+        return;
+    }
+
+    // Frames in flight may still use the old ones
+    if (!realized_.images.empty()) {
+        renderer.DeferDestruction(
+            [device = renderer.GetDevice(), old = realized_]() {
+                DestroyTransientImages(device, old);
+            });
+    }
+    realized_ = {};
+    realized_.descs = transient_descs_;
+    realized_.lifetimes = transient_lifetimes_;
+    device_ = renderer.GetDevice();
+
+    std::vector<vk::MemoryRequirements> requirements;
+    for (const auto& desc : transient_descs_) {
+        vk::ImageCreateInfo image_info(
+            vk::ImageCreateFlags(), vk::ImageType::e2D, desc.format,
+            {desc.extent.width, desc.extent.height, 1}, 1, 1,
+            desc.sample_count, vk::ImageTiling::eOptimal, desc.usage,
+            vk::SharingMode::eExclusive, {}, vk::ImageLayout::eUndefined);
+        auto image = device_.createImage(image_info);
+        realized_.images.push_back(image);
+        requirements.push_back(device_.getImageMemoryRequirements(image));
+    }
+
+    // Only images that end up in the same memory type can alias. Transient
+    // attachments never need backing on tilers if they stay in tile memory
+    auto physical_device = renderer.GetPhysicalDevice();
+    std::map<uint32_t, std::vector<size_t>> by_memory_type;
+    for (size_t i = 0; i < requirements.size(); ++i) {
+        vk::MemoryPropertyFlags preferred;
+        if (transient_descs_[i].usage &
+            vk::ImageUsageFlagBits::eTransientAttachment) {
+            preferred = vk::MemoryPropertyFlagBits::eLazilyAllocated;
+        }
+        auto memory_type = FindMemoryType(
+            physical_device, requirements[i].memoryTypeBits,
+            vk::MemoryPropertyFlagBits::eDeviceLocal, preferred);
+        by_memory_type[memory_type].push_back(i);
+    }
+    auto memory_types = physical_device.getMemoryProperties().memoryTypes;
+    for (const auto& [memory_type, indices] : by_memory_type) {
+        std::vector<AliasedResource> resources;
+        for (auto i : indices) {
+            // Images that are never used are given all of the frame
+            auto lifetime = transient_lifetimes_[i];
+            if (lifetime.first > lifetime.second) {
+                lifetime = {0, ~size_t(0)};
+            }
+            resources.push_back({requirements[i].size,
+                                 requirements[i].alignment, lifetime.first,
+                                 lifetime.second});
+        }
+        vk::DeviceSize size = 0;
+        auto offsets = PlaceAliasedResources(resources, size);
+        auto memory = device_.allocateMemory(
+            vk::MemoryAllocateInfo(size, memory_type));
+        realized_.memories.push_back(memory);
+        realized_.memory_sizes.push_back(size);
+        realized_.memory_properties.push_back(
+            memory_types[memory_type].propertyFlags);
+        for (size_t j = 0; j < indices.size(); ++j) {
+            device_.bindImageMemory(realized_.images[indices[j]], memory,
+                                    offsets[j]);
+        }
+    }
+
+    for (size_t i = 0; i < transient_descs_.size(); ++i) {
+        realized_.views.push_back(
+            CreateImageView(renderer, realized_.images[i],
+                            transient_descs_[i].format,
+                            transient_descs_[i].aspect, 1));
+    }
+}
+
+void RenderGraph::RecordBarriers(vk::CommandBuffer& command_buffer,
+                                 const BarrierBatch& batch) const
+{
+    if (batch.barriers.empty()) {
+        return;
+    }
+    std::vector<vk::ImageMemoryBarrier> image_barriers;
+    for (const auto& barrier : batch.barriers) {
+        image_barriers.emplace_back(
+            barrier.src_access, barrier.dst_access, barrier.old_layout,
+            barrier.new_layout, VK_QUEUE_FAMILY_IGNORED,
+            VK_QUEUE_FAMILY_IGNORED, GetImage(barrier.image),
+            vk::ImageSubresourceRange(images_[barrier.image].aspect, 0,
+                                      VK_REMAINING_MIP_LEVELS, 0,
+                                      VK_REMAINING_ARRAY_LAYERS));
+    }
+    command_buffer.pipelineBarrier(batch.src_stages, batch.dst_stages,
+                                   vk::DependencyFlags(), {}, {},
+                                   image_barriers);
+}
+
+void RenderGraph::DestroyTransientImages(vk::Device device,
+                                         const TransientImages& transients)
+{
+    for (auto view : transients.views) {
+        device.destroyImageView(view);
+    }
+    for (auto image : transients.images) {
+        device.destroyImage(image);
+    }
+    for (auto memory : transients.memories) {
+        device.freeMemory(memory);
+    }
+}
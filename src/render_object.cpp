@@ -9,6 +9,9 @@ RenderObject::RenderObject(RendererState& renderer)
     : device_(renderer.GetDevice()),
       owning_node_(nullptr),
       model_(nullptr),
+      transform_(1),
+      bounds_dirty_(true),
+      occluder_(false),
       object_properties_buffer_(renderer, sizeof(GpuObjectData),
                                 vk::BufferUsageFlagBits::eUniformBuffer,
                                 vk::MemoryPropertyFlagBits::eHostVisible |
@@ -24,7 +27,11 @@ void RenderObject::SetNode(NonOwningPointer<SceneNode> owning_node)
     UpdateTransform();
 }
 
-void RenderObject::SetModel(NonOwningPointer<Model> model) { model_ = model; }
+void RenderObject::SetModel(NonOwningPointer<Model> model)
+{
+    model_ = model;
+    UpdateWorldBounds();
+}
 
 NonOwningPointer<SceneNode> RenderObject::GetNode() { return owning_node_; }
 
@@ -32,14 +39,33 @@ NonOwningPointer<Model> RenderObject::GetModel() { return model_; }
 
 vk::DescriptorSet& RenderObject::GetDescriptorSet() { return object_set_; }
 
+const glm::mat4& RenderObject::GetTransform() const { return transform_; }
+
+const Aabb& RenderObject::GetWorldBounds() const { return world_bounds_; }
+
+const BoundingSphere& RenderObject::GetWorldBoundingSphere() const
+{
+    return world_bounding_sphere_;
+}
+
+bool RenderObject::IsBoundsDirty() const { return bounds_dirty_; }
+
+void RenderObject::ClearBoundsDirty() { bounds_dirty_ = false; }
+
+void RenderObject::SetOccluder(bool occluder) { occluder_ = occluder; }
+
+bool RenderObject::IsOccluder() const { return occluder_; }
+
 void RenderObject::UpdateTransform()
 {
     GpuObjectData object_properties;
     if (!owning_node_) {
-        object_properties.transform = glm::mat4(1);
+        transform_ = glm::mat4(1);
     } else {
-        object_properties.transform = owning_node_->GetTransform();
+        transform_ = owning_node_->GetTransform();
     }
+    object_properties.transform = transform_;
+    UpdateWorldBounds();
 
     void* data = device_.mapMemory(object_properties_buffer_.GetMemory(), 0,
                                    sizeof(GpuObjectData));
@@ -62,4 +88,21 @@ void RenderObject::CreateDescriptorSet(RendererState& renderer)
         object_set_, 0, 0, vk::DescriptorType::eUniformBuffer, {}, buffer_info);
 
     device_.updateDescriptorSets(descriptor_write, {});
-}
\ No newline at end of file
+}
+
+void RenderObject::UpdateWorldBounds()
+{
+    if (!model_) {
+        world_bounds_ = Aabb();
+        world_bounding_sphere_ = BoundingSphere();
+    } else {
+        const auto& local_bounds = model_->GetBounds();
+        world_bounds_ = local_bounds.Transform(transform_);
+
+        BoundingSphere local_sphere;
+        local_sphere.center = local_bounds.GetCenter();
+        local_sphere.radius = glm::length(local_bounds.GetExtents());
+        world_bounding_sphere_ = local_sphere.Transform(transform_);
+    }
+    bounds_dirty_ = true;
+}
@@ -0,0 +1,159 @@
+#include "renderer_settings.h"
+
+#include <algorithm>
+#include <array>
+#include <tuple>
+
+static constexpr std::array<LatencyMode, 3> LATENCY_MODES = {
+    LatencyMode::Low, LatencyMode::Balanced, LatencyMode::HighThroughput};
+
+static constexpr std::array<PresentModePolicy, 4> PRESENT_MODE_POLICIES = {
+    PresentModePolicy::Immediate, PresentModePolicy::Mailbox,
+    PresentModePolicy::Fifo, PresentModePolicy::FifoRelaxed};
+
+RendererSettings RendererSettings::FromLatencyMode(LatencyMode mode)
+{
+    RendererSettings settings;
+    settings.SetLatencyMode(mode);
+    return settings;
+}
+
+void RendererSettings::SetLatencyMode(LatencyMode mode)
+{
+    switch (mode) {
+        case LatencyMode::Low:
+            frames_in_flight = 1;
+            swapchain_image_count = 2;
+            break;
+        case LatencyMode::Balanced:
+            frames_in_flight = 2;
+            swapchain_image_count = 0;
+            break;
+        case LatencyMode::HighThroughput:
+            frames_in_flight = 3;
+            swapchain_image_count = 3;
+            break;
+    }
+}
+
+std::optional<LatencyMode> RendererSettings::GetLatencyMode() const
+{
+    for (auto mode : LATENCY_MODES) {
+        auto preset = FromLatencyMode(mode);
+        if (preset.frames_in_flight == frames_in_flight &&
+            preset.swapchain_image_count == swapchain_image_count) {
+            return mode;
+        }
+    }
+    return std::nullopt;
+}
+
+bool RendererSettings::operator==(const RendererSettings& other) const
+{
+    return std::tie(frames_in_flight, swapchain_image_count, present_mode,
+                    frame_rate_limit, dynamic_rendering, headless_frame_count,
+                    headless_output_directory) ==
+           std::tie(other.frames_in_flight, other.swapchain_image_count,
+                    other.present_mode, other.frame_rate_limit,
+                    other.dynamic_rendering, other.headless_frame_count,
+                    other.headless_output_directory);
+}
+
+bool RendererSettings::operator!=(const RendererSettings& other) const
+{
+    return !(*this == other);
+}
+
+const char* LatencyModeName(LatencyMode mode)
+{
+    switch (mode) {
+        case LatencyMode::Low:
+            return "low-latency";
+        case LatencyMode::Balanced:
+            return "balanced";
+        case LatencyMode::HighThroughput:
+            return "high-throughput";
+    }
+    return "unknown";
+}
+
+std::optional<LatencyMode> ParseLatencyMode(const std::string& name)
+{
+    for (auto mode : LATENCY_MODES) {
+        if (name == LatencyModeName(mode)) {
+            return mode;
+        }
+    }
+    return std::nullopt;
+}
+
+const char* PresentModePolicyName(PresentModePolicy policy)
+{
+    switch (policy) {
+        case PresentModePolicy::Immediate:
+            return "immediate";
+        case PresentModePolicy::Mailbox:
+            return "mailbox";
+        case PresentModePolicy::Fifo:
+            return "fifo";
+        case PresentModePolicy::FifoRelaxed:
+            return "fifo-relaxed";
+    }
+    return "unknown";
+}
+
+std::optional<PresentModePolicy> ParsePresentModePolicy(
+    const std::string& name)
+{
+    for (auto policy : PRESENT_MODE_POLICIES) {
+        if (name == PresentModePolicyName(policy)) {
+            return policy;
+        }
+    }
+    return std::nullopt;
+}
+
+vk::PresentModeKHR ChoosePresentMode(
+    PresentModePolicy policy,
+    const std::vector<vk::PresentModeKHR>& available_present_modes)
+{
+    // FIFO is left out, it is the fallback of every policy
+    std::vector<vk::PresentModeKHR> preferred;
+    switch (policy) {
+        case PresentModePolicy::Immediate:
+            // Mailbox is the next best thing for an uncapped frame rate
+            preferred = {vk::PresentModeKHR::eImmediate,
+                         vk::PresentModeKHR::eMailbox};
+            break;
+        case PresentModePolicy::Mailbox:
+            preferred = {vk::PresentModeKHR::eMailbox};
+            break;
+        case PresentModePolicy::Fifo:
+            break;
+        case PresentModePolicy::FifoRelaxed:
+            preferred = {vk::PresentModeKHR::eFifoRelaxed};
+            break;
+    }
+
+    for (auto present_mode : preferred) {
+        if (std::find(available_present_modes.begin(),
+                      available_present_modes.end(),
+                      present_mode) != available_present_modes.end()) {
+            return present_mode;
+        }
+    }
+    return vk::PresentModeKHR::eFifo;
+}
+
+uint32_t ChooseSwapchainImageCount(uint32_t requested_count,
+                                   uint32_t min_image_count,
+                                   uint32_t max_image_count)
+{
+    uint32_t image_count = requested_count == 0 ? min_image_count + 1
+                                                : requested_count;
+    image_count = std::max(image_count, min_image_count);
+    if (max_image_count > 0) {
+        image_count = std::min(image_count, max_image_count);
+    }
+    return image_count;
+}
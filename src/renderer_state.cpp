@@ -1,10 +1,13 @@
 #include "renderer_state.h"
 
+#include <array>
 #include <iostream>
+#include <memory>
 #include <unordered_map>
 
 #include "swapchain.h"
 #include "texture_cache.h"
+#include "utils.h"
 
 const std::string ENGINE_NAME = "VulkanRenderer";
 
@@ -12,10 +15,16 @@ RendererState::RendererState(
     const std::string name, GLFWwindow* window,
     const std::vector<const char*>& required_instance_extensions,
     const std::vector<const char*>& required_device_extensions,
-    const std::vector<const char*>& layers)
+    const std::vector<const char*>& layers, uint32_t swapchain_image_count,
+    PresentModePolicy present_mode_policy, bool dynamic_rendering,
+    vk::Extent2D headless_extent)
+    : swapchain_image_count_(swapchain_image_count),
+      present_mode_policy_(present_mode_policy)
 {
     instance_ = CreateInstance(name, required_instance_extensions, layers);
-    surface_ = CreateSurface(window);
+    if (window) {
+        surface_ = CreateSurface(window);
+    }
 
     physical_device_ = CreatePhysicalDevice(required_device_extensions);
     max_msaa_samples_ = GetMaxUsableSampleCount();
@@ -25,7 +34,12 @@ RendererState::RendererState(
     queue_families_ = FindQueueFamilies(physical_device_);
 
     std::tie(device_, graphics_queue_, present_queue_, transfer_queue_) =
-        CreateDeviceAndQueues(required_device_extensions, layers);
+        CreateDeviceAndQueues(required_device_extensions, layers,
+                              dynamic_rendering);
+
+    graphics_timeline_.emplace(device_, graphics_queue_);
+    transfer_timeline_.emplace(device_, transfer_queue_);
+    frame_graph_.emplace();
 
     graphics_command_pool_ =
         CreateCommandPool(queue_families_.graphics_family->index);
@@ -33,21 +47,38 @@ RendererState::RendererState(
     transient_command_pool_ =
         CreateCommandPool(queue_families_.transfer_family->index);
 
-    swapchain_.emplace(*this, window);
+    auto depth_format_properties = physical_device_.getFormatProperties(
+        FindDepthFormat(physical_device_));
+    supports_depth_sampling_ =
+        static_cast<bool>(depth_format_properties.optimalTilingFeatures &
+                          vk::FormatFeatureFlagBits::eSampledImage);
+
+    if (window) {
+        swapchain_.emplace(*this, window, swapchain_image_count_,
+                           present_mode_policy_);
+    } else {
+        swapchain_.emplace(*this, headless_extent, swapchain_image_count_);
+    }
     CreateColorResources();
     CreateDepthResources();
 
-    render_pass_ = CreateRenderPass();
+    if (!use_dynamic_rendering_) {
+        scene_render_passes_ = GetRenderPasses(current_msaa_samples_);
+    }
     CreateFramebuffers();
     descriptor_pool_ = CreateDescriptorPool();
     camera_descriptor_set_layout_ = CreateCameraDescriptorSetLayout();
     object_descriptor_set_layout_ = CreateObjectDescriptorSetLayout();
     material_descriptor_set_layout_ = CreateMaterialDescriptorSetLayout();
+    object_storage_descriptor_set_layout_ =
+        CreateObjectStorageDescriptorSetLayout();
 }
 
 RendererState::~RendererState()
 {
     device_.waitIdle();
+    deletion_queue_.Flush();
+    frame_graph_.reset();
 
     for (auto fb : swapchain_frame_buffers_) {
         device_.destroyFramebuffer(fb);
@@ -61,17 +92,26 @@ RendererState::~RendererState()
     device_.destroyImageView(depth_image_view_);
     depth_image_.reset();
 
-    device_.destroyRenderPass(render_pass_);
+    for (auto& [sample_count, render_passes] : render_passes_) {
+        for (auto render_pass : render_passes) {
+            device_.destroyRenderPass(render_pass);
+        }
+    }
     device_.destroyDescriptorSetLayout(camera_descriptor_set_layout_);
     device_.destroyDescriptorSetLayout(object_descriptor_set_layout_);
     device_.destroyDescriptorSetLayout(material_descriptor_set_layout_);
+    device_.destroyDescriptorSetLayout(object_storage_descriptor_set_layout_);
     device_.destroyDescriptorPool(descriptor_pool_);
 
     swapchain_.reset();
     device_.destroyCommandPool(transient_command_pool_);
     device_.destroyCommandPool(graphics_command_pool_);
+    graphics_timeline_.reset();
+    transfer_timeline_.reset();
     device_.destroy();
-    instance_.destroySurfaceKHR(surface_);
+    if (surface_) {
+        instance_.destroySurfaceKHR(surface_);
+    }
     instance_.destroy();
 }
 
@@ -79,6 +119,8 @@ vk::Instance& RendererState::GetInstance() { return instance_; }
 
 vk::SurfaceKHR& RendererState::GetSurface() { return surface_; }
 
+bool RendererState::IsHeadless() { return !surface_; }
+
 vk::PhysicalDevice& RendererState::GetPhysicalDevice()
 {
     return physical_device_;
@@ -93,6 +135,11 @@ vk::CommandPool& RendererState::GetGraphicsCommandPool()
 
 vk::Queue& RendererState::GetGraphicsQueue() { return graphics_queue_; }
 
+uint32_t RendererState::GetGraphicsQueueFamilyIndex()
+{
+    return queue_families_.graphics_family->index;
+}
+
 vk::Queue& RendererState::GetPresentQueue() { return present_queue_; }
 
 vk::CommandPool& RendererState::GetTransientCommandPool()
@@ -102,6 +149,27 @@ vk::CommandPool& RendererState::GetTransientCommandPool()
 
 vk::Queue& RendererState::GetTransferQueue() { return transfer_queue_; }
 
+QueueTimeline& RendererState::GetGraphicsTimeline()
+{
+    return graphics_timeline_.value();
+}
+
+QueueTimeline& RendererState::GetTransferTimeline()
+{
+    return transfer_timeline_.value();
+}
+
+void RendererState::DeferDestruction(DeletionQueue::Deleter deleter)
+{
+    deletion_queue_.Push(graphics_timeline_->GetSubmittedValue(),
+                         std::move(deleter));
+}
+
+void RendererState::CollectRetiredResources()
+{
+    deletion_queue_.Collect(graphics_timeline_->GetCompletedValue());
+}
+
 TextureCache& RendererState::GetTextureCache() { return texture_cache_; }
 
 MaterialCache& RendererState::GetMaterialCache() { return material_cache_; }
@@ -119,8 +187,6 @@ vk::SampleCountFlagBits RendererState::GetCurrentSampleCount()
 void RendererState::UpdateCurrentSampleCount(
     vk::SampleCountFlagBits new_sample_count)
 {
-    device_.waitIdle();
-
     if (new_sample_count > max_msaa_samples_) {
         throw std::runtime_error(
             "New sample count is greater than max sample count!");
@@ -130,55 +196,252 @@ void RendererState::UpdateCurrentSampleCount(
     }
     current_msaa_samples_ = new_sample_count;
 
-    // Destroy the resoures that need to be recreated
-    for (auto fb : swapchain_frame_buffers_) {
-        device_.destroyFramebuffer(fb);
+    // Frames in flight keep drawing to the old attachments while the new
+    // ones are made, the render passes and pipelines are kept per sample
+    // count so switching back and forth reuses them
+    RetireAttachments();
+    if (!use_dynamic_rendering_) {
+        scene_render_passes_ = GetRenderPasses(current_msaa_samples_);
     }
-    device_.destroyImageView(color_image_view_);
-    color_image_.reset();
-    device_.destroyImageView(depth_image_view_);
-    depth_image_.reset();
-    device_.destroyRenderPass(render_pass_);
-
     CreateColorResources();
     CreateDepthResources();
-    render_pass_ = CreateRenderPass();
     CreateFramebuffers();
-    material_cache_.RecreateAllPipelines(*this);
+    material_cache_.SelectPipelines(*this);
 }
 
 void RendererState::RecreateSwapchain(GLFWwindow* window)
 {
     // handle minimization
     int width = 0, height = 0;
-    glfwGetFramebufferSize(window, &width, &height);
-    while (width == 0 || height == 0) {
+    if (window) {
         glfwGetFramebufferSize(window, &width, &height);
-        glfwWaitEvents();
     }
-
-    device_.waitIdle();
-
-    for (auto fb : swapchain_frame_buffers_) {
-        device_.destroyFramebuffer(fb);
+    while (window && (width == 0 || height == 0)) {
+        glfwGetFramebufferSize(window, &width, &height);
+        glfwWaitEvents();
     }
 
-    device_.destroyImageView(color_image_view_);
-    color_image_.reset();
-    device_.destroyImageView(depth_image_view_);
-    depth_image_.reset();
-
-    swapchain_->RecreateSwapchain(*this, window);
+    // Nothing waits for the frames in flight, they finish on the old
+    // swapchain while the new one is created
+    RetireAttachments();
+    swapchain_->RecreateSwapchain(*this, window, swapchain_image_count_,
+                                  present_mode_policy_);
 
     CreateColorResources();
     CreateDepthResources();
     CreateFramebuffers();
-    material_cache_.RecreateAllPipelines(*this);
+}
+
+void RendererState::SetSwapchainImageCount(uint32_t swapchain_image_count)
+{
+    swapchain_image_count_ = swapchain_image_count;
+}
+
+void RendererState::SetPresentModePolicy(PresentModePolicy present_mode_policy)
+{
+    present_mode_policy_ = present_mode_policy;
 }
 
 Swapchain& RendererState::GetSwapchain() { return swapchain_.value(); }
 
-vk::RenderPass& RendererState::GetRenderPass() { return render_pass_; }
+vk::RenderPass& RendererState::GetRenderPass()
+{
+    return scene_render_passes_[static_cast<size_t>(ScenePass::Single)];
+}
+
+RenderGraph& RendererState::BeginFrameGraph(uint32_t image_index)
+{
+    frame_graph_->Reset();
+    scene_attachment_uses_.clear();
+    overlay_attachment_uses_.clear();
+    if (!use_dynamic_rendering_) {
+        return *frame_graph_;
+    }
+
+    // Whatever the last frame left in the swapchain image is not needed,
+    // the frame waits for it to be acquired in the color output stage
+    auto swapchain_image = frame_graph_->ImportImage(
+        "swapchain", swapchain_->GetImages()[image_index],
+        swapchain_->GetImageViews()[image_index],
+        vk::ImageAspectFlagBits::eColor, ImageAccess::ColorAttachment,
+        IsHeadless() ? ImageAccess::TransferRead : ImageAccess::Present,
+        true);
+    // Kept across frames for the Hi-Z pyramid, which samples it in between
+    // scene passes and puts it back the way it was
+    auto depth_image = frame_graph_->ImportImage(
+        "depth", depth_image_->GetImage(), depth_image_view_,
+        vk::ImageAspectFlagBits::eDepth, ImageAccess::DepthAttachment,
+        ImageAccess::DepthAttachment);
+    scene_attachment_uses_ = {
+        {swapchain_image, ImageAccess::ColorAttachment},
+        {depth_image, ImageAccess::DepthAttachment}};
+    overlay_attachment_uses_ = {
+        {swapchain_image, ImageAccess::ColorAttachment}};
+
+    // Only lives until it has been resolved
+    if (current_msaa_samples_ > vk::SampleCountFlagBits::e1) {
+        RenderGraph::TransientImageDesc desc;
+        desc.format = swapchain_->GetImageFormat().format;
+        desc.extent = swapchain_->GetExtent();
+        desc.sample_count = current_msaa_samples_;
+        desc.usage = vk::ImageUsageFlagBits::eTransientAttachment |
+                     vk::ImageUsageFlagBits::eColorAttachment;
+        scene_color_ = frame_graph_->CreateTransientImage("scene color", desc);
+        scene_attachment_uses_.push_back(
+            {scene_color_, ImageAccess::ColorAttachment});
+    }
+    return *frame_graph_;
+}
+
+RenderGraph& RendererState::GetFrameGraph() { return *frame_graph_; }
+
+const std::vector<RenderGraph::ImageUse>&
+RendererState::GetSceneAttachmentUses()
+{
+    return scene_attachment_uses_;
+}
+
+const std::vector<RenderGraph::ImageUse>&
+RendererState::GetOverlayAttachmentUses()
+{
+    return overlay_attachment_uses_;
+}
+
+void RendererState::BeginScenePass(vk::CommandBuffer& command_buffer,
+                                   uint32_t image_index, ScenePass pass,
+                                   bool secondaries)
+{
+    std::array<vk::ClearValue, 2> clear_values;
+    clear_values[0].color.setFloat32({{0.0f, 0.0f, 0.0f, 0.0f}});
+    clear_values[1].depthStencil.setDepth(1.0f);
+    clear_values[1].depthStencil.setStencil(0);
+    vk::Rect2D render_area({0, 0}, swapchain_->GetExtent());
+    // Before the pass begins, a pass of secondaries takes no other commands
+    SetSceneViewport(command_buffer);
+
+    if (!use_dynamic_rendering_) {
+        vk::RenderPassBeginInfo render_pass_info(
+            scene_render_passes_[static_cast<size_t>(pass)],
+            swapchain_frame_buffers_[image_index], render_area, clear_values);
+        auto contents = secondaries
+                            ? vk::SubpassContents::eSecondaryCommandBuffers
+                            : vk::SubpassContents::eInline;
+        command_buffer.beginRenderPass(render_pass_info, contents);
+        return;
+    }
+
+    // Without MSAA the swapchain image is drawn to directly, otherwise it is
+    // the resolve target
+    bool multisampled = current_msaa_samples_ > vk::SampleCountFlagBits::e1;
+    auto load_op = pass == ScenePass::Late ? vk::AttachmentLoadOp::eLoad
+                                           : vk::AttachmentLoadOp::eClear;
+    auto store_op = pass == ScenePass::Early ? vk::AttachmentStoreOp::eStore
+                                             : vk::AttachmentStoreOp::eDontCare;
+    auto swapchain_view = swapchain_->GetImageViews()[image_index];
+    vk::RenderingAttachmentInfoKHR color_attachment(
+        multisampled ? frame_graph_->GetImageView(scene_color_)
+                     : swapchain_view,
+        vk::ImageLayout::eColorAttachmentOptimal,
+        multisampled ? vk::ResolveModeFlagBits::eAverage
+                     : vk::ResolveModeFlagBits::eNone,
+        multisampled ? swapchain_view : vk::ImageView(),
+        vk::ImageLayout::eColorAttachmentOptimal, load_op,
+        multisampled ? store_op : vk::AttachmentStoreOp::eStore,
+        clear_values[0]);
+    vk::RenderingAttachmentInfoKHR depth_attachment(
+        depth_image_view_, vk::ImageLayout::eDepthStencilAttachmentOptimal,
+        vk::ResolveModeFlagBits::eNone, {}, vk::ImageLayout::eUndefined,
+        load_op, store_op, clear_values[1]);
+    vk::RenderingFlagsKHR rendering_flags;
+    if (secondaries) {
+        rendering_flags =
+            vk::RenderingFlagBitsKHR::eContentsSecondaryCommandBuffers;
+    }
+    vk::RenderingInfoKHR rendering_info(rendering_flags, render_area, 1, 0,
+                                        color_attachment, &depth_attachment);
+    command_buffer.beginRenderingKHR(rendering_info);
+}
+
+void RendererState::SetSceneViewport(vk::CommandBuffer& command_buffer)
+{
+    auto extent = swapchain_->GetExtent();
+    command_buffer.setViewport(
+        0, vk::Viewport(0.0f, 0.0f, static_cast<float>(extent.width),
+                        static_cast<float>(extent.height), 0.0f, 1.0f));
+    command_buffer.setScissor(0, vk::Rect2D({0, 0}, extent));
+}
+
+void RendererState::EndScenePass(vk::CommandBuffer& command_buffer,
+                                 bool overlay)
+{
+    if (use_dynamic_rendering_) {
+        command_buffer.endRenderingKHR();
+        return;
+    }
+    // The overlay subpass is part of the same render pass, it is left empty
+    // if something else comes first
+    command_buffer.nextSubpass(vk::SubpassContents::eInline);
+    if (!overlay) {
+        command_buffer.endRenderPass();
+    }
+}
+
+void RendererState::BeginOverlay(vk::CommandBuffer& command_buffer,
+                                 uint32_t image_index)
+{
+    if (!use_dynamic_rendering_) {
+        return;
+    }
+    // Blends over the resolved scene
+    vk::RenderingAttachmentInfoKHR color_attachment(
+        swapchain_->GetImageViews()[image_index],
+        vk::ImageLayout::eColorAttachmentOptimal,
+        vk::ResolveModeFlagBits::eNone, {}, vk::ImageLayout::eUndefined,
+        vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eStore);
+    vk::RenderingInfoKHR rendering_info(vk::RenderingFlagsKHR(),
+                                        {{0, 0}, swapchain_->GetExtent()}, 1,
+                                        0, color_attachment);
+    command_buffer.beginRenderingKHR(rendering_info);
+}
+
+void RendererState::EndOverlay(vk::CommandBuffer& command_buffer)
+{
+    if (use_dynamic_rendering_) {
+        command_buffer.endRenderingKHR();
+    } else {
+        command_buffer.endRenderPass();
+    }
+}
+
+PipelineTarget RendererState::GetSceneTarget()
+{
+    return PipelineTarget::ForSampleCount(*this, current_msaa_samples_);
+}
+
+vk::Framebuffer RendererState::GetFramebuffer(uint32_t image_index)
+{
+    if (use_dynamic_rendering_) {
+        return {};
+    }
+    return swapchain_frame_buffers_[image_index];
+}
+
+bool RendererState::UsesDynamicRendering() { return use_dynamic_rendering_; }
+
+std::array<vk::RenderPass, SCENE_PASS_COUNT> RendererState::GetRenderPasses(
+    vk::SampleCountFlagBits sample_count)
+{
+    auto it = render_passes_.find(sample_count);
+    if (it == render_passes_.end()) {
+        std::array<vk::RenderPass, SCENE_PASS_COUNT> render_passes;
+        for (size_t i = 0; i < SCENE_PASS_COUNT; ++i) {
+            render_passes[i] =
+                CreateRenderPass(static_cast<ScenePass>(i), sample_count);
+        }
+        it = render_passes_.emplace(sample_count, render_passes).first;
+    }
+    return it->second;
+}
 
 vk::DescriptorPool& RendererState::GetDescriptorPool()
 {
@@ -205,10 +468,50 @@ vk::DescriptorSetLayout& RendererState::GetMaterialDescriptorSetLayout()
     return material_descriptor_set_layout_;
 }
 
+vk::DescriptorSetLayout& RendererState::GetObjectStorageDescriptorSetLayout()
+{
+    return object_storage_descriptor_set_layout_;
+}
+
 vk::ImageView& RendererState::GetColorImageView() { return color_image_view_; }
 
 vk::ImageView& RendererState::GetDepthImageView() { return depth_image_view_; }
 
+vk::Image RendererState::GetDepthImage() { return depth_image_->GetImage(); }
+
+vk::Format RendererState::GetDepthFormat()
+{
+    return FindDepthFormat(physical_device_);
+}
+
+MemoryReport RendererState::GetAttachmentMemoryReport()
+{
+    // With dynamic rendering the multisampled color is a frame graph
+    // transient
+    auto report = frame_graph_->GetTransientMemoryReport();
+    for (auto* image : {&color_image_, &depth_image_}) {
+        if (!image->has_value()) {
+            continue;
+        }
+        auto memory = (*image)->GetMemory();
+        auto size = device_.getImageMemoryRequirements((*image)->GetImage())
+                        .size;
+        AddToMemoryReport(report, device_, memory, size,
+                          (*image)->GetMemoryProperties());
+    }
+    return report;
+}
+
+bool RendererState::SupportsDepthSampling()
+{
+    return supports_depth_sampling_;
+}
+
+bool RendererState::SupportsConditionalRendering()
+{
+    return supports_conditional_rendering_;
+}
+
 RendererState::QueueFamilyIndices RendererState::GetQueueFamilies()
 {
     return queue_families_;
@@ -231,6 +534,49 @@ vk::Result RendererState::Present(vk::PresentInfoKHR present_info)
     return present_result;
 }
 
+bool RendererState::SupportsGpuCulling() { return supports_gpu_culling_; }
+
+std::pair<vk::PipelineLayout, vk::Pipeline>
+RendererState::CreateComputePipeline(
+    const std::string& shader_path,
+    const std::vector<vk::DescriptorSetLayout>& set_layouts,
+    const std::vector<vk::PushConstantRange>& push_constant_ranges,
+    const std::vector<std::pair<std::string, std::string>>& macros)
+{
+    auto shader_bin =
+        CompileShader(shader_path, shaderc_glsl_compute_shader, macros);
+
+    vk::ShaderModuleCreateInfo module_info(vk::ShaderModuleCreateFlagBits(),
+                                           shader_bin);
+    auto shader_module = device_.createShaderModule(module_info);
+
+    vk::PipelineShaderStageCreateInfo shader_stage_info(
+        vk::PipelineShaderStageCreateFlags(), vk::ShaderStageFlagBits::eCompute,
+        shader_module, "main");
+
+    vk::PipelineLayoutCreateInfo pipeline_layout_info(
+        vk::PipelineLayoutCreateFlags(), set_layouts, push_constant_ranges);
+
+    auto pipeline_layout = device_.createPipelineLayout(pipeline_layout_info);
+
+    vk::ComputePipelineCreateInfo pipeline_info(
+        vk::PipelineCreateFlags(), shader_stage_info, pipeline_layout);
+
+    vk::Pipeline pipeline;
+    auto result = device_.createComputePipeline({}, pipeline_info);
+    switch (result.result) {
+        case vk::Result::eSuccess:
+            pipeline = result.value;
+            break;
+        case vk::Result::ePipelineCompileRequiredEXT:
+            throw std::runtime_error("Pipeline compile required (WTF?)");
+    }
+
+    device_.destroyShaderModule(shader_module);
+
+    return {pipeline_layout, pipeline};
+}
+
 vk::CommandBuffer RendererState::BeginSingleTimeCommands()
 {
     vk::CommandBufferAllocateInfo alloc_info(
@@ -250,10 +596,8 @@ void RendererState::EndSingleTimeCommands(vk::CommandBuffer command_buffer)
 {
     command_buffer.end();
 
-    vk::SubmitInfo submit_info({}, {}, command_buffer, {});
-
-    transfer_queue_.submit(submit_info);
-    transfer_queue_.waitIdle();
+    // Only waits for this upload, not everything else on the queue
+    transfer_timeline_->Wait(transfer_timeline_->Submit({command_buffer}));
 
     device_.freeCommandBuffers(transient_command_pool_, command_buffer);
 }
@@ -360,7 +704,15 @@ RendererState::QueueFamilyIndices RendererState::FindQueueFamilies(
         if (queue_family.queueFlags & vk::QueueFlagBits::eTransfer) {
             indices.transfer_family = {i, queue_family};
         }
-        if (device.getSurfaceSupportKHR(i, surface_)) {
+        bool can_present = false;
+        if (surface_) {
+            can_present = device.getSurfaceSupportKHR(i, surface_);
+        } else {
+            // Headless frames are never presented, any graphics queue will do
+            can_present = static_cast<bool>(queue_family.queueFlags &
+                                            vk::QueueFlagBits::eGraphics);
+        }
+        if (can_present) {
             indices.present_family = {i, queue_family};
         }
 
@@ -411,15 +763,25 @@ bool RendererState::IsDeviceSuitable(
     auto indices = FindQueueFamilies(device);
     bool extensions_supported =
         CheckDeviceExtensionSupport(required_extensions, device);
-    bool swapchain_adequate = false;
-    if (extensions_supported) {
+    bool swapchain_adequate = !surface_;
+    if (extensions_supported && surface_) {
         auto details = QuerySwapChainSupport(device);
         swapchain_adequate =
             !details.formats.empty() && !details.present_modes.empty();
     }
     auto supported_features = device.getFeatures();
+    // Frames and uploads are synchronized with timeline semaphores
+    bool supports_timeline_semaphores = false;
+    if (device.getProperties().apiVersion >= VK_API_VERSION_1_2) {
+        auto supported_chain =
+            device.getFeatures2<vk::PhysicalDeviceFeatures2,
+                                vk::PhysicalDeviceVulkan12Features>();
+        supports_timeline_semaphores =
+            supported_chain.get<vk::PhysicalDeviceVulkan12Features>()
+                .timelineSemaphore;
+    }
     return indices.IsComplete() && extensions_supported && swapchain_adequate &&
-           supported_features.samplerAnisotropy;
+           supported_features.samplerAnisotropy && supports_timeline_semaphores;
 }
 
 vk::SampleCountFlagBits RendererState::GetMaxUsableSampleCount()
@@ -488,7 +850,8 @@ vk::QueueFamilyProperties RendererState::GetQueueFamilyPropertiesByIndex(
 
 std::tuple<vk::Device, vk::Queue, vk::Queue, vk::Queue>
 RendererState::CreateDeviceAndQueues(const std::vector<const char*> extensions,
-                                     const std::vector<const char*> layers)
+                                     const std::vector<const char*> layers,
+                                     bool dynamic_rendering)
 {
     // TODO deal with max queue counts...
     std::unordered_map<uint32_t, uint32_t> index_to_count_map;
@@ -515,16 +878,93 @@ RendererState::CreateDeviceAndQueues(const std::vector<const char*> extensions,
         queue_create_infos.push_back(info);
     };
 
+    auto supported_features = physical_device_.getFeatures();
+
     vk::PhysicalDeviceFeatures device_features;
     device_features.samplerAnisotropy = VK_TRUE;
     device_features.sampleRateShading = VK_TRUE;
+    device_features.multiDrawIndirect = supported_features.multiDrawIndirect;
+    device_features.drawIndirectFirstInstance =
+        supported_features.drawIndirectFirstInstance;
+
+    // Vulkan 1.2 features can only be chained if the device supports 1.2
+    vk::PhysicalDeviceVulkan12Features vulkan_12_features;
+    bool has_vulkan_12 =
+        physical_device_.getProperties().apiVersion >= VK_API_VERSION_1_2;
+    if (has_vulkan_12) {
+        auto supported_chain =
+            physical_device_.getFeatures2<vk::PhysicalDeviceFeatures2,
+                                          vk::PhysicalDeviceVulkan12Features>();
+        auto& supported_12_features =
+            supported_chain.get<vk::PhysicalDeviceVulkan12Features>();
+        vulkan_12_features.drawIndirectCount =
+            supported_12_features.drawIndirectCount;
+        // Required, see IsDeviceSuitable
+        vulkan_12_features.timelineSemaphore = VK_TRUE;
+    }
+
+    supports_gpu_culling_ = vulkan_12_features.drawIndirectCount &&
+                            device_features.multiDrawIndirect &&
+                            device_features.drawIndirectFirstInstance;
+
+    // Conditional rendering is optional, it is only enabled if both the
+    // extension and the feature are there
+    std::vector<const char*> enabled_extensions = extensions;
+    vk::PhysicalDeviceConditionalRenderingFeaturesEXT
+        conditional_rendering_features;
+    if (has_vulkan_12 &&
+        CheckDeviceExtensionSupport(
+            {VK_EXT_CONDITIONAL_RENDERING_EXTENSION_NAME}, physical_device_)) {
+        auto supported_chain = physical_device_.getFeatures2<
+            vk::PhysicalDeviceFeatures2,
+            vk::PhysicalDeviceConditionalRenderingFeaturesEXT>();
+        conditional_rendering_features.conditionalRendering =
+            supported_chain
+                .get<vk::PhysicalDeviceConditionalRenderingFeaturesEXT>()
+                .conditionalRendering;
+    }
+    supports_conditional_rendering_ =
+        conditional_rendering_features.conditionalRendering;
+    if (supports_conditional_rendering_) {
+        enabled_extensions.push_back(
+            VK_EXT_CONDITIONAL_RENDERING_EXTENSION_NAME);
+        conditional_rendering_features.pNext = vulkan_12_features.pNext;
+        vulkan_12_features.pNext = &conditional_rendering_features;
+    }
+
+    // Dynamic rendering is only used if it was asked for, render passes are
+    // the fallback
+    vk::PhysicalDeviceDynamicRenderingFeaturesKHR dynamic_rendering_features;
+    if (dynamic_rendering && has_vulkan_12 &&
+        CheckDeviceExtensionSupport({VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME},
+                                    physical_device_)) {
+        auto supported_chain = physical_device_.getFeatures2<
+            vk::PhysicalDeviceFeatures2,
+            vk::PhysicalDeviceDynamicRenderingFeaturesKHR>();
+        dynamic_rendering_features.dynamicRendering =
+            supported_chain
+                .get<vk::PhysicalDeviceDynamicRenderingFeaturesKHR>()
+                .dynamicRendering;
+    }
+    use_dynamic_rendering_ = dynamic_rendering_features.dynamicRendering;
+    if (use_dynamic_rendering_) {
+        enabled_extensions.push_back(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
+        dynamic_rendering_features.pNext = vulkan_12_features.pNext;
+        vulkan_12_features.pNext = &dynamic_rendering_features;
+    } else if (dynamic_rendering) {
+        std::cerr << "Dynamic rendering is not supported, using render "
+                     "passes\n";
+    }
 
     vk::DeviceCreateInfo create_info;
+    if (has_vulkan_12) {
+        create_info.pNext = &vulkan_12_features;
+    }
     create_info.pQueueCreateInfos = queue_create_infos.data();
     create_info.queueCreateInfoCount = (uint32_t)queue_create_infos.size();
     create_info.pEnabledFeatures = &device_features;
-    create_info.ppEnabledExtensionNames = extensions.data();
-    create_info.enabledExtensionCount = (uint32_t)extensions.size();
+    create_info.ppEnabledExtensionNames = enabled_extensions.data();
+    create_info.enabledExtensionCount = (uint32_t)enabled_extensions.size();
     create_info.ppEnabledLayerNames = layers.data();
     create_info.enabledLayerCount = (uint32_t)layers.size();
 
@@ -549,6 +989,10 @@ RendererState::CreateDeviceAndQueues(const std::vector<const char*> extensions,
 
 void RendererState::CreateColorResources()
 {
+    if (use_dynamic_rendering_) {
+        return;
+    }
+
     auto extent = swapchain_->GetExtent();
     auto color_format = swapchain_->GetImageFormat().format;
 
@@ -557,7 +1001,8 @@ void RendererState::CreateColorResources()
                          vk::ImageTiling::eOptimal,
                          vk::ImageUsageFlagBits::eTransientAttachment |
                              vk::ImageUsageFlagBits::eColorAttachment,
-                         vk::MemoryPropertyFlagBits::eDeviceLocal);
+                         vk::MemoryPropertyFlagBits::eDeviceLocal,
+                         vk::MemoryPropertyFlagBits::eLazilyAllocated);
     color_image_view_ =
         CreateImageView(*this, color_image_->GetImage(), color_format,
                         vk::ImageAspectFlagBits::eColor, 1);
@@ -567,12 +1012,23 @@ void RendererState::CreateDepthResources()
 {
     vk::Format depth_format = FindDepthFormat(physical_device_);
 
+    // Without sampling there is no Hi-Z pyramid and so no early pass, depth
+    // is then never stored and needs no memory on tilers. Transient images
+    // cannot be sampled
+    vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eDepthStencilAttachment;
+    vk::MemoryPropertyFlags preferred;
+    if (supports_depth_sampling_) {
+        usage |= vk::ImageUsageFlagBits::eSampled;
+    } else {
+        usage |= vk::ImageUsageFlagBits::eTransientAttachment;
+        preferred = vk::MemoryPropertyFlagBits::eLazilyAllocated;
+    }
+
     auto extent = swapchain_->GetExtent();
     depth_image_.emplace(*this, extent.width, extent.height, 1,
                          current_msaa_samples_, depth_format,
-                         vk::ImageTiling::eOptimal,
-                         vk::ImageUsageFlagBits::eDepthStencilAttachment,
-                         vk::MemoryPropertyFlagBits::eDeviceLocal);
+                         vk::ImageTiling::eOptimal, usage,
+                         vk::MemoryPropertyFlagBits::eDeviceLocal, preferred);
 
     depth_image_view_ =
         CreateImageView(*this, depth_image_->GetImage(), depth_format,
@@ -582,6 +1038,33 @@ void RendererState::CreateDepthResources()
                           vk::ImageLayout::eDepthStencilAttachmentOptimal, 1);
 }
 
+void RendererState::RetireAttachments()
+{
+    // GpuImage can only be moved, the deleter has to be copyable
+    std::shared_ptr<GpuImage> color_image;
+    if (color_image_.has_value()) {
+        color_image = std::make_shared<GpuImage>(std::move(*color_image_));
+    }
+    auto depth_image = std::make_shared<GpuImage>(std::move(*depth_image_));
+    color_image_.reset();
+    depth_image_.reset();
+
+    DeferDestruction([device = device_,
+                      framebuffers = std::move(swapchain_frame_buffers_),
+                      color_image_view = color_image_view_,
+                      depth_image_view = depth_image_view_, color_image,
+                      depth_image]() mutable {
+        for (auto framebuffer : framebuffers) {
+            device.destroyFramebuffer(framebuffer);
+        }
+        device.destroyImageView(color_image_view);
+        device.destroyImageView(depth_image_view);
+        color_image.reset();
+        depth_image.reset();
+    });
+    swapchain_frame_buffers_.clear();
+}
+
 vk::CommandPool RendererState::CreateCommandPool(uint32_t queue_index)
 {
     vk::CommandPoolCreateInfo pool_info(
@@ -590,20 +1073,42 @@ vk::CommandPool RendererState::CreateCommandPool(uint32_t queue_index)
     return device_.createCommandPool(pool_info);
 }
 
-vk::RenderPass RendererState::CreateRenderPass()
+vk::RenderPass RendererState::CreateRenderPass(
+    ScenePass pass, vk::SampleCountFlagBits sample_count)
 {
+    bool load = pass == ScenePass::Late;
+    auto load_op =
+        load ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eClear;
+    // Multisampled color and depth are only needed again by the late pass,
+    // the Hi-Z pyramid built in between reads depth as well
+    auto store_op = pass == ScenePass::Early ? vk::AttachmentStoreOp::eStore
+                                             : vk::AttachmentStoreOp::eDontCare;
+
+    bool multisampled = sample_count > vk::SampleCountFlagBits::e1;
+    // Headless frames are copied out instead of presented
+    auto output_layout = IsHeadless() ? vk::ImageLayout::eTransferSrcOptimal
+                                      : vk::ImageLayout::ePresentSrcKHR;
+
+    // Without MSAA this is the swapchain image itself, which leaves the pass
+    // ready to present
     vk::AttachmentDescription color_attachment(
         vk::AttachmentDescriptionFlags(), swapchain_->GetImageFormat().format,
-        current_msaa_samples_, vk::AttachmentLoadOp::eClear,
-        vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare,
-        vk::AttachmentStoreOp::eDontCare, vk::ImageLayout::eUndefined,
-        vk::ImageLayout::eColorAttachmentOptimal);
+        sample_count, load_op,
+        multisampled ? store_op : vk::AttachmentStoreOp::eStore,
+        vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+        vk::ImageLayout::eUndefined,
+        multisampled ? vk::ImageLayout::eColorAttachmentOptimal
+                     : output_layout);
+    if (load) {
+        color_attachment.initialLayout = color_attachment.finalLayout;
+    }
 
     vk::AttachmentDescription depth_attachment(
         vk::AttachmentDescriptionFlags(), FindDepthFormat(physical_device_),
-        current_msaa_samples_, vk::AttachmentLoadOp::eClear,
-        vk::AttachmentStoreOp::eDontCare, vk::AttachmentLoadOp::eDontCare,
-        vk::AttachmentStoreOp::eDontCare, vk::ImageLayout::eUndefined,
+        sample_count, load_op, store_op,
+        vk::AttachmentLoadOp::eDontCare, vk::AttachmentStoreOp::eDontCare,
+        load ? vk::ImageLayout::eDepthStencilAttachmentOptimal
+             : vk::ImageLayout::eUndefined,
         vk::ImageLayout::eDepthStencilAttachmentOptimal);
 
     vk::AttachmentDescription color_attachment_resolve(
@@ -611,7 +1116,7 @@ vk::RenderPass RendererState::CreateRenderPass()
         vk::SampleCountFlagBits::e1, vk::AttachmentLoadOp::eDontCare,
         vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eDontCare,
         vk::AttachmentStoreOp::eDontCare, vk::ImageLayout::eUndefined,
-        vk::ImageLayout::eColorAttachmentOptimal);
+        output_layout);
 
     vk::AttachmentReference color_attachment_ref(
         0, vk::ImageLayout::eColorAttachmentOptimal);
@@ -623,14 +1128,22 @@ vk::RenderPass RendererState::CreateRenderPass()
         2, vk::ImageLayout::eColorAttachmentOptimal);
 
     // if the sample count is 1, then we cannot use a resolve attachment
-    vk::SubpassDescription subpass(
+    vk::SubpassDescription scene_subpass(
         vk::SubpassDescriptionFlags(), vk::PipelineBindPoint::eGraphics, {},
         color_attachment_ref, {},
         &depth_attachment_ref, {});
-    if (current_msaa_samples_ > vk::SampleCountFlagBits::e1) {
-        subpass.setResolveAttachments(color_attachment_resolve_ref);
+    if (multisampled) {
+        scene_subpass.setResolveAttachments(color_attachment_resolve_ref);
     }
 
+    // The overlay is drawn straight onto the single sampled swapchain image
+    // in the same pass, it never goes back to memory in between
+    vk::SubpassDescription overlay_subpass(
+        vk::SubpassDescriptionFlags(), vk::PipelineBindPoint::eGraphics, {},
+        multisampled ? color_attachment_resolve_ref : color_attachment_ref);
+    std::array<vk::SubpassDescription, 2> subpasses = {scene_subpass,
+                                                       overlay_subpass};
+
     vk::SubpassDependency dependency(
         VK_SUBPASS_EXTERNAL, 0,
         vk::PipelineStageFlagBits::eColorAttachmentOutput |
@@ -640,21 +1153,61 @@ vk::RenderPass RendererState::CreateRenderPass()
         vk::AccessFlagBits{0},
         vk::AccessFlagBits::eColorAttachmentWrite |
             vk::AccessFlagBits::eDepthStencilAttachmentWrite);
+    if (load) {
+        // Wait for the previous pass to finish writing before loading
+        dependency.srcStageMask |=
+            vk::PipelineStageFlagBits::eLateFragmentTests;
+        dependency.dstStageMask |=
+            vk::PipelineStageFlagBits::eLateFragmentTests;
+        dependency.srcAccessMask =
+            vk::AccessFlagBits::eColorAttachmentWrite |
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+        dependency.dstAccessMask |=
+            vk::AccessFlagBits::eColorAttachmentRead |
+            vk::AccessFlagBits::eDepthStencilAttachmentRead;
+    }
+
+    // The overlay blends over the scene once it has been written, or
+    // resolved, which also happens in the color attachment output stage
+    vk::SubpassDependency overlay_dependency(
+        0, OVERLAY_SUBPASS, vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::PipelineStageFlagBits::eColorAttachmentOutput,
+        vk::AccessFlagBits::eColorAttachmentWrite,
+        vk::AccessFlagBits::eColorAttachmentRead |
+            vk::AccessFlagBits::eColorAttachmentWrite,
+        vk::DependencyFlagBits::eByRegion);
+    std::vector<vk::SubpassDependency> dependencies = {dependency,
+                                                       overlay_dependency};
+    // The implicit dependency at the end only reaches bottom of pipe, which
+    // a readback copy would not wait for. This orders the copy after the
+    // final layout transition
+    if (IsHeadless()) {
+        dependencies.emplace_back(
+            OVERLAY_SUBPASS, VK_SUBPASS_EXTERNAL,
+            vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::AccessFlagBits::eColorAttachmentWrite,
+            vk::AccessFlagBits::eTransferRead);
+    }
 
     std::vector<vk::AttachmentDescription> attachments = {color_attachment,
                                                           depth_attachment};
-    if (current_msaa_samples_ > vk::SampleCountFlagBits::e1) {
+    if (multisampled) {
         attachments.push_back(color_attachment_resolve);
     }
 
-    vk::RenderPassCreateInfo render_pass_info(vk::RenderPassCreateFlags(),
-                                              attachments, subpass, dependency);
+    vk::RenderPassCreateInfo render_pass_info(
+        vk::RenderPassCreateFlags(), attachments, subpasses, dependencies);
 
     return device_.createRenderPass(render_pass_info);
 }
 
 void RendererState::CreateFramebuffers()
 {
+    if (use_dynamic_rendering_) {
+        return;
+    }
+
     auto image_count = swapchain_->GetActualImageCount();
     swapchain_frame_buffers_.resize(image_count);
     auto& image_views = swapchain_->GetImageViews();
@@ -674,7 +1227,7 @@ void RendererState::CreateFramebuffers()
         }
 
         vk::FramebufferCreateInfo framebuffer_info(
-            vk::FramebufferCreateFlags(), render_pass_, attachments,
+            vk::FramebufferCreateFlags(), GetRenderPass(), attachments,
             extent.width, extent.height, 1);
 
         swapchain_frame_buffers_[i] =
@@ -726,6 +1279,23 @@ vk::DescriptorSetLayout RendererState::CreateObjectDescriptorSetLayout()
     return device_.createDescriptorSetLayout(layout_info);
 }
 
+vk::DescriptorSetLayout RendererState::CreateObjectStorageDescriptorSetLayout()
+{
+    // Used by indirect draws, where the vertex shader indexes every object's
+    // data with gl_InstanceIndex instead of binding a set per object
+    vk::DescriptorSetLayoutBinding object_layout_binding(
+        0, vk::DescriptorType::eStorageBuffer, 1,
+        vk::ShaderStageFlagBits::eVertex);
+
+    std::array<vk::DescriptorSetLayoutBinding, 1> bindings = {
+        object_layout_binding};
+
+    vk::DescriptorSetLayoutCreateInfo layout_info(
+        vk::DescriptorSetLayoutCreateFlags(), bindings);
+
+    return device_.createDescriptorSetLayout(layout_info);
+}
+
 vk::DescriptorSetLayout RendererState::CreateMaterialDescriptorSetLayout()
 {
     vk::DescriptorSetLayoutBinding sampler_layout_binding(
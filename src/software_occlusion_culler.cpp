@@ -0,0 +1,321 @@
+#include "software_occlusion_culler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "thread_pool.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SOFTWARE_OCCLUSION_SSE
+#include <immintrin.h>
+#endif
+
+// Lets an occluder's own surface pass the test against its bounding box
+// despite rounding
+constexpr float DEPTH_BIAS = 1e-6f;
+
+// Rejects triangles that are too thin to cover a pixel center reliably
+constexpr float MIN_TRIANGLE_AREA = 1e-8f;
+
+struct ProjectedPoint
+{
+    glm::vec3 screen;
+    // False when the point is behind the near plane
+    bool valid;
+};
+
+static ProjectedPoint ProjectPoint(const glm::mat4& viewproj,
+                                   const glm::vec3& point, uint32_t width,
+                                   uint32_t height)
+{
+    glm::vec4 clip = viewproj * glm::vec4(point, 1.0f);
+    if (clip.w <= 0.0f || clip.z < 0.0f) {
+        return {glm::vec3(0.0f), false};
+    }
+
+    glm::vec3 ndc = glm::vec3(clip) / clip.w;
+    // The vertex shader flips y, so +1 is the top row
+    return {glm::vec3((ndc.x * 0.5f + 0.5f) * width,
+                      (0.5f - ndc.y * 0.5f) * height, ndc.z),
+            true};
+}
+
+// Pixel containing the coordinate, clamped to the buffer
+static uint32_t ToPixel(float coordinate, uint32_t size)
+{
+    return static_cast<uint32_t>(
+        std::clamp(coordinate, 0.0f, static_cast<float>(size - 1)));
+}
+
+SoftwareOcclusionCuller::SoftwareOcclusionCuller(uint32_t width,
+                                                 uint32_t height)
+    : tiles_x_((width + TILE_WIDTH - 1) / TILE_WIDTH),
+      tiles_y_((height + TILE_HEIGHT - 1) / TILE_HEIGHT),
+      viewproj_(1)
+{
+    width_ = tiles_x_ * TILE_WIDTH;
+    height_ = tiles_y_ * TILE_HEIGHT;
+    depth_buffer_.resize(width_ * height_, 1.0f);
+    tile_bins_.resize(tiles_x_ * tiles_y_);
+}
+
+uint32_t SoftwareOcclusionCuller::GetWidth() const { return width_; }
+
+uint32_t SoftwareOcclusionCuller::GetHeight() const { return height_; }
+
+void SoftwareOcclusionCuller::BeginFrame(const glm::mat4& viewproj)
+{
+    viewproj_ = viewproj;
+    std::fill(depth_buffer_.begin(), depth_buffer_.end(), 1.0f);
+    triangles_.clear();
+    for (auto& bin : tile_bins_) {
+        bin.clear();
+    }
+}
+
+void SoftwareOcclusionCuller::AddOccluder(
+    const std::vector<glm::vec3>& positions,
+    const std::vector<uint32_t>& indices, const glm::mat4& transform)
+{
+    glm::mat4 mvp = viewproj_ * transform;
+
+    std::vector<ProjectedPoint> projected;
+    projected.reserve(positions.size());
+    for (const auto& position : positions) {
+        projected.push_back(ProjectPoint(mvp, position, width_, height_));
+    }
+
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        const auto& p0 = projected[indices[i + 0]];
+        const auto& p1 = projected[indices[i + 1]];
+        const auto& p2 = projected[indices[i + 2]];
+        if (!p0.valid || !p1.valid || !p2.valid) {
+            continue;
+        }
+
+        // Occluders are rasterized double sided, so just fix up the winding
+        ScreenTriangle triangle{{p0.screen, p1.screen, p2.screen}};
+        glm::vec3 edge1 = triangle.vertices[1] - triangle.vertices[0];
+        glm::vec3 edge2 = triangle.vertices[2] - triangle.vertices[0];
+        float area = edge1.x * edge2.y - edge1.y * edge2.x;
+        if (std::abs(area) < MIN_TRIANGLE_AREA) {
+            continue;
+        }
+        if (area < 0.0f) {
+            std::swap(triangle.vertices[1], triangle.vertices[2]);
+        }
+
+        glm::vec3 min = glm::min(triangle.vertices[0],
+                                 glm::min(triangle.vertices[1],
+                                          triangle.vertices[2]));
+        glm::vec3 max = glm::max(triangle.vertices[0],
+                                 glm::max(triangle.vertices[1],
+                                          triangle.vertices[2]));
+        if (max.x < 0.0f || max.y < 0.0f || min.x >= width_ ||
+            min.y >= height_) {
+            continue;
+        }
+
+        uint32_t tile_x0 = ToPixel(min.x, width_) / TILE_WIDTH;
+        uint32_t tile_y0 = ToPixel(min.y, height_) / TILE_HEIGHT;
+        uint32_t tile_x1 = ToPixel(max.x, width_) / TILE_WIDTH;
+        uint32_t tile_y1 = ToPixel(max.y, height_) / TILE_HEIGHT;
+
+        auto triangle_index = static_cast<uint32_t>(triangles_.size());
+        triangles_.push_back(triangle);
+        for (uint32_t ty = tile_y0; ty <= tile_y1; ++ty) {
+            for (uint32_t tx = tile_x0; tx <= tile_x1; ++tx) {
+                tile_bins_[ty * tiles_x_ + tx].push_back(triangle_index);
+            }
+        }
+    }
+}
+
+void SoftwareOcclusionCuller::Rasterize(ThreadPool& thread_pool)
+{
+    // Tiles don't share pixels, so they need no synchronization
+    thread_pool.ParallelFor(tile_bins_.size(), [this](size_t tile_index) {
+        RasterizeTile(static_cast<uint32_t>(tile_index));
+    });
+}
+
+void SoftwareOcclusionCuller::RasterizeTile(uint32_t tile_index)
+{
+    uint32_t tile_x0 = (tile_index % tiles_x_) * TILE_WIDTH;
+    uint32_t tile_y0 = (tile_index / tiles_x_) * TILE_HEIGHT;
+    uint32_t tile_x1 = tile_x0 + TILE_WIDTH - 1;
+    uint32_t tile_y1 = tile_y0 + TILE_HEIGHT - 1;
+
+    for (uint32_t triangle_index : tile_bins_[tile_index]) {
+        const auto& v = triangles_[triangle_index].vertices;
+
+        // Edge function i is positive on the same side of the edge opposite
+        // vertex i as vertex i itself: e(x, y) = a * x + b * y + c
+        float edge_a[3];
+        float edge_b[3];
+        float edge_c[3];
+        for (int i = 0; i < 3; ++i) {
+            const auto& from = v[(i + 1) % 3];
+            const auto& to = v[(i + 2) % 3];
+            edge_a[i] = from.y - to.y;
+            edge_b[i] = to.x - from.x;
+            edge_c[i] = from.x * to.y - from.y * to.x;
+        }
+
+        // The edge functions are barycentric weights scaled by the area, so
+        // they also give the depth plane
+        float area = edge_a[0] * v[0].x + edge_b[0] * v[0].y + edge_c[0];
+        float inverse_area = 1.0f / area;
+        float depth_a = (edge_a[0] * v[0].z + edge_a[1] * v[1].z +
+                         edge_a[2] * v[2].z) *
+                        inverse_area;
+        float depth_b = (edge_b[0] * v[0].z + edge_b[1] * v[1].z +
+                         edge_b[2] * v[2].z) *
+                        inverse_area;
+        float depth_c = (edge_c[0] * v[0].z + edge_c[1] * v[1].z +
+                         edge_c[2] * v[2].z) *
+                        inverse_area;
+
+        float min_x = std::min({v[0].x, v[1].x, v[2].x});
+        float min_y = std::min({v[0].y, v[1].y, v[2].y});
+        float max_x = std::max({v[0].x, v[1].x, v[2].x});
+        float max_y = std::max({v[0].y, v[1].y, v[2].y});
+        uint32_t x0 = std::max(tile_x0, ToPixel(min_x, width_));
+        uint32_t y0 = std::max(tile_y0, ToPixel(min_y, height_));
+        uint32_t x1 = std::min(tile_x1, ToPixel(max_x, width_));
+        uint32_t y1 = std::min(tile_y1, ToPixel(max_y, height_));
+        if (x0 > x1 || y0 > y1) {
+            continue;
+        }
+
+#ifdef SOFTWARE_OCCLUSION_SSE
+        // Four pixels at a time, starting on a 4 pixel boundary. Tiles are a
+        // multiple of 4 wide so this never leaves the tile
+        x0 &= ~3u;
+        const __m128 lane_offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        const __m128 zero = _mm_setzero_ps();
+        __m128 a0 = _mm_set1_ps(edge_a[0]);
+        __m128 a1 = _mm_set1_ps(edge_a[1]);
+        __m128 a2 = _mm_set1_ps(edge_a[2]);
+        __m128 da = _mm_set1_ps(depth_a);
+        for (uint32_t y = y0; y <= y1; ++y) {
+            float py = y + 0.5f;
+            __m128 row0 = _mm_set1_ps(edge_b[0] * py + edge_c[0]);
+            __m128 row1 = _mm_set1_ps(edge_b[1] * py + edge_c[1]);
+            __m128 row2 = _mm_set1_ps(edge_b[2] * py + edge_c[2]);
+            __m128 row_depth = _mm_set1_ps(depth_b * py + depth_c);
+            float* row = &depth_buffer_[y * width_];
+            for (uint32_t x = x0; x <= x1; x += 4) {
+                __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane_offsets);
+                __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), row0);
+                __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), row1);
+                __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), row2);
+                __m128 inside = _mm_and_ps(
+                    _mm_cmpge_ps(e0, zero),
+                    _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+                if (_mm_movemask_ps(inside) == 0) {
+                    continue;
+                }
+
+                __m128 depth = _mm_add_ps(_mm_mul_ps(da, px), row_depth);
+                __m128 old_depth = _mm_loadu_ps(&row[x]);
+                __m128 new_depth = _mm_min_ps(old_depth, depth);
+                _mm_storeu_ps(&row[x],
+                              _mm_or_ps(_mm_and_ps(inside, new_depth),
+                                        _mm_andnot_ps(inside, old_depth)));
+            }
+        }
+#else
+        for (uint32_t y = y0; y <= y1; ++y) {
+            float py = y + 0.5f;
+            float* row = &depth_buffer_[y * width_];
+            for (uint32_t x = x0; x <= x1; ++x) {
+                float px = x + 0.5f;
+                bool inside = true;
+                for (int i = 0; i < 3; ++i) {
+                    float edge = edge_a[i] * px + edge_b[i] * py + edge_c[i];
+                    inside = inside && edge >= 0.0f;
+                }
+                if (inside) {
+                    float depth = depth_a * px + depth_b * py + depth_c;
+                    row[x] = std::min(row[x], depth);
+                }
+            }
+        }
+#endif
+    }
+}
+
+bool SoftwareOcclusionCuller::IsVisible(const Aabb& bounds) const
+{
+    glm::vec3 min(std::numeric_limits<float>::max());
+    glm::vec3 max(std::numeric_limits<float>::lowest());
+    for (int corner = 0; corner < 8; ++corner) {
+        glm::vec3 point((corner & 1) ? bounds.max.x : bounds.min.x,
+                        (corner & 2) ? bounds.max.y : bounds.min.y,
+                        (corner & 4) ? bounds.max.z : bounds.min.z);
+        auto projected = ProjectPoint(viewproj_, point, width_, height_);
+        if (!projected.valid) {
+            // Boxes crossing the near plane cover the camera, assume visible
+            return true;
+        }
+        min = glm::min(min, projected.screen);
+        max = glm::max(max, projected.screen);
+    }
+
+    if (max.x < 0.0f || max.y < 0.0f || min.x >= width_ || min.y >= height_) {
+        // Off screen, leave that to frustum culling
+        return true;
+    }
+
+    // Every pixel the projected box touches
+    uint32_t x0 = ToPixel(min.x, width_);
+    uint32_t y0 = ToPixel(min.y, height_);
+    uint32_t x1 = ToPixel(max.x, width_);
+    uint32_t y1 = ToPixel(max.y, height_);
+    float nearest_depth = min.z - DEPTH_BIAS;
+
+#ifdef SOFTWARE_OCCLUSION_SSE
+    const __m128 depth = _mm_set1_ps(nearest_depth);
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i first = _mm_set1_epi32(static_cast<int>(x0) - 1);
+    const __m128i last = _mm_set1_epi32(static_cast<int>(x1) + 1);
+    uint32_t aligned_x0 = x0 & ~3u;
+    for (uint32_t y = y0; y <= y1; ++y) {
+        const float* row = &depth_buffer_[y * width_];
+        for (uint32_t x = aligned_x0; x <= x1; x += 4) {
+            // Mask off the lanes left of x0 and right of x1
+            __m128i lane_x =
+                _mm_add_epi32(_mm_set1_epi32(static_cast<int>(x)), lanes);
+            __m128 in_range = _mm_castsi128_ps(_mm_and_si128(
+                _mm_cmpgt_epi32(lane_x, first), _mm_cmplt_epi32(lane_x, last)));
+            __m128 behind = _mm_cmpge_ps(_mm_loadu_ps(&row[x]), depth);
+            if (_mm_movemask_ps(_mm_and_ps(in_range, behind)) != 0) {
+                return true;
+            }
+        }
+    }
+#else
+    for (uint32_t y = y0; y <= y1; ++y) {
+        const float* row = &depth_buffer_[y * width_];
+        for (uint32_t x = x0; x <= x1; ++x) {
+            if (row[x] >= nearest_depth) {
+                return true;
+            }
+        }
+    }
+#endif
+
+    return false;
+}
+
+size_t SoftwareOcclusionCuller::GetOccluderTriangleCount() const
+{
+    return triangles_.size();
+}
+
+const std::vector<float>& SoftwareOcclusionCuller::GetDepthBuffer() const
+{
+    return depth_buffer_;
+}
@@ -1,31 +1,83 @@
 #include "swapchain.h"
 
+#include <memory>
+
 #include "renderer_state.h"
 #include "utils.h"
 
-Swapchain::Swapchain(RendererState& renderer, GLFWwindow* window)
+Swapchain::Swapchain(RendererState& renderer, GLFWwindow* window,
+                     uint32_t requested_image_count,
+                     PresentModePolicy present_mode_policy)
     : device_(renderer.GetDevice())
 {
-    CreateSwapchain(renderer, window);
+    CreateSwapchain(renderer, window, requested_image_count,
+                    present_mode_policy);
+    CreateSwapchainImageViews(renderer);
+}
+
+Swapchain::Swapchain(RendererState& renderer, vk::Extent2D extent,
+                     uint32_t requested_image_count)
+    : device_(renderer.GetDevice()), offscreen_(true)
+{
+    swapchain_extent_ = extent;
+    CreateOffscreenImages(renderer, requested_image_count);
     CreateSwapchainImageViews(renderer);
 }
 
 Swapchain::~Swapchain() { Cleanup(); }
 
-void Swapchain::RecreateSwapchain(RendererState& renderer, GLFWwindow* window)
+void Swapchain::RecreateSwapchain(RendererState& renderer, GLFWwindow* window,
+                                  uint32_t requested_image_count,
+                                  PresentModePolicy present_mode_policy)
 {
-    Cleanup();
-
-    CreateSwapchain(renderer, window);
+    // Handing the old swapchain over lets the presentation engine keep
+    // showing its images until the new ones arrive. Frames in flight may
+    // still render to and present them, so it is retired instead of
+    // destroyed
+    auto old_swapchain = swapchain_;
+    auto old_image_views = std::move(swapchain_image_views_);
+    swapchain_image_views_.clear();
+    // GpuImage can only be moved, the deleter has to be copyable
+    auto old_images = std::make_shared<std::vector<GpuImage>>(
+        std::move(offscreen_images_));
+    offscreen_images_.clear();
+
+    if (offscreen_) {
+        CreateOffscreenImages(renderer, requested_image_count);
+    } else {
+        CreateSwapchain(renderer, window, requested_image_count,
+                        present_mode_policy, old_swapchain);
+    }
     CreateSwapchainImageViews(renderer);
+
+    retired_swapchains_.push_back([device = device_, old_swapchain,
+                                   old_image_views, old_images]() mutable {
+        for (auto image_view : old_image_views) {
+            device.destroyImageView(image_view);
+        }
+        device.destroySwapchainKHR(old_swapchain);
+        old_images.reset();
+    });
+}
+
+void Swapchain::ReleaseRetiredSwapchains(RendererState& renderer)
+{
+    for (auto& deleter : retired_swapchains_) {
+        renderer.DeferDestruction(std::move(deleter));
+    }
+    retired_swapchains_.clear();
 }
 
 vk::SwapchainKHR Swapchain::GetSwapchain() { return swapchain_; }
 
+bool Swapchain::IsOffscreen() { return offscreen_; }
+
 uint32_t Swapchain::GetMinimumImageCount() { return min_image_count_; }
 
 uint32_t Swapchain::GetActualImageCount() { return image_count_; }
 
+vk::PresentModeKHR Swapchain::GetPresentMode() { return present_mode_; }
+
 std::vector<vk::Image>& Swapchain::GetImages() { return swapchain_images_; }
 
 vk::SurfaceFormatKHR& Swapchain::GetImageFormat()
@@ -49,6 +101,11 @@ void Swapchain::Cleanup()
         device_.destroyImageView(image_view);
     }
     device_.destroySwapchainKHR(swapchain_);
+    // The device is idle by now
+    for (auto& deleter : retired_swapchains_) {
+        deleter();
+    }
+    retired_swapchains_.clear();
 }
 
 vk::SurfaceFormatKHR Swapchain::ChooseSwapSurfaceFormat(
@@ -64,18 +121,6 @@ vk::SurfaceFormatKHR Swapchain::ChooseSwapSurfaceFormat(
     return available_formats[0];
 }
 
-vk::PresentModeKHR Swapchain::ChooseSwapPresentMode(
-    const std::vector<vk::PresentModeKHR>& available_present_modes)
-{
-    for (const auto& present_mode : available_present_modes) {
-        if (present_mode == vk::PresentModeKHR::eMailbox) {
-            return present_mode;
-        }
-    }
-
-    return vk::PresentModeKHR::eFifo;
-}
-
 vk::Extent2D Swapchain::ChooseSwapExtent(
     GLFWwindow* window, const vk::SurfaceCapabilitiesKHR& capabilities)
 {
@@ -100,19 +145,21 @@ vk::Extent2D Swapchain::ChooseSwapExtent(
     }
 }
 
-void Swapchain::CreateSwapchain(RendererState& renderer, GLFWwindow* window)
+void Swapchain::CreateSwapchain(RendererState& renderer, GLFWwindow* window,
+                                uint32_t requested_image_count,
+                                PresentModePolicy present_mode_policy,
+                                vk::SwapchainKHR old_swapchain)
 {
     auto details = renderer.QuerySwapChainSupport(renderer.GetPhysicalDevice());
 
     auto surface_format = ChooseSwapSurfaceFormat(details.formats);
-    auto present_mode = ChooseSwapPresentMode(details.present_modes);
+    auto present_mode =
+        ChoosePresentMode(present_mode_policy, details.present_modes);
     auto extent = ChooseSwapExtent(window, details.capabilities);
 
-    min_image_count_ = details.capabilities.minImageCount + 1;
-    if (details.capabilities.maxImageCount > 0) {
-        min_image_count_ =
-            std::min(min_image_count_, details.capabilities.maxImageCount);
-    }
+    min_image_count_ = ChooseSwapchainImageCount(
+        requested_image_count, details.capabilities.minImageCount,
+        details.capabilities.maxImageCount);
 
     auto indices = renderer.GetQueueFamilies();
     uint32_t queue_family_indices[] = {indices.graphics_family.value().index,
@@ -135,11 +182,13 @@ void Swapchain::CreateSwapchain(RendererState& renderer, GLFWwindow* window)
         vk::ImageUsageFlagBits::eColorAttachment, sharing_mode,
         queue_family_index_count, queue_family_indices_arg,
         details.capabilities.currentTransform,
-        vk::CompositeAlphaFlagBitsKHR::eOpaque, present_mode, VK_TRUE);
+        vk::CompositeAlphaFlagBitsKHR::eOpaque, present_mode, VK_TRUE,
+        old_swapchain);
 
     swapchain_ = renderer.GetDevice().createSwapchainKHR(swap_chain_info);
     swapchain_images_ = renderer.GetDevice().getSwapchainImagesKHR(swapchain_);
     image_count_ = (uint32_t)swapchain_images_.size();
+    present_mode_ = present_mode;
     swapchain_image_format_ = surface_format;
     swapchain_extent_ = extent;
 }
@@ -149,6 +198,11 @@ vk::ResultValue<uint32_t> Swapchain::GetNextImage(uint64_t timeout,
                                                   vk::Fence fence)
 {
     vk::ResultValue<uint32_t> result(vk::Result::eSuccess, 0);
+    if (offscreen_) {
+        result.value = next_offscreen_image_;
+        next_offscreen_image_ = (next_offscreen_image_ + 1) % image_count_;
+        return result;
+    }
     try {
         result =
             device_.acquireNextImageKHR(swapchain_, timeout, semaphore, {});
@@ -162,6 +216,43 @@ vk::ResultValue<uint32_t> Swapchain::GetNextImage(uint64_t timeout,
     return result;
 }
 
+void Swapchain::CreateOffscreenImages(RendererState& renderer,
+                                      uint32_t requested_image_count)
+{
+    // The same format a surface is asked for first, if it can be drawn to
+    // and copied from
+    swapchain_image_format_ = {vk::Format::eR8G8B8A8Srgb,
+                               vk::ColorSpaceKHR::eSrgbNonlinear};
+    auto required_features = vk::FormatFeatureFlagBits::eColorAttachment |
+                             vk::FormatFeatureFlagBits::eTransferSrc;
+    auto features = renderer.GetPhysicalDevice()
+                        .getFormatProperties(vk::Format::eB8G8R8A8Srgb)
+                        .optimalTilingFeatures;
+    if ((features & required_features) == required_features) {
+        swapchain_image_format_.format = vk::Format::eB8G8R8A8Srgb;
+    }
+
+    // No image is ever held by a presentation engine, so any count works
+    min_image_count_ = 1;
+    image_count_ = ChooseSwapchainImageCount(requested_image_count,
+                                             min_image_count_, 0);
+    present_mode_ = vk::PresentModeKHR::eImmediate;
+    next_offscreen_image_ = 0;
+
+    offscreen_images_.reserve(image_count_);
+    swapchain_images_.clear();
+    for (uint32_t i = 0; i < image_count_; ++i) {
+        offscreen_images_.emplace_back(
+            renderer, swapchain_extent_.width, swapchain_extent_.height, 1,
+            vk::SampleCountFlagBits::e1, swapchain_image_format_.format,
+            vk::ImageTiling::eOptimal,
+            vk::ImageUsageFlagBits::eColorAttachment |
+                vk::ImageUsageFlagBits::eTransferSrc,
+            vk::MemoryPropertyFlagBits::eDeviceLocal);
+        swapchain_images_.push_back(offscreen_images_.back().GetImage());
+    }
+}
+
 void Swapchain::CreateSwapchainImageViews(RendererState& renderer)
 {
     swapchain_image_views_.resize(image_count_);
@@ -17,6 +17,13 @@ Texture::Texture(RendererState& renderer, std::string texture_path)
         throw std::runtime_error("failed to load texture image");
     }
 
+    for (vk::DeviceSize i = 3; i < image_size; i += 4) {
+        if (pixels[i] != 255) {
+            has_transparency_ = true;
+            break;
+        }
+    }
+
     mip_levels_ = static_cast<uint32_t>(std::floor(
                       std::log2(std::max(texture_width, texture_height)))) +
                   1;
@@ -65,10 +72,14 @@ vk::ImageView Texture::GetImageView() { return image_view_; }
 
 uint32_t Texture::GetMipLevels() { return mip_levels_; }
 
+bool Texture::HasTransparency() const { return has_transparency_; }
+
 void Texture::MoveFrom(Texture&& other)
 {
     device_ = other.device_;
     image_ = std::move(other.image_);
     image_view_ = std::move(other.image_view_);
     other.image_view_ = (VkImageView)VK_NULL_HANDLE;
+    mip_levels_ = other.mip_levels_;
+    has_transparency_ = other.has_transparency_;
 }
\ No newline at end of file
@@ -1,23 +1,40 @@
 #include "texture_cache.h"
 
+#include <cassert>
+
 #include "texture.h"
 
-void TextureCache::LoadTexture(RendererState& renderer, std::string path)
+TextureHandle TextureCache::LoadTexture(RendererState& renderer,
+                                        const std::string& path)
 {
-    if (texture_map_.find(path) == texture_map_.end()) {
-        texture_map_.emplace(std::move(path), Texture(renderer, path));
+    auto it = handles_.find(path);
+    if (it != handles_.end()) {
+        return it->second;
     }
+
+    auto handle = static_cast<TextureHandle>(textures_.size());
+    textures_.emplace_back(renderer, path);
+    handles_.emplace(path, handle);
+    return handle;
 }
 
-Texture* TextureCache::GetTextureByPath(std::string path) {
-    if (texture_map_.find(path) != texture_map_.end())
-    {
-        return &texture_map_.at(path);
+TextureHandle TextureCache::FindTexture(const std::string& path) const
+{
+    auto it = handles_.find(path);
+    return it != handles_.end() ? it->second : INVALID_TEXTURE_HANDLE;
+}
+
+NonOwningPointer<Texture> TextureCache::GetTexture(TextureHandle handle)
+{
+    if (handle == INVALID_TEXTURE_HANDLE) {
+        return nullptr;
     }
-    return nullptr;
+    assert(handle < textures_.size());
+    return &textures_[handle];
 }
 
 void TextureCache::Clear()
 {
-    texture_map_.clear();
-}
\ No newline at end of file
+    textures_.clear();
+    handles_.clear();
+}
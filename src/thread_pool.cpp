@@ -0,0 +1,92 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool()
+    : ThreadPool(std::max(1u, std::thread::hardware_concurrency()) - 1)
+{}
+
+ThreadPool::ThreadPool(size_t worker_count)
+{
+    workers_.reserve(worker_count);
+    for (size_t i = 0; i < worker_count; ++i) {
+        workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_available_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const { return workers_.size() + 1; }
+
+void ThreadPool::ParallelFor(size_t count,
+                             const std::function<void(size_t)>& task)
+{
+    if (count == 0) {
+        return;
+    }
+    if (workers_.empty() || count == 1) {
+        for (size_t i = 0; i < count; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &task;
+        task_count_ = count;
+        next_task_ = 0;
+        busy_workers_ = workers_.size();
+        ++generation_;
+    }
+    work_available_.notify_all();
+
+    RunTasks();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_finished_.wait(lock, [this] { return busy_workers_ == 0; });
+    task_ = nullptr;
+}
+
+void ThreadPool::WorkerLoop()
+{
+    uint64_t last_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_available_.wait(lock, [&] {
+                return stopping_ || generation_ != last_generation;
+            });
+            if (stopping_) {
+                return;
+            }
+            last_generation = generation_;
+        }
+
+        RunTasks();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --busy_workers_;
+        }
+        work_finished_.notify_one();
+    }
+}
+
+void ThreadPool::RunTasks()
+{
+    // Tasks are handed out one at a time, so uneven tasks still balance
+    for (size_t i = next_task_++; i < task_count_; i = next_task_++) {
+        (*task_)(i);
+    }
+}
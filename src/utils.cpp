@@ -4,6 +4,9 @@
 #include <cerrno>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <tuple>
 
 #include "common.h"
 #include "common_vulkan.h"
@@ -61,12 +64,33 @@ const std::string CompilationStatusToString(shaderc_compilation_status status)
     }
 }
 
-std::vector<uint32_t> CompileShader(const std::string& path,
-                                    shaderc_shader_kind kind)
+std::vector<uint32_t> CompileShader(
+    const std::string& path, shaderc_shader_kind kind,
+    const std::vector<std::pair<std::string, std::string>>& macros)
 {
+    // Every pipeline rebuild compiles the same few shaders again, so the
+    // SPIR-V is kept for the lifetime of the program
+    using CacheKey =
+        std::tuple<std::string, shaderc_shader_kind,
+                   std::vector<std::pair<std::string, std::string>>>;
+    static std::mutex cache_mutex;
+    static std::map<CacheKey, std::vector<uint32_t>> cache;
+
+    CacheKey key(path, kind, macros);
+    {
+        std::lock_guard lock(cache_mutex);
+        auto it = cache.find(key);
+        if (it != cache.end()) {
+            return it->second;
+        }
+    }
+
     std::string shader_source = GetFileContents(path.c_str());
     shaderc::Compiler compiler;
     shaderc::CompileOptions options;
+    for (const auto& [name, value] : macros) {
+        options.AddMacroDefinition(name, value);
+    }
     shaderc::SpvCompilationResult result =
         compiler.CompileGlslToSpv(shader_source, kind, path.c_str(), options);
     if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
@@ -79,6 +103,9 @@ std::vector<uint32_t> CompileShader(const std::string& path,
     }
     std::vector<uint32_t> vertexSPRV;
     vertexSPRV.assign(result.cbegin(), result.cend());
+
+    std::lock_guard lock(cache_mutex);
+    cache.emplace(std::move(key), vertexSPRV);
     return vertexSPRV;
 }
 
@@ -100,21 +127,35 @@ const bool CheckExtensions(
 
 uint32_t FindMemoryType(vk::PhysicalDevice& physical_device,
                         uint32_t type_filter,
-                        vk::MemoryPropertyFlags properties)
+                        vk::MemoryPropertyFlags properties,
+                        vk::MemoryPropertyFlags preferred)
 {
     auto mem_properties = physical_device.getMemoryProperties();
 
-    for (uint32_t i = 0; i < mem_properties.memoryTypeCount; ++i) {
-        if (type_filter & (1 << i) &&
-            (mem_properties.memoryTypes[i].propertyFlags & properties) ==
-                properties) {
-            return i;
+    for (auto wanted : {properties | preferred, properties}) {
+        for (uint32_t i = 0; i < mem_properties.memoryTypeCount; ++i) {
+            if (type_filter & (1 << i) &&
+                (mem_properties.memoryTypes[i].propertyFlags & wanted) ==
+                    wanted) {
+                return i;
+            }
         }
     }
 
     throw std::runtime_error("failed to find suitable memory type!");
 }
 
+void AddToMemoryReport(MemoryReport& report, vk::Device device,
+                       vk::DeviceMemory memory, vk::DeviceSize size,
+                       vk::MemoryPropertyFlags properties)
+{
+    report.allocated_size += size;
+    if (properties & vk::MemoryPropertyFlagBits::eLazilyAllocated) {
+        report.lazy_size += size;
+        report.committed_lazy_size += device.getMemoryCommitment(memory);
+    }
+}
+
 std::pair<vk::Buffer, vk::DeviceMemory> CreateBuffer(
     RendererState& renderer, vk::DeviceSize size, vk::BufferUsageFlags usage,
     vk::MemoryPropertyFlags properties)
@@ -139,11 +180,11 @@ std::pair<vk::Buffer, vk::DeviceMemory> CreateBuffer(
     return {buffer, memory};
 }
 
-std::pair<vk::Image, vk::DeviceMemory> CreateImage(
+std::tuple<vk::Image, vk::DeviceMemory, vk::MemoryPropertyFlags> CreateImage(
     RendererState& renderer, uint32_t width, uint32_t height,
     uint32_t mip_levels, vk::SampleCountFlagBits num_samples, vk::Format format,
     vk::ImageTiling tiling, vk::ImageUsageFlags usage,
-    vk::MemoryPropertyFlags properties)
+    vk::MemoryPropertyFlags properties, vk::MemoryPropertyFlags preferred)
 {
     auto device = renderer.GetDevice();
     auto physical_device = renderer.GetPhysicalDevice();
@@ -159,14 +200,17 @@ std::pair<vk::Image, vk::DeviceMemory> CreateImage(
 
     vk::MemoryRequirements mem_reqs = device.getImageMemoryRequirements(image);
 
-    vk::MemoryAllocateInfo alloc_info(
-        mem_reqs.size,
-        FindMemoryType(physical_device, mem_reqs.memoryTypeBits, properties));
+    auto memory_type = FindMemoryType(
+        physical_device, mem_reqs.memoryTypeBits, properties, preferred);
+    vk::MemoryAllocateInfo alloc_info(mem_reqs.size, memory_type);
 
     vk::DeviceMemory memory = device.allocateMemory(alloc_info);
     device.bindImageMemory(image, memory, 0);
 
-    return {image, memory};
+    auto type_properties = physical_device.getMemoryProperties()
+                               .memoryTypes[memory_type]
+                               .propertyFlags;
+    return {image, memory, type_properties};
 }
 
 vk::ImageView CreateImageView(RendererState& renderer, vk::Image image,
@@ -277,6 +321,14 @@ void TransitionImageLayout(RendererState& renderer, vk::Image image,
             vk::AccessFlagBits::eDepthStencilAttachmentWrite;
         source_stage = vk::PipelineStageFlagBits::eTopOfPipe;
         destination_stage = vk::PipelineStageFlagBits::eEarlyFragmentTests;
+    } else if (old_layout == vk::ImageLayout::eUndefined &&
+               new_layout == vk::ImageLayout::eGeneral) {
+        // Storage images, only the layout changes. The single time commands
+        // may run on a transfer only queue, so no shader stage is named
+        source_access_mask = vk::AccessFlags(0);
+        destination_access_mask = vk::AccessFlags(0);
+        source_stage = vk::PipelineStageFlagBits::eTopOfPipe;
+        destination_stage = vk::PipelineStageFlagBits::eBottomOfPipe;
     } else {
         throw std::invalid_argument("unsupported layout transition!");
     }
@@ -2,21 +2,38 @@
 
 #include <glm/gtx/hash.hpp>
 
-vk::VertexInputBindingDescription Vertex::GetBindingDescription()
+VertexAttributes Vertex::GetAttributes() const { return {color, tex_coord}; }
+
+std::array<vk::VertexInputBindingDescription, 2>
+Vertex::GetBindingDescriptions()
 {
-    return vk::VertexInputBindingDescription(0, sizeof(Vertex),
-                                             vk::VertexInputRate::eVertex);
+    return {GetPositionBindingDescription(),
+            vk::VertexInputBindingDescription(1, sizeof(VertexAttributes),
+                                              vk::VertexInputRate::eVertex)};
 }
 
 std::array<vk::VertexInputAttributeDescription, 3>
 Vertex::GetAttributeDescriptions()
 {
-    return {vk::VertexInputAttributeDescription(
-                0, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, pos)),
+    return {GetPositionAttributeDescription(),
+            vk::VertexInputAttributeDescription(
+                1, 1, vk::Format::eR32G32B32Sfloat,
+                offsetof(VertexAttributes, color)),
             vk::VertexInputAttributeDescription(
-                1, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, color)),
-            vk::VertexInputAttributeDescription(2, 0, vk::Format::eR32G32Sfloat,
-                                                offsetof(Vertex, tex_coord))};
+                2, 1, vk::Format::eR32G32Sfloat,
+                offsetof(VertexAttributes, tex_coord))};
+}
+
+vk::VertexInputBindingDescription Vertex::GetPositionBindingDescription()
+{
+    return vk::VertexInputBindingDescription(0, sizeof(glm::vec3),
+                                             vk::VertexInputRate::eVertex);
+}
+
+vk::VertexInputAttributeDescription Vertex::GetPositionAttributeDescription()
+{
+    return vk::VertexInputAttributeDescription(0, 0,
+                                               vk::Format::eR32G32B32Sfloat, 0);
 }
 
 bool Vertex::operator==(const Vertex& other) const
@@ -1,9 +1,27 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <sstream>
+
 #include <gmock/gmock-matchers.h>
 #include <gtest/gtest-matchers.h>
 #include <gtest/gtest.h>
 
+#include "bounds.h"
+#include "bvh.h"
+#include "deletion_queue.h"
+#include "draw_item.h"
+#include "frame_pacer.h"
+#include "frame_readback.h"
+#include "frustum_culler.h"
+#include "parallel_command_recorder.h"
+#include "render_graph.h"
+#include "renderer_settings.h"
 #include "scene_graph.h"
 #include "scene_node.h"
+#include "software_occlusion_culler.h"
+#include "thread_pool.h"
 #include "utils.h"
 
 using testing::FloatEq;
@@ -42,4 +60,525 @@ TEST(Math, LookAt90Rotation)
     ASSERT_THAT(angles.x, FloatEq(glm::half_pi<float>()));
     ASSERT_THAT(angles.y, FloatEq(0));
     ASSERT_THAT(angles.z, FloatEq(0));
-}
\ No newline at end of file
+}
+
+TEST(Culling, FrustumContainsSphereInFront)
+{
+    auto proj = glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 10.0f);
+    auto frustum = Frustum::FromMatrix(proj);
+
+    // The camera looks down -z
+    ASSERT_TRUE(frustum.IntersectsSphere({{0.0f, 0.0f, -5.0f}, 0.5f}));
+    ASSERT_FALSE(frustum.IntersectsSphere({{0.0f, 0.0f, 5.0f}, 0.5f}));
+    ASSERT_FALSE(frustum.IntersectsSphere({{0.0f, 0.0f, -20.0f}, 0.5f}));
+    ASSERT_FALSE(frustum.IntersectsSphere({{10.0f, 0.0f, -5.0f}, 0.5f}));
+    // Straddling the far plane still counts as visible
+    ASSERT_TRUE(frustum.IntersectsSphere({{0.0f, 0.0f, -10.2f}, 0.5f}));
+}
+
+TEST(Culling, BoundingSphereContainsPoints)
+{
+    std::vector<glm::vec3> points = {
+        {-1.0f, 0.0f, 0.0f}, {1.0f, 0.0f, 0.0f}, {0.0f, 2.0f, 0.0f}};
+    auto sphere = BoundingSphere::FromPoints(points);
+    for (const auto& point : points) {
+        ASSERT_LE(glm::distance(point, sphere.center), sphere.radius + 1e-5f);
+    }
+
+    auto transform = glm::scale(glm::mat4(1), glm::vec3(1.0f, 3.0f, 1.0f));
+    auto scaled = sphere.Transform(transform);
+    ASSERT_THAT(scaled.radius, FloatEq(sphere.radius * 3.0f));
+}
+
+TEST(Culling, AabbTransformEnclosesRotatedBox)
+{
+    Aabb box{{-1.0f, -1.0f, -1.0f}, {1.0f, 1.0f, 1.0f}};
+    auto rotation = glm::toMat4(
+        glm::angleAxis(glm::radians(45.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+    auto transform =
+        glm::translate(glm::mat4(1), glm::vec3(5.0f, 0.0f, 0.0f)) * rotation;
+    auto rotated = box.Transform(transform);
+
+    ASSERT_NEAR(rotated.GetCenter().x, 5.0f, 1e-5f);
+    ASSERT_NEAR(rotated.GetExtents().x, glm::sqrt(2.0f), 1e-5f);
+    ASSERT_NEAR(rotated.GetExtents().y, 1.0f, 1e-5f);
+    ASSERT_NEAR(rotated.GetExtents().z, glm::sqrt(2.0f), 1e-5f);
+}
+
+TEST(Culling, SimdBackendsMatchScalar)
+{
+    auto view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+                            glm::vec3(0.0f, 1.0f, 0.0f));
+    auto proj = glm::perspective(glm::radians(60.0f), 1.5f, 0.1f, 50.0f);
+    auto frustum = Frustum::FromMatrix(proj * view);
+
+    // Not a multiple of the SIMD width, so the padding must be skipped
+    constexpr size_t count = 1001;
+    std::vector<Aabb> bounds(count);
+    for (size_t i = 0; i < count; ++i) {
+        // Deterministic spread over a cube around the camera
+        glm::vec3 center((float)(i % 11) * 10.0f - 50.0f,
+                         (float)(i % 7) * 10.0f - 30.0f,
+                         (float)(i % 13) * 10.0f - 60.0f);
+        bounds[i] = {center - glm::vec3(1.0f), center + glm::vec3(1.0f)};
+    }
+
+    std::vector<uint32_t> expected;
+    for (size_t i = 0; i < count; ++i) {
+        if (frustum.IntersectsAabb(bounds[i])) {
+            expected.push_back((uint32_t)i);
+        }
+    }
+    ASSERT_FALSE(expected.empty());
+    ASSERT_LT(expected.size(), count);
+
+    for (auto backend : {CullingBackend::Scalar, CullingBackend::Sse,
+                         CullingBackend::Avx}) {
+        if (!FrustumCuller::IsBackendSupported(backend)) {
+            continue;
+        }
+        FrustumCuller culler(backend);
+        culler.Resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            culler.SetBounds(i, bounds[i]);
+        }
+
+        std::vector<uint32_t> visible;
+        culler.Cull(frustum, visible);
+        ASSERT_EQ(visible, expected) << CullingBackendName(backend);
+    }
+}
+
+static std::vector<Aabb> MakeBvhTestBounds(size_t count)
+{
+    std::vector<Aabb> bounds(count);
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec3 center((float)(i % 10) * 4.0f, (float)(i / 10 % 10) * 4.0f,
+                         -(float)(i / 100) * 4.0f);
+        bounds[i] = {center - glm::vec3(0.5f), center + glm::vec3(0.5f)};
+    }
+    return bounds;
+}
+
+TEST(Bvh, QueriesMatchBruteForce)
+{
+    auto bounds = MakeBvhTestBounds(500);
+    Bvh bvh;
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        bvh.Insert(bounds[i], (uint32_t)i);
+    }
+    ASSERT_TRUE(bvh.Validate());
+
+    auto view = glm::lookAt(glm::vec3(18.0f, 18.0f, 10.0f),
+                            glm::vec3(18.0f, 18.0f, 0.0f),
+                            glm::vec3(0.0f, 1.0f, 0.0f));
+    auto proj = glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 12.0f);
+    auto frustum = Frustum::FromMatrix(proj * view);
+    glm::vec3 center(10.0f, 10.0f, -4.0f);
+    float radius = 5.0f;
+
+    for (int pass = 0; pass < 2; ++pass) {
+        std::vector<uint32_t> expected_frustum;
+        std::vector<uint32_t> expected_radius;
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            if (frustum.IntersectsAabb(bounds[i])) {
+                expected_frustum.push_back((uint32_t)i);
+            }
+            if (bounds[i].IntersectsSphere(center, radius)) {
+                expected_radius.push_back((uint32_t)i);
+            }
+        }
+
+        std::vector<uint32_t> visible;
+        bvh.QueryFrustum(frustum, visible);
+        std::sort(visible.begin(), visible.end());
+        ASSERT_EQ(visible, expected_frustum);
+
+        std::vector<uint32_t> nearby;
+        bvh.QueryRadius(center, radius, nearby);
+        std::sort(nearby.begin(), nearby.end());
+        ASSERT_EQ(nearby, expected_radius);
+
+        // The rebuilt tree must give the same answers
+        bvh.Rebuild();
+        ASSERT_TRUE(bvh.Validate());
+    }
+}
+
+TEST(Bvh, RemoveAndRefit)
+{
+    auto bounds = MakeBvhTestBounds(64);
+    Bvh bvh;
+    std::vector<Bvh::ProxyId> proxies;
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        proxies.push_back(bvh.Insert(bounds[i], (uint32_t)i));
+    }
+
+    for (size_t i = 0; i < bounds.size(); i += 2) {
+        bvh.Remove(proxies[i]);
+    }
+    ASSERT_TRUE(bvh.Validate());
+    ASSERT_EQ(bvh.GetLeafCount(), bounds.size() / 2);
+
+    // Move one object far away and check the ancestors were refit
+    Aabb moved{glm::vec3(99.5f), glm::vec3(100.5f)};
+    bvh.Update(proxies[1], moved);
+    ASSERT_TRUE(bvh.Validate());
+
+    std::vector<uint32_t> nearby;
+    bvh.QueryRadius(glm::vec3(100.0f), 1.0f, nearby);
+    ASSERT_EQ(nearby, std::vector<uint32_t>{1});
+
+    // Proxy ids stay valid across a rebuild
+    bvh.Rebuild();
+    ASSERT_TRUE(bvh.Validate());
+    ASSERT_EQ(bvh.GetUserData(proxies[1]), 1u);
+}
+
+TEST(Bvh, RayCastReturnsClosestHit)
+{
+    Bvh bvh;
+    bvh.Insert({{-1.0f, -1.0f, -6.0f}, {1.0f, 1.0f, -4.0f}}, 0);
+    bvh.Insert({{-1.0f, -1.0f, -3.0f}, {1.0f, 1.0f, -1.0f}}, 1);
+    bvh.Insert({{4.0f, -1.0f, -3.0f}, {6.0f, 1.0f, -1.0f}}, 2);
+    bvh.Rebuild();
+
+    Ray ray{{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, -1.0f}};
+    auto hit = bvh.RayCast(ray);
+    ASSERT_TRUE(hit.has_value());
+    ASSERT_EQ(hit->user_data, 1u);
+    ASSERT_THAT(hit->distance, FloatEq(1.0f));
+
+    ASSERT_FALSE(bvh.RayCast(ray, 0.5f).has_value());
+    ASSERT_FALSE(bvh.RayCast({{0.0f, 5.0f, 0.0f}, {0.0f, 0.0f, -1.0f}})
+                     .has_value());
+
+    // Grazing a face, parallel to it
+    auto grazing = bvh.RayCast({{1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, -1.0f}});
+    ASSERT_TRUE(grazing.has_value());
+    ASSERT_EQ(grazing->user_data, 1u);
+}
+
+TEST(ThreadPool, ParallelForRunsEveryIndexOnce)
+{
+    ThreadPool pool(3);
+    std::vector<std::atomic<int>> counts(1000);
+    for (int pass = 0; pass < 3; ++pass) {
+        pool.ParallelFor(counts.size(), [&](size_t i) { ++counts[i]; });
+    }
+    for (const auto& count : counts) {
+        ASSERT_EQ(count.load(), 3);
+    }
+}
+
+TEST(ParallelRecording, ChunksCoverDrawListInOrder)
+{
+    ASSERT_EQ(GetChunkCount(0, 8, 256), 0u);
+    ASSERT_EQ(GetChunkCount(100, 8, 256), 1u);
+    ASSERT_EQ(GetChunkCount(1000, 8, 256), 3u);
+    ASSERT_EQ(GetChunkCount(100000, 8, 256), 8u);
+
+    for (size_t item_count : {1u, 7u, 1000u, 1003u}) {
+        size_t chunk_count = std::min<size_t>(item_count, 4);
+        size_t expected_first = 0;
+        for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+            auto [first, last] = GetChunkRange(item_count, chunk_count, chunk);
+            ASSERT_EQ(first, expected_first);
+            ASSERT_GE(last - first, item_count / chunk_count);
+            ASSERT_LE(last - first, item_count / chunk_count + 1);
+            expected_first = last;
+        }
+        ASSERT_EQ(expected_first, item_count);
+    }
+}
+
+TEST(DrawItems, SortGroupsByMaterialThenMesh)
+{
+    // Only the addresses of the meshes matter for sorting
+    std::array<uint8_t, 2> meshes{};
+    auto mesh_a = reinterpret_cast<const Mesh*>(&meshes[0]);
+    auto mesh_b = reinterpret_cast<const Mesh*>(&meshes[1]);
+
+    std::vector<DrawItem> items = {
+        {1, mesh_b, 0, 0, 3}, {0, mesh_a, 0, 3, 6}, {1, mesh_a, 1, 6, 3},
+        {0, mesh_b, 2, 0, 3}, {1, mesh_a, 0, 6, 3}, {0, mesh_a, 1, 3, 6}};
+    ASSERT_EQ(SortDrawItems(items), items.size());
+
+    for (size_t i = 1; i < items.size(); ++i) {
+        const auto& a = items[i - 1];
+        const auto& b = items[i];
+        ASSERT_LE(a.material, b.material);
+        if (a.material == b.material) {
+            ASSERT_TRUE(a.mesh <= b.mesh);
+            if (a.mesh == b.mesh) {
+                ASSERT_LT(a.object_index, b.object_index);
+            }
+        }
+    }
+    ASSERT_EQ(items.front().material, 0u);
+    ASSERT_EQ(items.back().material, 1u);
+}
+
+TEST(DrawItems, TransparentItemsGoLastBackToFront)
+{
+    std::vector<DrawItem> items = {{0, nullptr, 0, 0, 3, true, 1.0f},
+                                   {1, nullptr, 1, 0, 3, false, 9.0f},
+                                   {0, nullptr, 2, 0, 3, true, 4.0f},
+                                   {1, nullptr, 3, 0, 3, false, 1.0f}};
+
+    auto partitioned = items;
+    ASSERT_EQ(PartitionDrawItems(partitioned), 2u);
+    ASSERT_EQ(partitioned[0].object_index, 1u);
+    ASSERT_EQ(partitioned[1].object_index, 3u);
+    ASSERT_EQ(partitioned[2].object_index, 0u);
+    ASSERT_EQ(partitioned[3].object_index, 2u);
+
+    ASSERT_EQ(SortDrawItems(items), 2u);
+    // Opaque front to back, transparent back to front
+    ASSERT_EQ(items[0].object_index, 3u);
+    ASSERT_EQ(items[1].object_index, 1u);
+    ASSERT_EQ(items[2].object_index, 2u);
+    ASSERT_EQ(items[3].object_index, 0u);
+}
+
+TEST(RendererSettings, LatencyModesAndImageCounts)
+{
+    for (auto mode : {LatencyMode::Low, LatencyMode::Balanced,
+                      LatencyMode::HighThroughput}) {
+        auto settings = RendererSettings::FromLatencyMode(mode);
+        ASSERT_EQ(settings.GetLatencyMode(), mode);
+        ASSERT_EQ(ParseLatencyMode(LatencyModeName(mode)), mode);
+    }
+    ASSERT_EQ(RendererSettings().GetLatencyMode(), LatencyMode::Balanced);
+    ASSERT_FALSE(ParseLatencyMode("fastest").has_value());
+
+    // One over the minimum by default, otherwise clamped to the surface
+    ASSERT_EQ(ChooseSwapchainImageCount(0, 2, 8), 3u);
+    ASSERT_EQ(ChooseSwapchainImageCount(0, 2, 2), 2u);
+    ASSERT_EQ(ChooseSwapchainImageCount(2, 3, 0), 3u);
+    ASSERT_EQ(ChooseSwapchainImageCount(3, 2, 0), 3u);
+    ASSERT_EQ(ChooseSwapchainImageCount(4, 2, 3), 3u);
+}
+
+TEST(RendererSettings, PresentModeFallsBackToFifo)
+{
+    std::vector<vk::PresentModeKHR> fifo_only = {vk::PresentModeKHR::eFifo};
+    for (auto policy :
+         {PresentModePolicy::Immediate, PresentModePolicy::Mailbox,
+          PresentModePolicy::Fifo, PresentModePolicy::FifoRelaxed}) {
+        ASSERT_EQ(ChoosePresentMode(policy, fifo_only),
+                  vk::PresentModeKHR::eFifo);
+        ASSERT_EQ(ParsePresentModePolicy(PresentModePolicyName(policy)),
+                  policy);
+    }
+
+    std::vector<vk::PresentModeKHR> modes = {vk::PresentModeKHR::eFifo,
+                                             vk::PresentModeKHR::eMailbox};
+    ASSERT_EQ(ChoosePresentMode(PresentModePolicy::Immediate, modes),
+              vk::PresentModeKHR::eMailbox);
+    ASSERT_EQ(ChoosePresentMode(PresentModePolicy::Mailbox, modes),
+              vk::PresentModeKHR::eMailbox);
+    ASSERT_EQ(ChoosePresentMode(PresentModePolicy::FifoRelaxed, modes),
+              vk::PresentModeKHR::eFifo);
+}
+
+TEST(FramePacer, PercentilesUseNearestRank)
+{
+    std::vector<double> values = {5.0, 1.0, 4.0, 2.0, 3.0};
+    ASSERT_EQ(GetPercentile(values, 0.0), 1.0);
+    ASSERT_EQ(GetPercentile(values, 50.0), 3.0);
+    ASSERT_EQ(GetPercentile(values, 80.0), 4.0);
+    ASSERT_EQ(GetPercentile(values, 100.0), 5.0);
+    ASSERT_EQ(GetPercentile({}, 50.0), 0.0);
+}
+
+TEST(FramePacer, HoldsFramesToTheTargetRate)
+{
+    FramePacer pacer;
+    pacer.SetTargetFrameRate(200.0);
+
+    // The first frame starts right away, every later one 5 ms after the
+    // previous deadline
+    constexpr int frame_count = 11;
+    auto start = FramePacer::Clock::now();
+    for (int i = 0; i < frame_count; ++i) {
+        pacer.WaitForNextFrame();
+    }
+    auto elapsed = FramePacer::Clock::now() - start;
+    ASSERT_GE(elapsed, std::chrono::milliseconds(5 * (frame_count - 1)));
+    ASSERT_GE(pacer.GetErrorPercentile(0.0), 0.0);
+
+    pacer.SetTargetFrameRate(0.0);
+    pacer.WaitForNextFrame();
+    ASSERT_EQ(pacer.GetErrorPercentile(100.0), 0.0);
+
+    // Rates without a usable period leave the pacer uncapped
+    using limits = std::numeric_limits<double>;
+    for (double rate : {-60.0, limits::quiet_NaN(), limits::infinity(),
+                        1e-300, 1e300}) {
+        pacer.SetTargetFrameRate(rate);
+        ASSERT_EQ(pacer.GetTargetFrameRate(), 0.0);
+    }
+}
+
+TEST(DeletionQueue, DestroysOnlyCompletedEntries)
+{
+    std::vector<int> destroyed;
+    {
+        DeletionQueue queue;
+        queue.Push(2, [&]() { destroyed.push_back(0); });
+        queue.Push(1, [&]() { destroyed.push_back(1); });
+        queue.Push(3, [&]() { destroyed.push_back(2); });
+        queue.Push(2, [&]() {
+            destroyed.push_back(3);
+            // Only destroyed by a later Collect
+            queue.Push(2, [&]() { destroyed.push_back(4); });
+        });
+
+        ASSERT_EQ(queue.Collect(0), 0);
+        ASSERT_EQ(queue.Collect(2), 3);
+        ASSERT_THAT(destroyed, testing::ElementsAre(0, 1, 3));
+        ASSERT_EQ(queue.GetPendingCount(), 2);
+        ASSERT_EQ(queue.Collect(2), 1);
+        ASSERT_EQ(queue.GetPendingCount(), 1);
+    }
+    // The rest goes when the queue does
+    ASSERT_THAT(destroyed, testing::ElementsAre(0, 1, 3, 4, 2));
+}
+
+TEST(FrameReadback, WritesBgraFramesAsRgbPpm)
+{
+    // 2x1 BGRA, a red and a blue texel
+    const uint8_t pixels[] = {0, 0, 255, 255, 255, 0, 0, 128};
+    ReadbackFrame frame;
+    frame.extent = vk::Extent2D(2, 1);
+    frame.format = vk::Format::eB8G8R8A8Srgb;
+    frame.pixels = pixels;
+
+    std::ostringstream out;
+    WritePpm(out, frame);
+    ASSERT_EQ(out.str(), std::string("P6\n2 1\n255\n"
+                                     "\xff\x00\x00\x00\x00\xff",
+                                     17));
+
+    frame.format = vk::Format::eR16G16B16A16Sfloat;
+    ASSERT_THROW(WritePpm(out, frame), std::runtime_error);
+}
+
+TEST(RenderGraph, CullsUnusedPassesAndBatchesBarriers)
+{
+    RenderGraph graph;
+    auto swapchain = graph.ImportImage(
+        "swapchain", {}, {}, vk::ImageAspectFlagBits::eColor,
+        ImageAccess::ColorAttachment, ImageAccess::Present, true);
+    auto depth = graph.ImportImage("depth", {}, {},
+                                   vk::ImageAspectFlagBits::eDepth,
+                                   ImageAccess::DepthAttachment,
+                                   ImageAccess::DepthAttachment);
+    RenderGraph::TransientImageDesc desc;
+    auto color = graph.CreateTransientImage("color", desc);
+    auto unused = graph.CreateTransientImage("unused", desc);
+
+    graph.AddPass("scene",
+                  {{color, ImageAccess::ColorAttachment},
+                   {depth, ImageAccess::DepthAttachment},
+                   {swapchain, ImageAccess::ColorAttachment}},
+                  {});
+    // Nothing reads what this one writes
+    graph.AddPass("debug", {{unused, ImageAccess::StorageWrite}}, {});
+    graph.AddPass("overlay", {{swapchain, ImageAccess::ColorAttachment}}, {});
+    graph.Compile();
+
+    ASSERT_THAT(graph.GetExecutionOrder(), testing::ElementsAre(0, 2));
+
+    // Every image of the scene pass in one batch
+    auto& scene = graph.GetBarriers(0);
+    ASSERT_EQ(scene.barriers.size(), 3);
+    ASSERT_EQ(scene.barriers[0].old_layout, vk::ImageLayout::eUndefined);
+    ASSERT_EQ(scene.barriers[1].old_layout,
+              vk::ImageLayout::eDepthStencilAttachmentOptimal);
+    ASSERT_EQ(scene.barriers[2].old_layout, vk::ImageLayout::eUndefined);
+    ASSERT_EQ(scene.barriers[2].new_layout,
+              vk::ImageLayout::eColorAttachmentOptimal);
+    // The swapchain image is waited on where the acquire semaphore is
+    ASSERT_TRUE(scene.src_stages &
+                vk::PipelineStageFlagBits::eColorAttachmentOutput);
+
+    // Blending over the scene only needs a memory dependency
+    auto& overlay = graph.GetBarriers(1);
+    ASSERT_EQ(overlay.barriers.size(), 1);
+    ASSERT_EQ(overlay.barriers[0].image, swapchain);
+    ASSERT_EQ(overlay.barriers[0].old_layout,
+              overlay.barriers[0].new_layout);
+
+    // Depth is left in the layout it started in
+    auto& final_barriers = graph.GetFinalBarriers();
+    ASSERT_EQ(final_barriers.barriers.size(), 1);
+    ASSERT_EQ(final_barriers.barriers[0].new_layout,
+              vk::ImageLayout::ePresentSrcKHR);
+}
+
+TEST(RenderGraph, ReadsWaitOnlyForUnseenWrites)
+{
+    RenderGraph graph;
+    auto image = graph.ImportImage("image", {}, {},
+                                   vk::ImageAspectFlagBits::eColor,
+                                   ImageAccess::ShaderRead,
+                                   ImageAccess::ShaderRead);
+    graph.AddPass("write", {{image, ImageAccess::StorageWrite}}, {});
+    graph.AddPass("read", {{image, ImageAccess::ShaderRead}}, {});
+    graph.AddPass("read again", {{image, ImageAccess::ShaderRead}}, {});
+    graph.Compile();
+
+    ASSERT_EQ(graph.GetExecutionOrder().size(), 3);
+    ASSERT_EQ(graph.GetBarriers(0).barriers[0].new_layout,
+              vk::ImageLayout::eGeneral);
+    ASSERT_EQ(graph.GetBarriers(1).barriers[0].src_access,
+              vk::AccessFlags(vk::AccessFlagBits::eShaderWrite));
+    ASSERT_TRUE(graph.GetBarriers(2).barriers.empty());
+    ASSERT_TRUE(graph.GetFinalBarriers().barriers.empty());
+}
+
+TEST(RenderGraph, AliasesResourcesNotInUseTogether)
+{
+    std::vector<AliasedResource> resources = {
+        {100, 1, 0, 1}, {100, 1, 2, 3}, {50, 64, 1, 2}};
+    vk::DeviceSize total_size = 0;
+    auto offsets = PlaceAliasedResources(resources, total_size);
+    // The first two take turns, the last overlaps both in time
+    ASSERT_THAT(offsets, testing::ElementsAre(0, 0, 128));
+    ASSERT_EQ(total_size, 178);
+}
+
+TEST(SoftwareOcclusion, WallHidesBoxBehindIt)
+{
+    auto view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+                            glm::vec3(0.0f, 1.0f, 0.0f));
+    auto proj = glm::perspective(glm::radians(60.0f), 1.5f, 0.1f, 100.0f);
+
+    // A 4x4 wall facing the camera, 5 units away
+    std::vector<glm::vec3> wall = {{-2.0f, -2.0f, -5.0f},
+                                   {2.0f, -2.0f, -5.0f},
+                                   {2.0f, 2.0f, -5.0f},
+                                   {-2.0f, 2.0f, -5.0f}};
+    std::vector<uint32_t> indices = {0, 1, 2, 0, 2, 3};
+
+    ThreadPool pool(2);
+    SoftwareOcclusionCuller culler(128, 64);
+    culler.BeginFrame(proj * view);
+    culler.AddOccluder(wall, indices, glm::mat4(1));
+    culler.Rasterize(pool);
+    ASSERT_EQ(culler.GetOccluderTriangleCount(), 2u);
+
+    // Behind the wall
+    ASSERT_FALSE(
+        culler.IsVisible({{-0.5f, -0.5f, -9.0f}, {0.5f, 0.5f, -8.0f}}));
+    // In front of the wall
+    ASSERT_TRUE(culler.IsVisible({{-0.5f, -0.5f, -4.0f}, {0.5f, 0.5f, -3.0f}}));
+    // Behind the wall, but peeking out to the side
+    ASSERT_TRUE(culler.IsVisible({{1.5f, -0.5f, -9.0f}, {6.0f, 0.5f, -8.0f}}));
+    // Crossing the near plane
+    ASSERT_TRUE(culler.IsVisible({{-0.5f, -0.5f, -1.0f}, {0.5f, 0.5f, 1.0f}}));
+    // An occluder's own bounds are never hidden by itself
+    ASSERT_TRUE(culler.IsVisible(Aabb::FromPoints(wall)));
+}